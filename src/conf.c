@@ -130,11 +130,26 @@ static CONF_ELEMENTS conf_elements[] = {
     { 0, 0, CONF_T_STRING,"general","interface" },
     { 0, 0, CONF_T_STRING,"general","ssc_codectypes" },
     { 0, 0, CONF_T_STRING,"general","ssc_prog" },
+    { 0, 0, CONF_T_INT,"general","ssc_script_workers" },
     { 0, 0, CONF_T_STRING,"general","password" },
     { 0, 0, CONF_T_STRING,"general","never_transcode" },
     { 0, 0, CONF_T_MULTICOMMA,"general","compdirs" },
     { 0, 0, CONF_T_STRING,"general","logfile" },
     { 0, 0, CONF_T_INT,"general","truncate" },
+    { 0, 0, CONF_T_INT,"general","worker_threads" },
+    { 0, 0, CONF_T_INT,"general","max_worker_threads" },
+    { 0, 0, CONF_T_INT,"general","db_cache_size" },
+    { 0, 0, CONF_T_INT,"general","dmap_cache_size" },
+    { 0, 0, CONF_T_INT,"general","dmap_cache_gzip" },
+    { 0, 0, CONF_T_INT,"general","db_handles" },
+    { 0, 0, CONF_T_INT,"general","db_mmap_size" },
+    { 0, 0, CONF_T_INT,"general","playcount_flush" },
+    { 0, 0, CONF_T_INT,"general","ssc_cache_size" },
+    { 0, 0, CONF_T_INT,"general","ssc_buffer" },
+    { 0, 0, CONF_T_INT,"general","ssc_buffer_high" },
+    { 0, 0, CONF_T_INT,"general","ssc_buffer_low" },
+    { 0, 0, CONF_T_INT,"general","ssc_session_buffer" },
+    { 0, 0, CONF_T_INT,"general","ssc_session_limit" },
     { 0, 0, CONF_T_EXISTPATH,"plugins","plugin_dir" },
     { 0, 0, CONF_T_MULTICOMMA,"plugins","plugins" },
     { 0, 0, CONF_T_INT,"daap","empty_strings" },
@@ -147,6 +162,11 @@ static CONF_ELEMENTS conf_elements[] = {
     { 0, 0, CONF_T_INT,"scanning","case_sensitive" },
     { 0, 0, CONF_T_INT,"scanning","follow_symlinks" },
     { 0, 0, CONF_T_INT,"scanning","skip_first" },
+    { 0, 0, CONF_T_INT,"scanning","watch" },
+    { 0, 0, CONF_T_INT,"scanning","watch_delay" },
+    { 0, 0, CONF_T_INT,"scanning","scan_threads" },
+    { 0, 0, CONF_T_INT,"scanning","scan_queue" },
+    { 0, 0, CONF_T_INT,"scanning","db_batch" },
     { 0, 0, CONF_T_STRING,"scanning","mp3_tag_codepage" },
     { 0, 0, CONF_T_INT,"scan","correct_order" },
 
@@ -497,6 +517,13 @@ int _conf_verify(LL_HANDLE pll) {
             DPRINTF(E_FATAL,L_CONF,"Can't make playlist dir: %s\n",ppath);
         }
         free(ppath);
+
+        ppath = util_asprintf("%s/ssc",ptemp->value.as_string);
+        if(!ppath) DPRINTF(E_FATAL,L_CONF,"malloc error\n");
+        if(!_conf_makedir(ppath,user)) {
+            DPRINTF(E_FATAL,L_CONF,"Can't make transcode cache dir: %s\n",ppath);
+        }
+        free(ppath);
     }
 
     return is_valid;
@@ -0,0 +1,664 @@
+/*
+ * $Id$
+ * Simple driver to benchmark the db backends against each other
+ * without the overhead of all of mt-daapd
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * This builds a synthetic library of the requested size in the
+ * songs3.db in the configured cache_dir (so point it at a scratch
+ * config!), then times fetching every song by id, the way the
+ * stream and playlist code does, and walking the whole table,
+ * the way the items query does, against both the sqlite3 and
+ * memory backends.
+ *
+ * With -i, the library is built through db_sqlite3_add instead, as
+ * a scan would, and the import rate is reported too.  The number of
+ * adds per transaction comes from scanning/db_batch in the config.
+ *
+ * With -s, the library is then loaded the way the server loads it
+ * at startup (db_init), and that is timed as well.
+ *
+ * With -p, that many smart playlists are then added to the loaded
+ * library (half genre and year ranges, half single albums), and
+ * the time to build them, refresh them all and the memory they
+ * take are reported, along with the time for the same filtered
+ * item query run twice.
+ *
+ * With -r, two threads then count a play of each of the first that
+ * many songs at the same time, with the item cache turned off so
+ * they mostly work on separate copies, and every song has to come
+ * out played twice.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "daapd.h"
+#include "conf.h"
+#include "db.h"
+#include "db-sql-sqlite3.h"
+#include "db-mem.h"
+#include "err.h"
+#include "io.h"
+#include "playlists.h"
+#include "webserver.h"
+#include "xml-rpc.h"
+
+#define DEFAULT_SONGS 100000
+
+CONFIG config;
+
+typedef struct backend_t {
+    char *name;
+    int(*load)(char **);
+    int(*fetch_item)(char **, uint32_t, void **, MEDIA_STRING **);
+    void(*dispose_item)(void *, MEDIA_STRING *);
+    int(*enum_begin)(char **, void **);
+    int(*enum_fetch)(char **, void *, MEDIA_STRING **);
+    int(*enum_end)(char **, void *);
+} BACKEND;
+
+BACKEND backends[] = {
+    { "sqlite3", NULL, db_sqlite3_fetch_item, db_sqlite3_dispose_item,
+      db_sqlite3_enum_items_begin, db_sqlite3_enum_items_fetch,
+      db_sqlite3_enum_end },
+    { "memory", db_mem_load, db_mem_fetch_item, db_mem_dispose_item,
+      db_mem_enum_items_begin, db_mem_enum_items_fetch, db_mem_enum_end },
+    { NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/*
+ * conf.c can dump itself as xml for the web config pages, which
+ * drags in the whole webserver.  We never ask it to, so stub those out.
+ */
+XMLSTRUCT *xml_init(WS_CONNINFO *pwsc, int emit_header) { return NULL; }
+void xml_push(XMLSTRUCT *pxml, char *term) { }
+void xml_pop(XMLSTRUCT *pxml) { }
+void xml_output(XMLSTRUCT *pxml, char *section, char *fmt, ...) { }
+void xml_deinit(XMLSTRUCT *pxml) { }
+
+void driver_io_errhandler(int level, char *msg) {
+    DPRINTF(level,L_MAIN,"%s",msg);
+}
+
+void usage(int errorcode) {
+    fprintf(stderr,"Usage: db [options]\n\n");
+    fprintf(stderr,"options:\n\n");
+    fprintf(stderr,"  -c configfile    use specified config file (required)\n");
+    fprintf(stderr,"  -n songs         size of library to build (default %d)\n",
+            DEFAULT_SONGS);
+    fprintf(stderr,"  -i               time importing through db_sqlite3_add\n");
+    fprintf(stderr,"  -s               time loading the library at startup (db_init)\n");
+    fprintf(stderr,"  -p playlists     time that many smart playlists (implies -s)\n");
+    fprintf(stderr,"  -r songs         check concurrent plays of that many songs (implies -s)\n");
+    fprintf(stderr,"  -d level         set debuglevel\n");
+    fprintf(stderr,"\n\n");
+    exit(errorcode);
+}
+
+double elapsed_ms(struct timeval *pstart) {
+    struct timeval end;
+
+    gettimeofday(&end,NULL);
+    return (end.tv_sec - pstart->tv_sec) * 1000.0 +
+        (end.tv_usec - pstart->tv_usec) / 1000.0;
+}
+
+/**
+ * fill the songs table with a synthetic library.  This goes straight
+ * to sqlite in one transaction, as it's setup, not the thing being
+ * measured.  Roughly: 12 songs to an album, 8 albums to an artist.
+ */
+int build_library(char *db_path, int songs) {
+    sqlite3 *pdb;
+    sqlite3_stmt *stmt;
+    char path[256], title[64], artist[64], album[64];
+    char *pe;
+    char *genres[] = { "Rock", "Jazz", "Classical", "Pop", "Electronic",
+                       "Folk", "Hip-Hop", "Blues" };
+    int song;
+
+    if(sqlite3_open(db_path,&pdb) != SQLITE_OK) {
+        fprintf(stderr,"Can't open %s: %s\n",db_path,sqlite3_errmsg(pdb));
+        return FALSE;
+    }
+
+    if(sqlite3_exec(pdb,"PRAGMA synchronous=off; BEGIN; delete from songs;",
+                    NULL,NULL,&pe) != SQLITE_OK) {
+        fprintf(stderr,"Can't clear songs: %s\n",pe);
+        sqlite3_free(pe);
+        sqlite3_close(pdb);
+        return FALSE;
+    }
+
+    if(sqlite3_prepare(pdb,"insert into songs (id,path,fname,title,artist,"
+                       "album,genre,type,bitrate,samplerate,song_length,"
+                       "file_size,year,track,total_tracks,disc,total_discs,"
+                       "data_kind,item_kind,description,time_added,"
+                       "time_modified,codectype,idx) values (?,?,?,?,?,?,?,"
+                       "'mp3',192,44100,?,?,?,?,12,1,1,0,2,'MPEG audio file',"
+                       "1195000000,1195000000,'mpeg',0)",
+                       -1,&stmt,NULL) != SQLITE_OK) {
+        fprintf(stderr,"Can't prepare insert: %s\n",sqlite3_errmsg(pdb));
+        sqlite3_close(pdb);
+        return FALSE;
+    }
+
+    for(song = 0; song < songs; song++) {
+        snprintf(artist,sizeof(artist),"Artist %d",song / 96);
+        snprintf(album,sizeof(album),"Album %d",song / 12);
+        snprintf(title,sizeof(title),"Track %d of album %d",
+                 (song % 12) + 1, song / 12);
+        snprintf(path,sizeof(path),"/music/%s/%s/%02d %s.mp3",
+                 artist, album, (song % 12) + 1, title);
+
+        sqlite3_bind_int(stmt,1,song + 1);
+        sqlite3_bind_text(stmt,2,path,-1,SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt,3,strrchr(path,'/') + 1,-1,SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt,4,title,-1,SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt,5,artist,-1,SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt,6,album,-1,SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt,7,genres[(song / 96) % 8],-1,SQLITE_STATIC);
+        sqlite3_bind_int(stmt,8,180000 + (song % 120) * 1000);
+        sqlite3_bind_int(stmt,9,4000000 + (song % 100) * 10000);
+        sqlite3_bind_int(stmt,10,1960 + (song / 12) % 48);
+        sqlite3_bind_int(stmt,11,(song % 12) + 1);
+
+        if(sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr,"Insert error: %s\n",sqlite3_errmsg(pdb));
+            sqlite3_finalize(stmt);
+            sqlite3_close(pdb);
+            return FALSE;
+        }
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+    if(sqlite3_exec(pdb,"COMMIT;",NULL,NULL,&pe) != SQLITE_OK) {
+        fprintf(stderr,"Can't commit songs: %s\n",pe);
+        sqlite3_free(pe);
+        sqlite3_close(pdb);
+        return FALSE;
+    }
+    sqlite3_close(pdb);
+    return TRUE;
+}
+
+/**
+ * fill the songs table with the same synthetic library as
+ * build_library, but through db_sqlite3_add, the way a scan does,
+ * and time it.  Then add them all again as updates, as a rescan of
+ * a changed library would.
+ */
+int import_library(char *db_path, int songs) {
+    MEDIA_NATIVE mo;
+    struct timeval start;
+    double insert_ms, update_ms;
+    char path[256], title[64], artist[64], album[64];
+    char *genres[] = { "Rock", "Jazz", "Classical", "Pop", "Electronic",
+                       "Folk", "Hip-Hop", "Blues" };
+    char *pe = NULL;
+    int song;
+    int pass;
+
+    /* empty it out */
+    if(!build_library(db_path, 0))
+        return FALSE;
+
+    for(pass = 0; pass < 2; pass++) {
+        gettimeofday(&start,NULL);
+        db_sqlite3_hint(DB_HINT_FULLSCAN_START);
+
+        for(song = 0; song < songs; song++) {
+            snprintf(artist,sizeof(artist),"Artist %d",song / 96);
+            snprintf(album,sizeof(album),"Album %d",song / 12);
+            snprintf(title,sizeof(title),"Track %d of album %d",
+                     (song % 12) + 1, song / 12);
+            snprintf(path,sizeof(path),"/music/%s/%s/%02d %s.mp3",
+                     artist, album, (song % 12) + 1, title);
+
+            memset(&mo,0,sizeof(mo));
+            mo.id = pass ? song + 1 : 0;
+            mo.path = path;
+            mo.fname = strrchr(path,'/') + 1;
+            mo.title = title;
+            mo.artist = artist;
+            mo.album = album;
+            mo.genre = genres[(song / 96) % 8];
+            mo.type = "mp3";
+            mo.bitrate = 192;
+            mo.samplerate = 44100;
+            mo.song_length = 180000 + (song % 120) * 1000;
+            mo.file_size = 4000000 + (song % 100) * 10000;
+            mo.year = 1960 + (song / 12) % 48;
+            mo.track = (song % 12) + 1;
+            mo.total_tracks = 12;
+            mo.disc = 1;
+            mo.total_discs = 1;
+            mo.item_kind = 2;
+            mo.description = "MPEG audio file";
+            mo.time_added = 1195000000;
+            mo.time_modified = 1195000000;
+            mo.codectype = "mpeg";
+
+            if(DB_E_SUCCESS != db_sqlite3_add(&pe, &mo)) {
+                fprintf(stderr,"Can't add %s: %s\n",path,pe ? pe : "?");
+                return FALSE;
+            }
+            if(mo.id != (uint32_t)song + 1) {
+                fprintf(stderr,"Added %s as %d, expected %d\n",path,
+                        mo.id, song + 1);
+                return FALSE;
+            }
+        }
+
+        db_sqlite3_hint(DB_HINT_FULLSCAN_END);
+        if(pass)
+            update_ms = elapsed_ms(&start);
+        else
+            insert_ms = elapsed_ms(&start);
+    }
+
+    printf("import  : insert %8.1f ms (%6.0f songs/sec), "
+           "update %8.1f ms (%6.0f songs/sec)\n",
+           insert_ms, songs * 1000.0 / insert_ms,
+           update_ms, songs * 1000.0 / update_ms);
+    return TRUE;
+}
+
+/**
+ * time loading the backend (if it needs it), fetching every song
+ * by id, and walking the whole song table, checking that every song
+ * comes back
+ */
+int bench(BACKEND *pb, int songs) {
+    struct timeval start;
+    double load_ms = 0.0, fetch_ms, enum_ms;
+    MEDIA_STRING *pms;
+    void *opaque;
+    char *pe = NULL;
+    uint32_t id;
+    uint64_t bytes = 0;
+    int count = 0;
+
+    if(pb->load) {
+        gettimeofday(&start,NULL);
+        if(DB_E_SUCCESS != pb->load(&pe)) {
+            fprintf(stderr,"Can't load %s: %s\n",pb->name,pe ? pe : "?");
+            return FALSE;
+        }
+        load_ms = elapsed_ms(&start);
+    }
+
+    gettimeofday(&start,NULL);
+    for(id = 1; id <= (uint32_t)songs; id++) {
+        if((DB_E_SUCCESS != pb->fetch_item(&pe, id, &opaque, &pms)) || (!pms)) {
+            fprintf(stderr,"%s: couldn't fetch %d: %s\n",pb->name,id,
+                    pe ? pe : "not found");
+            return FALSE;
+        }
+        /* touch a couple of fields, as a real client would */
+        bytes += strlen(pms->title) + strlen(pms->file_size);
+        pb->dispose_item(opaque, pms);
+    }
+    fetch_ms = elapsed_ms(&start);
+
+    gettimeofday(&start,NULL);
+    if(DB_E_SUCCESS != pb->enum_begin(&pe, &opaque)) {
+        fprintf(stderr,"%s: couldn't enum: %s\n",pb->name,pe ? pe : "?");
+        return FALSE;
+    }
+    while((DB_E_SUCCESS == pb->enum_fetch(&pe, opaque, &pms)) && (pms)) {
+        bytes += strlen(pms->title) + strlen(pms->file_size);
+        count++;
+    }
+    pb->enum_end(NULL, opaque);
+    enum_ms = elapsed_ms(&start);
+
+    if(count != songs) {
+        fprintf(stderr,"%s: enumerated %d songs, expected %d\n",pb->name,
+                count, songs);
+        return FALSE;
+    }
+
+    printf("%-8s: load %8.1f ms, fetch %8.1f ms (%6.2f us/song), "
+           "enum %8.1f ms (%6.2f us/song)\n", pb->name, load_ms,
+           fetch_ms, fetch_ms * 1000.0 / songs,
+           enum_ms, enum_ms * 1000.0 / songs);
+    DPRINTF(E_DBG,L_DB,"%s touched %llu bytes\n",pb->name,
+            (unsigned long long)bytes);
+
+    return TRUE;
+}
+
+/**
+ * resident set size, in kb
+ */
+long rss_kb(void) {
+    FILE *fin;
+    long pages = 0;
+
+    if((fin = fopen("/proc/self/statm","r"))) {
+        if(fscanf(fin,"%*s %ld",&pages) != 1)
+            pages = 0;
+        fclose(fin);
+    }
+
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * walk a filtered item query to the end
+ *
+ * @returns number of items it came up with, or -1 on error
+ */
+int filtered_walk(char *filter) {
+    DB_QUERY query;
+    char **row;
+    char *pe = NULL;
+    int count = 0;
+
+    memset(&query,0,sizeof(query));
+    query.query_type = QUERY_TYPE_ITEMS;
+    query.filter_type = FILTER_TYPE_FIREFLY;
+    query.filter = filter;
+
+    if(DB_E_SUCCESS != db_enum_start(&pe,&query)) {
+        fprintf(stderr,"Can't start query: %s\n",pe ? pe : "?");
+        return -1;
+    }
+
+    while((DB_E_SUCCESS == db_enum_fetch(&pe,&row,&query)) && (row))
+        count++;
+
+    db_enum_end(&pe,&query);
+    return count;
+}
+
+/**
+ * add smart playlists to the loaded library, and time building them,
+ * refreshing them, and a filtered query.  They are hidden, so they
+ * don't get saved into the cache dir.  The item cache gets filled
+ * first, so the memory is what the playlists take.
+ */
+int bench_smart(int songs, int playlists) {
+    char *genres[] = { "Rock", "Jazz", "Classical", "Pop", "Electronic",
+                       "Folk", "Hip-Hop", "Blues" };
+    char name[64], query[128];
+    char *pe = NULL;
+    MEDIA_NATIVE *pmn;
+    struct timeval start;
+    double build_ms, refresh_ms, first_ms;
+    long rss;
+    uint32_t id;
+    int index;
+    int items;
+
+    for(id = 1; id <= songs; id++) {
+        if((pmn = db_fetch_item(NULL,id)))
+            db_dispose_item(pmn);
+    }
+
+    rss = rss_kb();
+    gettimeofday(&start,NULL);
+    for(index = 0; index < playlists; index++) {
+        snprintf(name,sizeof(name),"Smart %d",index);
+        if(index % 2)
+            snprintf(query,sizeof(query),"album = \"Album %d\"",index * 7);
+        else
+            snprintf(query,sizeof(query),"genre = \"%s\" and year > %d",
+                     genres[(index / 2) % 8], 1960 + (index / 16) % 48);
+
+        if(DB_E_SUCCESS != db_add_playlist(&pe,name,PL_SMART | PL_HIDDEN,
+                                           query,NULL,0,&id)) {
+            fprintf(stderr,"Can't add %s: %s\n",name,pe ? pe : "?");
+            return FALSE;
+        }
+    }
+    build_ms = elapsed_ms(&start);
+    rss = rss_kb() - rss;
+
+    gettimeofday(&start,NULL);
+    if(PL_E_SUCCESS != pl_update_smart_all(&pe)) {
+        fprintf(stderr,"Can't refresh playlists: %s\n",pe ? pe : "?");
+        return FALSE;
+    }
+    refresh_ms = elapsed_ms(&start);
+
+    printf("smart   : %d playlists, build %8.1f ms, refresh %8.1f ms, "
+           "%ld kb\n",playlists,build_ms,refresh_ms,rss);
+
+    gettimeofday(&start,NULL);
+    items = filtered_walk("genre = \"Jazz\" and year > 1980");
+    first_ms = elapsed_ms(&start);
+    gettimeofday(&start,NULL);
+    if((items < 0) || (items != filtered_walk("genre = \"Jazz\" and year > 1980")))
+        return FALSE;
+
+    printf("filter  : %d items, first %8.1f ms, again %8.1f ms\n",
+           items,first_ms,elapsed_ms(&start));
+
+    return TRUE;
+}
+
+pthread_barrier_t play_barrier;
+
+/**
+ * count a play of each of the first songs, as one of the clients
+ * in check_plays.  Both wait for each other before each
+ * play, so they fetch the song at about the same time.
+ */
+void *play_thread(void *arg) {
+    int songs = *(int*)arg;
+    char *pe = NULL;
+    uint32_t id;
+
+    for(id = 1; id <= (uint32_t)songs; id++) {
+        pthread_barrier_wait(&play_barrier);
+        if(DB_E_SUCCESS != db_playcount_increment(&pe, id)) {
+            fprintf(stderr,"Can't count play of %d: %s\n",id,pe ? pe : "?");
+            exit(-1);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * have two threads play the same songs at once, and make sure
+ * neither play gets lost
+ */
+int check_plays(int songs) {
+    MEDIA_NATIVE *pmn;
+    pthread_t tid[2];
+    uint32_t *base;
+    uint32_t id;
+    int index;
+    int lost = 0;
+
+    base = (uint32_t*)calloc(songs + 1, sizeof(uint32_t));
+    if(!base)
+        return FALSE;
+
+    for(id = 1; id <= (uint32_t)songs; id++) {
+        if((pmn = db_fetch_item(NULL,id))) {
+            base[id] = pmn->play_count;
+            db_dispose_item(pmn);
+        }
+    }
+
+    pthread_barrier_init(&play_barrier,NULL,2);
+    for(index = 0; index < 2; index++) {
+        if(pthread_create(&tid[index],NULL,play_thread,&songs)) {
+            fprintf(stderr,"Can't start play thread\n");
+            exit(-1);
+        }
+    }
+    for(index = 0; index < 2; index++)
+        pthread_join(tid[index],NULL);
+    pthread_barrier_destroy(&play_barrier);
+
+    for(id = 1; id <= (uint32_t)songs; id++) {
+        if(!(pmn = db_fetch_item(NULL,id))) {
+            fprintf(stderr,"Can't fetch %d\n",id);
+            free(base);
+            return FALSE;
+        }
+        if(pmn->play_count != base[id] + 2)
+            lost++;
+        db_dispose_item(pmn);
+    }
+    free(base);
+
+    printf("plays   : %d songs played twice, %d plays lost\n",songs,lost);
+    return lost ? FALSE : TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    char *configfile = NULL;
+    char *cache_dir;
+    char db_path[PATH_MAX];
+    int songs = DEFAULT_SONGS;
+    int debuglevel = 0;
+    int import = 0;
+    int startup = 0;
+    int smart = 0;
+    int plays = 0;
+    char *pe = NULL;
+    BACKEND *pb;
+    struct timeval start;
+
+    while((option = getopt(argc, argv, "c:n:isp:r:d:")) != -1) {
+        switch(option) {
+        case 'c':
+            configfile = optarg;
+            break;
+        case 'n':
+            songs = atoi(optarg);
+            break;
+        case 'i':
+            import = 1;
+            break;
+        case 's':
+            startup = 1;
+            break;
+        case 'p':
+            startup = 1;
+            smart = atoi(optarg);
+            break;
+        case 'r':
+            startup = 1;
+            plays = atoi(optarg);
+            break;
+        case 'd':
+            debuglevel = atoi(optarg);
+            break;
+        default:
+            usage(-1);
+            break;
+        }
+    }
+
+    if((!configfile) || (songs <= 0) || (plays > songs))
+        usage(-1);
+
+    err_setdest(LOGDEST_STDERR);
+    io_init();
+    io_set_errhandler(driver_io_errhandler);
+    if(CONF_E_SUCCESS != conf_read(configfile)) {
+        fprintf(stderr,"Could not read config file %s\n",configfile);
+        exit(-1);
+    }
+
+    err_setlevel(debuglevel);
+
+    cache_dir = conf_alloc_string("general","cache_dir",NULL);
+    if(!cache_dir) {
+        fprintf(stderr,"No general/cache_dir in %s\n",configfile);
+        exit(-1);
+    }
+    snprintf(db_path,sizeof(db_path),"%s/songs3.db",cache_dir);
+    free(cache_dir);
+
+    /* this sets up a fresh schema, so must go before the build */
+    if(DB_E_SUCCESS != db_mem_open(&pe, NULL)) {
+        fprintf(stderr,"Can't open db: %s\n",pe ? pe : "?");
+        exit(-1);
+    }
+
+    printf("Building %d song library in %s\n",songs,db_path);
+    gettimeofday(&start,NULL);
+    if(import) {
+        if(!import_library(db_path, songs))
+            exit(-1);
+    } else if(!build_library(db_path, songs)) {
+        exit(-1);
+    }
+    printf("Built in %.1f ms\n\n",elapsed_ms(&start));
+
+    for(pb = backends; pb->name; pb++) {
+        if(!bench(pb, songs))
+            exit(-1);
+    }
+
+    db_mem_close();
+
+    if(startup) {
+        /* each play has to fetch its own copy */
+        if(plays)
+            conf_set_int("general","db_cache_size",0,0);
+
+        /* opening sets up a fresh schema again, so rebuild after */
+        cache_dir = conf_alloc_string("general","cache_dir",NULL);
+        if((DB_E_SUCCESS != db_open(&pe, "sqlite3", cache_dir)) ||
+           (!build_library(db_path, songs))) {
+            fprintf(stderr,"Can't open db: %s\n",pe ? pe : "?");
+            exit(-1);
+        }
+        free(cache_dir);
+
+        gettimeofday(&start,NULL);
+        if(DB_E_SUCCESS != db_init(0)) {
+            fprintf(stderr,"Can't init db\n");
+            exit(-1);
+        }
+        printf("db_init : %8.1f ms\n",elapsed_ms(&start));
+
+        if((smart) && (!bench_smart(songs, smart)))
+            exit(-1);
+        if((plays) && (!check_plays(plays)))
+            exit(-1);
+        db_deinit();
+    }
+    conf_close();
+    io_deinit();
+    return 0;
+}
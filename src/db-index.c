@@ -0,0 +1,395 @@
+/*
+ * $Id$
+ * bitmap indexes on low cardinality item fields
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Smart playlists and client filters lean on a few fields that only
+ * have a handful of different values across the whole library: genre,
+ * codec, year, rating and so on.  For each of those, this keeps the
+ * set of items with each value, so a compare on the field can be
+ * answered by running it once per value and or'ing together the sets
+ * of the values that pass, instead of once per item.  sp_plan puts
+ * those together into an answer for as much of a filter as it can.
+ *
+ * String values are kept lowercased, as every string compare ignores
+ * case.  A field that turns out to have too many values to be worth
+ * it stops being indexed.
+ *
+ * Only fields ahead of time_played get indexed.  The sqlite rows have
+ * db_timestamp and force_update columns that MEDIA_STRING doesn't, so
+ * a filter run against a row finds codectype, has_video and the rest
+ * somewhere else than the native item keeps them.  An index built
+ * from the native items would give different answers than the rows.
+ *
+ * This all runs under the db lock: a writelock for adds and deletes,
+ * and at least a readlock for plans.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include "daapd.h"
+#include "err.h"
+#include "db-index.h"
+#include "util.h"
+
+#ifndef TRUE
+#  define TRUE 1
+#  define FALSE 0
+#endif
+
+#define DB_INDEX_MAX_VALUES 1024
+
+typedef struct db_index_value_t {
+    char *svalue;               /**< lowercased, for string fields */
+    uint32_t ivalue;            /**< for int fields */
+    IDSET *pids;                /**< items with this value */
+} DB_INDEX_VALUE;
+
+typedef struct db_index_t {
+    int field;                  /**< SG_ column */
+    int string;                 /**< TRUE if a string field */
+    int disabled;               /**< too many values to be worth it */
+    int count;
+    int size;
+    DB_INDEX_VALUE *values;     /**< sorted by value */
+} DB_INDEX;
+
+/* Globals */
+static DB_INDEX db_indexes[] = {
+    { SG_GENRE, TRUE, FALSE, 0, 0, NULL },
+    { SG_TYPE, TRUE, FALSE, 0, 0, NULL },
+    { SG_COMPILATION, FALSE, FALSE, 0, 0, NULL },
+    { SG_YEAR, FALSE, FALSE, 0, 0, NULL },
+    { SG_RATING, FALSE, FALSE, 0, 0, NULL },
+    { SG_DATA_KIND, FALSE, FALSE, 0, 0, NULL },
+    { -1, FALSE, FALSE, 0, 0, NULL }
+};
+static IDSET *db_index_all = NULL;      /**< every item indexed */
+static int db_index_broken = FALSE;     /**< ran out of memory, so no index */
+
+/* Forwards */
+static void db_index_add_item(uint32_t id, MEDIA_NATIVE *pmn, MEDIA_STRING *pms);
+static int db_index_insert(DB_INDEX *pindex, uint32_t id, char *svalue, uint32_t ivalue);
+static int db_index_find(DB_INDEX *pindex, char *svalue, uint32_t ivalue, int *pslot);
+static void db_index_clear(DB_INDEX *pindex);
+static IDSET *db_index_lookup(int field_id, int(*test)(void *, char *, int64_t), void *arg);
+
+/**
+ * throw away all the indexes
+ */
+void db_index_deinit(void) {
+    DB_INDEX *pindex;
+
+    for(pindex = db_indexes; pindex->field != -1; pindex++)
+        db_index_clear(pindex);
+
+    idset_free(db_index_all);
+    db_index_all = NULL;
+}
+
+/**
+ * index an item that was just added to (or updated in) the db
+ *
+ * @param pmn item that was added
+ */
+void db_index_add(MEDIA_NATIVE *pmn) {
+    db_index_add_item(pmn->id, pmn, NULL);
+}
+
+/**
+ * index an item, as it comes out of the db at startup
+ *
+ * @param pms item to index
+ */
+void db_index_add_string(MEDIA_STRING *pms) {
+    db_index_add_item(util_atoui32(pms->id), NULL, pms);
+}
+
+/**
+ * take an item out of the indexes
+ *
+ * @param id item to remove
+ */
+void db_index_del(uint32_t id) {
+    DB_INDEX *pindex;
+    int slot;
+
+    if((!db_index_all) || (!idset_del(db_index_all, id)))
+        return;
+
+    for(pindex = db_indexes; pindex->field != -1; pindex++) {
+        /* it only has the one value, but which, we don't know */
+        for(slot = 0; slot < pindex->count; slot++) {
+            if(!idset_del(pindex->values[slot].pids, id))
+                continue;
+
+            if(!idset_count(pindex->values[slot].pids)) {
+                idset_free(pindex->values[slot].pids);
+                if(pindex->values[slot].svalue)
+                    free(pindex->values[slot].svalue);
+                memmove(&pindex->values[slot],&pindex->values[slot + 1],
+                        (pindex->count - slot - 1) * sizeof(DB_INDEX_VALUE));
+                pindex->count--;
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * work out which items match a parsed filter, as far as the indexes
+ * can tell.  See sp_plan.
+ *
+ * @param pt filter to plan
+ * @param ppyes returns items that match
+ * @param ppmaybe returns items that might match
+ * @returns TRUE if the indexes helped, FALSE if every item has to be checked
+ */
+int db_index_plan(PARSETREE pt, IDSET **ppyes, IDSET **ppmaybe) {
+    *ppyes = *ppmaybe = NULL;
+
+    if((db_index_broken) || (!db_index_all))
+        return FALSE;
+
+    return sp_plan(pt, db_index_all, db_index_lookup, ppyes, ppmaybe);
+}
+
+/**
+ * put an item's values into the indexes, from whichever form of the
+ * item we have
+ */
+void db_index_add_item(uint32_t id, MEDIA_NATIVE *pmn, MEDIA_STRING *pms) {
+    DB_INDEX *pindex;
+    char *svalue;
+    uint32_t ivalue;
+
+    if((db_index_broken) || (!id))
+        return;
+
+    if(!db_index_all)
+        db_index_all = idset_new();
+
+    if((db_index_all) && (idset_contains(db_index_all, id)))
+        db_index_del(id);
+
+    if((!db_index_all) || (idset_add(db_index_all, id) < 0)) {
+        DPRINTF(E_LOG,L_DB,"Malloc error indexing items, not indexing\n");
+        db_index_deinit();
+        db_index_broken = TRUE;
+        return;
+    }
+
+    for(pindex = db_indexes; pindex->field != -1; pindex++) {
+        if(pindex->disabled)
+            continue;
+
+        svalue = NULL;
+        ivalue = 0;
+        if(pmn) {
+            if(pindex->string)
+                svalue = *(char**)((char*)pmn + ff_field_data[pindex->field].offset);
+            else
+                ivalue = *(uint32_t*)((char*)pmn + ff_field_data[pindex->field].offset);
+        } else {
+            svalue = ((char**)pms)[pindex->field];
+            if(!pindex->string) {
+                ivalue = svalue ? util_atoui32(svalue) : 0;
+                svalue = NULL;
+            }
+        }
+
+        if(!db_index_insert(pindex, id, svalue, ivalue)) {
+            DPRINTF(E_LOG,L_DB,"Malloc error indexing items, not indexing\n");
+            db_index_deinit();
+            db_index_broken = TRUE;
+            return;
+        }
+    }
+}
+
+/**
+ * add an item to the set for its value, adding the value if it's
+ * new.  A field with too many values gets dropped from indexing.
+ *
+ * @param pindex index to add to
+ * @param id item to add
+ * @param svalue value, for string fields (NULL is empty)
+ * @param ivalue value, for int fields
+ * @returns TRUE on success, FALSE on malloc error
+ */
+int db_index_insert(DB_INDEX *pindex, uint32_t id, char *svalue, uint32_t ivalue) {
+    DB_INDEX_VALUE *pvalue;
+    DB_INDEX_VALUE *new_values;
+    char *lower = NULL;
+    char *dst;
+    int slot;
+
+    if(pindex->string) {
+        lower = strdup(svalue ? svalue : "");
+        if(!lower)
+            return FALSE;
+        for(dst = lower; *dst; dst++)
+            *dst = tolower((unsigned char)*dst);
+    }
+
+    if(!db_index_find(pindex, lower, ivalue, &slot)) {
+        if(pindex->count == DB_INDEX_MAX_VALUES) {
+            DPRINTF(E_LOG,L_DB,"Too many values of %s to index it\n",
+                    ff_field_data[pindex->field].name);
+            db_index_clear(pindex);
+            pindex->disabled = TRUE;
+            if(lower)
+                free(lower);
+            return TRUE;
+        }
+
+        if(pindex->count == pindex->size) {
+            new_values = (DB_INDEX_VALUE*)realloc(pindex->values,
+                (pindex->size ? pindex->size * 2 : 16) * sizeof(DB_INDEX_VALUE));
+            if(!new_values) {
+                if(lower)
+                    free(lower);
+                return FALSE;
+            }
+            pindex->values = new_values;
+            pindex->size = pindex->size ? pindex->size * 2 : 16;
+        }
+
+        memmove(&pindex->values[slot + 1],&pindex->values[slot],
+                (pindex->count - slot) * sizeof(DB_INDEX_VALUE));
+        pvalue = &pindex->values[slot];
+        pvalue->svalue = lower;
+        pvalue->ivalue = ivalue;
+        pvalue->pids = idset_new();
+        pindex->count++;
+        lower = NULL;
+        if(!pvalue->pids)
+            return FALSE;
+    }
+
+    if(lower)
+        free(lower);
+
+    return (idset_add(pindex->values[slot].pids, id) >= 0);
+}
+
+/**
+ * binary search an index for a value
+ *
+ * @param pslot returns where the value is, or would go
+ * @returns TRUE if the value is there
+ */
+int db_index_find(DB_INDEX *pindex, char *svalue, uint32_t ivalue, int *pslot) {
+    int low = 0;
+    int high = pindex->count;
+    int mid;
+    int cmp;
+
+    while(low < high) {
+        mid = low + (high - low) / 2;
+        if(pindex->string)
+            cmp = strcmp(pindex->values[mid].svalue, svalue);
+        else
+            cmp = (pindex->values[mid].ivalue < ivalue) ? -1 :
+                (pindex->values[mid].ivalue > ivalue);
+
+        if(!cmp) {
+            *pslot = mid;
+            return TRUE;
+        }
+
+        if(cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    *pslot = low;
+    return FALSE;
+}
+
+/**
+ * empty out an index
+ */
+void db_index_clear(DB_INDEX *pindex) {
+    int slot;
+
+    for(slot = 0; slot < pindex->count; slot++) {
+        idset_free(pindex->values[slot].pids);
+        if(pindex->values[slot].svalue)
+            free(pindex->values[slot].svalue);
+    }
+
+    if(pindex->values)
+        free(pindex->values);
+
+    pindex->values = NULL;
+    pindex->count = pindex->size = 0;
+}
+
+/**
+ * look a compare up in the indexes, for sp_plan
+ *
+ * @param field_id SG_ column being compared
+ * @param test the compare, to run on each value
+ * @param arg for test
+ * @returns items with a value that passed, or NULL if there's no index
+ */
+IDSET *db_index_lookup(int field_id, int(*test)(void *, char *, int64_t), void *arg) {
+    DB_INDEX *pindex;
+    DB_INDEX_VALUE *pvalue;
+    IDSET *presult;
+    IDSET *ptemp;
+    int slot;
+
+    for(pindex = db_indexes; pindex->field != -1; pindex++) {
+        if(pindex->field == field_id)
+            break;
+    }
+
+    if((pindex->field == -1) || (pindex->disabled))
+        return NULL;
+
+    if(!(presult = idset_new()))
+        return NULL;
+
+    for(slot = 0; slot < pindex->count; slot++) {
+        pvalue = &pindex->values[slot];
+        if(!test(arg, pvalue->svalue, (int64_t)pvalue->ivalue))
+            continue;
+
+        ptemp = idset_or(presult, pvalue->pids);
+        idset_free(presult);
+        if(!(presult = ptemp))
+            return NULL;
+    }
+
+    return presult;
+}
@@ -0,0 +1,35 @@
+/*
+ * $Id$
+ * bitmap indexes on low cardinality item fields
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DB_INDEX_H_
+#define _DB_INDEX_H_
+
+#include "ff-dbstruct.h"
+#include "idset.h"
+#include "smart-parser.h"
+
+extern void db_index_deinit(void);
+extern void db_index_add(MEDIA_NATIVE *pmn);
+extern void db_index_add_string(MEDIA_STRING *pms);
+extern void db_index_del(uint32_t id);
+extern int db_index_plan(PARSETREE pt, IDSET **ppyes, IDSET **ppmaybe);
+
+#endif /* _DB_INDEX_H_ */
@@ -0,0 +1,724 @@
+/*
+ * $Id$
+ * in-memory db implementation, backed by sqlite3
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * This keeps the whole song table resident in memory, so fetches
+ * and enumerations never have to go to sql.  The sqlite3 db is still
+ * the persistent store: it's loaded in full on open, and all adds and
+ * deletes are written through to it.
+ *
+ * The table is stored by column rather than by row.  Numeric fields
+ * are plain arrays of uint32_t/uint64_t, and string fields are arrays
+ * of ids into an interned string pool, so the artist, album and genre
+ * strings shared by many songs are only stored once.  A row is
+ * found by id through a direct id -> row map.
+ *
+ * The string pool is allocated in chunks that never move, so the
+ * strings handed out in a MEDIA_STRING stay valid even if the pool
+ * grows.  Strings are never freed from the pool, though, so updates
+ * and deletes leave garbage until the next restart.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <sys/time.h>
+
+#include "daapd.h"
+#include "err.h"
+#include "db.h"
+#include "db-sql-sqlite3.h"
+#include "db-mem.h"
+#include "util.h"
+
+#ifndef TRUE
+#  define TRUE 1
+#  define FALSE 0
+#endif
+
+#define DB_MEM_CHUNK_BITS  20
+#define DB_MEM_CHUNK_SIZE  (1 << DB_MEM_CHUNK_BITS)  /**< string pool chunk */
+#define DB_MEM_MIN_ROWS    1024
+#define DB_MEM_NUM_SIZE    21  /**< room for a uint64_t in decimal */
+
+/** a fetched item: a MEDIA_STRING and room for its numeric fields */
+typedef struct db_mem_item_t {
+    char *row[SG_LAST];
+    char numbers[SG_LAST][DB_MEM_NUM_SIZE];
+} DB_MEM_ITEM;
+
+typedef struct db_mem_enum_helper_t {
+    uint32_t next_row;
+    DB_MEM_ITEM item;
+} DB_MEM_EH;
+
+/* Globals */
+static pthread_rwlock_t db_mem_lock;
+static void *db_mem_columns[SG_LAST];   /**< uint32_t, uint64_t or string ids */
+static uint32_t db_mem_rows = 0;        /**< rows in use */
+static uint32_t db_mem_row_capacity = 0;
+static uint32_t *db_mem_row_of = NULL;  /**< id -> row + 1, or 0 */
+static uint32_t db_mem_id_capacity = 0;
+
+static char **db_mem_chunks = NULL;     /**< string pool */
+static uint32_t db_mem_chunk_count = 0;
+static uint32_t db_mem_chunk_used = 0;  /**< bytes used in last chunk */
+static uint32_t *db_mem_intern = NULL;  /**< open addressed string ids */
+static uint32_t db_mem_intern_size = 0;
+static uint32_t db_mem_intern_count = 0;
+
+/* Forwards */
+static char *db_mem_str(uint32_t strid);
+static uint32_t db_mem_str_hash(char *string);
+static uint32_t db_mem_str_intern(char *string);
+static int db_mem_grow_rows(uint32_t rows);
+static int db_mem_grow_ids(uint32_t id);
+static uint32_t db_mem_row_alloc(uint32_t id);
+static void db_mem_row_set_native(uint32_t row, MEDIA_NATIVE *pmo);
+static void db_mem_row_set_string(uint32_t row, char **pms);
+static void db_mem_row_get(uint32_t row, DB_MEM_ITEM *pitem);
+static char *db_mem_utoa(char *buffer, uint64_t value);
+static void db_mem_free(void);
+static void db_mem_set_error(char **pe, int error, ...);
+
+/**
+ * Build an error string
+ */
+void db_mem_set_error(char **pe, int error, ...) {
+    va_list ap;
+    char *errorptr;
+
+    if(!pe)
+        return;
+
+    va_start(ap, error);
+    errorptr = util_vasprintf(db_error_list[error], ap);
+    va_end(ap);
+
+    DPRINTF(E_SPAM,L_MISC,"Raising error: %s\n",errorptr);
+    *pe = errorptr;
+}
+
+/**
+ * get the string for an interned string id
+ *
+ * @param strid id returned from db_mem_str_intern
+ * @returns the string, or NULL if strid is 0
+ */
+char *db_mem_str(uint32_t strid) {
+    if(!strid)
+        return NULL;
+
+    return &db_mem_chunks[strid >> DB_MEM_CHUNK_BITS][strid & (DB_MEM_CHUNK_SIZE - 1)];
+}
+
+uint32_t db_mem_str_hash(char *string) {
+    uint32_t hash = 2166136261U;
+
+    while(*string) {
+        hash ^= (unsigned char)*string++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/**
+ * find a string in the pool, adding it if it isn't there already.
+ * Strings longer than a pool chunk are truncated.  Must be called
+ * with the write lock held.
+ *
+ * @param string string to intern
+ * @returns string id, or 0 for a NULL string
+ */
+uint32_t db_mem_str_intern(char *string) {
+    uint32_t *new_intern;
+    uint32_t new_size;
+    uint32_t mask;
+    uint32_t slot;
+    uint32_t index;
+    uint32_t strid;
+    size_t len;
+    char **new_chunks;
+
+    if(!string)
+        return 0;
+
+    /* keep the intern table under half full */
+    if((db_mem_intern_count + 1) * 2 > db_mem_intern_size) {
+        new_size = db_mem_intern_size ? db_mem_intern_size * 2 : 4096;
+        new_intern = (uint32_t*)calloc(new_size, sizeof(uint32_t));
+        if(!new_intern)
+            DPRINTF(E_FATAL,L_DB,"Malloc error growing string pool\n");
+
+        mask = new_size - 1;
+        for(index = 0; index < db_mem_intern_size; index++) {
+            if(db_mem_intern[index]) {
+                slot = db_mem_str_hash(db_mem_str(db_mem_intern[index])) & mask;
+                while(new_intern[slot])
+                    slot = (slot + 1) & mask;
+                new_intern[slot] = db_mem_intern[index];
+            }
+        }
+
+        if(db_mem_intern)
+            free(db_mem_intern);
+        db_mem_intern = new_intern;
+        db_mem_intern_size = new_size;
+    }
+
+    mask = db_mem_intern_size - 1;
+    slot = db_mem_str_hash(string) & mask;
+    while(db_mem_intern[slot]) {
+        if(strcmp(db_mem_str(db_mem_intern[slot]),string) == 0)
+            return db_mem_intern[slot];
+        slot = (slot + 1) & mask;
+    }
+
+    /* not there, so add it */
+    len = strlen(string);
+    if(len >= DB_MEM_CHUNK_SIZE - 1) {
+        DPRINTF(E_LOG,L_DB,"Truncating %d byte string\n",(int)len);
+        len = DB_MEM_CHUNK_SIZE - 2;
+    }
+
+    if((!db_mem_chunk_count) ||
+       (db_mem_chunk_used + len + 1 > DB_MEM_CHUNK_SIZE)) {
+        new_chunks = (char**)realloc(db_mem_chunks,
+                                     (db_mem_chunk_count + 1) * sizeof(char*));
+        if(!new_chunks)
+            DPRINTF(E_FATAL,L_DB,"Malloc error growing string pool\n");
+        db_mem_chunks = new_chunks;
+
+        db_mem_chunks[db_mem_chunk_count] = (char*)malloc(DB_MEM_CHUNK_SIZE);
+        if(!db_mem_chunks[db_mem_chunk_count])
+            DPRINTF(E_FATAL,L_DB,"Malloc error growing string pool\n");
+
+        db_mem_chunk_count++;
+        db_mem_chunk_used = 1; /* so no string gets id 0 */
+    }
+
+    strid = ((db_mem_chunk_count - 1) << DB_MEM_CHUNK_BITS) | db_mem_chunk_used;
+    memcpy(db_mem_str(strid),string,len);
+    db_mem_str(strid)[len] = '\0';
+    db_mem_chunk_used += (uint32_t)len + 1;
+
+    db_mem_intern[slot] = strid;
+    db_mem_intern_count++;
+
+    return strid;
+}
+
+/**
+ * make sure all the columns have room for at least the specified
+ * number of rows
+ *
+ * @param rows number of rows needed
+ * @returns TRUE on success
+ */
+int db_mem_grow_rows(uint32_t rows) {
+    uint32_t new_capacity;
+    void *new_column;
+    size_t width;
+    int field;
+
+    if(rows <= db_mem_row_capacity)
+        return TRUE;
+
+    new_capacity = db_mem_row_capacity ? db_mem_row_capacity : DB_MEM_MIN_ROWS;
+    while(new_capacity < rows)
+        new_capacity *= 2;
+
+    for(field = 0; field < SG_LAST; field++) {
+        width = (ff_field_data[field].type == FT_INT64) ?
+            sizeof(uint64_t) : sizeof(uint32_t);
+        new_column = realloc(db_mem_columns[field], new_capacity * width);
+        if(!new_column)
+            return FALSE;
+        db_mem_columns[field] = new_column;
+    }
+
+    db_mem_row_capacity = new_capacity;
+    return TRUE;
+}
+
+/**
+ * make sure the id map can hold the specified id
+ *
+ * @param id id that needs mapping
+ * @returns TRUE on success
+ */
+int db_mem_grow_ids(uint32_t id) {
+    uint32_t new_capacity;
+    uint32_t *new_map;
+
+    if(id < db_mem_id_capacity)
+        return TRUE;
+
+    new_capacity = db_mem_id_capacity ? db_mem_id_capacity : DB_MEM_MIN_ROWS;
+    while(new_capacity <= id)
+        new_capacity *= 2;
+
+    new_map = (uint32_t*)realloc(db_mem_row_of, new_capacity * sizeof(uint32_t));
+    if(!new_map)
+        return FALSE;
+
+    memset(&new_map[db_mem_id_capacity], 0,
+           (new_capacity - db_mem_id_capacity) * sizeof(uint32_t));
+    db_mem_row_of = new_map;
+    db_mem_id_capacity = new_capacity;
+    return TRUE;
+}
+
+/**
+ * get the row for an id, allocating a new one if the id doesn't
+ * have a row yet.  Must be called with the write lock held.
+ *
+ * @param id id to get a row for
+ * @returns row + 1, or 0 on malloc error
+ */
+uint32_t db_mem_row_alloc(uint32_t id) {
+    if(!db_mem_grow_ids(id))
+        return 0;
+
+    if(db_mem_row_of[id])
+        return db_mem_row_of[id];
+
+    if(!db_mem_grow_rows(db_mem_rows + 1))
+        return 0;
+
+    db_mem_row_of[id] = ++db_mem_rows;
+    return db_mem_rows;
+}
+
+/**
+ * fill a row from a native media object
+ */
+void db_mem_row_set_native(uint32_t row, MEDIA_NATIVE *pmo) {
+    int field;
+    void *pvalue;
+
+    for(field = 0; field < SG_LAST; field++) {
+        pvalue = (void*)((char*)pmo + ff_field_data[field].offset);
+        switch(ff_field_data[field].type) {
+        case FT_INT32:
+            ((uint32_t*)db_mem_columns[field])[row] = *((uint32_t*)pvalue);
+            break;
+        case FT_INT64:
+            ((uint64_t*)db_mem_columns[field])[row] = *((uint64_t*)pvalue);
+            break;
+        case FT_STRING:
+            ((uint32_t*)db_mem_columns[field])[row] =
+                db_mem_str_intern(*((char**)pvalue));
+            break;
+        }
+    }
+}
+
+/**
+ * fill a row from a string media object (as from sqlite)
+ */
+void db_mem_row_set_string(uint32_t row, char **pms) {
+    int field;
+
+    for(field = 0; field < SG_LAST; field++) {
+        switch(ff_field_data[field].type) {
+        case FT_INT32:
+            ((uint32_t*)db_mem_columns[field])[row] = util_atoui32(pms[field]);
+            break;
+        case FT_INT64:
+            ((uint64_t*)db_mem_columns[field])[row] = util_atoui64(pms[field]);
+            break;
+        case FT_STRING:
+            ((uint32_t*)db_mem_columns[field])[row] =
+                db_mem_str_intern(pms[field]);
+            break;
+        }
+    }
+}
+
+/**
+ * convert an unsigned number to decimal.  This is called for every
+ * numeric field of every fetched row, so it avoids snprintf.
+ *
+ * @param buffer buffer of at least DB_MEM_NUM_SIZE bytes
+ * @param value value to convert
+ * @returns pointer to the converted string (somewhere in buffer)
+ */
+char *db_mem_utoa(char *buffer, uint64_t value) {
+    char *p = &buffer[DB_MEM_NUM_SIZE - 1];
+
+    *p = '\0';
+    do {
+        *--p = (char)('0' + (value % 10));
+        value /= 10;
+    } while(value);
+
+    return p;
+}
+
+/**
+ * get a row as a MEDIA_STRING.  String fields point right into
+ * the string pool.  Must be called with at least a read lock.
+ */
+void db_mem_row_get(uint32_t row, DB_MEM_ITEM *pitem) {
+    int field;
+
+    for(field = 0; field < SG_LAST; field++) {
+        switch(ff_field_data[field].type) {
+        case FT_INT32:
+            pitem->row[field] = db_mem_utoa(pitem->numbers[field],
+                ((uint32_t*)db_mem_columns[field])[row]);
+            break;
+        case FT_INT64:
+            pitem->row[field] = db_mem_utoa(pitem->numbers[field],
+                ((uint64_t*)db_mem_columns[field])[row]);
+            break;
+        case FT_STRING:
+            pitem->row[field] =
+                db_mem_str(((uint32_t*)db_mem_columns[field])[row]);
+            break;
+        }
+    }
+}
+
+/**
+ * open the db: open the underlying sqlite3 db and pull the whole
+ * song table into memory
+ *
+ * @param pe error buffer
+ * @param dsn passed through to sqlite3
+ * @returns DB_E_SUCCESS on success
+ */
+int db_mem_open(char **pe, char *dsn) {
+    int err;
+
+    pthread_rwlock_init(&db_mem_lock,NULL);
+
+    if(DB_E_SUCCESS != (err = db_sqlite3_open(pe, dsn)))
+        return err;
+
+    return db_mem_load(pe);
+}
+
+/**
+ * (re)load the in-memory tables from the sqlite3 song table,
+ * throwing away whatever was there.
+ *
+ * @param pe error buffer
+ * @returns DB_E_SUCCESS on success
+ */
+int db_mem_load(char **pe) {
+    void *opaque;
+    char **row;
+    uint32_t slot;
+    int err;
+    struct timeval start, end;
+    uint32_t pool_size;
+    char *columns;
+    int field;
+
+    gettimeofday(&start,NULL);
+
+    /* the table has columns that aren't in the SG_ list, so ask
+     * for exactly the ones we want, in SG_ order */
+    columns = util_asprintf("%s",ff_field_data[0].name);
+    for(field = 1; field < SG_LAST; field++)
+        columns = util_aasprintf(columns,",%s",ff_field_data[field].name);
+
+    err = db_sqlite3_enum_begin(pe, &opaque, "select %s from songs", columns);
+    free(columns);
+    if(DB_E_SUCCESS != err)
+        return err;
+
+    pthread_rwlock_wrlock(&db_mem_lock);
+    db_mem_free();
+    while((DB_E_SUCCESS == (err = db_sqlite3_enum_items_fetch(pe, opaque, (MEDIA_STRING**)&row))) && (row)) {
+        slot = db_mem_row_alloc(util_atoui32(row[SG_ID]));
+        if(!slot) {
+            pthread_rwlock_unlock(&db_mem_lock);
+            db_sqlite3_enum_end(NULL, opaque);
+            db_mem_set_error(pe, DB_E_MALLOC);
+            return DB_E_MALLOC;
+        }
+        db_mem_row_set_string(slot - 1, row);
+    }
+    pthread_rwlock_unlock(&db_mem_lock);
+
+    if(err != DB_E_SUCCESS) /* fetch closes on error */
+        return err;
+
+    db_sqlite3_enum_end(NULL, opaque);
+
+    gettimeofday(&end,NULL);
+    pool_size = db_mem_chunk_count ? ((db_mem_chunk_count - 1) *
+                                      DB_MEM_CHUNK_SIZE) + db_mem_chunk_used : 0;
+
+    DPRINTF(E_LOG,L_DB,"Loaded %d songs (%d unique strings, %d bytes) in %d ms\n",
+            db_mem_rows, db_mem_intern_count, pool_size,
+            (int)((end.tv_sec - start.tv_sec) * 1000 +
+                  (end.tv_usec - start.tv_usec) / 1000));
+
+    return DB_E_SUCCESS;
+}
+
+/**
+ * free all the in-memory data
+ */
+void db_mem_free(void) {
+    uint32_t chunk;
+    int field;
+
+    for(field = 0; field < SG_LAST; field++) {
+        if(db_mem_columns[field])
+            free(db_mem_columns[field]);
+        db_mem_columns[field] = NULL;
+    }
+
+    for(chunk = 0; chunk < db_mem_chunk_count; chunk++)
+        free(db_mem_chunks[chunk]);
+
+    if(db_mem_chunks)
+        free(db_mem_chunks);
+    if(db_mem_intern)
+        free(db_mem_intern);
+    if(db_mem_row_of)
+        free(db_mem_row_of);
+
+    db_mem_chunks = NULL;
+    db_mem_intern = NULL;
+    db_mem_row_of = NULL;
+    db_mem_chunk_count = db_mem_chunk_used = 0;
+    db_mem_intern_size = db_mem_intern_count = 0;
+    db_mem_rows = db_mem_row_capacity = db_mem_id_capacity = 0;
+}
+
+/**
+ * close the database
+ */
+int db_mem_close(void) {
+    pthread_rwlock_wrlock(&db_mem_lock);
+    db_mem_free();
+    pthread_rwlock_unlock(&db_mem_lock);
+
+    return db_sqlite3_close();
+}
+
+/**
+ * add (or update) a media object.  This goes to sqlite first, so
+ * a new object gets its id from there.
+ *
+ * @param pe error buffer
+ * @param pmo object to add
+ * @returns DB_E_SUCCESS on success.  pmo->id gets updated on add
+ */
+int db_mem_add(char **pe, MEDIA_NATIVE *pmo) {
+    uint32_t slot;
+    int err;
+
+    if(DB_E_SUCCESS != (err = db_sqlite3_add(pe, pmo)))
+        return err;
+
+    pthread_rwlock_wrlock(&db_mem_lock);
+    slot = db_mem_row_alloc(pmo->id);
+    if(slot)
+        db_mem_row_set_native(slot - 1, pmo);
+    pthread_rwlock_unlock(&db_mem_lock);
+
+    if(!slot) {
+        db_mem_set_error(pe, DB_E_MALLOC);
+        return DB_E_MALLOC;
+    }
+
+    return DB_E_SUCCESS;
+}
+
+/**
+ * delete a media object by id.  The last row gets moved into the
+ * hole, so the table stays dense.
+ *
+ * @param pe error buffer
+ * @param id id of media object to delete
+ * @returns DB_E_SUCCESS on success, error on failure with pe allocated
+ */
+int db_mem_del(char **pe, uint32_t id) {
+    uint32_t row, last, last_id;
+    int field;
+    int err;
+
+    if(DB_E_SUCCESS != (err = db_sqlite3_del(pe, id)))
+        return err;
+
+    pthread_rwlock_wrlock(&db_mem_lock);
+    if((id < db_mem_id_capacity) && (db_mem_row_of[id])) {
+        row = db_mem_row_of[id] - 1;
+        last = db_mem_rows - 1;
+        if(row != last) {
+            for(field = 0; field < SG_LAST; field++) {
+                if(ff_field_data[field].type == FT_INT64) {
+                    ((uint64_t*)db_mem_columns[field])[row] =
+                        ((uint64_t*)db_mem_columns[field])[last];
+                } else {
+                    ((uint32_t*)db_mem_columns[field])[row] =
+                        ((uint32_t*)db_mem_columns[field])[last];
+                }
+            }
+            last_id = ((uint32_t*)db_mem_columns[SG_ID])[row];
+            db_mem_row_of[last_id] = row + 1;
+        }
+        db_mem_row_of[id] = 0;
+        db_mem_rows--;
+    }
+    pthread_rwlock_unlock(&db_mem_lock);
+
+    return DB_E_SUCCESS;
+}
+
+/**
+ * write back play counts, then patch them into the columns
+ */
+int db_mem_playcounts(char **pe, DB_PLAYCOUNT *pplays, int count) {
+    uint32_t row;
+    int index;
+    int err;
+
+    if(DB_E_SUCCESS != (err = db_sqlite3_playcounts(pe, pplays, count)))
+        return err;
+
+    pthread_rwlock_wrlock(&db_mem_lock);
+    for(index = 0; index < count; index++) {
+        if((pplays[index].id >= db_mem_id_capacity) ||
+           (!db_mem_row_of[pplays[index].id]))
+            continue;
+
+        row = db_mem_row_of[pplays[index].id] - 1;
+        ((uint32_t*)db_mem_columns[SG_PLAY_COUNT])[row] = pplays[index].play_count;
+        ((uint32_t*)db_mem_columns[SG_TIME_PLAYED])[row] = pplays[index].time_played;
+    }
+    pthread_rwlock_unlock(&db_mem_lock);
+
+    return DB_E_SUCCESS;
+}
+
+/**
+ * start walking through the songs
+ */
+int db_mem_enum_items_begin(char **pe, void **opaque) {
+    DB_MEM_EH *peh;
+
+    peh = (DB_MEM_EH*)malloc(sizeof(DB_MEM_EH));
+    if(!peh) {
+        db_mem_set_error(pe, DB_E_MALLOC);
+        return DB_E_MALLOC;
+    }
+
+    peh->next_row = 0;
+    *opaque = peh;
+    return DB_E_SUCCESS;
+}
+
+/**
+ * fetch the next song.  The returned row is good until the next
+ * fetch on this enum.
+ *
+ * @returns DB_E_SUCCESS, with *ppmo = NULL at the end of the table
+ */
+int db_mem_enum_items_fetch(char **pe, void *opaque, MEDIA_STRING **ppmo) {
+    DB_MEM_EH *peh = (DB_MEM_EH*)opaque;
+
+    pthread_rwlock_rdlock(&db_mem_lock);
+    if(peh->next_row < db_mem_rows) {
+        db_mem_row_get(peh->next_row++, &peh->item);
+        *ppmo = (MEDIA_STRING*)peh->item.row;
+    } else {
+        *ppmo = NULL;
+    }
+    pthread_rwlock_unlock(&db_mem_lock);
+
+    return DB_E_SUCCESS;
+}
+
+int db_mem_enum_end(char **pe, void *opaque) {
+    if(opaque)
+        free(opaque);
+    return DB_E_SUCCESS;
+}
+
+int db_mem_enum_restart(char **pe, void *opaque) {
+    ((DB_MEM_EH*)opaque)->next_row = 0;
+    return DB_E_SUCCESS;
+}
+
+/**
+ * fetch a single song by id
+ *
+ * @param pe error buffer
+ * @param id id of song to fetch
+ * @param opaque returns handle to pass to db_mem_dispose_item
+ * @param ppms returns the song, or NULL if there is no such song
+ * @returns DB_E_SUCCESS on success
+ */
+int db_mem_fetch_item(char **pe, uint32_t id, void **opaque, MEDIA_STRING **ppms) {
+    DB_MEM_ITEM *pitem;
+
+    *opaque = NULL;
+    *ppms = NULL;
+
+    pitem = (DB_MEM_ITEM*)malloc(sizeof(DB_MEM_ITEM));
+    if(!pitem) {
+        db_mem_set_error(pe, DB_E_MALLOC);
+        return DB_E_MALLOC;
+    }
+
+    pthread_rwlock_rdlock(&db_mem_lock);
+    if((id >= db_mem_id_capacity) || (!db_mem_row_of[id])) {
+        /* same as an empty select from sqlite */
+        pthread_rwlock_unlock(&db_mem_lock);
+        free(pitem);
+        return DB_E_SUCCESS;
+    }
+
+    db_mem_row_get(db_mem_row_of[id] - 1, pitem);
+    pthread_rwlock_unlock(&db_mem_lock);
+
+    *opaque = pitem;
+    *ppms = (MEDIA_STRING*)pitem->row;
+    return DB_E_SUCCESS;
+}
+
+void db_mem_dispose_item(void *opaque, MEDIA_STRING *ppms) {
+    if(opaque)
+        free(opaque);
+}
+
+void db_mem_hint(int hint) {
+    db_sqlite3_hint(hint);
+}
@@ -41,6 +41,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sqlite3.h>
+#include <sys/time.h>
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
 #endif
@@ -67,27 +68,76 @@ typedef struct db_sqlite3_enum_helper_t {
     char **row;
 } DB_SQLITE3_EH;
 
+/*
+ * the connections are opened up front, and handed out from a pool.
+ * Reads can go to any of them, and run side by side.  Writes all go
+ * through the one writer connection, a thread at a time.  Each
+ * connection carries the statements prepared on it.
+ */
+typedef struct db_sqlite3_conn_t {
+    sqlite3 *pdb;
+    sqlite3_stmt *insert_stmt;  /**< prepared on first add */
+    sqlite3_stmt *update_stmt;
+    sqlite3_stmt *fetch_stmt;   /**< fetch by id, prepared on first fetch */
+    struct db_sqlite3_conn_t *next; /**< next free reader */
+} DB_SQLITE3_CONN;
+
+/*
+ * what a thread has out of the pool.  Locks nest, so the connection
+ * goes back only when the last one is released.
+ */
+typedef struct db_sqlite3_lease_t {
+    DB_SQLITE3_CONN *pconn;     /**< connection reads go to */
+    int depth;                  /**< nested db_sqlite3_lock calls */
+    int writing;                /**< nested db_sqlite3_write_lock calls */
+} DB_SQLITE3_LEASE;
+
 /* Globals */
-static pthread_mutex_t db_sqlite3_mutex;
+static pthread_mutex_t db_sqlite3_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t db_sqlite3_pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t db_sqlite3_write_mutex;
 static pthread_key_t db_sqlite3_key;
 static char db_sqlite3_path[PATH_MAX + 1];
+static DB_SQLITE3_CONN *db_sqlite3_readers = NULL;  /**< all of the readers */
+static DB_SQLITE3_CONN *db_sqlite3_free = NULL;     /**< readers not leased */
+static DB_SQLITE3_CONN *db_sqlite3_writer = NULL;
+static DB_SQLITE3_STATS db_sqlite3_stats_data;
+
+/*
+ * During a full scan, adds are grouped into transactions of
+ * db_sqlite3_batch_size on the writer.  Nobody but the thread doing
+ * the adds can see them until they are committed, so that thread
+ * reads through the writer too.  Everyone else reads the last
+ * commit through their own reader, as WAL lets them, and only the
+ * thread doing the adds decides when a batch ends.
+ */
+static int db_sqlite3_batch_size = 0;       /**< 0 when not batching */
+static int db_sqlite3_batch_count = 0;      /**< adds in the open transaction */
+static int db_sqlite3_batch_open = FALSE;
+static pthread_t db_sqlite3_batch_owner;    /**< thread doing the adds */
 
 #define DB_SQLITE3_VERSION 14
+#define DB_SQLITE3_BATCH_DEFAULT 500
+#define DB_SQLITE3_HANDLES_DEFAULT 4
+#define DB_SQLITE3_MMAP_DEFAULT 65536       /* kb */
 
 
 /* Forwards */
 static void db_sqlite3_lock(void);
 static void db_sqlite3_unlock(void);
+static void db_sqlite3_write_lock(void);
+static void db_sqlite3_write_unlock(void);
 extern char *db_sqlite3_initial;
 static int db_sqlite3_enum_begin_helper(char **pe, void *opaque);
 static int db_sqlite3_exec(char **pe, int loglevel, char *fmt, ...);
-static int db_sqlite3_insert_id(void);
 static void db_sqlite3_set_error(char **pe, int error, ...);
 static void db_sqlite3_set_version(int version);
-static int db_sqlite3_enum_begin(char **pe, void **opaque, char *fmt, ...);
 static int db_sqlite3_enum_fetch(char **pe, void *opaque, char ***row);
-static int db_sqlite3_fetch_row(char **pe, void **opaque, char ***row, char *fmt, ...);
-static void db_sqlite3_dispose_row(void *opaque);
+static DB_SQLITE3_CONN *db_sqlite3_conn(void);
+static DB_SQLITE3_CONN *db_sqlite3_openconn(char **pe, int readonly);
+static void db_sqlite3_freedb(DB_SQLITE3_CONN *pconn);
+static int db_sqlite3_prepare_add(DB_SQLITE3_CONN *pconn);
+static void db_sqlite3_batch_commit(void);
 
 extern char *db_sqlite_updates[];
 
@@ -104,80 +154,160 @@ void db_sqlite3_set_version(int version) {
 }
 
 /**
+ * fetch a song by id.  This is what every item enumeration ends up
+ * calling, so rather than building and preparing a query each time,
+ * each connection keeps a prepared statement and just rebinds the id.
+ * The row is copied out, so the reader goes back to the pool before
+ * this returns, rather than staying out while the caller writes the
+ * song to a client.
+ *
  * @param pe error buffer
- * @param ppmo returns the result
+ * @param id id of the song to fetch
+ * @param opaque returns handle to pass to db_sqlite3_dispose_item
+ * @param ppms returns the result (NULL if there's no such song)
  * @return DB_E_SUCCESS on success, error code with pe allocated otherwise
  */
 int db_sqlite3_fetch_item(char **pe, uint32_t id, void **opaque, MEDIA_STRING **ppms) {
-    return db_sqlite3_fetch_row(pe, opaque, (char***)ppms, "select * from songs where id=%d",id);
-}
-
-int db_sqlite3_fetch_row(char **pe, void **opaque, char ***row, char *fmt, ...) {
-    DB_SQLITE3_EH *peh;
-    va_list ap;
+    DB_SQLITE3_CONN *pconn;
+    sqlite3_stmt *stmt;
+    char **row;
+    char *dst;
+    size_t size;
+    int cols;
+    int idx;
     int err;
 
-    peh = (DB_SQLITE3_EH*)malloc(sizeof(DB_SQLITE3_EH));
+    *opaque = NULL;
+    *ppms = NULL;
 
-    if(!peh) {
-        db_sqlite3_set_error(pe, DB_E_MALLOC);
-        return DB_E_MALLOC;
+    db_sqlite3_lock();
+
+    pconn = db_sqlite3_conn();
+    if(!pconn->fetch_stmt) {
+        err = sqlite3_prepare_v2(pconn->pdb,"select * from songs where id=?",
+                                 -1,&pconn->fetch_stmt,NULL);
+        if(err != SQLITE_OK) {
+            db_sqlite3_set_error(pe,DB_E_SQL_ERROR,sqlite3_errmsg(pconn->pdb));
+            pconn->fetch_stmt = NULL;
+            db_sqlite3_unlock();
+            return DB_E_SQL_ERROR;
+        }
     }
+    stmt = pconn->fetch_stmt;
 
-    *opaque = peh;
-    memset(peh,0,sizeof(DB_SQLITE3_EH));
+    sqlite3_bind_int(stmt,1,id);
+    err = sqlite3_step(stmt);
+    if(err == SQLITE_DONE) {
+        sqlite3_reset(stmt);
+        db_sqlite3_unlock();
+        return DB_E_SUCCESS;
+    }
 
-    db_sqlite3_lock();
-    va_start(ap,fmt);
-    peh->query = sqlite3_vmprintf(fmt,ap);
-    va_end(ap);
+    if(err != SQLITE_ROW) {
+        db_sqlite3_set_error(pe,DB_E_SQL_ERROR,sqlite3_errmsg(pconn->pdb));
+        sqlite3_reset(stmt);
+        db_sqlite3_unlock();
+        return DB_E_SQL_ERROR;
+    }
 
-    if(DB_E_SUCCESS != (err = db_sqlite3_enum_begin_helper(pe, *opaque)))
-        return err;
+    /* one block: the column pointers, then the strings they point to */
+    cols = sqlite3_column_count(stmt);
+    size = sizeof(char*) * cols;
+    for(idx=0; idx < cols; idx++) {
+        if(sqlite3_column_type(stmt,idx) != SQLITE_NULL) {
+            sqlite3_column_text(stmt,idx);
+            size += sqlite3_column_bytes(stmt,idx) + 1;
+        }
+    }
 
-    if(DB_E_SUCCESS != (err = db_sqlite3_enum_fetch(pe, *opaque, row))) {
-        db_sqlite3_enum_end(NULL, *opaque);
-        return err;
+    row = (char**)malloc(size);
+    if(!row) {
+        sqlite3_reset(stmt);
+        db_sqlite3_unlock();
+        db_sqlite3_set_error(pe,DB_E_MALLOC);
+        return DB_E_MALLOC;
+    }
+
+    dst = (char*)&row[cols];
+    for(idx=0; idx < cols; idx++) {
+        if(sqlite3_column_type(stmt,idx) == SQLITE_NULL) {
+            row[idx] = NULL;
+            continue;
+        }
+        size = sqlite3_column_bytes(stmt,idx);
+        memcpy(dst,sqlite3_column_text(stmt,idx),size);
+        dst[size] = '\0';
+        row[idx] = dst;
+        dst += size + 1;
     }
 
+    sqlite3_reset(stmt);
+    db_sqlite3_unlock();
+
+    *opaque = row;
+    *ppms = (MEDIA_STRING*)row;
     return DB_E_SUCCESS;
 }
 
 /**
- * dispose of a row fetched via db_sqlite2_fetch
+ * dispose of a song fetched via db_sqlite3_fetch_item
  *
+ * @param opaque handle from db_sqlite3_fetch_item
  * @param ppms media object to destroy
  */
 void db_sqlite3_dispose_item(void *opaque, MEDIA_STRING *ppms) {
-    db_sqlite3_dispose_row(opaque);
-}
-
-void db_sqlite3_dispose_row(void *opaque) {
     if(opaque)
-        db_sqlite3_enum_end(NULL,opaque);
+        free(opaque);
 }
 
 /**
- * some db actions can be optimized by the db itself.
- * this is particularly true on prescans, when
- * the entire action can be wrapped in a transaction
+ * some db actions can be optimized by the db itself.  For now,
+ * that means grouping the adds during a full scan into transactions,
+ * rather than syncing the db for every song.
  *
  * @param hint hint type (@see ff-dbstruct.h)
  */
 void db_sqlite3_hint(int hint) {
-    return;
-
     switch(hint) {
-    case DB_HINT_PRESCAN_START:
-        db_sqlite3_exec(NULL,E_LOG,"PRAGMA synchronous=off;PRAGMA temp_store=MEMORY;BEGIN;");
-
+    case DB_HINT_FULLSCAN_START:
+        db_sqlite3_write_lock();
+        db_sqlite3_batch_size = conf_get_int("scanning","db_batch",
+                                             DB_SQLITE3_BATCH_DEFAULT);
+        if(db_sqlite3_batch_size < 2)
+            db_sqlite3_batch_size = 0;
+        db_sqlite3_write_unlock();
         break;
-    case DB_HINT_PRESCAN_END:
-        db_sqlite3_exec(NULL,E_LOG,"END;PRAGMA synchronous=on;");
+    case DB_HINT_FULLSCAN_END:
+        db_sqlite3_write_lock();
+        db_sqlite3_batch_commit();
+        db_sqlite3_batch_size = 0;
+        db_sqlite3_write_unlock();
+        break;
+    default:
         break;
     }
 }
 
+/**
+ * commit the open batch of adds, if there is one.  Only the thread
+ * doing the adds (or the close, once it's gone) does this, holding
+ * the writer.
+ */
+void db_sqlite3_batch_commit(void) {
+    char *perr;
+
+    if(!db_sqlite3_batch_open)
+        return;
+
+    DPRINTF(E_DBG,L_DB,"Committing %d adds\n",db_sqlite3_batch_count);
+    if(sqlite3_exec(db_sqlite3_writer->pdb,"COMMIT",NULL,NULL,&perr) != SQLITE_OK) {
+        DPRINTF(E_LOG,L_DB,"Error committing adds: %s\n",perr);
+        sqlite3_free(perr);
+    }
+
+    db_sqlite3_batch_open = FALSE;
+    db_sqlite3_batch_count = 0;
+}
 
 /**
  * delete a media object by id
@@ -191,120 +321,304 @@ int db_sqlite3_del(char **pe, uint32_t id) {
 }
 
 /**
- * insert a media object into the database
+ * prepare the insert and update statements for db_sqlite3_add on
+ * a connection.  Both bind every column but id, in SG_ order, and
+ * the update binds id last.
+ *
+ * @param pconn connection to prepare them on
+ * @returns TRUE on success
+ */
+int db_sqlite3_prepare_add(DB_SQLITE3_CONN *pconn) {
+    char *insert, *values, *update;
+    int field;
+    int err;
+
+    insert = util_asprintf("insert into songs (");
+    values = util_asprintf(") values (");
+    update = util_asprintf("update songs set ");
+    for(field = 1; field < SG_LAST; field++) { /* skip id */
+        insert = util_aasprintf(insert,"%s%c",ff_field_data[field].name,
+                                (field == (SG_LAST - 1)) ? ' ' : ',');
+        values = util_aasprintf(values,"?%c",
+                                (field == (SG_LAST - 1)) ? ')' : ',');
+        update = util_aasprintf(update,"%s = ?%c",ff_field_data[field].name,
+                                (field == (SG_LAST - 1)) ? ' ' : ',');
+    }
+    insert = util_aasprintf(insert,"%s",values);
+    update = util_aasprintf(update,"where id = ?");
+
+    err = sqlite3_prepare_v2(pconn->pdb,insert,-1,&pconn->insert_stmt,NULL);
+    if(err == SQLITE_OK)
+        err = sqlite3_prepare_v2(pconn->pdb,update,-1,&pconn->update_stmt,NULL);
+
+    if(err != SQLITE_OK) {
+        DPRINTF(E_LOG,L_DB,"Can't prepare add: %s\n",sqlite3_errmsg(pconn->pdb));
+        sqlite3_finalize(pconn->insert_stmt);
+        sqlite3_finalize(pconn->update_stmt);
+        pconn->insert_stmt = pconn->update_stmt = NULL;
+    }
+
+    free(insert);
+    free(values);
+    free(update);
+    return (err == SQLITE_OK);
+}
+
+/**
+ * insert a media object into the database.  This binds into
+ * statements prepared once on the writer, rather than building
+ * and parsing new sql for every song.
  *
  * @param pe error buffer
  * @param pmo object to add
  * @returns DB_E_SUCCESS on success.  pmo->id gets updated on add/update
  */
 int db_sqlite3_add(char **pe, MEDIA_NATIVE *pmo) {
-    char *sql;
-    char *term;
-    int field,pass;
+    DB_SQLITE3_CONN *pconn;
+    sqlite3_stmt *stmt;
+    char *value;
+    char *perr;
+    int field;
     int offset;
     int err;
 
-    db_sqlite3_lock();
+    db_sqlite3_write_lock();
 
-    if(pmo->id) {
-        /* update query */
-        sql = util_asprintf("update songs set ");
-        for(field = 1; field < SG_LAST; field++) { /* skip id */
-            offset = ff_field_data[field].offset;
-
-            switch(ff_field_data[field].type) {
-            case FT_INT32:
-                sql = util_aasprintf(sql,"%s = %d%c ",ff_field_data[field].name,
-                                     *((uint32_t*)(((void*)pmo)+offset)),
-                                     (field == (SG_LAST - 1)) ? ' ' : ',');
-                break;
-            case FT_INT64:
-                sql = util_aasprintf(sql,"%s = %llu%c ",ff_field_data[field].name,
-                                     *((uint64_t*)(((void*)pmo)+offset)),
-                                     (field == (SG_LAST - 1)) ? ' ' : ',');
-                break;
-            case FT_STRING:
-                term = sqlite3_mprintf("%Q",*(char**)(((void*)pmo)+offset));
-                sql = util_aasprintf(sql,"%s = %s%c ",ff_field_data[field].name,
-                                     term, (field == (SG_LAST - 1)) ? ' ' : ',');
-                sqlite3_free(term);
-                break;
-            default:
-                DPRINTF(E_FATAL,L_DB,"Unhandled data type in db_add for '%s'\n",
-                        ff_field_data[field].name);
-                break;
-            }
+    pconn = db_sqlite3_writer;
+    if((!pconn->insert_stmt) && (!db_sqlite3_prepare_add(pconn))) {
+        db_sqlite3_set_error(pe,DB_E_SQL_ERROR,sqlite3_errmsg(pconn->pdb));
+        db_sqlite3_write_unlock();
+        return DB_E_SQL_ERROR;
+    }
+
+    if((db_sqlite3_batch_size) && (!db_sqlite3_batch_open)) {
+        if(sqlite3_exec(pconn->pdb,"BEGIN",NULL,NULL,&perr) == SQLITE_OK) {
+            db_sqlite3_batch_open = TRUE;
+            db_sqlite3_batch_owner = pthread_self();
+            db_sqlite3_batch_count = 0;
+        } else {
+            DPRINTF(E_LOG,L_DB,"Can't start a batch of adds: %s\n",perr);
+            sqlite3_free(perr);
         }
-        sql = util_aasprintf(sql,"where id=%d",pmo->id);
-    } else {
-        /* insert query */
-        sql = util_asprintf("insert into songs (");
-        for(pass = 0; pass < 2; pass++) {
-            for(field = 1; field < SG_LAST; field++) { /* skip id */
-                if(!pass) {
-                    sql = util_aasprintf(sql,"%s%c ",ff_field_data[field].name,
-                                         (field == (SG_LAST - 1)) ? ')' : ',');
-                } else {
-                    offset = ff_field_data[field].offset;
-                    switch(ff_field_data[field].type) {
-                    case FT_INT32:
-                        sql = util_aasprintf(sql,"%d%c ",
-                                             *((uint32_t*)(((void*)pmo)+offset)),
-                                             (field == (SG_LAST - 1)) ? ')' : ',');
-                        break;
-                    case FT_INT64:
-                        sql = util_aasprintf(sql,"%llu%c ",
-                                             *((uint64_t*)(((void*)pmo)+offset)),
-                                             (field == (SG_LAST - 1)) ? ')' : ',');
-                        break;
-                    case FT_STRING:
-                        term = sqlite3_mprintf("%Q",*(char**)((((void*)pmo)+offset)));
-                        sql = util_aasprintf(sql,"%s%c ", term,
-                                             (field == (SG_LAST - 1)) ? ')' : ',');
-                        sqlite3_free(term);
-                        break;
-                    default:
-                        DPRINTF(E_FATAL,L_DB,"Unhandled data type in db_add for '%s'\n",
-                                ff_field_data[field].name);
-                        break;
-                    }
-                }
-            }
-            if(!pass)
-                sql = util_aasprintf(sql," values (");
+    }
+
+    stmt = pmo->id ? pconn->update_stmt : pconn->insert_stmt;
+    for(field = 1; field < SG_LAST; field++) { /* skip id */
+        offset = ff_field_data[field].offset;
+
+        switch(ff_field_data[field].type) {
+        case FT_INT32:
+            sqlite3_bind_int(stmt,field,*((int*)(((void*)pmo)+offset)));
+            break;
+        case FT_INT64:
+            sqlite3_bind_int64(stmt,field,
+                               (sqlite3_int64)*((uint64_t*)(((void*)pmo)+offset)));
+            break;
+        case FT_STRING:
+            value = *(char**)(((void*)pmo)+offset);
+            if(value)
+                sqlite3_bind_text(stmt,field,value,-1,SQLITE_STATIC);
+            else
+                sqlite3_bind_null(stmt,field);
+            break;
+        default:
+            DPRINTF(E_FATAL,L_DB,"Unhandled data type in db_add for '%s'\n",
+                    ff_field_data[field].name);
+            break;
         }
     }
-    db_sqlite3_unlock();
+    if(pmo->id)
+        sqlite3_bind_int(stmt,SG_LAST,pmo->id);
 
-    if(DB_E_SUCCESS == (err = db_sqlite3_exec(pe, E_FATAL, "%s", sql))) {
+    err = sqlite3_step(stmt);
+    if(err == SQLITE_DONE) {
         if(!pmo->id)
-            pmo->id = (uint32_t)db_sqlite3_insert_id();
+            pmo->id = (uint32_t)sqlite3_last_insert_rowid(pconn->pdb);
+
+        if((db_sqlite3_batch_open) &&
+           (++db_sqlite3_batch_count >= db_sqlite3_batch_size))
+            db_sqlite3_batch_commit();
+    } else {
+        db_sqlite3_set_error(pe,DB_E_SQL_ERROR,sqlite3_errmsg(pconn->pdb));
+        DPRINTF(E_LOG,L_DB,"Query: %s\n",sqlite3_sql(stmt));
+        DPRINTF(E_FATAL,L_DB,"Error: %s\n",sqlite3_errmsg(pconn->pdb));
     }
 
-    return err;
+    sqlite3_reset(stmt);
+    db_sqlite3_write_unlock();
+
+    if(err != SQLITE_DONE)
+        return DB_E_SQL_ERROR;
+    return DB_E_SUCCESS;
 }
 
 /**
- * get (or create) the db handle
+ * write back a set of play counts as one transaction.  If a scan
+ * has a batch of adds open, they just ride along in that.
+ *
+ * @param pe error buffer
+ * @param pplays play counts to write
+ * @param count number of entries in pplays
+ * @returns DB_E_SUCCESS on success
+ */
+int db_sqlite3_playcounts(char **pe, DB_PLAYCOUNT *pplays, int count) {
+    sqlite3_stmt *stmt;
+    char *perr;
+    int in_batch;
+    int index;
+    int err;
+
+    db_sqlite3_write_lock();
+
+    err = sqlite3_prepare_v2(db_sqlite3_writer->pdb,"update songs set "
+                             "play_count=?, time_played=? where id=?",
+                             -1,&stmt,NULL);
+    if(err != SQLITE_OK) {
+        db_sqlite3_set_error(pe,DB_E_SQL_ERROR,
+                             sqlite3_errmsg(db_sqlite3_writer->pdb));
+        db_sqlite3_write_unlock();
+        return DB_E_SQL_ERROR;
+    }
+
+    in_batch = db_sqlite3_batch_open;
+    if((!in_batch) &&
+       (sqlite3_exec(db_sqlite3_writer->pdb,"BEGIN",NULL,NULL,&perr) != SQLITE_OK)) {
+        DPRINTF(E_LOG,L_DB,"Can't start play count update: %s\n",perr);
+        sqlite3_free(perr);
+        in_batch = TRUE; /* autocommit each one, then */
+    }
+
+    for(index = 0; index < count; index++) {
+        sqlite3_bind_int(stmt,1,pplays[index].play_count);
+        sqlite3_bind_int(stmt,2,pplays[index].time_played);
+        sqlite3_bind_int(stmt,3,pplays[index].id);
+        err = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if(err != SQLITE_DONE) {
+            db_sqlite3_set_error(pe,DB_E_SQL_ERROR,
+                                 sqlite3_errmsg(db_sqlite3_writer->pdb));
+            break;
+        }
+    }
+
+    if((!in_batch) &&
+       (sqlite3_exec(db_sqlite3_writer->pdb,
+                     (err == SQLITE_DONE) ? "COMMIT" : "ROLLBACK",
+                     NULL,NULL,&perr) != SQLITE_OK)) {
+        DPRINTF(E_LOG,L_DB,"Error committing play counts: %s\n",perr);
+        sqlite3_free(perr);
+        if(err == SQLITE_DONE) {
+            db_sqlite3_set_error(pe,DB_E_SQL_ERROR,"commit failed");
+            err = SQLITE_ERROR;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    db_sqlite3_write_unlock();
+
+    if(err != SQLITE_DONE)
+        return DB_E_SQL_ERROR;
+    return DB_E_SUCCESS;
+}
+
+/**
+ * get this thread's lease on the pool, making an empty one the
+ * first time through
+ */
+DB_SQLITE3_LEASE *db_sqlite3_lease(void) {
+    DB_SQLITE3_LEASE *plm;
+
+    plm = (DB_SQLITE3_LEASE*)pthread_getspecific(db_sqlite3_key);
+    if(!plm) {
+        plm = (DB_SQLITE3_LEASE*)calloc(1,sizeof(DB_SQLITE3_LEASE));
+        if(!plm)
+            DPRINTF(E_FATAL,L_DB,"Malloc error\n");
+        pthread_setspecific(db_sqlite3_key,(void*)plm);
+    }
+
+    return plm;
+}
+
+/**
+ * free a thread's lease when the thread exits
+ */
+void db_sqlite3_freelease(DB_SQLITE3_LEASE *plm) {
+    if(plm->depth)
+        DPRINTF(E_LOG,L_DB,"Thread exiting with a db handle out\n");
+    free(plm);
+}
+
+/**
+ * get the connection this thread should be talking to: the writer
+ * while it's writing, otherwise whatever it has leased.  Only good
+ * with the lock held.
+ */
+DB_SQLITE3_CONN *db_sqlite3_conn(void) {
+    DB_SQLITE3_LEASE *plm;
+
+    plm = db_sqlite3_lease();
+    if((plm->writing) || (!plm->pconn))
+        return db_sqlite3_writer;
+
+    return plm->pconn;
+}
+
+/**
+ * get the db handle for this thread
  */
 sqlite3 *db_sqlite3_handle(void) {
-    sqlite3 *pdb = NULL;
-    char *pe = NULL;
-
-    pdb = (sqlite3*)pthread_getspecific(db_sqlite3_key);
-    if(pdb == NULL) { /* don't have a handle yet */
-        DPRINTF(E_DBG,L_DB,"Creating new db handle\n");
-        if(sqlite3_open(db_sqlite3_path,&pdb) != SQLITE_OK) {
-            db_sqlite3_set_error(&pe,DB_E_SQL_ERROR,sqlite3_errmsg(pdb));
-            DPRINTF(E_FATAL,L_DB,"db_sqlite3_open: %s (%s)\n",pe,db_sqlite3_path);
-            db_sqlite3_unlock();
-            return NULL;
+    return db_sqlite3_conn()->pdb;
+}
+
+/**
+ * open a connection for the pool
+ *
+ * @param pe error buffer
+ * @param readonly TRUE for a reader, FALSE for the writer
+ * @returns the new connection, or NULL with pe allocated
+ */
+DB_SQLITE3_CONN *db_sqlite3_openconn(char **pe, int readonly) {
+    DB_SQLITE3_CONN *pconn;
+    int flags;
+    int mmap_size;
+    char *perr;
+
+    pconn = (DB_SQLITE3_CONN*)calloc(1,sizeof(DB_SQLITE3_CONN));
+    if(!pconn)
+        DPRINTF(E_FATAL,L_DB,"Malloc error\n");
+
+    flags = readonly ? SQLITE_OPEN_READONLY :
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+    if(sqlite3_open_v2(db_sqlite3_path,&pconn->pdb,flags,NULL) != SQLITE_OK) {
+        db_sqlite3_set_error(pe,DB_E_SQL_ERROR,sqlite3_errmsg(pconn->pdb));
+        DPRINTF(E_LOG,L_DB,"db_sqlite3_open: %s (%s)\n",pe ? *pe : "Unknown",
+            db_sqlite3_path);
+        sqlite3_close(pconn->pdb);
+        free(pconn);
+        return NULL;
+    }
+    sqlite3_busy_timeout(pconn->pdb,30000);  /* 30 seconds */
+
+    /* WAL sticks to the db file, so it only needs setting once */
+    if(!readonly) {
+        if(sqlite3_exec(pconn->pdb,"PRAGMA journal_mode=WAL",
+                        NULL,NULL,&perr) != SQLITE_OK) {
+            DPRINTF(E_LOG,L_DB,"Can't set WAL mode: %s\n",perr);
+            sqlite3_free(perr);
         }
-        sqlite3_busy_timeout(pdb,30000);  /* 30 seconds */
-        pthread_setspecific(db_sqlite3_key,(void*)pdb);
+        sqlite3_exec(pconn->pdb,"PRAGMA synchronous=NORMAL",NULL,NULL,NULL);
     }
 
-    return pdb;
+    mmap_size = conf_get_int("general","db_mmap_size",DB_SQLITE3_MMAP_DEFAULT);
+    if(mmap_size > 0) {
+        perr = sqlite3_mprintf("PRAGMA mmap_size=%lld",
+                               (sqlite3_int64)mmap_size * 1024);
+        sqlite3_exec(pconn->pdb,perr,NULL,NULL,NULL);
+        sqlite3_free(perr);
+    }
+
+    return pconn;
 }
 
 /**
@@ -329,32 +643,145 @@ void db_sqlite3_set_error(char **pe, int error, ...) {
 }
 
 /**
- * free a thread-specific db handle
+ * close a connection, and the statements prepared on it
+ */
+void db_sqlite3_freedb(DB_SQLITE3_CONN *pconn) {
+    if(pconn->insert_stmt)
+        sqlite3_finalize(pconn->insert_stmt);
+    if(pconn->update_stmt)
+        sqlite3_finalize(pconn->update_stmt);
+    if(pconn->fetch_stmt)
+        sqlite3_finalize(pconn->fetch_stmt);
+    sqlite3_close(pconn->pdb);
+
+    free(pconn);
+}
+
+/**
+ * get the number of microseconds between two times
  */
-void db_sqlite3_freedb(sqlite3 *pdb) {
-    sqlite3_close(pdb);
+uint64_t db_sqlite3_elapsed_us(struct timeval *pstart, struct timeval *pend) {
+    return (uint64_t)((pend->tv_sec - pstart->tv_sec) * 1000000 +
+                      (pend->tv_usec - pstart->tv_usec));
 }
 
 /**
- * lock the db_mutex
+ * lock the db for reading.  The first lock a thread takes leases a
+ * reader from the pool, waiting for one if they are all out.  The
+ * thread that has adds waiting in a transaction reads through the
+ * writer instead, so it sees them.  Anyone else reads around them;
+ * committing them here would cut the batch short.
  */
 void db_sqlite3_lock(void) {
-    int err;
+    DB_SQLITE3_LEASE *plm;
+    struct timeval start, end;
+
+    plm = db_sqlite3_lease();
+    if(plm->depth++)
+        return;
+
+    /* only the owner can open or close a batch, so this can't change
+     * out from under it */
+    if(db_sqlite3_batch_open &&
+       pthread_equal(db_sqlite3_batch_owner,pthread_self())) {
+        /* keep the writer until the last unlock */
+        db_sqlite3_write_lock();
+        plm->pconn = db_sqlite3_writer;
+        return;
+    }
 
-    if((err=pthread_mutex_lock(&db_sqlite3_mutex))) {
-        DPRINTF(E_FATAL,L_DB,"cannot lock sqlite lock: %s\n",strerror(err));
+    pthread_mutex_lock(&db_sqlite3_pool_lock);
+    if(!db_sqlite3_free) {
+        gettimeofday(&start,NULL);
+        while(!db_sqlite3_free)
+            pthread_cond_wait(&db_sqlite3_pool_cond,&db_sqlite3_pool_lock);
+        gettimeofday(&end,NULL);
+        db_sqlite3_stats_data.read_waits++;
+        db_sqlite3_stats_data.read_wait_us += db_sqlite3_elapsed_us(&start,&end);
     }
+    plm->pconn = db_sqlite3_free;
+    db_sqlite3_free = plm->pconn->next;
+    db_sqlite3_stats_data.read_leases++;
+    pthread_mutex_unlock(&db_sqlite3_pool_lock);
 }
 
 /**
- * unlock the db_mutex
+ * release a read lock, handing the reader back to the pool when
+ * it's the last one
  */
 void db_sqlite3_unlock(void) {
+    DB_SQLITE3_LEASE *plm;
+    DB_SQLITE3_CONN *pconn;
+
+    plm = db_sqlite3_lease();
+    if(--plm->depth)
+        return;
+
+    pconn = plm->pconn;
+    plm->pconn = NULL;
+
+    if(pconn == db_sqlite3_writer) {
+        db_sqlite3_write_unlock();
+        return;
+    }
+
+    pthread_mutex_lock(&db_sqlite3_pool_lock);
+    pconn->next = db_sqlite3_free;
+    db_sqlite3_free = pconn;
+    pthread_cond_signal(&db_sqlite3_pool_cond);
+    pthread_mutex_unlock(&db_sqlite3_pool_lock);
+}
+
+/**
+ * lock the writer.  This nests, and until the matching unlock,
+ * db_sqlite3_handle returns the writer.
+ */
+void db_sqlite3_write_lock(void) {
+    DB_SQLITE3_LEASE *plm;
+    struct timeval start, end;
     int err;
 
-    if((err=pthread_mutex_unlock(&db_sqlite3_mutex))) {
-        DPRINTF(E_FATAL,L_DB,"cannot unlock sqlite3 lock: %s\n",strerror(err));
+    if((err = pthread_mutex_trylock(&db_sqlite3_write_mutex)) == EBUSY) {
+        gettimeofday(&start,NULL);
+        err = pthread_mutex_lock(&db_sqlite3_write_mutex);
+        gettimeofday(&end,NULL);
+        db_sqlite3_stats_data.write_waits++;
+        db_sqlite3_stats_data.write_wait_us += db_sqlite3_elapsed_us(&start,&end);
+    }
+
+    if(err) {
+        DPRINTF(E_FATAL,L_DB,"cannot lock sqlite writer: %s\n",strerror(err));
     }
+
+    db_sqlite3_stats_data.write_locks++;
+    plm = db_sqlite3_lease();
+    plm->writing++;
+}
+
+/**
+ * unlock the writer
+ */
+void db_sqlite3_write_unlock(void) {
+    DB_SQLITE3_LEASE *plm;
+    int err;
+
+    plm = db_sqlite3_lease();
+    plm->writing--;
+
+    if((err=pthread_mutex_unlock(&db_sqlite3_write_mutex))) {
+        DPRINTF(E_FATAL,L_DB,"cannot unlock sqlite writer: %s\n",strerror(err));
+    }
+}
+
+/**
+ * get the pool counters, for the status page
+ *
+ * @param pstats filled in with the current counts
+ */
+void db_sqlite3_stats(DB_SQLITE3_STATS *pstats) {
+    pthread_mutex_lock(&db_sqlite3_pool_lock);
+    memcpy(pstats,&db_sqlite3_stats_data,sizeof(DB_SQLITE3_STATS));
+    pthread_mutex_unlock(&db_sqlite3_pool_lock);
 }
 
 /**
@@ -389,16 +816,17 @@ int db_sqlite3_db_version(void) {
  * @returns DB_E_SUCCESS on success
  */
 int db_sqlite3_open(char **pe, char *dsn) {
-    sqlite3 *pdb;
+    DB_SQLITE3_CONN *pconn;
     pthread_mutexattr_t mutexattr;
     char *db_dir;
+    int handles;
     int version;
     int max_version;
     int result;
 
     pthread_mutexattr_init(&mutexattr);
     pthread_mutexattr_settype(&mutexattr,PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&db_sqlite3_mutex,&mutexattr);
+    pthread_mutex_init(&db_sqlite3_write_mutex,&mutexattr);
 
     db_dir = conf_alloc_string("general","cache_dir",NULL);
     if(!db_dir) {
@@ -406,20 +834,16 @@ int db_sqlite3_open(char **pe, char *dsn) {
         return DB_E_NOPATH;
     }
 
-    pthread_key_create(&db_sqlite3_key, (void*)db_sqlite3_freedb);
+    pthread_key_create(&db_sqlite3_key, (void*)db_sqlite3_freelease);
+    db_sqlite3_batch_size = 0;
+    db_sqlite3_batch_open = FALSE;
+    memset(&db_sqlite3_stats_data,0,sizeof(db_sqlite3_stats_data));
     snprintf(db_sqlite3_path,sizeof(db_sqlite3_path),"%s/songs3.db",db_dir);
+    free(db_dir);
 
-    db_sqlite3_lock();
-    if(sqlite3_open(db_sqlite3_path,&pdb) != SQLITE_OK) {
-        db_sqlite3_set_error(pe,DB_E_SQL_ERROR,sqlite3_errmsg(pdb));
-        DPRINTF(E_LOG,L_DB,"db_sqlite3_open: %s (%s)\n",pe ? *pe : "Unknown",
-            db_sqlite3_path);
-        db_sqlite3_unlock();
+    db_sqlite3_writer = db_sqlite3_openconn(pe,FALSE);
+    if(!db_sqlite3_writer)
         return DB_E_SQL_ERROR;
-    }
-    sqlite3_close(pdb);
-    db_sqlite3_unlock();
-
 
     version = db_sqlite3_db_version();
 
@@ -455,6 +879,24 @@ int db_sqlite3_open(char **pe, char *dsn) {
     }
 
     db_sqlite3_set_version(DB_SQLITE3_VERSION);
+
+    /* readers come after the schema is settled */
+    handles = conf_get_int("general","db_handles",DB_SQLITE3_HANDLES_DEFAULT);
+    if(handles < 1)
+        handles = 1;
+
+    while(db_sqlite3_stats_data.handles < handles) {
+        if(!(pconn = db_sqlite3_openconn(pe,TRUE))) {
+            db_sqlite3_close();
+            return DB_E_SQL_ERROR;
+        }
+        pconn->next = db_sqlite3_readers;
+        db_sqlite3_readers = pconn;
+        db_sqlite3_stats_data.handles++;
+    }
+    db_sqlite3_free = db_sqlite3_readers;
+
+    DPRINTF(E_LOG,L_DB,"Opened %d db readers\n",handles);
     return DB_E_SUCCESS;
 }
 
@@ -462,7 +904,24 @@ int db_sqlite3_open(char **pe, char *dsn) {
  * close the database
  */
 int db_sqlite3_close(void) {
-    /* this doens't actually make much sense, as the closes get done by the threads */
+    DB_SQLITE3_CONN *pconn;
+
+    /* everyone should have given their readers back by now */
+    while((pconn = db_sqlite3_readers)) {
+        db_sqlite3_readers = pconn->next;
+        db_sqlite3_freedb(pconn);
+    }
+    db_sqlite3_free = NULL;
+    db_sqlite3_stats_data.handles = 0;
+
+    if(db_sqlite3_writer) {
+        db_sqlite3_write_lock();
+        db_sqlite3_batch_commit();
+        db_sqlite3_write_unlock();
+        db_sqlite3_freedb(db_sqlite3_writer);
+        db_sqlite3_writer = NULL;
+    }
+
     return DB_E_SUCCESS;
 }
 
@@ -482,7 +941,7 @@ int db_sqlite3_exec(char **pe, int loglevel, char *fmt, ...) {
     int err;
     char *perr;
 
-    db_sqlite3_lock();
+    db_sqlite3_write_lock();
 
     va_start(ap,fmt);
     query=sqlite3_vmprintf(fmt,ap);
@@ -503,7 +962,7 @@ int db_sqlite3_exec(char **pe, int loglevel, char *fmt, ...) {
     }
     sqlite3_free(query);
 
-    db_sqlite3_unlock();
+    db_sqlite3_write_unlock();
 
     if(err != SQLITE_OK)
         return DB_E_SQL_ERROR;
@@ -632,6 +1091,7 @@ int db_sqlite3_enum_fetch(char **pe, void *opaque, char ***row) {
 
     db_sqlite3_set_error(pe,DB_E_SQL_ERROR,sqlite3_errmsg(db_sqlite3_handle()));
     sqlite3_finalize(peh->stmt);
+    peh->stmt = NULL;
 
     return DB_E_SQL_ERROR;
 }
@@ -648,13 +1108,16 @@ int db_sqlite3_enum_end(char **pe, void *opaque) {
     peh->row = NULL;
 
     err = sqlite3_finalize(peh->stmt);
-    if(err != SQLITE_OK) {
+    if(err != SQLITE_OK)
         db_sqlite3_set_error(pe,DB_E_SQL_ERROR,sqlite3_errmsg(db_sqlite3_handle()));
-        db_sqlite3_unlock();
-        return DB_E_SQL_ERROR;
-    }
+
+    sqlite3_free(peh->query);
+    free(peh);
 
     db_sqlite3_unlock();
+
+    if(err != SQLITE_OK)
+        return DB_E_SQL_ERROR;
     return DB_E_SUCCESS;
 }
 
@@ -665,24 +1128,6 @@ int db_sqlite3_enum_restart(char **pe, void *opaque) {
     return db_sqlite3_enum_begin_helper(pe, opaque);
 }
 
-/**
- * get the id of the last auto_update inserted item
- *
- * @returns autoupdate value
- */
-
-int db_sqlite3_insert_id(void) {
-    int result;
-
-    db_sqlite3_lock();
-    result = (int)sqlite3_last_insert_rowid(db_sqlite3_handle());
-    db_sqlite3_unlock();
-
-    return result;
-}
-
-
-
 char *db_sqlite3_initial =
 "create table songs (\n"
 "   id              INTEGER PRIMARY KEY NOT NULL,\n"
@@ -22,6 +22,16 @@
 #ifndef _DB_SQL_SQLITE3_
 #define _DB_SQL_SQLITE3_
 
+typedef struct tag_db_sqlite3_stats {
+    uint32_t handles;       /**< readers in the pool */
+    uint32_t read_leases;   /**< times a reader was handed out */
+    uint32_t read_waits;    /**< times all the readers were out */
+    uint64_t read_wait_us;  /**< time spent waiting for a reader */
+    uint32_t write_locks;   /**< times the writer was locked */
+    uint32_t write_waits;   /**< times someone else had it */
+    uint64_t write_wait_us; /**< time spent waiting for the writer */
+} DB_SQLITE3_STATS;
+
 /* db funcs */
 extern int db_sqlite3_open(char **pe, char *dsn);
 extern int db_sqlite3_close(void);
@@ -29,15 +39,18 @@ extern int db_sqlite3_close(void);
 /* add a media object */
 extern int db_sqlite3_add(char **pe, MEDIA_NATIVE *pmo);
 extern int db_sqlite3_del(char **pe, uint32_t id);
+extern int db_sqlite3_playcounts(char **pe, DB_PLAYCOUNT *pplays, int count);
 
 /* walk through a table */
 extern int db_sqlite3_enum_items_begin(char **pe, void **opaque);
+extern int db_sqlite3_enum_begin(char **pe, void **opaque, char *fmt, ...);
 extern int db_sqlite3_enum_items_fetch(char **pe, void *opaque, MEDIA_STRING **ppmo);
 extern int db_sqlite3_enum_end(char **pe, void *opaque);
 extern int db_sqlite3_enum_restart(char **pe, void *opaque);
 extern int db_sqlite3_fetch_item(char **pe, uint32_t id, void **opaque, MEDIA_STRING **ppms);
 extern void db_sqlite3_dispose_item(void *opaque, MEDIA_STRING *ppms);
 extern void db_sqlite3_hint(int hint);
+extern void db_sqlite3_stats(DB_SQLITE3_STATS *pstats);
 
 
 #endif /* _DB_SQL_SQLITE3_ */
@@ -30,17 +30,26 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "daapd.h"
+#include "conf.h"
 #include "db.h"
+#include "db-index.h"
 #include "err.h"
+#include "os.h"
 
 // FIXME: modularize the db handlers
 #include "db-sql-sqlite2.h"
 #include "db-sql-sqlite3.h"
+#ifdef HAVE_LIBSQLITE3
+#include "db-mem.h"
+#endif
 #include "playlists.h"
 #include "util.h"
 #include "redblack.h"
+#include "smart-parser.h"
 
 #ifdef DEBUG
 #  ifndef ASSERT
@@ -74,18 +83,46 @@ typedef struct tag_plugin_db_fn {
 
     int (*db_fetch_item)(char **, uint32_t, void **, MEDIA_STRING **);
     void (*db_dispose_item)(void *, MEDIA_STRING *);
+
+    int (*db_playcounts)(char **, DB_PLAYCOUNT *, int);
 } PLUGIN_DB_FN;
 
+typedef struct db_filter_entry_t {
+    char *filter;
+    int type;                   /**< SP_TYPE_PLAYLIST or SP_TYPE_QUERY */
+    PARSETREE pt;
+    int refcount;               /**< the cache itself holds one */
+    IDSET *pchecked;            /**< items the filter has been tried on */
+    IDSET *pmatched;            /**< the ones of those that matched */
+    int stamp;                  /**< db_filter_stamp the results are good for */
+    struct db_filter_entry_t *next;
+} DB_FILTER_ENTRY;
+
 typedef struct enum_helper_t {
     PLENUMHANDLE handle;
     char **result;
     void *opaque;
-    char *composite_query;
-    uint32_t old_playlist;
+
+    /* filter */
+    DB_FILTER_ENTRY *pfilter;
+    int matched;                /**< items so far that passed the filter */
+    int exhausted;              /**< walked off the end of the playlist */
+    IDSET *pmatch_ids;          /**< matching ids, if known up front */
+    uint32_t match_pos;
+    IDSET *pwalk;               /**< items that might match, if indexed */
+    uint32_t walk_pos;
+    IDSET *pyes;                /**< items the indexes say match */
+    IDSET *pchecked;            /**< items tried against the filter so far */
+    IDSET *pmatched;            /**< the ones of those that matched */
+    int stamp;                  /**< db_filter_stamp when the walk started */
 
     /* index/limits */
     int current_position;
 
+    /* play counts not written back yet */
+    char play_count[12];
+    char time_played[12];
+
     /* distinct */
     struct rbtree *pdistinct;
     char *last_value;
@@ -96,17 +133,24 @@ typedef struct enum_helper_t {
 
 typedef struct db_cache_entry_t {
     MEDIA_NATIVE *pmn;
+    uint32_t id;
     int refcount;
     struct db_cache_entry_t *next;
     struct db_cache_entry_t *prev;
 } DB_CACHE_ENTRY;
 
-typedef struct db_cache_list_t {
-    int max_length;
-    int current_length;
-    DB_CACHE_ENTRY cache_list;
-    DB_CACHE_ENTRY *tail;
-} DB_CACHE_LIST;
+typedef struct db_cache_shard_t {
+    pthread_mutex_t lock;
+    DB_CACHE_ENTRY **table;     /**< open addressed, power of two size */
+    uint32_t table_size;
+    uint32_t max_length;
+    uint32_t current_length;
+    DB_CACHE_ENTRY lru;         /**< lru.next is newest, lru.prev oldest */
+    DB_CACHE_ENTRY *orphans;    /**< invalidated, but still on loan */
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+} DB_CACHE_SHARD;
 
 typedef struct db_path_node_t {
     char *path;
@@ -117,13 +161,26 @@ typedef struct db_path_node_t {
 
 #define MAYBEFREE(a) if((a)) free((a));
 
+#define DB_CACHE_SHARDS       16
+#define DB_CACHE_DEFAULT_SIZE 4096
+#define DB_FILTER_CACHE_SIZE  16
+
 /* Globals */
 static int db_revision_no=2;                          /**< current revision of the db */
+static pthread_mutex_t db_revision_lock = PTHREAD_MUTEX_INITIALIZER; /**< for bumping db_revision_no */
+static void (*db_revision_cb)(void *) = NULL;        /**< told when the revision changes */
+static void *db_revision_cb_arg = NULL;
 static pthread_once_t db_initlock=PTHREAD_ONCE_INIT;  /**< to initialize the rwlock */
 static pthread_rwlock_t db_rwlock;                    /**< pthread r/w sync for the database */
 static PLUGIN_DB_FN *db_pfn = NULL;                   /**< link to db plugin funcs */
-static DB_CACHE_LIST db_cache_list = { 32, 0, { NULL, 0, NULL, NULL }, NULL};
+static DB_CACHE_SHARD db_cache_shards[DB_CACHE_SHARDS];  /**< item cache */
 static struct rbtree *db_path_lookup;
+static pthread_mutex_t db_filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static DB_FILTER_ENTRY *db_filter_cache = NULL;      /**< parsed filters, newest first */
+static int db_filter_stamp = 0;                       /**< bumped when items change */
+static pthread_mutex_t db_play_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rbtree *db_play_pending = NULL;        /**< DB_PLAYCOUNTs, by id */
+static int db_play_count = 0;                         /**< entries in db_play_pending */
 
 /* This could arguably go somewhere else, but we'll put it here  */
 #define OFFSET_OF(__type, __field)      ((size_t) (&((__type*) 0)->__field))
@@ -209,6 +266,7 @@ static void db_trim_string(char *string);
 static MEDIA_NATIVE *db_string_to_native(MEDIA_STRING *pmos);
 static MEDIA_STRING *db_native_to_string(MEDIA_NATIVE *pmon);
 static void db_set_error(char **pe, int err, ...);
+static void db_revision_bump(void);
 
 static char *db_util_strdup(char *string);
 
@@ -221,16 +279,35 @@ static int db_enum_playlist_fetch(char **pe, char ***result, DB_QUERY *pquery);
 static int db_enum_browse_fetch(char **pe, char ***result, DB_QUERY *pquery);
 
 /* db cache layer */
+static void db_cache_init(void);
+static void db_cache_deinit(void);
 static MEDIA_NATIVE *db_cache_fetch(char **pe, uint32_t id);
-static void db_cache_update(MEDIA_NATIVE *pmn);
-static void db_cache_promote(DB_CACHE_ENTRY *pentry);
-static void db_cache_insert(MEDIA_NATIVE *pmn);
-static DB_CACHE_ENTRY *db_cache_find(int id);
+static void db_cache_invalidate(uint32_t id);
+static void db_cache_promote(DB_CACHE_SHARD *pshard, DB_CACHE_ENTRY *pentry);
+static int db_cache_insert(DB_CACHE_SHARD *pshard, MEDIA_NATIVE *pmn);
+static DB_CACHE_ENTRY *db_cache_find(DB_CACHE_SHARD *pshard, uint32_t id);
 static void db_cache_dispose_item(MEDIA_NATIVE *pmo);
 
+/* parsed filter cache */
+static int db_filter_get(char **pe, char *filter, int type, DB_FILTER_ENTRY **ppentry);
+static void db_filter_release(DB_FILTER_ENTRY *pentry);
+static void db_filter_stale(void);
+static IDSET *db_filter_lookup(DB_FILTER_ENTRY *pentry, IDSET *pids, int *pstamp);
+static void db_filter_remember(DB_FILTER_ENTRY *pentry, IDSET *pchecked,
+                               IDSET *pmatched, int stamp);
+static void db_enum_items_record(ENUMHELPER *peh, uint32_t id, int matched);
+static void db_enum_items_plan(ENUMHELPER *peh, IDSET *pids);
+static uint32_t db_enum_items_next(ENUMHELPER *peh);
+static void db_filter_deinit(void);
+static int db_enum_items_count(DB_QUERY *pquery, int keep_ids);
 
 /* path-to-id mapping */
 static int db_path_compare(const void *p1, const void *p2, const void *arg);
+static int db_path_sort_compare(const void *p1, const void *p2);
+static uint32_t db_elapsed_ms(struct timeval *pstart);
+static int db_play_compare(const void *p1, const void *p2, const void *arg);
+static void db_play_apply_native(MEDIA_NATIVE *pmn);
+static void db_play_apply_string(MEDIA_STRING *pms, char *play_count, char *time_played);
 
 /* lock-free functions */
 MEDIA_NATIVE *db_fetch_item_nolock(char **pe, int id);
@@ -241,178 +318,275 @@ int db_del_nolock(char **pe, uint32_t id);
 #define DB_INT64_COPY(field) pnew->field=util_atoui64(pmos->field)
 
 
-void db_cache_dump(void) {
-    DB_CACHE_ENTRY *pentry;
+/*
+ * caching functions.
+ *
+ * The item cache is split into DB_CACHE_SHARDS shards by id, each with
+ * its own lock, so concurrent fetches of different items don't contend.
+ * Each shard is an open-addressed (linear probe) hash table of entries,
+ * with the entries also threaded on an lru list.  Entries are refcounted
+ * while they are out on loan from db_fetch_item, and are only evicted
+ * once they have been returned with db_dispose_item.
+ *
+ * An entry that is invalidated while it is still on loan is pulled out
+ * of the table and put on the shard's orphan list, where it waits to be
+ * disposed.
+ */
+static uint32_t db_cache_hash(uint32_t id) {
+    return id * 2654435761U;
+}
 
-    return;
+static DB_CACHE_SHARD *db_cache_shard(uint32_t id) {
+    return &db_cache_shards[id % DB_CACHE_SHARDS];
+}
 
-    DPRINTF(E_DBG,L_DB,"db_cache_list.cache_list: %08x\n",&db_cache_list.cache_list);
-    DPRINTF(E_DBG,L_DB,"db_cache_list.cache_list.next: %08x\n",db_cache_list.cache_list.next);
-    DPRINTF(E_DBG,L_DB,"db_cache_list.tail: %08x\n",db_cache_list.tail);
-    DPRINTF(E_DBG,L_DB,"\n");
+/**
+ * find the table slot for an id.  This is either the slot holding
+ * the entry for the id, or the empty slot where it would go.
+ *
+ * @param pshard shard to search (must be locked)
+ * @param id id to look for
+ * @returns slot index
+ */
+static uint32_t db_cache_slot(DB_CACHE_SHARD *pshard, uint32_t id) {
+    uint32_t mask = pshard->table_size - 1;
+    uint32_t slot = (db_cache_hash(id) / DB_CACHE_SHARDS) & mask;
 
-    pentry = db_cache_list.cache_list.next;
-    while(pentry) {
-        DPRINTF(E_DBG,L_DB,"ID: %d: %08x\n",pentry->pmn->id,pentry);
-        DPRINTF(E_DBG,L_DB,"  prev: %08x\n",pentry->prev);
-        DPRINTF(E_DBG,L_DB,"  next: %08x\n",pentry->next);
-        DPRINTF(E_DBG,L_DB,"\n");
-        pentry=pentry->next;
-    }
+    while((pshard->table[slot]) && (pshard->table[slot]->id != id))
+        slot = (slot + 1) & mask;
+
+    return slot;
 }
 
-/*
- * caching functions.
+DB_CACHE_ENTRY *db_cache_find(DB_CACHE_SHARD *pshard, uint32_t id) {
+    return pshard->table[db_cache_slot(pshard, id)];
+}
+
+/**
+ * pull an entry out of the hash table.  This does backward-shift
+ * deletion, so there are no tombstones to clean up later.
+ *
+ * @param pshard shard to remove from (must be locked)
+ * @param pentry entry to remove
  */
-DB_CACHE_ENTRY *db_cache_find(int id) {
-    DB_CACHE_ENTRY *pentry;
+static void db_cache_table_remove(DB_CACHE_SHARD *pshard,
+                                  DB_CACHE_ENTRY *pentry) {
+    uint32_t mask = pshard->table_size - 1;
+    uint32_t hole, slot, home;
+
+    hole = db_cache_slot(pshard, pentry->id);
+    slot = hole;
+    while(1) {
+        slot = (slot + 1) & mask;
+        if(!pshard->table[slot])
+            break;
 
-    //    DPRINTF(E_DBG,L_DB,"Finding %d in cache\n",id);
-    pentry = db_cache_list.cache_list.next;
-    while(pentry) {
-        if(id == pentry->pmn->id)
-            return pentry;
-        pentry = pentry->next;
+        /* can this entry move back into the hole? */
+        home = (db_cache_hash(pshard->table[slot]->id) / DB_CACHE_SHARDS) & mask;
+        if(((slot - home) & mask) >= ((slot - hole) & mask)) {
+            pshard->table[hole] = pshard->table[slot];
+            hole = slot;
+        }
     }
-    return NULL;
+    pshard->table[hole] = NULL;
 }
 
-void db_cache_insert(MEDIA_NATIVE *pmn) {
-    DB_CACHE_ENTRY *pentry;
+static void db_cache_lru_unlink(DB_CACHE_ENTRY *pentry) {
+    pentry->prev->next = pentry->next;
+    pentry->next->prev = pentry->prev;
+}
 
-    //    DPRINTF(E_DBG,L_DB,"Adding %d to cache. Current size: %d\n",pmn->id,db_cache_list.current_length);
-    pentry = (DB_CACHE_ENTRY *)malloc(sizeof(DB_CACHE_ENTRY));
-    if(!pentry)
+static void db_cache_lru_push(DB_CACHE_SHARD *pshard, DB_CACHE_ENTRY *pentry) {
+    pentry->next = pshard->lru.next;
+    pentry->prev = &pshard->lru;
+    pshard->lru.next->prev = pentry;
+    pshard->lru.next = pentry;
+}
+
+/*
+ * move a cache entry to the front of the list
+ */
+void db_cache_promote(DB_CACHE_SHARD *pshard, DB_CACHE_ENTRY *pentry) {
+    if(pshard->lru.next == pentry)
         return;
 
-    pentry->pmn = pmn;
+    db_cache_lru_unlink(pentry);
+    db_cache_lru_push(pshard, pentry);
+}
 
-    pentry->refcount = 1;
-    pentry->prev = &db_cache_list.cache_list;
-    pentry->next = db_cache_list.cache_list.next;
-    db_cache_list.cache_list.next = pentry;
+/**
+ * double the size of the hash table.  Only happens when more than
+ * max_length entries are on loan at once.
+ *
+ * @param pshard shard to grow (must be locked)
+ * @returns TRUE on success
+ */
+static int db_cache_grow(DB_CACHE_SHARD *pshard) {
+    DB_CACHE_ENTRY **old_table = pshard->table;
+    uint32_t old_size = pshard->table_size;
+    uint32_t index;
 
-    if(pentry->next) {
-        pentry->next->prev = pentry;
-    } else {
-        db_cache_list.tail = pentry;
+    pshard->table = (DB_CACHE_ENTRY **)calloc(old_size * 2,
+                                              sizeof(DB_CACHE_ENTRY *));
+    if(!pshard->table) {
+        pshard->table = old_table;
+        return FALSE;
     }
 
-    /* maybe delete last */
-    while((db_cache_list.current_length >= db_cache_list.max_length) &&
-          (db_cache_list.tail->refcount == 0)) {
-        /* gotta delete */
-        pentry = db_cache_list.tail;
-        db_cache_list.tail = db_cache_list.tail->prev;
-        db_cache_list.tail->next = NULL;
-        db_cache_dispose_item(pentry->pmn);
-        free(pentry);
-        db_cache_list.current_length--;
+    pshard->table_size = old_size * 2;
+    for(index = 0; index < old_size; index++) {
+        if(old_table[index])
+            pshard->table[db_cache_slot(pshard, old_table[index]->id)] =
+                old_table[index];
     }
 
-    db_cache_list.current_length++;
+    free(old_table);
+    return TRUE;
 }
 
-/*
- * move a cache entry to the front of the list
+/**
+ * evict least recently used entries that aren't on loan, until
+ * the shard is back under capacity
+ *
+ * @param pshard shard to trim (must be locked)
  */
-void db_cache_promote(DB_CACHE_ENTRY *pentry) {
-    //    DPRINTF(E_DBG,L_DB,"promoting %d in cache\n",pentry->pmn->id);
-
-    if(pentry == db_cache_list.cache_list.next) {
-        return;
+static void db_cache_trim(DB_CACHE_SHARD *pshard) {
+    DB_CACHE_ENTRY *pentry, *pprev;
+
+    pentry = pshard->lru.prev;
+    while((pshard->current_length > pshard->max_length) &&
+          (pentry != &pshard->lru)) {
+        pprev = pentry->prev;
+        if(!pentry->refcount) {
+            db_cache_table_remove(pshard, pentry);
+            db_cache_lru_unlink(pentry);
+            db_cache_dispose_item(pentry->pmn);
+            free(pentry);
+            pshard->current_length--;
+            pshard->evictions++;
+        }
+        pentry = pprev;
     }
+}
 
-    if(pentry == db_cache_list.tail)
-        db_cache_list.tail = pentry->prev;
+/**
+ * add a freshly fetched item to the cache, on loan to the caller
+ *
+ * @param pshard shard to add to (must be locked)
+ * @param pmn item to add
+ * @returns TRUE if cached, FALSE if it couldn't be
+ */
+int db_cache_insert(DB_CACHE_SHARD *pshard, MEDIA_NATIVE *pmn) {
+    DB_CACHE_ENTRY *pentry;
 
-    if(pentry->next)
-        pentry->next->prev = pentry->prev;
-    pentry->prev->next = pentry->next;
+    if(((pshard->current_length + 1) * 2 > pshard->table_size) &&
+       (!db_cache_grow(pshard)))
+        return FALSE;
 
-    pentry->next = db_cache_list.cache_list.next;
-    pentry->prev = &db_cache_list.cache_list;
+    pentry = (DB_CACHE_ENTRY *)malloc(sizeof(DB_CACHE_ENTRY));
+    if(!pentry)
+        return FALSE;
 
-    if(pentry->next)
-        pentry->next->prev = pentry;
+    pentry->pmn = pmn;
+    pentry->id = pmn->id;
+    pentry->refcount = 1;
 
-    db_cache_list.cache_list.next = pentry;
-}
+    pshard->table[db_cache_slot(pshard, pentry->id)] = pentry;
+    db_cache_lru_push(pshard, pentry);
+    pshard->current_length++;
 
-void db_cache_update(MEDIA_NATIVE *pmn) {
-    MEDIA_NATIVE *pmn_new, *pmn_existing;
-    DB_CACHE_ENTRY *pcache;
-    int field;
-    int offset;
-    void *pold, *pnew;
+    db_cache_trim(pshard);
+    return TRUE;
+}
 
-    //    DPRINTF(E_DBG,L_DB,"write-through cache update of %d\n",pmn->id);
-    for(field = 0; field < SG_LAST; field++) {
-        memcpy(pmn_new,pmn,sizeof(MEDIA_NATIVE));
+/**
+ * drop an item from the cache, as it has changed in the backend.  If
+ * anyone still has it on loan, it's freed when they give it back.
+ *
+ * @param id id of item to drop
+ */
+void db_cache_invalidate(uint32_t id) {
+    DB_CACHE_SHARD *pshard = db_cache_shard(id);
+    DB_CACHE_ENTRY *pentry;
 
-        switch(ff_field_data[field].type) {
-        case FT_STRING:
-            offset = ff_field_data[field].offset;
-            pold = (void*)((pmn) + offset);
-            pnew = (void*)((pmn_new) + offset);
+    pthread_mutex_lock(&pshard->lock);
+    pentry = db_cache_find(pshard, id);
+    if(pentry) {
+        db_cache_table_remove(pshard, pentry);
+        db_cache_lru_unlink(pentry);
+        pshard->current_length--;
 
-            *((char**)pnew) = strdup(*((char**)pold));
-            break;
+        if(pentry->refcount) {
+            pentry->next = pshard->orphans;
+            pshard->orphans = pentry;
+        } else {
+            db_cache_dispose_item(pentry->pmn);
+            free(pentry);
         }
     }
-
-    util_mutex_lock(l_pl);
-    /* got a new copy of the pmn */
-    pcache = db_cache_find(pmn->id);
-    if(pcache) {
-        /* promote and update */
-        db_cache_promote(pcache);
-        pmn_existing = pcache->pmn;
-        pcache->pmn = pmn_new;
-        db_cache_dispose_item(pmn_existing);
-    } else {
-        /* just add */
-        db_cache_insert(pmn_new);
-    }
-    util_mutex_unlock(l_pl);
+    pthread_mutex_unlock(&pshard->lock);
 }
 
 MEDIA_NATIVE *db_cache_fetch(char **pe, uint32_t id) {
+    DB_CACHE_SHARD *pshard = db_cache_shard(id);
     DB_CACHE_ENTRY *pentry;
     MEDIA_NATIVE *pmn = NULL;
     MEDIA_STRING *pms;
     void *opaque;
 
-    util_mutex_lock(l_pl);
-    db_cache_dump();
+    pthread_mutex_lock(&pshard->lock);
+    pentry = db_cache_find(pshard, id);
+    if(pentry) {
+        pshard->hits++;
+        db_cache_promote(pshard, pentry);
+        pentry->refcount++;
+        pmn = pentry->pmn;
+        pthread_mutex_unlock(&pshard->lock);
+        return pmn;
+    }
+    pshard->misses++;
+    pthread_mutex_unlock(&pshard->lock);
 
-    /* first, see if it is in the cache */
-    DPRINTF(E_DBG,L_DB,"Fetching %d from cache\n",id);
+    /* don't hold the shard over the backend fetch */
+    DPRINTF(E_DBG,L_DB,"Cache miss on %d\n",id);
+    if(DB_E_SUCCESS != db_pfn->db_fetch_item(pe, id, &opaque, &pms)) {
+        DPRINTF(E_DBG,L_DB,"Couldn't fetch from underlying storage\n");
+        return NULL;
+    }
 
-    config.stats.db_id_fetches++;
+    if(pms)
+        pmn = db_string_to_native(pms);
+    db_pfn->db_dispose_item(opaque, pms);
 
-    pentry = db_cache_find(id);
+    if(!pmn)
+        return NULL;
+
+    db_play_apply_native(pmn);
+
+    pthread_mutex_lock(&pshard->lock);
+    pentry = db_cache_find(pshard, id);
     if(pentry) {
-        DPRINTF(E_DBG,L_DB,"Cache hit\n");
-        config.stats.db_id_hits++;
+        /* someone beat us to it */
+        db_cache_dispose_item(pmn);
         pmn = pentry->pmn;
-        db_cache_promote(pentry);
         pentry->refcount++;
-    } else {
-        DPRINTF(E_DBG,L_DB,"Cache miss\n");
-        if(DB_E_SUCCESS == db_pfn->db_fetch_item(pe, id, &opaque, &pms)) {
-            if(pms) {
-                pmn = db_string_to_native(pms);
-                db_cache_insert(pmn);
-            }
-
-            db_pfn->db_dispose_item(opaque, pms);
-        } else {
-            DPRINTF(E_DBG,L_DB,"Couldn't fetch from underlying storage\n");
+    } else if(!db_cache_insert(pshard, pmn)) {
+        /* can't cache it, so make it an orphan */
+        pentry = (DB_CACHE_ENTRY *)malloc(sizeof(DB_CACHE_ENTRY));
+        if(!pentry) {
+            pthread_mutex_unlock(&pshard->lock);
+            db_cache_dispose_item(pmn);
+            db_set_error(pe, DB_E_MALLOC);
+            return NULL;
         }
+        pentry->pmn = pmn;
+        pentry->id = id;
+        pentry->refcount = 1;
+        pentry->next = pshard->orphans;
+        pshard->orphans = pentry;
     }
-    db_cache_dump();
-    util_mutex_unlock(l_pl);
+    pthread_mutex_unlock(&pshard->lock);
+
     return pmn;
 }
 
@@ -422,15 +596,128 @@ MEDIA_NATIVE *db_cache_fetch(char **pe, uint32_t id) {
  * @param pmo media object to dec refcount
  */
 void db_dispose_item(MEDIA_NATIVE *pmo) {
-    DB_CACHE_ENTRY *pentry;
+    DB_CACHE_SHARD *pshard;
+    DB_CACHE_ENTRY *pentry, **ppentry;
 
-    util_mutex_lock(l_pl);
+    if(!pmo)
+        return;
 
-    pentry = db_cache_find(pmo->id);
-    if(pentry)
+    pshard = db_cache_shard(pmo->id);
+    pthread_mutex_lock(&pshard->lock);
+
+    pentry = db_cache_find(pshard, pmo->id);
+    if((pentry) && (pentry->pmn == pmo)) {
         pentry->refcount--;
+        if(!pentry->refcount)
+            db_cache_trim(pshard);
+    } else {
+        ppentry = &pshard->orphans;
+        while((*ppentry) && ((*ppentry)->pmn != pmo))
+            ppentry = &(*ppentry)->next;
+
+        pentry = *ppentry;
+        if(pentry) {
+            pentry->refcount--;
+            if(!pentry->refcount) {
+                *ppentry = pentry->next;
+                db_cache_dispose_item(pentry->pmn);
+                free(pentry);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&pshard->lock);
+}
 
-    util_mutex_unlock(l_pl);
+/**
+ * set up the cache shards.  Capacity is general/db_cache_size items,
+ * split across the shards.
+ */
+void db_cache_init(void) {
+    DB_CACHE_SHARD *pshard;
+    int capacity;
+    int shard;
+
+    capacity = conf_get_int("general","db_cache_size",DB_CACHE_DEFAULT_SIZE);
+    if(capacity < 0)
+        capacity = 0;
+
+    DPRINTF(E_DBG,L_DB,"Item cache capacity: %d\n",capacity);
+
+    for(shard = 0; shard < DB_CACHE_SHARDS; shard++) {
+        pshard = &db_cache_shards[shard];
+        memset(pshard,0,sizeof(DB_CACHE_SHARD));
+        pthread_mutex_init(&pshard->lock,NULL);
+
+        pshard->max_length = (capacity + DB_CACHE_SHARDS - 1) / DB_CACHE_SHARDS;
+        pshard->table_size = 16;
+        while(pshard->table_size < pshard->max_length * 2)
+            pshard->table_size *= 2;
+
+        pshard->table = (DB_CACHE_ENTRY **)calloc(pshard->table_size,
+                                                  sizeof(DB_CACHE_ENTRY *));
+        if(!pshard->table)
+            DPRINTF(E_FATAL,L_DB,"Malloc error allocating item cache\n");
+
+        pshard->lru.next = pshard->lru.prev = &pshard->lru;
+    }
+}
+
+/**
+ * throw away everything in the cache
+ */
+void db_cache_deinit(void) {
+    DB_CACHE_SHARD *pshard;
+    DB_CACHE_ENTRY *pentry, *pnext;
+    int shard;
+
+    for(shard = 0; shard < DB_CACHE_SHARDS; shard++) {
+        pshard = &db_cache_shards[shard];
+        if(!pshard->table)
+            continue;
+
+        pentry = pshard->lru.next;
+        while(pentry != &pshard->lru) {
+            pnext = pentry->next;
+            db_cache_dispose_item(pentry->pmn);
+            free(pentry);
+            pentry = pnext;
+        }
+
+        pentry = pshard->orphans;
+        while(pentry) {
+            pnext = pentry->next;
+            db_cache_dispose_item(pentry->pmn);
+            free(pentry);
+            pentry = pnext;
+        }
+
+        free(pshard->table);
+        pshard->table = NULL;
+        pthread_mutex_destroy(&pshard->lock);
+    }
+}
+
+/**
+ * get a snapshot of the cache counters, for the status page
+ *
+ * @param pstats stats struct to fill
+ */
+void db_cache_stats(DB_CACHE_STATS *pstats) {
+    DB_CACHE_SHARD *pshard;
+    int shard;
+
+    memset(pstats,0,sizeof(DB_CACHE_STATS));
+    for(shard = 0; shard < DB_CACHE_SHARDS; shard++) {
+        pshard = &db_cache_shards[shard];
+        pthread_mutex_lock(&pshard->lock);
+        pstats->capacity += pshard->max_length;
+        pstats->items += pshard->current_length;
+        pstats->hits += pshard->hits;
+        pstats->misses += pshard->misses;
+        pstats->evictions += pshard->evictions;
+        pthread_mutex_unlock(&pshard->lock);
+    }
 }
 
 /**
@@ -463,6 +750,227 @@ void db_cache_dispose_item(MEDIA_NATIVE *pmo) {
     free(pmo);
 }
 
+/*
+ * Clients tend to send the same handful of filters over and over
+ * (the browse panes ask for each artist's albums, and so on), so
+ * keep the last few parse trees around rather than parsing them
+ * again on every request.  Parse trees never change once parsed,
+ * so any number of enumerations can match against one at once.
+ */
+
+/**
+ * drop a reference to a filter, freeing it when it's the last.
+ * Must be called with the filter lock held.
+ *
+ * @param pentry filter to unref
+ */
+static void db_filter_unref(DB_FILTER_ENTRY *pentry) {
+    if(--pentry->refcount)
+        return;
+
+    sp_dispose(pentry->pt);
+    idset_free(pentry->pchecked);
+    idset_free(pentry->pmatched);
+    free(pentry->filter);
+    free(pentry);
+}
+
+/**
+ * get a parsed filter, from the cache if possible
+ *
+ * @param pe error buffer
+ * @param filter filter string
+ * @param type SP_TYPE_PLAYLIST or SP_TYPE_QUERY
+ * @param ppentry filter to pass to db_filter_release, on success
+ * @returns DB_E_SUCCESS on success, error code with pe set otherwise
+ */
+int db_filter_get(char **pe, char *filter, int type, DB_FILTER_ENTRY **ppentry) {
+    DB_FILTER_ENTRY *pentry, *pprev;
+    int count;
+
+    pthread_mutex_lock(&db_filter_lock);
+    pprev = NULL;
+    for(pentry = db_filter_cache; pentry; pentry = pentry->next) {
+        if((pentry->type == type) && (0 == strcmp(pentry->filter,filter)))
+            break;
+        pprev = pentry;
+    }
+
+    if(pentry) {
+        /* move it to the front */
+        if(pprev) {
+            pprev->next = pentry->next;
+            pentry->next = db_filter_cache;
+            db_filter_cache = pentry;
+        }
+        pentry->refcount++;
+        pthread_mutex_unlock(&db_filter_lock);
+        *ppentry = pentry;
+        return DB_E_SUCCESS;
+    }
+    pthread_mutex_unlock(&db_filter_lock);
+
+    pentry = (DB_FILTER_ENTRY*)calloc(1,sizeof(DB_FILTER_ENTRY));
+    if(!pentry) {
+        db_set_error(pe,DB_E_MALLOC);
+        return DB_E_MALLOC;
+    }
+
+    pentry->filter = strdup(filter);
+    pentry->type = type;
+    pentry->pt = sp_init();
+    if((!pentry->filter) || (!pentry->pt)) {
+        if(pentry->pt) sp_dispose(pentry->pt);
+        MAYBEFREE(pentry->filter);
+        free(pentry);
+        db_set_error(pe,DB_E_MALLOC);
+        return DB_E_MALLOC;
+    }
+
+    if(!sp_parse(pentry->pt,filter,type)) {
+        DPRINTF(E_LOG,L_DB,"Error parsing filter %s: %s\n",filter,
+                sp_get_error(pentry->pt));
+        db_set_error(pe,DB_E_PARSE,sp_get_error(pentry->pt));
+        sp_dispose(pentry->pt);
+        free(pentry->filter);
+        free(pentry);
+        return DB_E_PARSE;
+    }
+
+    /* one for the cache, one for the caller.  If another thread got
+     * the same filter in first, there are just two copies for a bit */
+    pentry->refcount = 2;
+
+    pthread_mutex_lock(&db_filter_lock);
+    pentry->next = db_filter_cache;
+    db_filter_cache = pentry;
+
+    count = 0;
+    for(pprev = db_filter_cache; pprev->next; pprev = pprev->next) {
+        if(++count == DB_FILTER_CACHE_SIZE) {
+            db_filter_unref(pprev->next);
+            pprev->next = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&db_filter_lock);
+
+    *ppentry = pentry;
+    return DB_E_SUCCESS;
+}
+
+/**
+ * done with a filter from db_filter_get
+ *
+ * @param pentry filter to release
+ */
+void db_filter_release(DB_FILTER_ENTRY *pentry) {
+    pthread_mutex_lock(&db_filter_lock);
+    db_filter_unref(pentry);
+    pthread_mutex_unlock(&db_filter_lock);
+}
+
+/**
+ * items have changed, so what the cached filters matched before
+ * can't be trusted any more.  This can get called with or without
+ * the db lock held.
+ */
+void db_filter_stale(void) {
+    pthread_mutex_lock(&db_filter_lock);
+    db_filter_stamp++;
+    pthread_mutex_unlock(&db_filter_lock);
+}
+
+/**
+ * work out which of a set of items match a filter from what earlier
+ * walks found, without looking at the items.  This only works if
+ * every one of them has been tried against the filter since the
+ * items last changed.
+ *
+ * @param pentry filter to match
+ * @param pids items to match against it
+ * @param pstamp returns the stamp to hand db_filter_remember
+ * @returns the matching items, or NULL if they have to be checked
+ */
+IDSET *db_filter_lookup(DB_FILTER_ENTRY *pentry, IDSET *pids, int *pstamp) {
+    IDSET *punchecked;
+    IDSET *presult = NULL;
+
+    pthread_mutex_lock(&db_filter_lock);
+    *pstamp = db_filter_stamp;
+    if((pentry->stamp == db_filter_stamp) && (pentry->pchecked)) {
+        punchecked = idset_andnot(pids, pentry->pchecked);
+        if((punchecked) && (!idset_count(punchecked)))
+            presult = idset_and(pids, pentry->pmatched);
+        idset_free(punchecked);
+    }
+    pthread_mutex_unlock(&db_filter_lock);
+
+    return presult;
+}
+
+/**
+ * add what a walk found out about a filter to what's known, so
+ * long as nothing changed while it was walking.
+ *
+ * @param pentry filter that was matched
+ * @param pchecked items that were tried
+ * @param pmatched items that matched
+ * @param stamp stamp from db_filter_lookup when the walk started
+ */
+void db_filter_remember(DB_FILTER_ENTRY *pentry, IDSET *pchecked,
+                        IDSET *pmatched, int stamp) {
+    IDSET *pnew_checked, *pnew_matched;
+
+    pthread_mutex_lock(&db_filter_lock);
+    if(stamp != db_filter_stamp) {
+        pthread_mutex_unlock(&db_filter_lock);
+        return;
+    }
+
+    if(pentry->stamp != stamp) {
+        idset_free(pentry->pchecked);
+        idset_free(pentry->pmatched);
+        pentry->pchecked = pentry->pmatched = NULL;
+        pentry->stamp = stamp;
+    }
+
+    if(pentry->pchecked) {
+        pnew_checked = idset_or(pentry->pchecked, pchecked);
+        pnew_matched = idset_or(pentry->pmatched, pmatched);
+    } else {
+        pnew_checked = idset_copy(pchecked);
+        pnew_matched = idset_copy(pmatched);
+    }
+
+    idset_free(pentry->pchecked);
+    idset_free(pentry->pmatched);
+    pentry->pchecked = pentry->pmatched = NULL;
+
+    if((pnew_checked) && (pnew_matched)) {
+        pentry->pchecked = pnew_checked;
+        pentry->pmatched = pnew_matched;
+    } else {
+        idset_free(pnew_checked);
+        idset_free(pnew_matched);
+    }
+    pthread_mutex_unlock(&db_filter_lock);
+}
+
+/**
+ * throw away all the cached filters
+ */
+void db_filter_deinit(void) {
+    DB_FILTER_ENTRY *pentry;
+
+    pthread_mutex_lock(&db_filter_lock);
+    while((pentry = db_filter_cache)) {
+        db_filter_cache = pentry->next;
+        db_filter_unref(pentry);
+    }
+    pthread_mutex_unlock(&db_filter_lock);
+}
+
 /*
  * db_readlock
  *
@@ -554,6 +1062,9 @@ int db_open(char **pe, char *type, char *parameters) {
     if(pthread_once(&db_initlock,db_init_once))
         return DB_E_PTHREAD;
 
+    db_cache_init();
+    db_play_pending = rbinit(db_play_compare, NULL);
+
     db_pfn = (PLUGIN_DB_FN*)malloc(sizeof(PLUGIN_DB_FN));
     if(!db_pfn) {
         db_set_error(pe, DB_E_MALLOC);
@@ -589,9 +1100,26 @@ int db_open(char **pe, char *type, char *parameters) {
         db_pfn->db_fetch_item = db_sqlite3_fetch_item;
         db_pfn->db_dispose_item = db_sqlite3_dispose_item;
         db_pfn->db_hint = db_sqlite3_hint;
+        db_pfn->db_playcounts = db_sqlite3_playcounts;
+
+    /* everything in memory, with sqlite3 behind it */
+    if(0 == strcasecmp(type,"memory")) {
+        db_pfn->db_open = db_mem_open;
+        db_pfn->db_close = db_mem_close;
+        db_pfn->db_add = db_mem_add;
+        db_pfn->db_del = db_mem_del;
+        db_pfn->db_enum_start = db_mem_enum_items_begin;
+        db_pfn->db_enum_fetch = db_mem_enum_items_fetch;
+        db_pfn->db_enum_reset = db_mem_enum_restart;
+        db_pfn->db_enum_end = db_mem_enum_end;
+        db_pfn->db_fetch_item = db_mem_fetch_item;
+        db_pfn->db_dispose_item = db_mem_dispose_item;
+        db_pfn->db_hint = db_mem_hint;
+        db_pfn->db_playcounts = db_mem_playcounts;
+    }
 #endif
 
-    if(!db_pfn) {
+    if(!db_pfn->db_open) {
         db_set_error(pe,DB_E_BADPROVIDER,type);
         return DB_E_BADPROVIDER;
     }
@@ -627,6 +1155,7 @@ void db_hint(int hint) {
         } else {
             DPRINTF(E_LOG,L_DB,"Can't open path lookup for tree traversal\n");
         }
+        pl_advise_fullscan(FALSE);
         db_unlock();
         break;
 
@@ -644,6 +1173,8 @@ void db_hint(int hint) {
             }
             pnode = pnext;
         }
+        pl_advise_fullscan(TRUE);
+        db_revision_bump();
         db_unlock();
         break;
 
@@ -686,9 +1217,19 @@ int db_init(int reload) {
     int result;
     char *pe;
     MEDIA_STRING *pmo;
-    uint32_t m_id;
     DB_PATH_NODE *pnew;
+    DB_PATH_NODE **pnodes = NULL;
+    uint32_t *ids = NULL;
+    int count = 0;
+    int size = 0;
+    int unique;
+    int index;
     void *opaque;
+    void *ptemp;
+    struct timeval start, phase;
+    uint32_t read_ms, path_ms, library_ms;
+
+    gettimeofday(&start,NULL);
 
     /* this should arguably be done in pl_init, rather than here */
     pl_add_playlist(&pe,"Library",PL_STATICWEB,NULL,NULL,0,&id);
@@ -697,7 +1238,9 @@ int db_init(int reload) {
         free(pe);
     }
 
-    /* walk through and add all the items */
+    /* walk through and collect all the items.  Ids straight out of
+     * the db don't need checking, and building the path map and the
+     * library from sorted arrays beats one tree insert per song */
     if(DB_E_SUCCESS != (result = db_pfn->db_enum_start(&pe,&opaque))) {
         DPRINTF(E_FATAL,L_DB,"Error populating initial playlist: %s\n",pe);
         free(pe);
@@ -708,9 +1251,17 @@ int db_init(int reload) {
 
     /* FIXME: assumes string return */
     while((DB_E_SUCCESS == (result=db_pfn->db_enum_fetch(&pe, opaque, &pmo))) && pmo) {
-        /* got a row */
+        if(count == size) {
+            size = size ? size * 2 : 1024;
+            ptemp = realloc(pnodes, size * sizeof(DB_PATH_NODE*));
+            if(ptemp)
+                pnodes = (DB_PATH_NODE**)ptemp;
+            ptemp = ptemp ? realloc(ids, size * sizeof(uint32_t)) : NULL;
+            if(!ptemp)
+                DPRINTF(E_FATAL,L_DB,"Malloc error allocating path map\n");
+            ids = (uint32_t*)ptemp;
+        }
 
-        /* add to path map */
         pnew = (DB_PATH_NODE*)malloc(sizeof(DB_PATH_NODE));
         if(!pnew)
             DPRINTF(E_FATAL,L_DB,"Malloc error allocating path map entry\n");
@@ -720,30 +1271,97 @@ int db_init(int reload) {
         pnew->id = util_atoui32(pmo->id);
         pnew->fetched = 0;
 
-        if(!rbsearch((const void*)pnew, db_path_lookup)) {
-            DPRINTF(E_FATAL,L_DB,"Can't insert into path map\n");
-        }
+        db_index_add_string(pmo);
 
-        m_id = util_atoui32(pmo->id);
-        if(m_id) {
-            if(PL_E_SUCCESS != (result = pl_add_playlist_item(&pe, 1, m_id))) {
-                DPRINTF(E_LOG,L_DB,"Error inserting item into library: %s\n",
-                        pe);
-                free(pe);
-                db_pfn->db_enum_end(NULL,opaque);
-                return result;
-            }
-        }
+        pnodes[count] = pnew;
+        ids[count++] = pnew->id;
     }
 
     db_pfn->db_enum_end(NULL,opaque);
+    read_ms = db_elapsed_ms(&start);
+
+    /* path map, dropping any duplicate paths.  The sort puts the
+     * lowest id first, and that's the one we keep */
+    gettimeofday(&phase,NULL);
+    if(count)
+        qsort(pnodes,count,sizeof(DB_PATH_NODE*),db_path_sort_compare);
+
+    unique = 0;
+    for(index = 0; index < count; index++) {
+        if((unique) && (!db_path_compare(pnodes[unique - 1],pnodes[index],NULL))) {
+            free(pnodes[index]->path);
+            free(pnodes[index]);
+            continue;
+        }
+        pnodes[unique++] = pnodes[index];
+    }
+
+    if(rbbuild((const void **)pnodes, unique, db_path_lookup))
+        DPRINTF(E_FATAL,L_DB,"Can't build path map\n");
+    path_ms = db_elapsed_ms(&phase);
+
+    gettimeofday(&phase,NULL);
+    for(index = 0, unique = 0; index < count; index++) {
+        if(ids[index])
+            ids[unique++] = ids[index];
+    }
+
+    result = pl_add_playlist_items(&pe, 1, ids, unique);
+    free(pnodes);
+    free(ids);
+
+    if(PL_E_SUCCESS != result) {
+        DPRINTF(E_LOG,L_DB,"Error inserting items into library: %s\n",pe);
+        free(pe);
+        return result;
+    }
+    library_ms = db_elapsed_ms(&phase);
 
+    gettimeofday(&phase,NULL);
     pl_init(NULL);
 
+    DPRINTF(E_LOG,L_DB,"Loaded %d songs in %d ms (read %d ms, paths %d ms, "
+            "library %d ms, playlists %d ms)\n",count,db_elapsed_ms(&start),
+            read_ms,path_ms,library_ms,db_elapsed_ms(&phase));
+
     return DB_E_SUCCESS;
 }
 
+/**
+ * qsort wrapper for db_path_compare, for sorting arrays of path
+ * map entries.  Same paths sort by id.
+ */
+int db_path_sort_compare(const void *p1, const void *p2) {
+    DB_PATH_NODE *ppn1 = *((DB_PATH_NODE**)p1);
+    DB_PATH_NODE *ppn2 = *((DB_PATH_NODE**)p2);
+    int result;
+
+    if((result = db_path_compare(ppn1, ppn2, NULL)))
+        return result;
+
+    if(ppn1->id < ppn2->id)
+        return -1;
+    if(ppn1->id > ppn2->id)
+        return 1;
+    return 0;
+}
+
+/**
+ * get the number of milliseconds since pstart
+ */
+uint32_t db_elapsed_ms(struct timeval *pstart) {
+    struct timeval end;
+
+    gettimeofday(&end,NULL);
+    return (uint32_t)((end.tv_sec - pstart->tv_sec) * 1000 +
+                      (end.tv_usec - pstart->tv_usec) / 1000);
+}
+
 int db_deinit(void) {
+    db_playcount_flush();
+    db_filter_deinit();
+    db_index_deinit();
+    db_cache_deinit();
     return DB_E_SUCCESS;
 }
 
@@ -752,8 +1370,40 @@ int db_revision(void) {
 }
 
 /**
- * add a media item to the database.  This needs to also
- * invalidate the cache on adds, but doesn't, currently.
+ * set a function to be called whenever the db revision changes, so
+ * whoever is waiting on it (clients parked on /update) can be told.
+ * Once this returns, the old function won't be called again, so
+ * whatever it was passed can be freed.
+ *
+ * @param cb function to call, or NULL for none
+ * @param arg passed through to cb
+ */
+void db_revision_callback(void (*cb)(void *), void *arg) {
+    pthread_mutex_lock(&db_revision_lock);
+    db_revision_cb = cb;
+    db_revision_cb_arg = arg;
+    pthread_mutex_unlock(&db_revision_lock);
+}
+
+/**
+ * note that the db has changed, so clients (and anything cached
+ * off the db) know to refresh.  This can get called with or without
+ * the db lock held, so it has its own.
+ */
+void db_revision_bump(void) {
+    pthread_mutex_lock(&db_revision_lock);
+    db_revision_no++;
+    /* under the lock, so it can't run after being unregistered */
+    if(db_revision_cb)
+        db_revision_cb(db_revision_cb_arg);
+    pthread_mutex_unlock(&db_revision_lock);
+
+    db_filter_stale();
+}
+
+/**
+ * add a media item to the database, dropping any stale copy
+ * from the item cache.
  *
  * @param pe error string buffer
  * @param pmo media object
@@ -762,6 +1412,8 @@ int db_revision(void) {
 int db_add(char **pe, MEDIA_NATIVE *pmo) {
     int result;
     MEDIA_NATIVE *ptemp;
+    DB_PATH_NODE *pnew;
+    int is_new;
 
     ptemp = db_fetch_path(NULL, pmo->path, pmo->idx);
     if(ptemp) {
@@ -782,19 +1434,34 @@ int db_add(char **pe, MEDIA_NATIVE *pmo) {
         db_utf8_validate(pmo);
         db_trim_strings(pmo);
 
+        is_new = !pmo->id;
         result = db_pfn->db_add(pe,pmo);
         /* FIXME: deadlock?  Do I ever acquired a db lock with the playlist
          * lock held? */
-        if(DB_E_SUCCESS == result)
+        if(DB_E_SUCCESS == result) {
+            if(is_new) {
+                /* so the next scan updates it rather than adding it again */
+                pnew = (DB_PATH_NODE*)malloc(sizeof(DB_PATH_NODE));
+                if(pnew)
+                    pnew->path = strdup(pmo->path);
+                if((!pnew) || (!pnew->path))
+                    DPRINTF(E_FATAL,L_DB,"Malloc error allocating path map entry\n");
+                pnew->index = pmo->idx;
+                pnew->id = pmo->id;
+                pnew->fetched = 1;
+                if(!rbsearch((const void*)pnew, db_path_lookup))
+                    DPRINTF(E_FATAL,L_DB,"Can't insert into path map\n");
+            }
+            db_cache_invalidate(pmo->id);
+            db_index_add(pmo);
             pl_advise_add(pmo);
+            db_revision_bump();
+        }
 
         db_unlock();
         return result;
     }
 
-    /* write through the cache */
-    //    db_cache_update(pmo);
-
     return DB_E_SUCCESS;
 }
 
@@ -807,6 +1474,63 @@ int db_del(char **pe, uint32_t id) {
     return result;
 }
 
+/**
+ * delete everything that came from a path: the file itself, or
+ * everything under it if it was a directory
+ *
+ * @param pe error string buffer
+ * @param path path that went away
+ * @returns DB_E_SUCCESS on success, error code on failure with pe allocated
+ */
+int db_del_path(char **pe, char *path) {
+    DB_PATH_NODE path_node;
+    DB_PATH_NODE *pnode, *pnext;
+    char *prefix;
+    int prefix_len;
+    int pass;
+    int result = DB_E_SUCCESS;
+
+    prefix = util_asprintf("%s%c",path,PATHSEP);
+    if(!prefix) {
+        db_set_error(pe,DB_E_MALLOC);
+        return DB_E_MALLOC;
+    }
+    prefix_len = (int)strlen(prefix);
+
+    db_writelock();
+
+    /* the path itself, then anything under it.  These aren't next
+     * to each other in the path map ("dir" < "dir-2" < "dir/") */
+    for(pass = 0; pass < 2; pass++) {
+        path_node.path = pass ? prefix : path;
+        path_node.index = 0;
+
+        pnode = (DB_PATH_NODE*)rblookup(RB_LUGTEQ, (void*)&path_node, db_path_lookup);
+        while((pnode) && (result == DB_E_SUCCESS)) {
+            if(pass) {
+                if(strncmp(pnode->path, prefix, prefix_len))
+                    break;
+            } else if(strcmp(pnode->path, path)) {
+                break;
+            }
+
+            pnext = (DB_PATH_NODE*)rblookup(RB_LUGREAT, (void*)pnode, db_path_lookup);
+
+            DPRINTF(E_INF,L_DB,"File removed: %s\n", pnode->path);
+            result = db_del_nolock(pe, pnode->id);
+            rbdelete(pnode, db_path_lookup);
+            free(pnode->path);
+            free(pnode);
+
+            pnode = pnext;
+        }
+    }
+
+    db_unlock();
+    free(prefix);
+    return result;
+}
+
 int db_del_nolock(char **pe, uint32_t id) {
     int result = DB_E_NOTIMPL;
 
@@ -814,8 +1538,12 @@ int db_del_nolock(char **pe, uint32_t id) {
         result = db_pfn->db_del(pe, id);
     }
 
-    if(DB_E_SUCCESS == result)
+    if(DB_E_SUCCESS == result) {
+        db_cache_invalidate(id);
+        db_index_del(id);
         pl_advise_del(id);
+        db_revision_bump();
+    }
 
     return result;
 }
@@ -824,8 +1552,13 @@ int db_del_nolock(char **pe, uint32_t id) {
  * start enumerating all items, based on the specifications set up
  * in the query.  (items, distinct, playlists, etc)
  *
- * If the enum_start returns an error, the lock will not be held -
- * the caller should not call db_enum_end
+ * The read lock is only held while the enumeration takes its
+ * snapshot of the playlist, so a slow client doesn't hold up the
+ * scanner.  Items are fetched as the enumeration gets to them, and
+ * any deleted in the meantime are skipped.
+ *
+ * If the enum_start returns an error, the caller should not call
+ * db_enum_end
  *
  * @param pe error string buffer
  * @param pinfo db query to enumerate
@@ -833,9 +1566,7 @@ int db_del_nolock(char **pe, uint32_t id) {
  */
 int db_enum_start(char **pe, DB_QUERY *pinfo) {
     ENUMHELPER *peh;
-    PLAYLIST_NATIVE *plold;
-    char *e_pl = NULL;
-    char *name;
+    DB_FILTER_ENTRY *pfilter = NULL;
     int err;
 
     db_readlock();
@@ -855,43 +1586,20 @@ int db_enum_start(char **pe, DB_QUERY *pinfo) {
     memset(pinfo->priv,0,sizeof(ENUMHELPER));
     peh = pinfo->priv;
 
-    if(pinfo->filter) {
-        if(pinfo->playlist_id != 1) {
-            /* construct a new query, based on playlist */
-            plold = pl_fetch_playlist_id(&e_pl,pinfo->playlist_id);
-            if(!plold) {
-                db_set_error(pe,DB_E_PLAYLIST,e_pl);
-                free(e_pl);
-                db_unlock();
-                return DB_E_PLAYLIST;
-            }
-
-            peh->composite_query = util_asprintf("(%s) and (%s)",
-                                                 plold->query,
-                                                 pinfo->filter);
-            pl_dispose_playlist(plold);
-        } else {
-            peh->composite_query = strdup(pinfo->filter);
-        }
-
-        peh->old_playlist = pinfo->playlist_id;
-
-        /* got the new query in pinfo->query, now set up a hidden playlist */
-        name = util_asprintf("temp-%x-%p",util_get_threadid(), &pinfo);
-
-        err = pl_add_playlist(&e_pl, name, PL_SMART | PL_HIDDEN,
-                              peh->composite_query, NULL, 0,
-                              &pinfo->playlist_id);
-        if(err != PL_E_SUCCESS) {
-            db_set_error(pe,DB_E_PLAYLIST,e_pl);
-            free(e_pl);
-            if(peh->composite_query) free(peh->composite_query);
+    /* filters get matched as the items go by.  Browses filter the
+     * items they are built from, so leave that to the item enum */
+    if((pinfo->filter) && (pinfo->filter_type != FILTER_TYPE_NONE) &&
+       (pinfo->query_type == QUERY_TYPE_ITEMS)) {
+        err = db_filter_get(pe, pinfo->filter,
+                            (pinfo->filter_type == FILTER_TYPE_APPLE) ?
+                            SP_TYPE_QUERY : SP_TYPE_PLAYLIST,
+                            &peh->pfilter);
+        if(err != DB_E_SUCCESS) {
+            free(pinfo->priv);
+            pinfo->priv = NULL;
             db_unlock();
-            return DB_E_PLAYLIST;
+            return err;
         }
-
-        DPRINTF(E_DBG,L_PL,"Created new playlist %d with query %s\n",
-                pinfo->playlist_id, peh->composite_query);
     }
 
     switch(pinfo->query_type) {
@@ -918,13 +1626,13 @@ int db_enum_start(char **pe, DB_QUERY *pinfo) {
         break;
     }
 
+    /* on error, the enum_start has already freed peh.  Either way,
+     * it has released the lock */
+    pfilter = peh->pfilter;
+
     err = peh->enum_start(pe, pinfo);
-    if(err != DB_E_SUCCESS) {
-        if(peh->composite_query) {
-            free(peh->composite_query);
-            pl_delete_playlist(NULL,pinfo->playlist_id);
-        }
-    }
+    if((err != DB_E_SUCCESS) && (pfilter))
+        db_filter_release(pfilter);
 
     return err;
 }
@@ -946,7 +1654,6 @@ int db_enum_items_start(char **pe, DB_QUERY *pinfo) {
         free(pinfo->priv);
         return DB_E_PLAYLIST;
     }
-    pinfo->totalcount = ppn->items;
     pl_dispose_playlist(ppn);
     peh->handle = (void*)pl_enum_items_start(&e_pl, pinfo->playlist_id);
 
@@ -959,6 +1666,37 @@ int db_enum_items_start(char **pe, DB_QUERY *pinfo) {
         return DB_E_PLAYLIST;
     }
 
+    /* with a filter, there's no telling how many will match without
+     * looking, unless earlier walks with the same filter have already
+     * looked at all of these items, or the indexes can say.  The
+     * indexes have to be asked before the lock goes. */
+    if(peh->pfilter) {
+        peh->pmatch_ids = db_filter_lookup(peh->pfilter,
+                                           pl_enum_items_ids(peh->handle),
+                                           &peh->stamp);
+        if(!peh->pmatch_ids)
+            db_enum_items_plan(peh, pl_enum_items_ids(peh->handle));
+    }
+
+    /* have the snapshot, don't need the lock any more */
+    db_unlock();
+    pinfo->totalcount = pl_enum_items_count(peh->handle);
+
+    /* otherwise, callers that can wait get the count at db_enum_end.
+     * Everyone else gets the matches picked out up front, so at
+     * least the second walk only has to fetch what matched. */
+    if(peh->pfilter) {
+        if(peh->pmatch_ids) {
+            pinfo->totalcount = peh->matched = idset_count(peh->pmatch_ids);
+            peh->exhausted = TRUE;
+            return DB_E_SUCCESS;
+        }
+
+        pinfo->totalcount = 0;
+        if(!pinfo->count_at_end)
+            pinfo->totalcount = peh->matched = db_enum_items_count(pinfo, TRUE);
+    }
+
     return DB_E_SUCCESS;
 }
 
@@ -971,10 +1709,10 @@ int db_enum_playlist_start(char **pe, DB_QUERY *pinfo) {
     pl_get_playlist_count(pe, &pinfo->totalcount);
 
     peh->handle = (void*)pl_enum_start(&e_pl);
+    db_unlock();
 
     if(!peh->handle) {
         DPRINTF(E_LOG,L_DB,"Error starting playlist enumeration: %s\n",e_pl);
-        db_unlock();
         db_set_error(pe,DB_E_PLAYLIST,e_pl);
         free(e_pl);
         free(pinfo->priv);
@@ -1004,11 +1742,15 @@ int db_enum_browse_start(char **pe, DB_QUERY *pinfo) {
     // We'll want to handle the query, etc
     memcpy(&pinfo2,pinfo,sizeof(DB_QUERY));
     pinfo2.query_type = QUERY_TYPE_ITEMS;
+    pinfo2.count_at_end = TRUE; /* reading them all anyway */
 
     DPRINTF(E_DBG,L_DB,"Browsing playlist %d\n",pinfo2.playlist_id);
 
     peh = (ENUMHELPER*)pinfo->priv;
 
+    /* the item enumeration takes its own */
+    db_unlock();
+
     pinfo->totalcount=0;
 
     peh->pdistinct = rbinit(db_distinct_compare,&pinfo->distinct_field);
@@ -1099,24 +1841,205 @@ int db_enum_items_fetch(char **pe, char ***result, DB_QUERY *pquery) {
 
     peh = (ENUMHELPER*)pquery->priv;
 
-    if(peh->result) {
-        db_pfn->db_dispose_item(peh->opaque, (MEDIA_STRING*)peh->result);
-        peh->result = NULL;
+    while(1) {
+        if(peh->result) {
+            db_pfn->db_dispose_item(peh->opaque, (MEDIA_STRING*)peh->result);
+            peh->result = NULL;
+        }
+
+        if(peh->pmatch_ids) {
+            /* already matched, just fetch them */
+            *result = NULL;
+            id = idset_next(peh->pmatch_ids, &peh->match_pos);
+            if(!id)
+                return DB_E_SUCCESS;
+
+            config.stats.db_enum_fetches++;
+            if(DB_E_SUCCESS != db_pfn->db_fetch_item(NULL, id, &peh->opaque, (MEDIA_STRING **)&peh->result))
+                continue; /* as with the filtered walk, just skip it */
+            if(!peh->result) {
+                /* deleted since the snapshot */
+                db_pfn->db_dispose_item(peh->opaque, NULL);
+                continue;
+            }
+            db_play_apply_string((MEDIA_STRING*)peh->result,
+                                 peh->play_count, peh->time_played);
+            *result = peh->result;
+            return DB_E_SUCCESS;
+        }
+
+        id = db_enum_items_next(peh);
+        if(!id) {
+            if((peh->pfilter) && (pquery->count_at_end)) {
+                peh->exhausted = TRUE;
+                pquery->totalcount = peh->matched;
+            }
+            *result = NULL;
+            return DB_E_SUCCESS;
+        }
+
+        /* fetch the item -- won't cache this */
+        config.stats.db_enum_fetches++;
+        if(!peh->pfilter) {
+            if(DB_E_SUCCESS == (err = db_pfn->db_fetch_item(pe, id, &peh->opaque, (MEDIA_STRING **)&peh->result))) {
+                if(!peh->result) {
+                    db_pfn->db_dispose_item(peh->opaque, NULL);
+                    continue;
+                }
+                db_play_apply_string((MEDIA_STRING*)peh->result,
+                                     peh->play_count, peh->time_played);
+                *result = peh->result;
+            }
+            return DB_E_SUCCESS;
+        }
+
+        /* filtered: skip anything that doesn't match */
+        if(DB_E_SUCCESS != db_pfn->db_fetch_item(NULL, id, &peh->opaque, (MEDIA_STRING **)&peh->result))
+            continue;
+
+        if(!peh->result) {
+            db_pfn->db_dispose_item(peh->opaque, NULL);
+            continue;
+        }
+
+        db_play_apply_string((MEDIA_STRING*)peh->result,
+                             peh->play_count, peh->time_played);
+        if(((peh->pyes) && (idset_contains(peh->pyes, id))) ||
+           (sp_matches_string(peh->pfilter->pt, (MEDIA_STRING*)peh->result))) {
+            db_enum_items_record(peh, id, TRUE);
+            peh->matched++;
+            *result = peh->result;
+            return DB_E_SUCCESS;
+        }
+        db_enum_items_record(peh, id, FALSE);
     }
+}
 
-    id = pl_enum_items_fetch(NULL, peh->handle);
-    if(!id) {
-        *result = NULL;
-        return DB_E_SUCCESS;
+/**
+ * narrow down a filtered item walk with the indexes.  If they can
+ * answer the whole filter, the matches are known up front.  If they
+ * can answer some of it, only the items that might match get walked,
+ * and the ones that certainly match don't need checking.  Either way,
+ * set up to remember what the walk finds.  This needs the db lock.
+ *
+ * @param peh filtered item enumeration
+ * @param pids items in the playlist being walked
+ */
+void db_enum_items_plan(ENUMHELPER *peh, IDSET *pids) {
+    IDSET *pyes, *pmaybe, *pcheck;
+
+    if(db_index_plan(peh->pfilter->pt, &pyes, &pmaybe)) {
+        pcheck = idset_andnot(pmaybe, pyes);
+        if((pcheck) && (!idset_count(pcheck))) {
+            peh->pmatch_ids = idset_and(pids, pyes);
+        } else if(pcheck) {
+            peh->pwalk = idset_and(pids, pmaybe);
+            peh->pyes = pyes;
+            pyes = NULL;
+        }
+
+        idset_free(pcheck);
+        idset_free(pyes);
+        idset_free(pmaybe);
+
+        if(peh->pmatch_ids)
+            return;
     }
 
-    /* fetch the item -- won't cache this */
-    config.stats.db_enum_fetches++;
-    if(DB_E_SUCCESS == (err = db_pfn->db_fetch_item(pe, id, &peh->opaque, (MEDIA_STRING **)&peh->result))) {
-        *result = peh->result;
+    /* no matter if these can't be had, it just won't remember.
+     * Anything not walked is already known not to match */
+    peh->pchecked = peh->pwalk ? idset_andnot(pids, peh->pwalk) : idset_new();
+    peh->pmatched = idset_new();
+}
+
+/**
+ * get the next item to look at in an item walk
+ *
+ * @param peh item enumeration
+ * @returns id of the item, or 0 at the end
+ */
+uint32_t db_enum_items_next(ENUMHELPER *peh) {
+    if(peh->pwalk)
+        return idset_next(peh->pwalk, &peh->walk_pos);
+
+    return pl_enum_items_fetch(NULL, peh->handle);
+}
+
+/**
+ * note how an item went against the filter, so later walks with
+ * the same filter might not have to look
+ *
+ * @param peh filtered item enumeration
+ * @param id item that was tried
+ * @param matched whether it matched
+ */
+void db_enum_items_record(ENUMHELPER *peh, uint32_t id, int matched) {
+    if((!peh->pchecked) || (!peh->pmatched))
+        return;
+
+    if((idset_add(peh->pchecked, id) < 0) ||
+       ((matched) && (idset_add(peh->pmatched, id) < 0))) {
+        idset_free(peh->pchecked);
+        idset_free(peh->pmatched);
+        peh->pchecked = peh->pmatched = NULL;
     }
+}
 
-    return DB_E_SUCCESS;
+/**
+ * count how many of the rest of the items in a filtered item
+ * enumeration match the filter, leaving the enumeration at the end
+ *
+ * @param pquery filtered item query
+ * @param keep_ids whether to keep the matching ids for the fetches
+ * @returns number of matching items
+ */
+int db_enum_items_count(DB_QUERY *pquery, int keep_ids) {
+    ENUMHELPER *peh;
+    MEDIA_STRING *pms;
+    void *opaque;
+    uint32_t id;
+    char play_count[12];
+    char time_played[12];
+    int count = 0;
+    int matched;
+
+    peh = (ENUMHELPER*)pquery->priv;
+
+    if(keep_ids) {
+        peh->pmatch_ids = idset_new();
+        if(!peh->pmatch_ids)
+            DPRINTF(E_FATAL,L_DB,"Malloc error in db_enum_items_count\n");
+    }
+
+    while((id = db_enum_items_next(peh))) {
+        /* if the indexes already know, there's no need to look */
+        if((peh->pyes) && (idset_contains(peh->pyes, id))) {
+            matched = TRUE;
+        } else {
+            config.stats.db_enum_fetches++;
+            if(DB_E_SUCCESS != db_pfn->db_fetch_item(NULL, id, &opaque, &pms))
+                continue;
+
+            if(!pms) {
+                db_pfn->db_dispose_item(opaque, NULL);
+                continue;
+            }
+
+            db_play_apply_string(pms, play_count, time_played);
+            matched = sp_matches_string(peh->pfilter->pt, pms);
+            db_pfn->db_dispose_item(opaque, pms);
+        }
+
+        db_enum_items_record(peh, id, matched);
+        if(matched) {
+            if((keep_ids) && (idset_add(peh->pmatch_ids, id) < 0))
+                DPRINTF(E_FATAL,L_DB,"Malloc error in db_enum_items_count\n");
+            count++;
+        }
+    }
+
+    peh->exhausted = TRUE;
+    return count;
 }
 
 int db_enum_playlist_fetch(char **pe, char ***result, DB_QUERY *pquery) {
@@ -1155,12 +2078,22 @@ int db_enum_browse_fetch(char **pe, char ***result, DB_QUERY *pquery) {
  * @returns DB_E_SUCCESS on success, error code with pe allocate on failure
  */
 int db_enum_reset(char **pe, DB_QUERY *pquery) {
+    ENUMHELPER *peh;
+
+    peh = (ENUMHELPER*)pquery->priv;
+
     switch(pquery->query_type) {
     case QUERY_TYPE_ITEMS:
-        pl_enum_items_reset(pe, ((ENUMHELPER*)pquery->priv)->handle);
+        pl_enum_items_reset(pe, peh->handle);
+        peh->match_pos = 0;
+        peh->walk_pos = 0;
+        if(!peh->pmatch_ids) {
+            peh->matched = 0;
+            peh->exhausted = FALSE;
+        }
         break;
     case QUERY_TYPE_PLAYLISTS:
-        pl_enum_reset(pe, ((ENUMHELPER*)pquery->priv)->handle);
+        pl_enum_reset(pe, peh->handle);
         break;
     case QUERY_TYPE_DISTINCT:
         break;
@@ -1188,8 +2121,24 @@ int db_enum_end(char **pe, DB_QUERY *pquery) {
     switch(pquery->query_type) {
     case QUERY_TYPE_ITEMS:
         if(peh->result) {
+            /* dispose, not free: the backend might be holding a lock
+             * until it gets it back, as sqlite3 does */
             DPRINTF(E_DBG,L_PL,"Freeing last result\n");
-            free(peh->result);
+            db_pfn->db_dispose_item(peh->opaque, (MEDIA_STRING*)peh->result);
+        }
+        if(peh->pfilter) {
+            /* finish the count for callers that stopped early */
+            if((pquery->count_at_end) && (!peh->exhausted))
+                pquery->totalcount = peh->matched + db_enum_items_count(pquery, FALSE);
+            if(peh->pchecked)
+                db_filter_remember(peh->pfilter, peh->pchecked,
+                                   peh->pmatched, peh->stamp);
+            db_filter_release(peh->pfilter);
+            idset_free(peh->pmatch_ids);
+            idset_free(peh->pwalk);
+            idset_free(peh->pyes);
+            idset_free(peh->pchecked);
+            idset_free(peh->pmatched);
         }
         DPRINTF(E_DBG,L_PL,"Ending playlist enumeration\n");
         pl_enum_items_end(peh->handle);
@@ -1212,15 +2161,9 @@ int db_enum_end(char **pe, DB_QUERY *pquery) {
         break;
     }
 
-    if(peh->composite_query) {
-        free(peh->composite_query);
-        pl_delete_playlist(NULL,pquery->playlist_id);
-    }
-
     DPRINTF(E_DBG,L_PL,"Freeing prive\n");
     free(peh);
 
-    db_unlock();
     return DB_E_SUCCESS;
 }
 
@@ -1237,7 +2180,12 @@ int db_enum_end(char **pe, DB_QUERY *pquery) {
  * @return DB_E_SUCCESS on success, error code otherwise
  */
 int db_add_playlist(char **pe, char *name, int type, char *clause, char *path, int index, uint32_t *playlistid) {
-    return pl_add_playlist(pe, name, type, clause, path, index, playlistid);
+    int result;
+
+    if(DB_E_SUCCESS == (result = pl_add_playlist(pe, name, type, clause, path, index, playlistid)))
+        db_revision_bump();
+
+    return result;
 }
 
 /**
@@ -1252,7 +2200,12 @@ int db_add_playlist(char **pe, char *name, int type, char *clause, char *path, i
  * @return DB_E_SUCCESS on succes, error code with pe allocated otherwise
  */
 int db_add_playlist_item(char **pe, int playlistid, int songid) {
-    return pl_add_playlist_item(pe, playlistid, songid);
+    int result;
+
+    if(DB_E_SUCCESS == (result = pl_add_playlist_item(pe, playlistid, songid)))
+        db_revision_bump();
+
+    return result;
 }
 
 /**
@@ -1267,7 +2220,12 @@ int db_add_playlist_item(char **pe, int playlistid, int songid) {
  * @return DB_E_SUCCESS on succes, error code with pe allocated otherwise
  */
 int db_delete_playlist_item(char **pe, int playlistid, int songid) {
-    return pl_delete_playlist_item(pe, playlistid, songid);
+    int result;
+
+    if(DB_E_SUCCESS == (result = pl_delete_playlist_item(pe, playlistid, songid)))
+        db_revision_bump();
+
+    return result;
 }
 
 /**
@@ -1280,7 +2238,12 @@ int db_delete_playlist_item(char **pe, int playlistid, int songid) {
  * @returns DB_E_SUCCESS on success, error code with pe allocated otherwise
  */
 int db_edit_playlist(char **pe, int id, char *name, char *clause) {
-    return pl_edit_playlist(pe, id, name, clause);
+    int result;
+
+    if(DB_E_SUCCESS == (result = pl_edit_playlist(pe, id, name, clause)))
+        db_revision_bump();
+
+    return result;
 }
 
 /**
@@ -1293,7 +2256,12 @@ int db_edit_playlist(char **pe, int id, char *name, char *clause) {
  * @return DB_E_SUCCESS on succes, error code with pe allocated otherwise
  */
 int db_delete_playlist(char **pe, int playlistid) {
-    return pl_delete_playlist(pe, playlistid);
+    int result;
+
+    if(DB_E_SUCCESS == (result = pl_delete_playlist(pe, playlistid)))
+        db_revision_bump();
+
+    return result;
 }
 
 /**
@@ -1350,58 +2318,223 @@ MEDIA_NATIVE *db_fetch_item_nolock(char **pe, int id) {
 MEDIA_NATIVE *db_fetch_path(char **pe, char *path, int index) {
     DB_PATH_NODE path_node;
     DB_PATH_NODE *pnode;
+    uint32_t id;
 
     /* this lookups into path cache... */
     path_node.path = path;
     path_node.index = index;
 
+    /* the path map changes as files get added, so hold the lock */
+    db_readlock();
     pnode = (DB_PATH_NODE*)rbfind((void*)&path_node,db_path_lookup);
     if(!pnode) {
+        db_unlock();
         DPRINTF(E_DBG,L_DB,"Couldn't find %s:%d\n",path,index);
         return NULL;
     }
 
     // Mark node as fetched in case we are in a scan
     pnode->fetched = 1;
+    id = pnode->id;
+    db_unlock();
 
     DPRINTF(E_DBG,L_DB,"Fetching item %s:%d\n",path,index);
-    return db_fetch_item(pe, pnode->id);
+    return db_fetch_item(pe, id);
+}
+
+/**
+ * compare two pending play counts, by id
+ */
+int db_play_compare(const void *p1, const void *p2, const void *arg) {
+    uint32_t id1 = ((DB_PLAYCOUNT*)p1)->id;
+    uint32_t id2 = ((DB_PLAYCOUNT*)p2)->id;
+
+    if(id1 < id2)
+        return -1;
+    if(id1 > id2)
+        return 1;
+    return 0;
+}
+
+/**
+ * put any play count not yet written back onto an item fetched
+ * from the backend
+ *
+ * @param pmn item to update
+ */
+void db_play_apply_native(MEDIA_NATIVE *pmn) {
+    DB_PLAYCOUNT key, *pplay;
+
+    if(!db_play_count)
+        return;
+
+    key.id = pmn->id;
+    pthread_mutex_lock(&db_play_lock);
+    if((pplay = (DB_PLAYCOUNT*)rbfind((void*)&key, db_play_pending))) {
+        pmn->play_count = pplay->play_count;
+        pmn->time_played = pplay->time_played;
+    }
+    pthread_mutex_unlock(&db_play_lock);
+}
+
+/**
+ * same as db_play_apply_native, but for a row straight from the
+ * backend.  The new values are written into the buffers passed,
+ * which have to last as long as the row does.
+ *
+ * @param pms row to update
+ * @param play_count buffer for the play count (12 chars)
+ * @param time_played buffer for the time played (12 chars)
+ */
+void db_play_apply_string(MEDIA_STRING *pms, char *play_count, char *time_played) {
+    DB_PLAYCOUNT key, *pplay;
+
+    if((!db_play_count) || (!pms->id))
+        return;
+
+    key.id = util_atoui32(pms->id);
+    pthread_mutex_lock(&db_play_lock);
+    if((pplay = (DB_PLAYCOUNT*)rbfind((void*)&key, db_play_pending))) {
+        snprintf(play_count,12,"%u",pplay->play_count);
+        snprintf(time_played,12,"%u",pplay->time_played);
+        pms->play_count = play_count;
+        pms->time_played = time_played;
+    }
+    pthread_mutex_unlock(&db_play_lock);
 }
 
 /**
- * fetch the old object, update play count and time_played
+ * count a play.  Smart playlists are told about it right away, but
+ * the database itself only gets the new count at the next
+ * db_playcount_flush.  Until then, fetches and enumerations see the
+ * pending count.  Cached copies are shared with readers, so rather
+ * than being updated in place, the song is dropped from the cache,
+ * and the next fetch picks up the pending count.
  *
  * @param pe error string
  * @param id media id of object to update
  * @returns DB_E_SUCCESS on success
  */
 int db_playcount_increment(char **pe, int id) {
-    MEDIA_NATIVE *pold;
-    int err;
+    MEDIA_NATIVE *pmn;
+    DB_PLAYCOUNT key, *pplay;
+    int changed;
 
+    pmn = db_fetch_item(pe, id);
+    if(!pmn)
+        return DB_E_DB_ERROR;
+
+    /* the pending entry is the real count, as pmn may be a copy
+     * that was fetched before someone else's play was counted */
+    pthread_mutex_lock(&db_play_lock);
+    key.id = id;
+    pplay = (DB_PLAYCOUNT*)rbfind((void*)&key, db_play_pending);
+    if(!pplay) {
+        pplay = (DB_PLAYCOUNT*)malloc(sizeof(DB_PLAYCOUNT));
+        if(!pplay)
+            DPRINTF(E_FATAL,L_DB,"Malloc error in db_playcount_increment\n");
+        pplay->id = id;
+        pplay->play_count = pmn->play_count;
+        rbsearch((void*)pplay, db_play_pending);
+        db_play_count++;
+    }
+
+    pplay->play_count++;
+    pplay->time_played = (uint32_t)time(NULL);
+    pthread_mutex_unlock(&db_play_lock);
+
+    db_dispose_item(pmn);
+    db_filter_stale();
+
+    /* fetches hold the readlock from the backend read through the
+     * cache insert, so none can put back a copy without the new count */
     db_writelock();
+    db_cache_invalidate(id);
+    changed = FALSE;
+    if((pmn = db_fetch_item_nolock(NULL, id))) {
+        changed = pl_advise_add(pmn);
+        db_dispose_item(pmn);
+    }
+    db_unlock();
 
-    pold = db_fetch_item_nolock(pe, id);
-    if(!pold) {
-        db_unlock();
-        return DB_E_DB_ERROR;
+    /* a smart playlist on play count may have picked it up (or
+     * dropped it), so clients and cached responses have to refresh */
+    if(changed)
+        db_revision_bump();
+
+    if(!conf_get_int("general","playcount_flush",DB_PLAY_FLUSH_DEFAULT))
+        db_playcount_flush();
+
+    return DB_E_SUCCESS;
+}
+
+/**
+ * write the pending play counts back to the database, as one
+ * batch.  This gets called from the main loop every so often, and
+ * on shutdown.  Anything that fails to write stays pending for
+ * the next try.
+ */
+void db_playcount_flush(void) {
+    DB_PLAYCOUNT *pplays, *pplay;
+    MEDIA_NATIVE *pmn;
+    RBLIST *rblist;
+    char *pe = NULL;
+    int count = 0;
+    int index;
+    int err = DB_E_SUCCESS;
+
+    pthread_mutex_lock(&db_play_lock);
+    if(!db_play_count) {
+        pthread_mutex_unlock(&db_play_lock);
+        return;
     }
 
-    /* otherwise, update and re-insert */
-    pold->play_count++;
-    pold->time_played = time(NULL);
+    pplays = (DB_PLAYCOUNT*)malloc(db_play_count * sizeof(DB_PLAYCOUNT));
+    if(!pplays)
+        DPRINTF(E_FATAL,L_DB,"Malloc error in db_playcount_flush\n");
 
-    if(db_pfn->db_add) {
-        if(DB_E_SUCCESS != ((err = db_pfn->db_add(pe, pold)))) {
-            db_unlock();
-            return err;
+    rblist = rbopenlist(db_play_pending);
+    while((rblist) && (pplay = (DB_PLAYCOUNT*)rbreadlist(rblist)))
+        memcpy(&pplays[count++],pplay,sizeof(DB_PLAYCOUNT));
+    if(rblist)
+        rbcloselist(rblist);
+    pthread_mutex_unlock(&db_play_lock);
+
+    if(db_pfn->db_playcounts) {
+        err = db_pfn->db_playcounts(&pe, pplays, count);
+    } else {
+        /* no way to write just the counts, so rewrite the songs */
+        db_writelock();
+        for(index = 0; (index < count) && (err == DB_E_SUCCESS); index++) {
+            if((pmn = db_fetch_item_nolock(NULL, pplays[index].id))) {
+                err = db_pfn->db_add(&pe, pmn);
+                db_dispose_item(pmn);
+            }
         }
+        db_unlock();
     }
 
-    /* FIXME: Advise playlists and update cache.  Call db_add? */
+    if(err != DB_E_SUCCESS) {
+        DPRINTF(E_LOG,L_DB,"Error writing play counts: %s\n",pe ? pe : "?");
+        if(pe) free(pe);
+        free(pplays);
+        return;
+    }
 
-    db_unlock();
-    return DB_E_SUCCESS;
+    /* forget the ones that haven't been played again since */
+    pthread_mutex_lock(&db_play_lock);
+    for(index = 0; index < count; index++) {
+        pplay = (DB_PLAYCOUNT*)rbfind((void*)&pplays[index], db_play_pending);
+        if((pplay) && (pplay->play_count == pplays[index].play_count)) {
+            rbdelete((void*)pplay, db_play_pending);
+            free(pplay);
+            db_play_count--;
+        }
+    }
+    pthread_mutex_unlock(&db_play_lock);
+
+    DPRINTF(E_DBG,L_DB,"Wrote %d play counts\n",count);
+    free(pplays);
 }
 
 /**
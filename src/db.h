@@ -26,14 +26,34 @@
 #include "smart-parser.h" /** for PARSETREE */
 #include "webserver.h" /** for WS_CONNINFO */
 
+/** item cache counters, for the status page */
+typedef struct tag_db_cache_stats {
+    uint32_t capacity;
+    uint32_t items;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+} DB_CACHE_STATS;
+
+#define DB_PLAY_FLUSH_DEFAULT 60 /**< seconds between play count flushes */
+
+/** a play count waiting to be written back */
+typedef struct tag_db_playcount {
+    uint32_t id;
+    uint32_t play_count;
+    uint32_t time_played;
+} DB_PLAYCOUNT;
+
 extern int db_open(char **pe, char *type, char *parameters);
 extern int db_init(int reload);
 extern int db_deinit(void);
 
 extern int db_revision(void);
+extern void db_revision_callback(void (*cb)(void *), void *arg);
 
 extern int db_add(char **pe, MEDIA_NATIVE *pmo);
 extern int db_del(char **pe, uint32_t id);
+extern int db_del_path(char **pe, char *path);
 
 /* enumerate db items (songs) */
 extern int db_enum_start(char **pe, DB_QUERY *pquery);
@@ -60,9 +80,11 @@ extern void db_hint(int hint);
  * should these be removed?  Refactored?
  */
 extern int db_playcount_increment(char **pe, int id);
+extern void db_playcount_flush(void);
 extern int db_get_song_count(char **pe, int *count);
 extern int db_get_playlist_count(char **pe, int *count);
 extern void db_dispose_item(MEDIA_NATIVE *pmo);
+extern void db_cache_stats(DB_CACHE_STATS *pstats);
 
 
 /* FIXME: won't work with db as modules */
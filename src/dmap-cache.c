@@ -0,0 +1,370 @@
+/*
+ * $Id$
+ * cache of finished dmap responses
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Clients ask for the same handful of things (the full item list,
+ * the playlist list) every time they connect, and the answer only
+ * changes when the db does.  So output plugins can hand their
+ * finished responses in here, keyed by whatever makes the response
+ * unique (path, metas, query...), and serve them straight back out
+ * until the db revision changes.  When it does, everything gets
+ * thrown away.
+ *
+ * Entries are reference counted, as a big response might still be
+ * going out to one client when another client's store pushes it out
+ * of the cache.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <zlib.h>
+
+#include "daapd.h"
+#include "conf.h"
+#include "db.h"
+#include "err.h"
+#include "dmap-cache.h"
+
+#ifndef TRUE
+#  define TRUE 1
+#  define FALSE 0
+#endif
+
+#define DMAP_CACHE_DEFAULT_SIZE 32768 /**< in kilobytes */
+
+typedef struct tag_dmap_cache_entry {
+    char *key;
+    unsigned char *data;
+    int len;
+    unsigned char *gzdata;        /**< gzipped data, or NULL */
+    int gzlen;
+    int refcount;                 /**< the cache itself holds one */
+    struct tag_dmap_cache_entry *prev;
+    struct tag_dmap_cache_entry *next;
+} DMAP_CACHE_ENTRY;
+
+/* Globals */
+static pthread_mutex_t dmap_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static DMAP_CACHE_ENTRY dmap_cache_lru; /**< sentinel: next is newest */
+static int dmap_cache_revision = 0;     /**< db revision of the entries */
+static int dmap_cache_gzip = 0;         /**< keep gzipped copies too */
+static DMAP_CACHE_STATS dmap_cache_info;
+
+/* Forwards */
+static void dmap_cache_unlink(DMAP_CACHE_ENTRY *pentry);
+static void dmap_cache_unref(DMAP_CACHE_ENTRY *pentry);
+static void dmap_cache_flush(void);
+static unsigned char *dmap_cache_gzip_block(unsigned char *data, int len, int *gzlen);
+
+/**
+ * set up the cache from the config.  The cache is disabled if
+ * general/dmap_cache_size is 0.
+ */
+void dmap_cache_init(void) {
+    dmap_cache_lru.next = dmap_cache_lru.prev = &dmap_cache_lru;
+    memset(&dmap_cache_info,0,sizeof(dmap_cache_info));
+
+    dmap_cache_info.max_bytes = 1024 *
+        conf_get_int("general","dmap_cache_size",DMAP_CACHE_DEFAULT_SIZE);
+    dmap_cache_gzip = conf_get_int("general","dmap_cache_gzip",0);
+    dmap_cache_revision = db_revision();
+
+    DPRINTF(E_DBG,L_WS,"Response cache: %d bytes, gzip %s\n",
+            dmap_cache_info.max_bytes, dmap_cache_gzip ? "on" : "off");
+}
+
+/**
+ * throw away everything.  Responses still being written out get
+ * freed when they are released.
+ */
+void dmap_cache_deinit(void) {
+    pthread_mutex_lock(&dmap_cache_lock);
+    dmap_cache_flush();
+    pthread_mutex_unlock(&dmap_cache_lock);
+}
+
+/**
+ * take an entry out of the lru list and the accounting.  Must be
+ * called with the cache lock held.
+ */
+void dmap_cache_unlink(DMAP_CACHE_ENTRY *pentry) {
+    pentry->prev->next = pentry->next;
+    pentry->next->prev = pentry->prev;
+    pentry->prev = pentry->next = NULL;
+
+    dmap_cache_info.bytes -= (pentry->len + pentry->gzlen);
+    dmap_cache_info.entries--;
+}
+
+/**
+ * drop a reference to an entry, freeing it when it's the last.
+ * Must be called with the cache lock held.
+ */
+void dmap_cache_unref(DMAP_CACHE_ENTRY *pentry) {
+    if(--pentry->refcount)
+        return;
+
+    free(pentry->key);
+    free(pentry->data);
+    if(pentry->gzdata)
+        free(pentry->gzdata);
+    free(pentry);
+}
+
+/**
+ * throw away all the entries.  Must be called with the cache lock held.
+ */
+void dmap_cache_flush(void) {
+    DMAP_CACHE_ENTRY *pentry;
+
+    while((pentry = dmap_cache_lru.next) != &dmap_cache_lru) {
+        dmap_cache_unlink(pentry);
+        dmap_cache_unref(pentry);
+    }
+}
+
+/**
+ * gzip a block, for clients that will take it that way.
+ *
+ * @param data block to compress
+ * @param len length of block
+ * @param gzlen returns length of compressed block
+ * @returns malloc'd compressed block, or NULL if it didn't shrink
+ */
+unsigned char *dmap_cache_gzip_block(unsigned char *data, int len, int *gzlen) {
+    z_stream strm;
+    unsigned char *out;
+    uLong out_len;
+
+    memset(&strm,0,sizeof(strm));
+    if(deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                    31, 8, Z_DEFAULT_STRATEGY) != Z_OK) /* 15 + 16: gzip */
+        return NULL;
+
+    out_len = deflateBound(&strm, len) + 32; /* plus gzip header */
+    out = (unsigned char *)malloc(out_len);
+    if(!out) {
+        deflateEnd(&strm);
+        return NULL;
+    }
+
+    strm.next_in = data;
+    strm.avail_in = len;
+    strm.next_out = out;
+    strm.avail_out = out_len;
+
+    if((deflate(&strm, Z_FINISH) != Z_STREAM_END) ||
+       (strm.total_out >= (uLong)len)) {
+        deflateEnd(&strm);
+        free(out);
+        return NULL;
+    }
+
+    *gzlen = (int)strm.total_out;
+    deflateEnd(&strm);
+    return out;
+}
+
+/**
+ * look for a cached response.  On a hit, the data stays valid
+ * until the returned handle is passed to dmap_cache_release.
+ *
+ * @param key what the response is for
+ * @param gzip whether the client will take a gzipped response
+ * @param pdata returns the response
+ * @param len returns the length of the response
+ * @param gzipped returns whether the response is gzipped
+ * @returns handle to release, or NULL on a miss
+ */
+void *dmap_cache_lookup(char *key, int gzip, unsigned char **pdata,
+                        int *len, int *gzipped) {
+    DMAP_CACHE_ENTRY *pentry;
+
+    if(!dmap_cache_info.max_bytes)
+        return NULL;
+
+    pthread_mutex_lock(&dmap_cache_lock);
+
+    if(dmap_cache_revision != db_revision()) {
+        dmap_cache_flush();
+        dmap_cache_revision = db_revision();
+    }
+
+    for(pentry = dmap_cache_lru.next; pentry != &dmap_cache_lru;
+        pentry = pentry->next) {
+        if(0 == strcmp(pentry->key, key))
+            break;
+    }
+
+    if(pentry == &dmap_cache_lru) {
+        dmap_cache_info.misses++;
+        pthread_mutex_unlock(&dmap_cache_lock);
+        return NULL;
+    }
+
+    /* move it to the front */
+    pentry->prev->next = pentry->next;
+    pentry->next->prev = pentry->prev;
+    pentry->next = dmap_cache_lru.next;
+    pentry->prev = &dmap_cache_lru;
+    dmap_cache_lru.next->prev = pentry;
+    dmap_cache_lru.next = pentry;
+
+    pentry->refcount++;
+    dmap_cache_info.hits++;
+
+    if((gzip) && (pentry->gzdata)) {
+        dmap_cache_info.gzip_hits++;
+        *pdata = pentry->gzdata;
+        *len = pentry->gzlen;
+        *gzipped = TRUE;
+    } else {
+        *pdata = pentry->data;
+        *len = pentry->len;
+        *gzipped = FALSE;
+    }
+
+    pthread_mutex_unlock(&dmap_cache_lock);
+    return (void*)pentry;
+}
+
+/**
+ * done with a response from dmap_cache_lookup
+ *
+ * @param handle handle returned from dmap_cache_lookup
+ */
+void dmap_cache_release(void *handle) {
+    pthread_mutex_lock(&dmap_cache_lock);
+    dmap_cache_unref((DMAP_CACHE_ENTRY*)handle);
+    pthread_mutex_unlock(&dmap_cache_lock);
+}
+
+/**
+ * add a response to the cache.  If the cache keeps it, it owns
+ * data from then on, otherwise the caller still has to free it.
+ *
+ * @param key what the response is for
+ * @param revision the db revision the response was built from
+ * @param data the response (malloc'd)
+ * @param len length of the response
+ * @returns TRUE if the cache took the response
+ */
+int dmap_cache_store(char *key, int revision, unsigned char *data, int len) {
+    DMAP_CACHE_ENTRY *pentry, *pold;
+    unsigned char *gzdata = NULL;
+    int gzlen = 0;
+
+    if((!dmap_cache_info.max_bytes) || (len > (int)dmap_cache_info.max_bytes))
+        return FALSE;
+
+    /* already stale? */
+    if(revision != db_revision())
+        return FALSE;
+
+    /* compress outside the lock -- this is the slow part */
+    if(dmap_cache_gzip)
+        gzdata = dmap_cache_gzip_block(data, len, &gzlen);
+
+    pentry = (DMAP_CACHE_ENTRY*)calloc(1,sizeof(DMAP_CACHE_ENTRY));
+    if(pentry)
+        pentry->key = strdup(key);
+
+    if((!pentry) || (!pentry->key)) {
+        DPRINTF(E_LOG,L_WS,"Malloc error in dmap_cache_store\n");
+        if(pentry)
+            free(pentry);
+        if(gzdata)
+            free(gzdata);
+        return FALSE;
+    }
+
+    pentry->data = data;
+    pentry->len = len;
+    pentry->gzdata = gzdata;
+    pentry->gzlen = gzlen;
+    pentry->refcount = 1;
+
+    pthread_mutex_lock(&dmap_cache_lock);
+
+    if(dmap_cache_revision != db_revision()) {
+        dmap_cache_flush();
+        dmap_cache_revision = db_revision();
+    }
+
+    if(revision != dmap_cache_revision) {
+        pthread_mutex_unlock(&dmap_cache_lock);
+        pentry->data = NULL;
+        free(pentry->key);
+        if(gzdata)
+            free(gzdata);
+        free(pentry);
+        return FALSE;
+    }
+
+    /* two clients missed on the same thing at the same time */
+    for(pold = dmap_cache_lru.next; pold != &dmap_cache_lru;
+        pold = pold->next) {
+        if(0 == strcmp(pold->key, key)) {
+            dmap_cache_unlink(pold);
+            dmap_cache_unref(pold);
+            break;
+        }
+    }
+
+    while((dmap_cache_info.bytes + len + gzlen > dmap_cache_info.max_bytes) &&
+          (dmap_cache_lru.prev != &dmap_cache_lru)) {
+        pold = dmap_cache_lru.prev;
+        dmap_cache_unlink(pold);
+        dmap_cache_unref(pold);
+        dmap_cache_info.evictions++;
+    }
+
+    pentry->next = dmap_cache_lru.next;
+    pentry->prev = &dmap_cache_lru;
+    dmap_cache_lru.next->prev = pentry;
+    dmap_cache_lru.next = pentry;
+
+    dmap_cache_info.bytes += (len + gzlen);
+    dmap_cache_info.entries++;
+
+    pthread_mutex_unlock(&dmap_cache_lock);
+    return TRUE;
+}
+
+/**
+ * get a snapshot of the cache counters
+ *
+ * @param pstats struct to fill
+ */
+void dmap_cache_stats(DMAP_CACHE_STATS *pstats) {
+    pthread_mutex_lock(&dmap_cache_lock);
+    memcpy(pstats,&dmap_cache_info,sizeof(DMAP_CACHE_STATS));
+    pthread_mutex_unlock(&dmap_cache_lock);
+}
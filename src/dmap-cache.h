@@ -0,0 +1,43 @@
+/*
+ * $Id$
+ * cache of finished dmap responses
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DMAP_CACHE_H_
+#define _DMAP_CACHE_H_
+
+typedef struct tag_dmap_cache_stats {
+    uint32_t max_bytes;     /**< memory cap (0 = cache disabled) */
+    uint32_t bytes;         /**< memory in use */
+    uint32_t entries;       /**< responses cached */
+    uint32_t hits;
+    uint32_t gzip_hits;     /**< hits that went out compressed */
+    uint32_t misses;
+    uint32_t evictions;     /**< dropped to stay under max_bytes */
+} DMAP_CACHE_STATS;
+
+extern void dmap_cache_init(void);
+extern void dmap_cache_deinit(void);
+extern void *dmap_cache_lookup(char *key, int gzip, unsigned char **pdata,
+                               int *len, int *gzipped);
+extern void dmap_cache_release(void *handle);
+extern int dmap_cache_store(char *key, int revision, unsigned char *data, int len);
+extern void dmap_cache_stats(DMAP_CACHE_STATS *pstats);
+
+#endif /* _DMAP_CACHE_H_ */
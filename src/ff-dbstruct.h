@@ -214,6 +214,7 @@ typedef struct tag_db_query { /* this will get union'ed */
     /* items */
     int filter_type;
     char *filter;
+    int count_at_end;           /**< filtered totalcount can wait for db_enum_end */
 } DB_QUERY;
 
 #define FT_INT32         0
@@ -12,12 +12,14 @@
 #include "configfile.h"
 #include "daapd.h"
 #include "db.h"
+#include "dmap-cache.h"
 #include "err.h"
 #include "ff-dbstruct.h"
 #include "ff-plugins.h"
 #include "io.h"
 #include "mp3-scanner.h"
 #include "plugin.h"
+#include "ssc-cache.h"
 #include "util.h"
 #include "webserver.h"
 
@@ -217,6 +219,9 @@ EXPORT void pi_stream(WS_CONNINFO *pwsc, char *id) {
     uint64_t real_len;
     uint64_t file_len;
     uint64_t offset=0;
+    void *pcache = NULL;
+    char *path;
+    char *type;
     int item;
 
     /* stream out the song */
@@ -234,7 +239,8 @@ EXPORT void pi_stream(WS_CONNINFO *pwsc, char *id) {
         DPRINTF(E_LOG,L_DAAP|L_WS|L_DB,"Could not find requested item %lu\n",item);
         config_set_status(pwsc,session,NULL);
         ws_returnerror(pwsc,404,"File Not Found");
-    } else if (pi_should_transcode(pwsc,pmp3->codectype)) {
+    } else if ((pi_should_transcode(pwsc,pmp3->codectype)) &&
+               (!(pcache = plugin_ssc_cached(pmp3,&path)))) {
         /************************
          * Server side conversion
          ************************/
@@ -258,19 +264,27 @@ EXPORT void pi_stream(WS_CONNINFO *pwsc, char *id) {
          * stream file normally
          **********************/
         if(pmp3->data_kind != 0) {
+            if(pcache) {
+                ssc_cache_release(pcache);
+                free(path);
+            }
             ws_returnerror(pwsc,500,"Can't stream radio station");
             return;
         }
 
+        /* a finished transcode is just another file */
+        path = pcache ? path : pmp3->path;
+        type = pcache ? "wav" : pmp3->type;
+
         hfile = io_new();
         if(!hfile)
             DPRINTF(E_FATAL,L_WS,"Cannot allocate file handle\n");
 
-        if(!io_open(hfile,"file://%U",pmp3->path)) {
+        if(!io_open(hfile,"file://%U",path)) {
             /* FIXME: ws_set_errstr */
             ws_set_err(pwsc,E_WS_NATIVE);
             DPRINTF(E_WARN,L_WS,"Thread %d: Error opening %s: %s\n",
-                ws_threadno(pwsc),pmp3->path,io_errstr(hfile));
+                ws_threadno(pwsc),path,io_errstr(hfile));
             ws_returnerror(pwsc,404,"Not found");
             config_set_status(pwsc,session,NULL);
             db_dispose_item(pmp3);
@@ -285,8 +299,8 @@ EXPORT void pi_stream(WS_CONNINFO *pwsc, char *id) {
             // DWB:  fix content-type to correctly reflect data
             // content type (dmap tagged) should only be used on
             // dmap protocol requests, not the actually song data
-            if(pmp3->type)
-                ws_addresponseheader(pwsc,"Content-Type","audio/%s",pmp3->type);
+            if(type)
+                ws_addresponseheader(pwsc,"Content-Type","audio/%s",type);
 
             ws_addresponseheader(pwsc,"Content-Length","%ld",(long)file_len);
 
@@ -303,17 +317,19 @@ EXPORT void pi_stream(WS_CONNINFO *pwsc, char *id) {
                 ws_writefd(pwsc,"HTTP/1.1 200 OK\r\n");
             else {
                 ws_addresponseheader(pwsc,"Content-Range","bytes %ld-%ld/%ld",
-                                     (long)offset,(long)real_len,
-                                     (long)real_len+1);
+                                     (long)offset,(long)real_len - 1,
+                                     (long)real_len);
                 ws_writefd(pwsc,"HTTP/1.1 206 Partial Content\r\n");
             }
 
             ws_emitheaders(pwsc);
 
-            config_set_status(pwsc,session,"Streaming '%s' (id %d)",
-                              pmp3->title, pmp3->id);
-            DPRINTF(E_WARN,L_WS,"Session %d: Streaming file '%s' to %s (offset %d)\n",
-                    session,pmp3->fname, ws_hostname(pwsc),(long)offset);
+            config_set_status(pwsc,session,"%s '%s' (id %d)",
+                              pcache ? "Streaming cached transcode of" :
+                              "Streaming", pmp3->title, pmp3->id);
+            DPRINTF(E_WARN,L_WS,"Session %d: Streaming %sfile '%s' to %s (offset %d)\n",
+                    session,pcache ? "transcoded " : "",pmp3->fname,
+                    ws_hostname(pwsc),(long)offset);
 
             if(offset) {
                 DPRINTF(E_INF,L_WS,"Seeking to offset %ld\n",(long)offset);
@@ -334,10 +350,15 @@ EXPORT void pi_stream(WS_CONNINFO *pwsc, char *id) {
             io_dispose(hfile);
             db_dispose_item(pmp3);
         }
+
+        if(pcache) {
+            ssc_cache_release(pcache);
+            free(path);
+        }
     }
-    /* update play counts */
+    /* update play counts.  pmp3 has been disposed by now */
     if(bytes_copied  >= (real_len * 80 / 100)) {
-        db_playcount_increment(NULL,pmp3->id);
+        db_playcount_increment(NULL,item);
         if(!offset)
             config.stats.songs_served++; /* FIXME: remove stat races */
     }
@@ -369,6 +390,18 @@ EXPORT int pi_db_revision(void) {
     return db_revision();
 }
 
+EXPORT void *pi_dmap_cache_lookup(char *key, int gzip, unsigned char **pdata, int *len, int *gzipped) {
+    return dmap_cache_lookup(key, gzip, pdata, len, gzipped);
+}
+
+EXPORT void pi_dmap_cache_release(void *handle) {
+    dmap_cache_release(handle);
+}
+
+EXPORT int pi_dmap_cache_store(char *key, int revision, unsigned char *data, int len) {
+    return dmap_cache_store(key, revision, data, len);
+}
+
 EXPORT int pi_db_count_items(int what) {
     int count=0;
     char *pe = NULL;
@@ -389,6 +422,15 @@ EXPORT int pi_db_count_items(int what) {
     return count;
 }
 
+/**
+ * see if the client asking for an update is behind the db.  If it
+ * isn't, the request is held, without tying up a worker, until
+ * db_revision_bump releases it, and then the handler is run again.
+ * Only where the webserver can't hold requests does this wait here.
+ *
+ * @param pwsc connection asking for the update
+ * @returns TRUE if there's an update to send, FALSE otherwise
+ */
 EXPORT int pi_db_wait_update(WS_CONNINFO *pwsc) {
     int clientver=1;
     int lastver=0;
@@ -399,6 +441,12 @@ EXPORT int pi_db_wait_update(WS_CONNINFO *pwsc) {
         clientver=atoi(ws_getvar(pwsc,"revision-number"));
     }
 
+    if(clientver != db_revision())
+        return TRUE;
+
+    if(ws_hold(pwsc))
+        return FALSE;
+
     /* wait for db_version to be stable for 30 seconds */
     hwait = io_wait_new();
     if(!hwait)
@@ -413,6 +461,7 @@ EXPORT int pi_db_wait_update(WS_CONNINFO *pwsc) {
           (lastver && (db_revision() != lastver))) {
         lastver = db_revision();
 
+        ms = 30000;
         if(!io_wait(hwait,&ms) && (ms != 0)) {
             /* can't be ready for read, must be error */
             DPRINTF(E_DBG,L_DAAP,"Update session stopped\n");
@@ -74,6 +74,7 @@ typedef struct tag_plugin_transcode_fn {
     int (*ssc_close)(void*);
     int (*ssc_read)(void*, char*, int);
     char *(*ssc_error)(void*);
+    int (*ssc_seek)(void*, uint64_t);  /* to a sample, after the header (optional) */
 } PLUGIN_TRANSCODE_FN;
 
 /* info for rendezvous advertising */
@@ -134,6 +135,11 @@ extern EXPORT int pi_db_revision(void);
 extern EXPORT int pi_db_count_items(int what);
 extern EXPORT int pi_db_wait_update(struct tag_ws_conninfo *);
 
+/* response cache */
+extern EXPORT void *pi_dmap_cache_lookup(char *key, int gzip, unsigned char **pdata, int *len, int *gzipped);
+extern EXPORT void pi_dmap_cache_release(void *handle);
+extern EXPORT int pi_dmap_cache_store(char *key, int revision, unsigned char *data, int len);
+
 /* config/misc functions */
 extern EXPORT char *pi_conf_alloc_string(char *section, char *key, char *dflt);
 extern EXPORT void pi_conf_dispose_string(char *str);
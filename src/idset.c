@@ -0,0 +1,596 @@
+/*
+ * $Id$
+ * compact sets of song ids
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Playlist membership (and anything else that is just "which songs")
+ * is kept as a set of ids.  A set with only a few members is a
+ * sorted array of them.  Once the array would be bigger than a
+ * bitmap of every id up to the highest member, it turns into one,
+ * and turns back into an array if it empties out again.  Song ids
+ * are handed out in order, so the library and most smart playlists
+ * end up as bitmaps at one bit per song, and small playlists stay
+ * at four bytes per member.
+ *
+ * Id 0 is never a song, so it is never a member either.  That lets
+ * idset_next use it as the end marker.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include "idset.h"
+
+#ifndef TRUE
+#  define TRUE 1
+#  define FALSE 0
+#endif
+
+#define IDSET_MIN_SIZE 8
+
+#define IDSET_WORD(id)  ((id) >> 5)
+#define IDSET_BIT(id)   ((uint32_t)1 << ((id) & 31))
+
+/* an array set is due to become a bitmap once it has more members
+ * than the bitmap would have words */
+#define IDSET_WANTS_BITMAP(pset) \
+    (((pset)->count > IDSET_MIN_SIZE) && \
+     ((pset)->count > IDSET_WORD((pset)->data[(pset)->count - 1]) + 1))
+
+struct idset_t {
+    int bitmap;         /**< TRUE if data is a bitmap, else a sorted array */
+    uint32_t count;     /**< members */
+    uint32_t size;      /**< allocated: ids in the array, or bitmap words */
+    uint32_t *data;
+};
+
+/* Forwards */
+static int idset_grow(IDSET *pset, uint32_t size);
+static int idset_append(IDSET *pset, uint32_t id);
+static int idset_find(IDSET *pset, uint32_t id, uint32_t *pindex);
+static int idset_to_bitmap(IDSET *pset);
+static int idset_to_array(IDSET *pset);
+static IDSET *idset_pack(IDSET *pset);
+static uint32_t idset_popcount(uint32_t word);
+
+/**
+ * make a new, empty set
+ *
+ * @returns the set, or NULL on malloc error
+ */
+IDSET *idset_new(void) {
+    IDSET *pset;
+
+    pset = (IDSET*)malloc(sizeof(IDSET));
+    if(pset)
+        memset(pset,0,sizeof(IDSET));
+
+    return pset;
+}
+
+/**
+ * make a copy of a set
+ *
+ * @param pset set to copy
+ * @returns the copy, or NULL on malloc error
+ */
+IDSET *idset_copy(IDSET *pset) {
+    IDSET *pnew;
+
+    if(!(pnew = idset_new()))
+        return NULL;
+
+    pnew->bitmap = pset->bitmap;
+    if(pset->size) {
+        if(!(pnew->data = (uint32_t*)malloc(pset->size * sizeof(uint32_t)))) {
+            free(pnew);
+            return NULL;
+        }
+        memcpy(pnew->data,pset->data,pset->size * sizeof(uint32_t));
+    }
+    pnew->size = pset->size;
+    pnew->count = pset->count;
+
+    return pnew;
+}
+
+void idset_free(IDSET *pset) {
+    if(!pset)
+        return;
+
+    if(pset->data)
+        free(pset->data);
+    free(pset);
+}
+
+/**
+ * empty out a set, giving back its memory
+ */
+void idset_clear(IDSET *pset) {
+    if(pset->data)
+        free(pset->data);
+    memset(pset,0,sizeof(IDSET));
+}
+
+/**
+ * make sure there is room for size ids (or bitmap words).  New
+ * bitmap words come back clear.
+ *
+ * @returns TRUE on success, FALSE on malloc error
+ */
+int idset_grow(IDSET *pset, uint32_t size) {
+    uint32_t *new_data;
+    uint32_t new_size;
+
+    if(size <= pset->size)
+        return TRUE;
+
+    new_size = pset->size ? pset->size : IDSET_MIN_SIZE;
+    while(new_size < size)
+        new_size *= 2;
+
+    new_data = (uint32_t*)realloc(pset->data, new_size * sizeof(uint32_t));
+    if(!new_data)
+        return FALSE;
+
+    if(pset->bitmap)
+        memset(&new_data[pset->size],0,(new_size - pset->size) * sizeof(uint32_t));
+
+    pset->data = new_data;
+    pset->size = new_size;
+    return TRUE;
+}
+
+/**
+ * tack an id onto the end of an array set.  It had better be
+ * bigger than anything already in there.
+ *
+ * @returns TRUE on success, FALSE on malloc error
+ */
+int idset_append(IDSET *pset, uint32_t id) {
+    if(!idset_grow(pset, pset->count + 1))
+        return FALSE;
+
+    pset->data[pset->count++] = id;
+    return TRUE;
+}
+
+/**
+ * binary search an array set
+ *
+ * @param pindex returns where the id is, or would go
+ * @returns TRUE if the id is there
+ */
+int idset_find(IDSET *pset, uint32_t id, uint32_t *pindex) {
+    uint32_t low = 0;
+    uint32_t high = pset->count;
+    uint32_t mid;
+
+    while(low < high) {
+        mid = low + (high - low) / 2;
+        if(pset->data[mid] < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    *pindex = low;
+    return ((low < pset->count) && (pset->data[low] == id));
+}
+
+/**
+ * switch an array set over to a bitmap
+ *
+ * @returns TRUE on success, FALSE on malloc error
+ */
+int idset_to_bitmap(IDSET *pset) {
+    uint32_t *pbits;
+    uint32_t words;
+    uint32_t index;
+
+    words = pset->count ? IDSET_WORD(pset->data[pset->count - 1]) + 1 : 0;
+    if(words < IDSET_MIN_SIZE)
+        words = IDSET_MIN_SIZE;
+
+    pbits = (uint32_t*)calloc(words, sizeof(uint32_t));
+    if(!pbits)
+        return FALSE;
+
+    for(index = 0; index < pset->count; index++)
+        pbits[IDSET_WORD(pset->data[index])] |= IDSET_BIT(pset->data[index]);
+
+    if(pset->data)
+        free(pset->data);
+    pset->data = pbits;
+    pset->size = words;
+    pset->bitmap = TRUE;
+    return TRUE;
+}
+
+/**
+ * switch a bitmap set over to an array
+ *
+ * @returns TRUE on success, FALSE on malloc error
+ */
+int idset_to_array(IDSET *pset) {
+    IDSET array;
+    uint32_t cursor = 0;
+    uint32_t id;
+
+    memset(&array,0,sizeof(IDSET));
+    if(!idset_grow(&array, pset->count))
+        return FALSE;
+
+    while((id = idset_next(pset, &cursor)))
+        array.data[array.count++] = id;
+
+    free(pset->data);
+    pset->data = array.data;
+    pset->size = array.size;
+    pset->bitmap = FALSE;
+    return TRUE;
+}
+
+/**
+ * put a set into whichever form is smaller.  An array goes to a
+ * bitmap as soon as the bitmap would be smaller, but a bitmap
+ * doesn't go back until the array would be half the size, so a set
+ * sitting on the line doesn't keep flipping.
+ *
+ * @returns the set, or NULL (having freed it) on malloc error
+ */
+IDSET *idset_pack(IDSET *pset) {
+    int result = TRUE;
+
+    if(!pset)
+        return NULL;
+
+    if((!pset->bitmap) && (IDSET_WANTS_BITMAP(pset)))
+        result = idset_to_bitmap(pset);
+    else if((pset->bitmap) && (pset->count * 2 < pset->size))
+        result = idset_to_array(pset);
+
+    if(!result) {
+        idset_free(pset);
+        return NULL;
+    }
+
+    return pset;
+}
+
+/**
+ * count the bits in a word
+ */
+uint32_t idset_popcount(uint32_t word) {
+    word = word - ((word >> 1) & 0x55555555);
+    word = (word & 0x33333333) + ((word >> 2) & 0x33333333);
+    return (((word + (word >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+/**
+ * add an id to a set
+ *
+ * @param pset set to add to
+ * @param id id to add (not 0)
+ * @returns 1 if it was added, 0 if it was already there, -1 on malloc error
+ */
+int idset_add(IDSET *pset, uint32_t id) {
+    uint32_t index;
+
+    if(!id)
+        return 0;
+
+    if(pset->bitmap) {
+        if(!idset_grow(pset, IDSET_WORD(id) + 1))
+            return -1;
+        if(pset->data[IDSET_WORD(id)] & IDSET_BIT(id))
+            return 0;
+        pset->data[IDSET_WORD(id)] |= IDSET_BIT(id);
+        pset->count++;
+        return 1;
+    }
+
+    /* songs mostly come in id order, so try the end first */
+    if((!pset->count) || (id > pset->data[pset->count - 1])) {
+        if(!idset_append(pset, id))
+            return -1;
+    } else {
+        if(idset_find(pset, id, &index))
+            return 0;
+        if(!idset_grow(pset, pset->count + 1))
+            return -1;
+        memmove(&pset->data[index + 1],&pset->data[index],
+                (pset->count - index) * sizeof(uint32_t));
+        pset->data[index] = id;
+        pset->count++;
+    }
+
+    if((IDSET_WANTS_BITMAP(pset)) && (!idset_to_bitmap(pset)))
+        return -1;
+
+    return 1;
+}
+
+/**
+ * take an id out of a set
+ *
+ * @param pset set to remove from
+ * @param id id to remove
+ * @returns TRUE if it was there
+ */
+int idset_del(IDSET *pset, uint32_t id) {
+    uint32_t index;
+
+    if(!idset_contains(pset, id))
+        return FALSE;
+
+    if(pset->bitmap) {
+        pset->data[IDSET_WORD(id)] &= ~IDSET_BIT(id);
+        pset->count--;
+        if(pset->count * 2 < pset->size)
+            idset_to_array(pset); /* stays a bitmap if this fails */
+        return TRUE;
+    }
+
+    idset_find(pset, id, &index);
+    memmove(&pset->data[index],&pset->data[index + 1],
+            (pset->count - index - 1) * sizeof(uint32_t));
+    pset->count--;
+    return TRUE;
+}
+
+/**
+ * see if an id is in a set
+ */
+int idset_contains(IDSET *pset, uint32_t id) {
+    uint32_t index;
+
+    if(pset->bitmap) {
+        if(IDSET_WORD(id) >= pset->size)
+            return FALSE;
+        return (pset->data[IDSET_WORD(id)] & IDSET_BIT(id)) ? TRUE : FALSE;
+    }
+
+    return idset_find(pset, id, &index);
+}
+
+uint32_t idset_count(IDSET *pset) {
+    return pset->count;
+}
+
+/**
+ * walk through a set in id order.  Start with *pcursor at 0, and
+ * don't change the set in the middle of a walk.
+ *
+ * @param pset set to walk
+ * @param pcursor where the walk is up to
+ * @returns the next id, or 0 at the end of the set
+ */
+uint32_t idset_next(IDSET *pset, uint32_t *pcursor) {
+    uint32_t word;
+    uint32_t bits;
+    uint32_t bit;
+
+    if(!pset->bitmap) {
+        if(*pcursor >= pset->count)
+            return 0;
+        return pset->data[(*pcursor)++];
+    }
+
+    word = *pcursor >> 5;
+    bit = *pcursor & 31;
+    while(word < pset->size) {
+        bits = pset->data[word] >> bit;
+        if(bits) {
+            while(!(bits & 1)) {
+                bits >>= 1;
+                bit++;
+            }
+            *pcursor = (word << 5) + bit + 1;
+            return (word << 5) + bit;
+        }
+        word++;
+        bit = 0;
+    }
+
+    *pcursor = pset->size << 5;
+    return 0;
+}
+
+/**
+ * how much memory a set is using
+ */
+uint32_t idset_bytes(IDSET *pset) {
+    return sizeof(IDSET) + pset->size * sizeof(uint32_t);
+}
+
+/**
+ * ids in both sets
+ *
+ * @returns a new set, or NULL on malloc error
+ */
+IDSET *idset_and(IDSET *pset1, IDSET *pset2) {
+    IDSET *presult;
+    IDSET *ptemp;
+    uint32_t cursor = 0;
+    uint32_t words;
+    uint32_t index;
+    uint32_t id;
+
+    if(!(presult = idset_new()))
+        return NULL;
+
+    if((pset1->bitmap) && (pset2->bitmap)) {
+        words = (pset1->size < pset2->size) ? pset1->size : pset2->size;
+        presult->bitmap = TRUE;
+        if(!idset_grow(presult, words)) {
+            idset_free(presult);
+            return NULL;
+        }
+        for(index = 0; index < words; index++) {
+            presult->data[index] = pset1->data[index] & pset2->data[index];
+            presult->count += idset_popcount(presult->data[index]);
+        }
+        return idset_pack(presult);
+    }
+
+    /* walk the array (or the smaller one), checking the other */
+    if((pset1->bitmap) ||
+       ((!pset2->bitmap) && (pset2->count < pset1->count))) {
+        ptemp = pset1;
+        pset1 = pset2;
+        pset2 = ptemp;
+    }
+
+    while((id = idset_next(pset1, &cursor))) {
+        if((idset_contains(pset2, id)) && (!idset_append(presult, id))) {
+            idset_free(presult);
+            return NULL;
+        }
+    }
+
+    return idset_pack(presult);
+}
+
+/**
+ * ids in either set
+ *
+ * @returns a new set, or NULL on malloc error
+ */
+IDSET *idset_or(IDSET *pset1, IDSET *pset2) {
+    IDSET *presult;
+    IDSET *ptemp;
+    uint32_t cursor1 = 0, cursor2 = 0;
+    uint32_t id1, id2;
+    uint32_t index;
+
+    if((!pset1->bitmap) && (!pset2->bitmap)) {
+        /* merge the two arrays */
+        if(!(presult = idset_new()))
+            return NULL;
+
+        id1 = idset_next(pset1, &cursor1);
+        id2 = idset_next(pset2, &cursor2);
+        while((id1) || (id2)) {
+            if((id2) && ((!id1) || (id2 < id1))) {
+                if(!idset_append(presult, id2))
+                    break;
+                id2 = idset_next(pset2, &cursor2);
+            } else {
+                if(!idset_append(presult, id1))
+                    break;
+                if(id1 == id2)
+                    id2 = idset_next(pset2, &cursor2);
+                id1 = idset_next(pset1, &cursor1);
+            }
+        }
+
+        if((id1) || (id2)) {
+            idset_free(presult);
+            return NULL;
+        }
+        return idset_pack(presult);
+    }
+
+    /* start from the bigger bitmap and add the other one in */
+    if((!pset1->bitmap) ||
+       ((pset2->bitmap) && (pset2->size > pset1->size))) {
+        ptemp = pset1;
+        pset1 = pset2;
+        pset2 = ptemp;
+    }
+
+    if(!(presult = idset_copy(pset1)))
+        return NULL;
+
+    if(pset2->bitmap) {
+        presult->count = 0;
+        for(index = 0; index < presult->size; index++) {
+            if(index < pset2->size)
+                presult->data[index] |= pset2->data[index];
+            presult->count += idset_popcount(presult->data[index]);
+        }
+    } else {
+        while((id2 = idset_next(pset2, &cursor2))) {
+            if(idset_add(presult, id2) < 0) {
+                idset_free(presult);
+                return NULL;
+            }
+        }
+    }
+
+    return idset_pack(presult);
+}
+
+/**
+ * ids in the first set but not the second
+ *
+ * @returns a new set, or NULL on malloc error
+ */
+IDSET *idset_andnot(IDSET *pset1, IDSET *pset2) {
+    IDSET *presult;
+    uint32_t cursor = 0;
+    uint32_t index;
+    uint32_t id;
+
+    if(!pset1->bitmap) {
+        if(!(presult = idset_new()))
+            return NULL;
+
+        while((id = idset_next(pset1, &cursor))) {
+            if((!idset_contains(pset2, id)) && (!idset_append(presult, id))) {
+                idset_free(presult);
+                return NULL;
+            }
+        }
+        return idset_pack(presult);
+    }
+
+    if(!(presult = idset_copy(pset1)))
+        return NULL;
+
+    if(pset2->bitmap) {
+        presult->count = 0;
+        for(index = 0; index < presult->size; index++) {
+            if(index < pset2->size)
+                presult->data[index] &= ~pset2->data[index];
+            presult->count += idset_popcount(presult->data[index]);
+        }
+    } else {
+        /* clear the bits directly, so nothing flips back to an
+         * array halfway through */
+        while((id = idset_next(pset2, &cursor))) {
+            if((IDSET_WORD(id) < presult->size) &&
+               (presult->data[IDSET_WORD(id)] & IDSET_BIT(id))) {
+                presult->data[IDSET_WORD(id)] &= ~IDSET_BIT(id);
+                presult->count--;
+            }
+        }
+    }
+
+    return idset_pack(presult);
+}
@@ -0,0 +1,43 @@
+/*
+ * $Id$
+ * compact sets of song ids
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _IDSET_H_
+#define _IDSET_H_
+
+typedef struct idset_t IDSET;
+
+extern IDSET *idset_new(void);
+extern IDSET *idset_copy(IDSET *pset);
+extern void idset_free(IDSET *pset);
+extern void idset_clear(IDSET *pset);
+
+extern int idset_add(IDSET *pset, uint32_t id);
+extern int idset_del(IDSET *pset, uint32_t id);
+extern int idset_contains(IDSET *pset, uint32_t id);
+extern uint32_t idset_count(IDSET *pset);
+extern uint32_t idset_next(IDSET *pset, uint32_t *pcursor);
+extern uint32_t idset_bytes(IDSET *pset);
+
+extern IDSET *idset_and(IDSET *pset1, IDSET *pset2);
+extern IDSET *idset_or(IDSET *pset1, IDSET *pset2);
+extern IDSET *idset_andnot(IDSET *pset1, IDSET *pset2);
+
+#endif /* _IDSET_H_ */
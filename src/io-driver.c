@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -19,6 +20,7 @@
 #endif
 
 #include "io.h"
+#include "io-plugin.h"
 
 struct testinfo {
     char *name;
@@ -33,6 +35,7 @@ int test_servefile(void);
 int test_udpserver(void);
 int test_udpclient(void);
 int test_buffer(void);
+int test_request_parse(void);
 
 struct testinfo tests[] = {
     { "Read file, showing block size [uri to read]", 1, 0, test_readfile },
@@ -40,7 +43,8 @@ struct testinfo tests[] = {
     { "Serve a file [listen://port] [uri to serve]", 2, 1, test_servefile },
     { "UDP echo server [udplisten://port]", 1, 0, test_udpserver },
     { "UDP echo client [udp://server:port]", 1, 0, test_udpclient },
-    { "Buffered line read [uri]", 1, 0, test_buffer }
+    { "Buffered line read [uri]", 1, 0, test_buffer },
+    { "Request parse syscall count [iterations]", 1, 0, test_request_parse }
 };
 
 int debuglevel=1;
@@ -268,6 +272,148 @@ int test_buffer(void) {
     return TRUE;
 }
 
+/*
+ * request parsing benchmark.  This wraps the read and waitable
+ * functions of a socket handle so we can count how many times a
+ * request parse actually goes to the kernel.
+ */
+static IO_FNPTR counted_fnptr;
+static IO_FNPTR *real_fnptr;
+static int counted_reads;
+static int counted_waits;
+
+static char *test_request =
+    "GET /databases/1/items?session-id=1234&revision-number=42&"
+    "meta=dmap.itemid,dmap.itemname,daap.songalbum,daap.songartist,"
+    "daap.songtime&type=music HTTP/1.1\r\n"
+    "Host: 192.168.1.10:3689\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-us, en;q=0.50\r\n"
+    "Accept-Encoding: gzip\r\n"
+    "Client-DAAP-Version: 3.0\r\n"
+    "Client-DAAP-Access-Index: 2\r\n"
+    "Client-DAAP-Validation: 3A1B7B4C0E9D6E5F4A3B2C1D0E9F8A7B\r\n"
+    "Client-DAAP-Request-ID: 7\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: iTunes/7.0 (Macintosh; N; PPC)\r\n"
+    "Viewer-Only-Client: 1\r\n"
+    "\r\n";
+
+int counted_read(IO_PRIVHANDLE *phandle, unsigned char *buf, uint32_t *len) {
+    counted_reads++;
+    return real_fnptr->fn_read(phandle, buf, len);
+}
+
+int counted_getwaitable(IO_PRIVHANDLE *phandle, int mode, WAITABLE_T *pw) {
+    counted_waits++;
+    return real_fnptr->fn_getwaitable(phandle, mode, pw);
+}
+
+/* parse one request and its headers, the way the webserver would */
+int request_parse(IOHANDLE ioh, int mode) {
+    unsigned char buffer[2048];
+    unsigned char *line;
+    uint32_t len, ms;
+    int lines=0;
+
+    do {
+        ms = 30000;
+        len = sizeof(buffer);
+        switch(mode) {
+        case 2:
+            if(!io_readline_slice(ioh,&line,&len,lines ? NULL : &ms))
+                return -1;
+            break;
+        default:
+            if(lines) {
+                if(!io_readline(ioh,buffer,&len))
+                    return -1;
+            } else {
+                if(!io_readline_timeout(ioh,buffer,&len,&ms))
+                    return -1;
+            }
+            /* strip the \n for the end-of-headers check */
+            len--;
+            line = buffer;
+            break;
+        }
+        if(!len)
+            return -1;
+        lines++;
+    } while(!((len == 1) && (line[0] == '\r')));
+
+    return lines;
+}
+
+int test_request_parse(void) {
+    char *modes[] = { "unbuffered", "buffered copy", "buffered slice" };
+    IOHANDLE ioh;
+    int fds[2];
+    int iterations, mode, current;
+    uint32_t len;
+    struct timeval start, end;
+    double elapsed;
+
+    iterations = atoi(files[0]);
+    if(iterations <= 0)
+        iterations = 1000;
+
+    for(mode = 0; mode < 3; mode++) {
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            return FALSE;
+        }
+
+        ioh = io_new();
+        if(!io_socket_attach(ioh,fds[0])) {
+            printf("Can't attach socket: %s\n",io_errstr(ioh));
+            return FALSE;
+        }
+
+        real_fnptr = ((IO_PRIVHANDLE*)ioh)->fnptr;
+        memcpy(&counted_fnptr,real_fnptr,sizeof(IO_FNPTR));
+        counted_fnptr.fn_read = counted_read;
+        counted_fnptr.fn_getwaitable = counted_getwaitable;
+        ((IO_PRIVHANDLE*)ioh)->fnptr = &counted_fnptr;
+
+        if(mode)
+            io_buffer(ioh);
+
+        counted_reads = counted_waits = 0;
+        elapsed = 0.0;
+
+        for(current = 0; current < iterations; current++) {
+            len = (uint32_t)strlen(test_request);
+            if(write(fds[1],test_request,len) != (ssize_t)len) {
+                perror("write");
+                return FALSE;
+            }
+
+            gettimeofday(&start,NULL);
+            if(request_parse(ioh,mode) < 0) {
+                printf("Parse error: %s\n",io_errstr(ioh));
+                return FALSE;
+            }
+            gettimeofday(&end,NULL);
+            elapsed += (end.tv_sec - start.tv_sec) * 1000000.0 +
+                (end.tv_usec - start.tv_usec);
+        }
+
+        printf("%-15s: %6.2f reads/req, %6.2f waits/req, %8.2f us/req\n",
+               modes[mode],
+               (double)counted_reads / iterations,
+               (double)counted_waits / iterations,
+               elapsed / iterations);
+
+        ((IO_PRIVHANDLE*)ioh)->fnptr = real_fnptr;
+        io_close(ioh);
+        io_dispose(ioh);
+        close(fds[1]);
+    }
+
+    return TRUE;
+}
+
 int test_readfile_timeout(void) {
     IOHANDLE ioh;
     unsigned char buffer[256];
@@ -98,7 +98,7 @@ int io_isproto(IO_PRIVHANDLE *phandle, char *proto);
 #define IO_WAIT_WRITE 2
 #define IO_WAIT_ERROR 4
 
-#define IO_BUFFER_SIZE 1024
+#define IO_BUFFER_SIZE 4096
 
 IO_WAITHANDLE *io_wait_new(void);
 int io_wait_add(IO_WAITHANDLE *pwait, IO_PRIVHANDLE *phandle, int type);
@@ -116,9 +116,14 @@ int io_size(IO_PRIVHANDLE *phandle, uint64_t *size);
 int io_setpos(IO_PRIVHANDLE *phandle, uint64_t offset, int whence);
 int io_getpos(IO_PRIVHANDLE *phandle, uint64_t *pos);
 int io_buffer(IO_PRIVHANDLE *phandle);
+uint32_t io_buffered(IO_PRIVHANDLE *phandle);
+int io_getfd(IO_PRIVHANDLE *phandle, FILE_T *pfd);
+int io_getsocket(IO_PRIVHANDLE *phandle, SOCKET_T *psock);
 int io_readline(IO_PRIVHANDLE *phandle, unsigned char *buf, uint32_t *len);
 int io_readline_timeout(IO_PRIVHANDLE *phandle, unsigned char *buf,
                       uint32_t *len, uint32_t *ms);
+int io_readline_slice(IO_PRIVHANDLE *phandle, unsigned char **line,
+                      uint32_t *len, uint32_t *ms);
 int io_allocline(IO_PRIVHANDLE *phandle, unsigned char **buf);
 int io_allocline_timeout(IO_PRIVHANDLE *phandle, unsigned char **buf, uint32_t *ms);
 
@@ -175,6 +180,8 @@ static int io_urldecode(char *); /**< do an in-place decode */
 static int io_option_add(IO_PRIVHANDLE *phandle, char *key, char *value);
 static int io_option_remove(IO_PRIVHANDLE *phandle, char *key);
 static int io_option_dispose(IO_PRIVHANDLE *phandle);
+static int io_wait_readable(IO_PRIVHANDLE *phandle, uint32_t *ms);
+static int io_buffer_fill(IO_PRIVHANDLE *phandle, uint32_t *ms);
 
 static void io_file_seterr(IO_PRIVHANDLE *phandle, ERR_T errcode);
 static void io_socket_seterr(IO_PRIVHANDLE *phandle, ERR_T errcode);
@@ -752,6 +759,8 @@ int io_close(IO_PRIVHANDLE *phandle) {
     }
 
     phandle->open = FALSE;
+    phandle->buffer_offset = 0;
+    phandle->buffer_len = 0;
     io_option_dispose(phandle);
     return result;
 }
@@ -773,8 +782,6 @@ int io_close(IO_PRIVHANDLE *phandle) {
  */
 int io_read_timeout(IO_PRIVHANDLE *phandle, unsigned char *buf, uint32_t *len,
                     uint32_t *ms) {
-    IO_WAITHANDLE *pwh;
-
     ASSERT(io_initialized);   /* call io_init first */
     ASSERT(phandle);
     ASSERT(phandle->open);
@@ -795,29 +802,92 @@ int io_read_timeout(IO_PRIVHANDLE *phandle, unsigned char *buf, uint32_t *len,
         return FALSE;
     }
 
-    if(ms) {
-        /* wait for handle to become readable */
-        pwh=io_wait_new();
-        if(!pwh) {
-            io_err(phandle,IO_E_INTERNAL);
+    /* no sense waiting if there is data in the read-ahead buffer */
+    if((ms) && (!io_buffered(phandle))) {
+        if(!io_wait_readable(phandle,ms)) {
+            *len = 0;
             return FALSE;
         }
+    }
 
-        io_wait_add(pwh,phandle,IO_WAIT_READ | IO_WAIT_ERROR);
-        if(!io_wait(pwh,ms)) {
-            io_wait_dispose(pwh);
-            io_err(phandle,IO_E_INTERNAL);
-            return FALSE;
-        }
+    return io_read(phandle,buf,len);
+}
+
+/**
+ * wait for an io device to become readable
+ *
+ * @param phandle handle of io device to wait on
+ * @param ms timeout in milliseconds
+ * @returns TRUE if readable, FALSE with ms=0 on timeout, or FALSE
+ *          on other kind of error
+ */
+int io_wait_readable(IO_PRIVHANDLE *phandle, uint32_t *ms) {
+    IO_WAITHANDLE *pwh;
+
+    pwh=io_wait_new();
+    if(!pwh) {
+        io_err(phandle,IO_E_INTERNAL);
+        return FALSE;
+    }
+
+    io_wait_add(pwh,phandle,IO_WAIT_READ | IO_WAIT_ERROR);
+    if(!io_wait(pwh,ms)) {
         io_wait_dispose(pwh);
+        io_err(phandle,IO_E_INTERNAL);
+        return FALSE;
+    }
+    io_wait_dispose(pwh);
+    return TRUE;
+}
+
+/**
+ * top up the read-ahead buffer with a single read from the underlying
+ * provider.  Whatever hasn't been consumed yet gets moved to the front
+ * of the buffer first, so there is always room for more unless the
+ * buffer is completely full of unconsumed data.
+ *
+ * @param phandle handle of (buffered) io device to fill
+ * @param ms timeout in milliseconds, or NULL to block
+ * @returns TRUE on success (with no new data on EOF), FALSE with ms=0
+ *          on timeout, or FALSE on other kind of error
+ */
+int io_buffer_fill(IO_PRIVHANDLE *phandle, uint32_t *ms) {
+    uint32_t avail;
+    uint32_t to_read;
+
+    avail = phandle->buffer_len - phandle->buffer_offset;
+    if((phandle->buffer_offset) && (avail)) {
+        memmove(phandle->buffer, &phandle->buffer[phandle->buffer_offset],
+                avail);
     }
+    phandle->buffer_offset = 0;
+    phandle->buffer_len = avail;
 
-    return io_read(phandle,buf,len);
+    if(avail == IO_BUFFER_SIZE) {
+        io_err(phandle,IO_E_BUFFER);
+        return FALSE;
+    }
+
+    if((ms) && (!io_wait_readable(phandle,ms)))
+        return FALSE;
+
+    to_read = IO_BUFFER_SIZE - avail;
+    if(!phandle->fnptr->fn_read(phandle,&phandle->buffer[avail],&to_read)) {
+        io_err(phandle,IO_E_OTHER);
+        return FALSE;
+    }
+
+    io_err_printf(IO_LOG_SPAM,"Buffered %d bytes\n",to_read);
+    phandle->buffer_len += to_read;
+    return TRUE;
 }
 
 
 /**
- * read from the io device, using the underlying provider
+ * read from the io device, using the underlying provider.  In
+ * buffering mode, this is satisfied from the read-ahead buffer if
+ * possible.  Either way, this makes at most one read from the provider,
+ * so like the underlying read, it can come up short.
  *
  * @param phandle handle of io device
  * @param buf buffer to read into
@@ -826,7 +896,6 @@ int io_read_timeout(IO_PRIVHANDLE *phandle, unsigned char *buf, uint32_t *len,
  */
 int io_read(IO_PRIVHANDLE *phandle, unsigned char *buf, uint32_t *len) {
     int result;
-    unsigned char *buf_ptr = buf;
     uint32_t read_size;
     uint32_t max_len = *len;
 
@@ -851,36 +920,32 @@ int io_read(IO_PRIVHANDLE *phandle, unsigned char *buf, uint32_t *len) {
     }
 
     /* check to see if we are in buffering mode */
-    if(phandle->buffering) {
-        *len = 0;
-        while(max_len) {
-            /* fill as much as possible from buffer */
-            if(phandle->buffer_offset < phandle->buffer_len) {
-                io_err_printf(IO_LOG_SPAM,"Fulfilling from buffer\n");
-                read_size = max_len;
-                if(read_size > (phandle->buffer_len - phandle->buffer_offset))
-                    read_size = phandle->buffer_len - phandle->buffer_offset;
-                memcpy((void*)buf_ptr,(void*)&phandle->buffer[phandle->buffer_offset], read_size);
-                *len += read_size;
-                max_len -= read_size;
-                buf_ptr += read_size;
-                phandle->buffer_offset += read_size;
-            } else {
-                /* read a new block */
-                io_err_printf(IO_LOG_SPAM,"reading new block\n");
-                phandle->buffer_len = IO_BUFFER_SIZE;
-                if(!phandle->fnptr->fn_read(phandle,phandle->buffer,&phandle->buffer_len)) {
-                    io_err(phandle,IO_E_OTHER);
-                    return FALSE;
-                }
-                phandle->buffer_offset = 0;
-                if(phandle->buffer_len == 0)
-                    return TRUE; /* can't read any more */
+    if((phandle->buffering) &&
+       ((phandle->buffer_offset < phandle->buffer_len) ||
+        (max_len < IO_BUFFER_SIZE))) {
+        if(phandle->buffer_offset >= phandle->buffer_len) {
+            io_err_printf(IO_LOG_SPAM,"reading new block\n");
+            if(!io_buffer_fill(phandle,NULL)) {
+                *len = 0;
+                return FALSE;
             }
         }
-        return TRUE; /* filled buffer */
+
+        io_err_printf(IO_LOG_SPAM,"Fulfilling from buffer\n");
+        read_size = phandle->buffer_len - phandle->buffer_offset;
+        if(read_size > max_len)
+            read_size = max_len;
+
+        memcpy((void*)buf,(void*)&phandle->buffer[phandle->buffer_offset],
+               read_size);
+        phandle->buffer_offset += read_size;
+        *len = read_size;
+        return TRUE;
     }
 
+    /* either unbuffered, or a big read with nothing buffered, in
+     * which case there is no sense bouncing it through the buffer */
+
     result = phandle->fnptr->fn_read(phandle,buf,len);
     if(!result)
         io_err(phandle,IO_E_OTHER);
@@ -909,6 +974,7 @@ int io_readline_timeout(IO_PRIVHANDLE *phandle, unsigned char *buf,
                       uint32_t *len, uint32_t *ms) {
     uint32_t numread = 0;
     uint32_t to_read;
+    unsigned char *eol;
     int ascii = 0;
     int esmall = 0;
     uint32_t total_to_read = *len-1;
@@ -922,6 +988,39 @@ int io_readline_timeout(IO_PRIVHANDLE *phandle, unsigned char *buf,
 
     io_err_printf(IO_LOG_SPAM,"entering readline_timeout\n");
 
+    if(phandle->buffering) {
+        while(numread < total_to_read) {
+            if(phandle->buffer_offset >= phandle->buffer_len) {
+                if(!io_buffer_fill(phandle,ms))
+                    return FALSE;
+
+                if(!phandle->buffer_len) { /* EOF */
+                    *len = numread;
+                    buf[numread] = '\0';
+                    return TRUE;
+                }
+            }
+
+            to_read = phandle->buffer_len - phandle->buffer_offset;
+            if(to_read > total_to_read - numread)
+                to_read = total_to_read - numread;
+
+            eol = memchr(&phandle->buffer[phandle->buffer_offset],'\n',to_read);
+            if(eol)
+                to_read = (uint32_t)(eol - &phandle->buffer[phandle->buffer_offset]) + 1;
+
+            memcpy(buf + numread,&phandle->buffer[phandle->buffer_offset],to_read);
+            phandle->buffer_offset += to_read;
+            numread += to_read;
+
+            if(eol) {
+                buf[numread] = '\0'; /* retain the CR */
+                *len = numread;
+                return TRUE;
+            }
+        }
+    }
+
     while(numread < total_to_read) {
         to_read = 1;
         if(io_read_timeout(phandle, buf + numread, &to_read, ms)) {
@@ -977,6 +1076,83 @@ int io_readline(IO_PRIVHANDLE *phandle, unsigned char *buf,
     return io_readline_timeout(phandle, buf, len, NULL);
 }
 
+/**
+ * read a line from an io device without copying it.  This returns a
+ * pointer to the line in the read-ahead buffer, with the trailing
+ * newline replaced by a NUL, so it can be used (and modified) in place
+ * as a C string.  The slice is only good until the next read on the
+ * device.  This turns on buffering for the device if it wasn't already.
+ *
+ * Lines longer than the read-ahead buffer fail with IO_E_BUFFER.  At
+ * EOF, whatever is left is returned as the last line, so a zero-length
+ * line with TRUE means there is nothing more to read.
+ *
+ * Pass NULL to ms to read without a timeout
+ *
+ * @param phandle handle of io device to read from
+ * @param line returns pointer to the start of the line
+ * @param len returns length of the line, not counting the newline
+ * @param ms timeout in milliseconds
+ * @returns TRUE on success, FALSE with ms=0 on timeout, or FALSE
+ *          on other kind of error
+ */
+int io_readline_slice(IO_PRIVHANDLE *phandle, unsigned char **line,
+                      uint32_t *len, uint32_t *ms) {
+    unsigned char *eol;
+    uint32_t scanned = 0;
+    uint32_t avail;
+
+    ASSERT(io_initialized);
+    ASSERT(phandle);
+    ASSERT(phandle->open);
+    ASSERT(phandle->fnptr);
+    ASSERT(phandle->fnptr->fn_read);
+
+    io_err_printf(IO_LOG_SPAM,"entering io_readline_slice\n");
+
+    *len = 0;
+    if((!phandle) || (!phandle->open) || (!phandle->fnptr)) {
+        io_err(phandle,IO_E_NOTINIT);
+        return FALSE;
+    }
+
+    if(!phandle->fnptr->fn_read) {
+        io_err(phandle,IO_E_BADFN);
+        return FALSE;
+    }
+
+    if(!phandle->buffering)
+        io_buffer(phandle);
+
+    while(1) {
+        avail = phandle->buffer_len - phandle->buffer_offset;
+        if(avail > scanned) {
+            eol = memchr(&phandle->buffer[phandle->buffer_offset + scanned],
+                         '\n', avail - scanned);
+            if(eol) {
+                *line = &phandle->buffer[phandle->buffer_offset];
+                *len = (uint32_t)(eol - *line);
+                *eol = '\0';
+                phandle->buffer_offset += *len + 1;
+                return TRUE;
+            }
+            scanned = avail;
+        }
+
+        /* don't have a whole line yet */
+        if(!io_buffer_fill(phandle,ms))
+            return FALSE;
+
+        if(phandle->buffer_len == avail) { /* EOF */
+            *line = phandle->buffer;
+            *len = avail;
+            phandle->buffer[avail] = '\0'; /* always room for this */
+            phandle->buffer_offset = phandle->buffer_len;
+            return TRUE;
+        }
+    }
+}
+
 /**
  * read a line from an io device, allocating as much space as necessary.
  *
@@ -1326,17 +1502,100 @@ int io_buffer(IO_PRIVHANDLE *phandle) {
     if(phandle->buffer)
         return TRUE;
 
-    phandle->buffer = (unsigned char*)malloc(IO_BUFFER_SIZE);
+    /* extra byte is so io_readline_slice can always terminate */
+    phandle->buffer = (unsigned char*)malloc(IO_BUFFER_SIZE + 1);
     if(!phandle->buffer) {
         io_err_printf(IO_LOG_FATAL,"Malloc error in io_buffer\n");
         exit(-1);
     }
 
+    phandle->buffer_offset = 0;
+    phandle->buffer_len = 0;
     phandle->buffering=1;
 
     return TRUE;
 }
 
+/**
+ * return how many bytes are sitting in the read-ahead buffer.  Data
+ * in the buffer won't show up as readable to select or epoll, so
+ * anyone waiting on the underlying device has to check this first.
+ *
+ * @param phandle device to check
+ * @returns number of bytes buffered and not yet consumed
+ */
+uint32_t io_buffered(IO_PRIVHANDLE *phandle) {
+    if((!phandle) || (!phandle->buffering))
+        return 0;
+
+    return phandle->buffer_len - phandle->buffer_offset;
+}
+
+/**
+ * get the native file descriptor for an io device.  This is only
+ * useful for file type devices, and is mostly to allow for
+ * platform-specific optimizations that the io layer doesn't know about.
+ *
+ * @param phandle device to get fd for
+ * @param pfd returns native file descriptor (if successful)
+ * @returns TRUE on success
+ */
+int io_getfd(IO_PRIVHANDLE *phandle, FILE_T *pfd) {
+    ASSERT(io_initialized);  /* call io_init first */
+    ASSERT(phandle);
+    ASSERT(phandle->open);
+    ASSERT(phandle->fnptr);
+
+    if((!phandle) || (!phandle->open) || (!phandle->fnptr)) {
+        io_err(phandle,IO_E_NOTINIT);
+        return FALSE;
+    }
+
+    if(!phandle->fnptr->fn_getfd) {
+        io_err(phandle,IO_E_BADFN);
+        return FALSE;
+    }
+
+    if(!phandle->fnptr->fn_getfd(phandle,pfd)) {
+        io_err(phandle,IO_E_OTHER);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * get the native socket for a socket type io device (socket, listen,
+ * udp, etc), so it can be handed to an event notification facility.
+ *
+ * @param phandle device to get socket for
+ * @param psock returns native socket (if successful)
+ * @returns TRUE on success
+ */
+int io_getsocket(IO_PRIVHANDLE *phandle, SOCKET_T *psock) {
+    ASSERT(io_initialized);  /* call io_init first */
+    ASSERT(phandle);
+    ASSERT(phandle->open);
+    ASSERT(phandle->fnptr);
+
+    if((!phandle) || (!phandle->open) || (!phandle->fnptr)) {
+        io_err(phandle,IO_E_NOTINIT);
+        return FALSE;
+    }
+
+    if(!phandle->fnptr->fn_getsocket) {
+        io_err(phandle,IO_E_BADFN);
+        return FALSE;
+    }
+
+    if(!phandle->fnptr->fn_getsocket(phandle,psock)) {
+        io_err(phandle,IO_E_OTHER);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 /**
  * return the current error string for an io device
  *
@@ -1388,6 +1647,8 @@ void io_dispose(IO_PRIVHANDLE *phandle) {
     io_option_dispose(phandle);
     if(phandle->err_str)
         free(phandle->err_str);
+    if(phandle->buffer)
+        free(phandle->buffer);
 
     free(phandle);
 }
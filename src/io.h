@@ -81,12 +81,17 @@ extern int io_printf(IOHANDLE io, char *fmt, ...);
 extern int io_size(IOHANDLE io, uint64_t *size);
 extern int io_setpos(IOHANDLE io, uint64_t offset, int whence);
 extern int io_getpos(IOHANDLE io, uint64_t *pos);
-extern int io_buffer(IOHANDLE io); /* unimplemented */
+extern int io_buffer(IOHANDLE io);
+extern uint32_t io_buffered(IOHANDLE io);
 extern int io_readline(IOHANDLE io, unsigned char *buf, uint32_t *len);
 extern int io_readline_timeout(IOHANDLE io, unsigned char *buf, uint32_t *len,
     uint32_t *ms);
+extern int io_readline_slice(IOHANDLE io, unsigned char **line, uint32_t *len,
+    uint32_t *ms);
 extern int io_allocline(IOHANDLE io, unsigned char **buf);
 extern int io_allocline_timeout(IOHANDLE io, unsigned char **buf, uint32_t *ms);
+extern int io_getfd(IOHANDLE io, FILE_T *pfd);
+extern int io_getsocket(IOHANDLE io, SOCKET_T *psock);
 
 extern char* io_errstr(IOHANDLE io);
 extern int io_errcode(IOHANDLE io);
@@ -85,6 +85,11 @@
 #include "webserver.h"
 #include "restart.h"
 #include "db.h"
+#include "dmap-cache.h"
+#include "ssc-cache.h"
+#include "ssc-pipe.h"
+#include "ssc-session.h"
+#include "monitor.h"
 #include "os.h"
 #include "plugin.h"
 #include "util.h"
@@ -288,6 +293,7 @@ int main(int argc, char *argv[]) {
     int start_time;
     int end_time;
     int rescan_counter=0;
+    int flush_counter=0;
     int old_song_count, song_count;
     int force_non_root=0;
     int skip_initial=1;
@@ -531,6 +537,10 @@ int main(int argc, char *argv[]) {
     if(db_init(reload)) {
         DPRINTF(E_FATAL,L_MAIN|L_DB,"Error in db_init: %s\n",strerror(errno));
     }
+    dmap_cache_init();
+    ssc_cache_init();
+    ssc_pipe_init();
+    ssc_session_init();
 
     err=db_get_song_count(&perr,&song_count);
     if(err != DB_E_SUCCESS) {
@@ -559,6 +569,7 @@ int main(int argc, char *argv[]) {
             }
             db_hint(DB_HINT_PRESCAN_END);
         }
+        monitor_init(mp3_dir_array);
         conf_dispose_array(mp3_dir_array);
     }
 
@@ -566,6 +577,8 @@ int main(int argc, char *argv[]) {
     web_root = conf_alloc_string("general","web_root",NULL);
     ws_config.web_root=web_root;
     ws_config.port=conf_get_int("general","port",0);
+    ws_config.worker_threads=conf_get_int("general","worker_threads",0);
+    ws_config.max_worker_threads=conf_get_int("general","max_worker_threads",0);
 
     DPRINTF(E_LOG,L_MAIN|L_WS,"Starting web server from %s on port %d\n",
             ws_config.web_root, ws_config.port);
@@ -584,6 +597,9 @@ int main(int argc, char *argv[]) {
     ws_registerhandler(config.server, "/",main_handler,main_auth,
                        0,1);
 
+    /* answer clients parked on /update when the db changes */
+    db_revision_callback(ws_release_held,config.server);
+
 #ifndef WITHOUT_MDNS
     if(config.use_mdns) { /* register services */
         servername = conf_get_servername();
@@ -637,7 +653,10 @@ int main(int argc, char *argv[]) {
         config.reload = 1; /* force a reload on start */
 
     while(!config.stop) {
-        if((conf_get_int("general","rescan_interval",0) &&
+        /* if the monitor is watching, it asks for a rescan when it
+         * needs one */
+        if((!monitor_running()) &&
+           (conf_get_int("general","rescan_interval",0) &&
             (rescan_counter > conf_get_int("general","rescan_interval",0)))) {
             if((conf_get_int("general","always_scan",0)) ||
                 (config_get_session_count())) {
@@ -672,8 +691,16 @@ int main(int argc, char *argv[]) {
                     time(NULL)-start_time);
         }
 
+        if((conf_get_int("general","playcount_flush",DB_PLAY_FLUSH_DEFAULT) > 0) &&
+           (flush_counter >= conf_get_int("general","playcount_flush",
+                                          DB_PLAY_FLUSH_DEFAULT))) {
+            db_playcount_flush();
+            flush_counter=0;
+        }
+
         os_wait(MAIN_SLEEP_INTERVAL);
         rescan_counter += MAIN_SLEEP_INTERVAL;
+        flush_counter += MAIN_SLEEP_INTERVAL;
     }
 
     DPRINTF(E_LOG,L_MAIN,"Stopping gracefully\n");
@@ -690,17 +717,27 @@ int main(int argc, char *argv[]) {
 #endif
 
 
-    /* Got to find a cleaner way to stop the web server.
-     * Closing the fd of the socking accepting doesn't necessarily
-     * cause the accept to fail on some libcs.
-     *
+    /* nothing to tell once the web server is gone */
+    db_revision_callback(NULL,NULL);
+
+#ifdef HAVE_SYS_EPOLL_H
+    /* The reactor can be woken up to stop.  Without it, got to find
+     * a cleaner way to stop the web server.  Closing the fd of the
+     * socket accepting doesn't necessarily cause the accept to fail
+     * on some libcs.
+     */
     DPRINTF(E_LOG,L_MAIN|L_WS,"Stopping web server\n");
     ws_stop(config.server);
-    */
+#endif
     free(web_root);
     conf_close();
 
+    DPRINTF(E_LOG,L_MAIN|L_SCAN,"Stopping file monitor\n");
+    monitor_deinit();
+
     DPRINTF(E_LOG,L_MAIN|L_DB,"Closing database\n");
+    dmap_cache_deinit();
+    ssc_cache_deinit();
     db_deinit();
 
     DPRINTF(E_LOG,L_MAIN,"Done!\n");
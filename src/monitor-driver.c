@@ -0,0 +1,290 @@
+/*
+ * $Id$
+ * Simple driver to check the file monitor without the overhead
+ * of all of mt-daapd
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * This watches a scratch directory, and makes the kernel drop events
+ * on it (IN_Q_OVERFLOW) by holding up the monitor in scan_update while
+ * more files are written than /proc/sys/fs/inotify/max_queued_events.
+ * A subdirectory is made while the events are being dropped, so the
+ * monitor never hears about it.  Once it has caught up, a file is
+ * written into that subdirectory, and the monitor has to hand it to
+ * scan_update, which it only does if it walked the directories for
+ * watches again after the overflow.
+ *
+ * The scratch directory is made under the given directory, and removed
+ * again when done.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "daapd.h"
+#include "conf.h"
+#include "err.h"
+#include "io.h"
+#include "monitor.h"
+#include "webserver.h"
+#include "xml-rpc.h"
+
+#define WAIT_SECONDS 30
+
+CONFIG config;
+
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+int scan_held = FALSE;      /**< scan_update waits while this is set */
+int scan_entered = FALSE;   /**< scan_update has been called */
+char *scan_target = NULL;   /**< path we're waiting to see updated */
+int scan_found = FALSE;     /**< scan_update got scan_target */
+
+/*
+ * conf.c can dump itself as xml for the web config pages, which
+ * drags in the whole webserver.  We never ask it to, so stub those out.
+ */
+XMLSTRUCT *xml_init(WS_CONNINFO *pwsc, int emit_header) { return NULL; }
+void xml_push(XMLSTRUCT *pxml, char *term) { }
+void xml_pop(XMLSTRUCT *pxml) { }
+void xml_output(XMLSTRUCT *pxml, char *section, char *fmt, ...) { }
+void xml_deinit(XMLSTRUCT *pxml) { }
+
+void driver_io_errhandler(int level, char *msg) {
+    DPRINTF(level,L_MAIN,"%s",msg);
+}
+
+/**
+ * stands in for the scanner.  This notes whether the path we're
+ * waiting for came through, and holds up the monitor thread while
+ * scan_held is set.
+ */
+int scan_update(char **patharray) {
+    int index;
+
+    pthread_mutex_lock(&scan_lock);
+    scan_entered = TRUE;
+    for(index = 0; patharray[index]; index++) {
+        DPRINTF(E_DBG,L_SCAN,"Update: %s\n",patharray[index]);
+        if((scan_target) && (!strcmp(patharray[index],scan_target)))
+            scan_found = TRUE;
+    }
+    pthread_cond_broadcast(&scan_cond);
+    while(scan_held)
+        pthread_cond_wait(&scan_cond,&scan_lock);
+    pthread_mutex_unlock(&scan_lock);
+
+    return 0;
+}
+
+void usage(int errorcode) {
+    fprintf(stderr,"Usage: monitor [options]\n\n");
+    fprintf(stderr,"options:\n\n");
+    fprintf(stderr,"  -c configfile    use specified config file (required)\n");
+    fprintf(stderr,"  -m dir           make the scratch directory in dir (default /tmp)\n");
+    fprintf(stderr,"  -d level         set debuglevel\n");
+    fprintf(stderr,"\n\n");
+    exit(errorcode);
+}
+
+/**
+ * write an empty file, which is what the monitor waits for
+ */
+int touch(char *path) {
+    int fd;
+
+    if((fd = open(path,O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        perror(path);
+        return FALSE;
+    }
+    close(fd);
+    return TRUE;
+}
+
+/**
+ * wait up to WAIT_SECONDS for a flag to get set
+ */
+int wait_for(volatile int *pflag) {
+    int tries;
+
+    for(tries = 0; tries < WAIT_SECONDS * 10; tries++) {
+        pthread_mutex_lock(&scan_lock);
+        if(*pflag) {
+            pthread_mutex_unlock(&scan_lock);
+            return TRUE;
+        }
+        pthread_mutex_unlock(&scan_lock);
+        usleep(100000);
+    }
+
+    return FALSE;
+}
+
+/**
+ * max_queued_events, or a guess at it
+ */
+int max_queued_events(void) {
+    FILE *fin;
+    int count = 16384;
+
+    if((fin = fopen("/proc/sys/fs/inotify/max_queued_events","r"))) {
+        if(fscanf(fin,"%d",&count) != 1)
+            count = 16384;
+        fclose(fin);
+    }
+
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    char *configfile = NULL;
+    char *parent = "/tmp";
+    char root[PATH_MAX];
+    char path[PATH_MAX];
+    char newdir[PATH_MAX];
+    char *patharray[2];
+    MONITOR_STATS stats;
+    int debuglevel = 0;
+    int files;
+    int index;
+    int result = 0;
+
+    while((option = getopt(argc, argv, "c:m:d:")) != -1) {
+        switch(option) {
+        case 'c':
+            configfile = optarg;
+            break;
+        case 'm':
+            parent = optarg;
+            break;
+        case 'd':
+            debuglevel = atoi(optarg);
+            break;
+        default:
+            usage(-1);
+            break;
+        }
+    }
+
+    if(!configfile)
+        usage(-1);
+
+    err_setdest(LOGDEST_STDERR);
+    io_init();
+    io_set_errhandler(driver_io_errhandler);
+    if(CONF_E_SUCCESS != conf_read(configfile)) {
+        fprintf(stderr,"Could not read config file %s\n",configfile);
+        exit(-1);
+    }
+
+    err_setlevel(debuglevel);
+
+    snprintf(root,sizeof(root),"%s/monitor-XXXXXX",parent);
+    if(!mkdtemp(root)) {
+        perror(root);
+        exit(-1);
+    }
+    snprintf(newdir,sizeof(newdir),"%s/new",root);
+
+    patharray[0] = root;
+    patharray[1] = NULL;
+    if(!monitor_init(patharray)) {
+        fprintf(stderr,"Can't watch %s\n",root);
+        rmdir(root);
+        exit(-1);
+    }
+
+    /* get the monitor stuck in scan_update */
+    scan_held = TRUE;
+    snprintf(path,sizeof(path),"%s/first.mp3",root);
+    if((!touch(path)) || (!wait_for(&scan_entered))) {
+        fprintf(stderr,"Monitor never saw %s\n",path);
+        result = -1;
+    }
+
+    /* two events a file, so this is twice what the queue holds, and
+     * the new directory comes after the queue is full */
+    files = max_queued_events();
+    for(index = 0; (!result) && (index < files); index++) {
+        snprintf(path,sizeof(path),"%s/flood-%d.mp3",root,index);
+        if(!touch(path))
+            result = -1;
+    }
+    if((!result) && (mkdir(newdir,0755) == -1)) {
+        perror(newdir);
+        result = -1;
+    }
+
+    pthread_mutex_lock(&scan_lock);
+    scan_held = FALSE;
+    pthread_cond_broadcast(&scan_cond);
+    pthread_mutex_unlock(&scan_lock);
+
+    if((!result) && (!wait_for(&config.reload))) {
+        fprintf(stderr,"Monitor never overflowed\n");
+        result = -1;
+    }
+
+    if(!result) {
+        snprintf(path,sizeof(path),"%s/song.mp3",newdir);
+        pthread_mutex_lock(&scan_lock);
+        scan_target = path;
+        pthread_mutex_unlock(&scan_lock);
+
+        if((!touch(path)) || (!wait_for(&scan_found))) {
+            fprintf(stderr,"Monitor never saw %s\n",path);
+            result = -1;
+        }
+    }
+
+    monitor_stats(&stats);
+    printf("monitor : %u watches, %u events, %u overflows, new directory %s\n",
+           stats.watches, stats.events, stats.overflows,
+           result ? "missed" : "picked up");
+
+    monitor_deinit();
+
+    /* clean up after ourselves */
+    snprintf(path,sizeof(path),"%s/song.mp3",newdir);
+    unlink(path);
+    rmdir(newdir);
+    for(index = 0; index < files; index++) {
+        snprintf(path,sizeof(path),"%s/flood-%d.mp3",root,index);
+        unlink(path);
+    }
+    snprintf(path,sizeof(path),"%s/first.mp3",root);
+    unlink(path);
+    rmdir(root);
+
+    conf_close();
+    io_deinit();
+    return result;
+}
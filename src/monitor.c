@@ -0,0 +1,618 @@
+/*
+ * $Id$
+ * watch the music directories for changes
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Rather than walking the whole library every rescan_interval, ask
+ * the kernel to tell us what changed (inotify, so linux only) and
+ * hand just those paths to the scanner.
+ *
+ * Changes tend to come in bursts -- an album being copied in, a
+ * tagger rewriting a directory -- so paths are collected until
+ * things have been quiet for scanning/watch_delay seconds, and then
+ * scanned all at once.  A path that changes ten times in a burst
+ * only gets scanned once.  The scanner looks at what's actually on
+ * disk when it gets there, so it doesn't matter what the events were.
+ *
+ * If the kernel drops events (IN_Q_OVERFLOW), there's no telling
+ * what we missed, so ask main for a full rescan, and walk the
+ * directories again for watches, as new ones may have come in.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#ifdef HAVE_DIRENT_H
+# include <dirent.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+#include "daapd.h"
+#include "conf.h"
+#include "err.h"
+#include "mp3-scanner.h"
+#include "monitor.h"
+#include "os.h"
+#include "redblack.h"
+#include "util.h"
+
+#ifndef TRUE
+#  define TRUE 1
+#  define FALSE 0
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define MONITOR_DEFAULT_DELAY 2  /**< seconds of quiet before scanning */
+#define MONITOR_MAX_WAIT      10 /**< scan anyway after this many delays */
+
+#define MONITOR_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct monitor_watch_t {
+    int wd;
+    char *path;
+} MONITOR_WATCH;
+
+/* Globals */
+static int monitor_fd = -1;
+static int monitor_started = FALSE;
+static int monitor_quit = FALSE;
+static int monitor_delay = MONITOR_DEFAULT_DELAY;
+static pthread_t monitor_tid;
+static pthread_mutex_t monitor_lock = PTHREAD_MUTEX_INITIALIZER; /**< for stats */
+static struct rbtree *monitor_watches = NULL; /**< directories, by wd */
+static struct rbtree *monitor_pending = NULL; /**< paths waiting for the scanner */
+static char **monitor_roots = NULL;           /**< resolved mp3_dirs */
+static MONITOR_STATS monitor_info;
+
+/* Forwards */
+static void *monitor_thread(void *arg);
+static int monitor_watch_compare(const void *p1, const void *p2, const void *arg);
+static int monitor_path_compare(const void *p1, const void *p2, const void *arg);
+static int monitor_add_tree(char *path);
+static void monitor_remove_tree(char *path);
+static void monitor_queue(char *path);
+static void monitor_flush(void);
+static void monitor_handle_event(struct inotify_event *pev);
+static void monitor_free_watches(void);
+static void monitor_rewatch(void);
+
+int monitor_watch_compare(const void *p1, const void *p2, const void *arg) {
+    int wd1 = ((MONITOR_WATCH*)p1)->wd;
+    int wd2 = ((MONITOR_WATCH*)p2)->wd;
+
+    if(wd1 < wd2)
+        return -1;
+    if(wd1 > wd2)
+        return 1;
+    return 0;
+}
+
+int monitor_path_compare(const void *p1, const void *p2, const void *arg) {
+    return strcmp((char*)p1, (char*)p2);
+}
+
+/**
+ * start watching the music directories.  This should be called
+ * after the initial scan, and if it returns FALSE, the periodic
+ * rescans are all there is.
+ *
+ * @param patharray the mp3_dir array
+ * @returns TRUE if the directories are being watched
+ */
+int monitor_init(char **patharray) {
+    char resolved_path[PATH_MAX];
+    int index = 0;
+    int count = 0;
+    int err;
+
+    if(!conf_get_int("scanning","watch",1))
+        return FALSE;
+
+    monitor_delay = conf_get_int("scanning","watch_delay",MONITOR_DEFAULT_DELAY);
+    if(monitor_delay < 1)
+        monitor_delay = 1;
+
+    memset(&monitor_info,0,sizeof(monitor_info));
+
+    monitor_fd = inotify_init();
+    if(monitor_fd == -1) {
+        DPRINTF(E_LOG,L_SCAN,"Can't watch for changes: %s\n",strerror(errno));
+        return FALSE;
+    }
+
+    monitor_watches = rbinit(monitor_watch_compare, NULL);
+    monitor_pending = rbinit(monitor_path_compare, NULL);
+    while(patharray[count])
+        count++;
+    monitor_roots = (char**)calloc(count + 1, sizeof(char*));
+    if((!monitor_watches) || (!monitor_pending) || (!monitor_roots))
+        DPRINTF(E_FATAL,L_SCAN,"Malloc error in monitor_init\n");
+
+    while(patharray[index] != NULL) {
+        realpath(patharray[index],resolved_path);
+        if(!(monitor_roots[index] = strdup(resolved_path)))
+            DPRINTF(E_FATAL,L_SCAN,"Malloc error in monitor_init\n");
+        if(!monitor_add_tree(resolved_path)) {
+            DPRINTF(E_LOG,L_SCAN,"Not enough inotify watches for %s "
+                    "(see /proc/sys/fs/inotify/max_user_watches)\n",
+                    patharray[index]);
+            monitor_deinit();
+            return FALSE;
+        }
+        index++;
+    }
+
+    monitor_quit = FALSE;
+    if((err=pthread_create(&monitor_tid,NULL,monitor_thread,NULL))) {
+        DPRINTF(E_LOG,L_SCAN,"Could not start file monitor: %s\n",
+                strerror(err));
+        monitor_deinit();
+        return FALSE;
+    }
+    monitor_started = TRUE;
+
+    DPRINTF(E_LOG,L_SCAN,"Watching %d directories for changes\n",
+            monitor_info.watches);
+    return TRUE;
+}
+
+/**
+ * stop watching
+ */
+void monitor_deinit(void) {
+    char *path;
+    int index;
+
+    if(monitor_started) {
+        monitor_quit = TRUE;
+        pthread_join(monitor_tid, NULL);
+        monitor_started = FALSE;
+    }
+
+    if(monitor_fd != -1) {
+        close(monitor_fd);
+        monitor_fd = -1;
+    }
+
+    if(monitor_watches) {
+        monitor_free_watches();
+        rbdestroy(monitor_watches);
+        monitor_watches = NULL;
+    }
+
+    if(monitor_pending) {
+        while((path = (char*)rblookup(RB_LUFIRST,NULL,monitor_pending))) {
+            rbdelete(path,monitor_pending);
+            free(path);
+        }
+        rbdestroy(monitor_pending);
+        monitor_pending = NULL;
+    }
+
+    if(monitor_roots) {
+        for(index = 0; monitor_roots[index]; index++)
+            free(monitor_roots[index]);
+        free(monitor_roots);
+        monitor_roots = NULL;
+    }
+}
+
+/**
+ * whether the directories are being watched, in which case
+ * there is no need for periodic rescans
+ */
+int monitor_running(void) {
+    return monitor_started;
+}
+
+/**
+ * get a snapshot of the monitor counters
+ *
+ * @param pstats struct to fill
+ */
+void monitor_stats(MONITOR_STATS *pstats) {
+    pthread_mutex_lock(&monitor_lock);
+    memcpy(pstats,&monitor_info,sizeof(MONITOR_STATS));
+    pthread_mutex_unlock(&monitor_lock);
+}
+
+/**
+ * forget all the watches, and stop watching, if we still are
+ */
+void monitor_free_watches(void) {
+    MONITOR_WATCH *pwatch;
+
+    while((pwatch = (MONITOR_WATCH*)rblookup(RB_LUFIRST,NULL,monitor_watches))) {
+        if(monitor_fd != -1)
+            inotify_rm_watch(monitor_fd, pwatch->wd);
+        rbdelete(pwatch,monitor_watches);
+        free(pwatch->path);
+        free(pwatch);
+    }
+
+    pthread_mutex_lock(&monitor_lock);
+    monitor_info.watches = 0;
+    pthread_mutex_unlock(&monitor_lock);
+}
+
+/**
+ * throw away the watches and walk the music directories for them
+ * again, after events got lost and we can't tell which directories
+ * came or went.  The watches thrown away still send IN_IGNORED, but
+ * by then nothing knows their wd, so they're dropped.
+ */
+void monitor_rewatch(void) {
+    int index;
+
+    monitor_free_watches();
+
+    for(index = 0; monitor_roots[index]; index++) {
+        if(!monitor_add_tree(monitor_roots[index]))
+            DPRINTF(E_LOG,L_SCAN,"Out of inotify watches, not all of %s "
+                    "will be watched\n",monitor_roots[index]);
+    }
+
+    DPRINTF(E_INF,L_SCAN,"Watching %d directories for changes\n",
+            monitor_info.watches);
+}
+
+/**
+ * watch a directory and everything under it.  The rules about
+ * what to skip are the same as scan_path's.
+ *
+ * @param path directory to watch (already resolved)
+ * @returns FALSE if we ran out of watches, TRUE otherwise
+ */
+int monitor_add_tree(char *path) {
+    MONITOR_WATCH *pwatch, *pold;
+    DIR *current_dir;
+    struct dirent *pde;
+    char relative_path[PATH_MAX];
+    char dir_path[PATH_MAX];
+    struct stat sb;
+    int follow_symlinks;
+    int wd;
+
+    wd = inotify_add_watch(monitor_fd, path, MONITOR_MASK);
+    if(wd == -1) {
+        DPRINTF(E_INF,L_SCAN,"Can't watch %s: %s\n",path,strerror(errno));
+        return (errno == ENOSPC) ? FALSE : TRUE;
+    }
+
+    pwatch = (MONITOR_WATCH*)malloc(sizeof(MONITOR_WATCH));
+    if(pwatch)
+        pwatch->path = strdup(path);
+    if((!pwatch) || (!pwatch->path))
+        DPRINTF(E_FATAL,L_SCAN,"Malloc error in monitor_add_tree\n");
+    pwatch->wd = wd;
+
+    /* same directory again (moved back in, say) gets the same wd */
+    pold = (MONITOR_WATCH*)rbfind((void*)pwatch,monitor_watches);
+    if(pold) {
+        free(pold->path);
+        pold->path = pwatch->path;
+        free(pwatch);
+    } else {
+        rbsearch((void*)pwatch,monitor_watches);
+        pthread_mutex_lock(&monitor_lock);
+        monitor_info.watches++;
+        pthread_mutex_unlock(&monitor_lock);
+    }
+
+    if((current_dir=opendir(path)) == NULL) {
+        DPRINTF(E_INF,L_SCAN,"opendir: %s\n",strerror(errno));
+        return TRUE;
+    }
+
+    follow_symlinks = conf_get_int("scanning","follow_symlinks",1);
+
+    while((pde = readdir(current_dir))) {
+        if(!strcmp(pde->d_name,".") || !strcmp(pde->d_name,".."))
+            continue;
+
+        if(conf_get_int("scanning","ignore_appledouble",1) &&
+           ((strcasecmp(pde->d_name,".AppleDouble") == 0) ||
+            (strcasecmp(pde->d_name,".AppleDesktop") == 0)))
+            continue;
+
+        if(conf_get_int("scanning","ignore_dotfiles",0) &&
+           pde->d_name[0] == '.')
+            continue;
+
+        snprintf(relative_path,PATH_MAX,"%s/%s",path,pde->d_name);
+        if(os_lstat(relative_path,&sb))
+            continue;
+        if(S_ISLNK(sb.st_mode) && !follow_symlinks)
+            continue;
+
+        dir_path[0] = '\0';
+        realpath(relative_path,dir_path);
+        if((os_stat(dir_path,&sb)) || (!S_ISDIR(sb.st_mode)))
+            continue;
+
+        if(!monitor_add_tree(dir_path)) {
+            closedir(current_dir);
+            return FALSE;
+        }
+    }
+
+    closedir(current_dir);
+    return TRUE;
+}
+
+/**
+ * stop watching a directory and everything under it, as when
+ * it gets moved away.
+ *
+ * @param path directory that's gone
+ */
+void monitor_remove_tree(char *path) {
+    MONITOR_WATCH *pwatch, *pnext;
+    int len;
+
+    len = (int)strlen(path);
+    pwatch = (MONITOR_WATCH*)rblookup(RB_LUFIRST,NULL,monitor_watches);
+    while(pwatch) {
+        pnext = (MONITOR_WATCH*)rblookup(RB_LUNEXT,(void*)pwatch,monitor_watches);
+        if((strncmp(pwatch->path,path,len) == 0) &&
+           ((pwatch->path[len] == '\0') || (pwatch->path[len] == '/'))) {
+            inotify_rm_watch(monitor_fd, pwatch->wd);
+            rbdelete(pwatch,monitor_watches);
+            free(pwatch->path);
+            free(pwatch);
+            pthread_mutex_lock(&monitor_lock);
+            monitor_info.watches--;
+            pthread_mutex_unlock(&monitor_lock);
+        }
+        pwatch = pnext;
+    }
+}
+
+/**
+ * note that a path needs looking at.  Multiple changes to the same
+ * path collapse into one.
+ *
+ * @param path path that changed
+ */
+void monitor_queue(char *path) {
+    char *pnew;
+
+    if(rbfind((void*)path,monitor_pending))
+        return;
+
+    pnew = strdup(path);
+    if((!pnew) || (!rbsearch((void*)pnew,monitor_pending)))
+        DPRINTF(E_FATAL,L_SCAN,"Malloc error in monitor_queue\n");
+}
+
+/**
+ * hand everything that's changed to the scanner
+ */
+void monitor_flush(void) {
+    char **patharray;
+    char *path;
+    int count = 0;
+    int index;
+
+    path = (char*)rblookup(RB_LUFIRST,NULL,monitor_pending);
+    while(path) {
+        count++;
+        path = (char*)rblookup(RB_LUNEXT,(void*)path,monitor_pending);
+    }
+
+    if(!count)
+        return;
+
+    patharray = (char**)malloc((count + 1) * sizeof(char*));
+    if(!patharray)
+        DPRINTF(E_FATAL,L_SCAN,"Malloc error in monitor_flush\n");
+
+    for(index = 0; index < count; index++) {
+        patharray[index] = (char*)rblookup(RB_LUFIRST,NULL,monitor_pending);
+        rbdelete(patharray[index],monitor_pending);
+    }
+    patharray[count] = NULL;
+
+    DPRINTF(E_INF,L_SCAN,"Updating %d changed paths\n",count);
+    scan_update(patharray);
+
+    pthread_mutex_lock(&monitor_lock);
+    monitor_info.updates += count;
+    pthread_mutex_unlock(&monitor_lock);
+
+    for(index = 0; index < count; index++)
+        free(patharray[index]);
+    free(patharray);
+}
+
+/**
+ * deal with one inotify event
+ *
+ * @param pev event to handle
+ */
+void monitor_handle_event(struct inotify_event *pev) {
+    MONITOR_WATCH key, *pwatch;
+    char path[PATH_MAX];
+    char *pending;
+
+    pthread_mutex_lock(&monitor_lock);
+    monitor_info.events++;
+    if(pev->mask & IN_Q_OVERFLOW)
+        monitor_info.overflows++;
+    pthread_mutex_unlock(&monitor_lock);
+
+    if(pev->mask & IN_Q_OVERFLOW) {
+        /* lost track.  Start over. */
+        DPRINTF(E_LOG,L_SCAN,"Too many changes to track, rescanning\n");
+        while((pending = (char*)rblookup(RB_LUFIRST,NULL,monitor_pending))) {
+            rbdelete(pending,monitor_pending);
+            free(pending);
+        }
+        monitor_rewatch();
+        config.reload = 1;
+        return;
+    }
+
+    key.wd = pev->wd;
+    pwatch = (MONITOR_WATCH*)rbfind((void*)&key,monitor_watches);
+    if(!pwatch)
+        return; /* already forgotten */
+
+    if(pev->mask & IN_IGNORED) {
+        /* directory is gone */
+        rbdelete(pwatch,monitor_watches);
+        free(pwatch->path);
+        free(pwatch);
+        pthread_mutex_lock(&monitor_lock);
+        monitor_info.watches--;
+        pthread_mutex_unlock(&monitor_lock);
+        return;
+    }
+
+    if(pev->mask & IN_MOVE_SELF) {
+        /* moved somewhere we might not be watching.  If it's somewhere
+         * we are, the parent will see it arrive */
+        snprintf(path,PATH_MAX,"%s",pwatch->path);
+        monitor_remove_tree(path);
+        monitor_queue(path);
+        return;
+    }
+
+    if(!pev->len)
+        return;
+
+    snprintf(path,PATH_MAX,"%s/%s",pwatch->path,pev->name);
+    DPRINTF(E_DBG,L_SCAN,"Change (%08x): %s\n",pev->mask,path);
+
+    if(pev->mask & IN_ISDIR) {
+        if(pev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            if(!monitor_add_tree(path))
+                DPRINTF(E_LOG,L_SCAN,"Out of inotify watches, %s "
+                        "won't be watched\n",path);
+        } else if(pev->mask & IN_MOVED_FROM) {
+            monitor_remove_tree(path);
+        }
+    } else if(pev->mask & IN_CREATE) {
+        return; /* wait for the close */
+    }
+
+    monitor_queue(path);
+}
+
+/**
+ * read events, and when they stop coming, scan what changed
+ */
+void *monitor_thread(void *arg) {
+    union {
+        struct inotify_event ev;
+        char buffer[8192];
+    } events;
+    struct inotify_event *pev;
+    struct timeval tv;
+    fd_set fds;
+    time_t now, first_event = 0, last_event = 0;
+    int len, offset;
+    int result;
+
+    while((!monitor_quit) && (!util_must_exit())) {
+        /* wake up once a second to check for quitting */
+        FD_ZERO(&fds);
+        FD_SET(monitor_fd,&fds);
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+
+        result = select(monitor_fd + 1, &fds, NULL, NULL, &tv);
+        if((result == -1) && (errno != EINTR)) {
+            DPRINTF(E_LOG,L_SCAN,"File monitor select: %s\n",strerror(errno));
+            break;
+        }
+
+        now = time(NULL);
+
+        if((result > 0) && (FD_ISSET(monitor_fd,&fds))) {
+            len = read(monitor_fd,events.buffer,sizeof(events.buffer));
+            if((len == -1) && (errno != EINTR) && (errno != EAGAIN)) {
+                DPRINTF(E_LOG,L_SCAN,"File monitor read: %s\n",strerror(errno));
+                break;
+            }
+
+            offset = 0;
+            while(offset < len) {
+                pev = (struct inotify_event*)&events.buffer[offset];
+                monitor_handle_event(pev);
+                offset += sizeof(struct inotify_event) + pev->len;
+            }
+
+            if(len > 0) {
+                if(!last_event)
+                    first_event = now;
+                last_event = now;
+            }
+        }
+
+        /* quiet for a bit, or too busy for too long */
+        if((last_event) &&
+           ((now - last_event >= monitor_delay) ||
+            (now - first_event >= monitor_delay * MONITOR_MAX_WAIT))) {
+            monitor_flush();
+            first_event = last_event = 0;
+        }
+    }
+
+    DPRINTF(E_DBG,L_SCAN,"File monitor exiting\n");
+    return NULL;
+}
+
+#else /* no inotify: rescan_interval it is */
+
+int monitor_init(char **patharray) {
+    return FALSE;
+}
+
+void monitor_deinit(void) {
+}
+
+int monitor_running(void) {
+    return FALSE;
+}
+
+void monitor_stats(MONITOR_STATS *pstats) {
+    memset(pstats,0,sizeof(MONITOR_STATS));
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
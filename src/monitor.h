@@ -0,0 +1,37 @@
+/*
+ * $Id$
+ * watch the music directories for changes
+ *
+ * Copyright (C) 2005 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _MONITOR_H_
+#define _MONITOR_H_
+
+typedef struct tag_monitor_stats {
+    uint32_t watches;       /**< directories being watched */
+    uint32_t events;        /**< filesystem events seen */
+    uint32_t updates;       /**< paths handed to the scanner */
+    uint32_t overflows;     /**< times we had to fall back to a full scan */
+} MONITOR_STATS;
+
+extern int monitor_init(char **patharray);
+extern void monitor_deinit(void);
+extern int monitor_running(void);
+extern void monitor_stats(MONITOR_STATS *pstats);
+
+#endif /* _MONITOR_H_ */
@@ -0,0 +1,17 @@
+# $Id$
+CC=gcc
+CFLAGS := $(CFLAGS) -g -DHAVE_CONFIG_H -I. -I.. -DERR_LEAN
+LDFLAGS := $(LDFLAGS) -lpthread
+TARGET = monitor
+OBJECTS=monitor-driver.o monitor.o redblack.o conf.o ll.o err.o util.o io.o \
+	os-unix.o compat.o bsd-snprintf.o
+
+$(TARGET):	$(OBJECTS)
+	$(CC) -o $(TARGET) $(OBJECTS) $(LDFLAGS)
+
+# os-unix wants the real syslog functions that ERR_LEAN stubs out
+os-unix.o:	os-unix.c
+	$(CC) $(filter-out -DERR_LEAN,$(CFLAGS)) -c -o $@ os-unix.c
+
+clean:
+	rm -f $(OBJECTS) $(TARGET)
@@ -29,6 +29,9 @@
 
 #include "includes.h"
 
+#include <pthread.h>
+#include <sys/time.h>
+
 #include "daapd.h"
 #include "conf.h"
 #include "db.h"
@@ -52,6 +55,42 @@ typedef struct {
 } TAGHANDLER;
 
 
+/*
+ * A full scan is done as a pipeline: the thread calling scan_init
+ * walks the tree and queues up the files that need scanning, a pool
+ * of workers reads the tags, and a single writer thread adds the
+ * results to the db.  The queues are bounded, so a slow stage holds
+ * up the ones in front of it rather than piling up memory.
+ */
+typedef struct tag_scan_job {
+    MP3FILE mp3file;
+    struct stat sb;
+    int is_compdir;
+    int result;                 /**< TRUE if the tags were read ok */
+    struct tag_scan_job *next;
+} SCAN_JOB;
+
+typedef struct tag_scan_queue {
+    SCAN_JOB *head;
+    SCAN_JOB *tail;
+    int count;
+    int max;
+    int producers;              /**< stages still feeding the queue */
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} SCAN_QUEUE;
+
+typedef struct tag_scan_stage {
+    uint32_t files;
+    uint32_t wait_ms;           /**< time spent blocked on a queue */
+    struct timeval done;
+} SCAN_STAGE;
+
+#define SCAN_DEFAULT_THREADS 4
+#define SCAN_DEFAULT_QUEUE   256
+#define SCAN_WRITE_BATCH     64  /**< max items the writer takes at once */
+
 #define MAYBEFREE(a) { if((a)) free((a)); };
 #ifndef S_ISDIR
 # define S_ISDIR(a) (((a) & S_IFMT) == S_IFDIR)
@@ -68,6 +107,19 @@ static int scan_path(char *path);
 static int scan_get_info(char *file, MP3FILE *pmp3);
 static int scan_freetags(MP3FILE *pmp3);
 static void scan_music_file(char *path, char *fname,struct stat *psb, int is_compdir);
+static void scan_music_setup(MP3FILE *pmp3, char *path, char *fname, struct stat *psb);
+static int scan_music_info(MP3FILE *pmp3, struct stat *psb, int is_compdir);
+
+static int scan_pipeline_start(void);
+static void scan_pipeline_finish(void);
+static void *scan_parse_thread(void *arg);
+static void *scan_write_thread(void *arg);
+static void scan_queue_init(SCAN_QUEUE *pq, int max, int producers);
+static void scan_queue_destroy(SCAN_QUEUE *pq);
+static void scan_queue_push(SCAN_QUEUE *pq, SCAN_JOB *pjob, uint32_t *wait_ms);
+static SCAN_JOB *scan_queue_pop(SCAN_QUEUE *pq, int max, uint32_t *wait_ms);
+static void scan_queue_close(SCAN_QUEUE *pq);
+static uint32_t scan_elapsed_ms(struct timeval *pstart, struct timeval *pend);
 
 static TAGHANDLER *scan_gethandler(char *type);
 
@@ -157,6 +209,19 @@ typedef struct tag_playlistlist {
 
 static PLAYLISTLIST scan_playlistlist = { NULL, NULL };
 
+/* pipeline state -- only touched with l_scan held */
+static int scan_pipeline_running = FALSE;
+static int scan_threads = 0;
+static pthread_t *scan_parse_tids = NULL;
+static pthread_t scan_write_tid;
+static SCAN_QUEUE scan_parse_queue;  /**< walker -> parsers */
+static SCAN_QUEUE scan_write_queue;  /**< parsers -> writer */
+static pthread_mutex_t scan_stage_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timeval scan_start;
+static SCAN_STAGE scan_walk_stage;
+static SCAN_STAGE scan_parse_stage;
+static SCAN_STAGE scan_write_stage;
+
 /**
  * add a playlist to the playlistlist.  The playlistlist is a
  * list of playlists that need to be processed once the current
@@ -257,6 +322,7 @@ int scan_init(char **patharray) {
 
     DPRINTF(E_DBG,L_SCAN,"Starting scan_init\n");
 
+    util_mutex_lock(l_scan);
     db_hint(DB_HINT_FULLSCAN_START);
 
     /*
@@ -268,6 +334,8 @@ int scan_init(char **patharray) {
 
     scan_playlistlist.next=NULL;
 
+    scan_pipeline_start();
+
     while((patharray[index] != NULL) && (!util_must_exit())) {
         DPRINTF(E_DBG,L_SCAN,"Scanning for MP3s in %s\n",patharray[index]);
         realpath(patharray[index],resolved_path);
@@ -275,10 +343,16 @@ int scan_init(char **patharray) {
         index++;
     }
 
+    /* everything has to be in the db before we go looking for
+     * things that disappeared */
+    scan_pipeline_finish();
+
     db_hint(DB_HINT_FULLSCAN_END);
 
-    if(util_must_exit()) // || db_end_song_scan())
+    if(util_must_exit()) { // || db_end_song_scan())
+        util_mutex_unlock(l_scan);
         return -1;
+    }
 
     if(!util_must_exit()) {
         DPRINTF(E_DBG,L_SCAN,"Processing playlists\n");
@@ -290,9 +364,344 @@ int scan_init(char **patharray) {
         return -1;
     */
 
+    util_mutex_unlock(l_scan);
     return err;
 }
 
+/**
+ * rescan just the paths that are known to have changed, rather
+ * than everything.  Paths that are gone get dropped from the db,
+ * directories get scanned recursively, and anything else gets
+ * scanned as a file.
+ *
+ * @param patharray NULL terminated list of paths to look at
+ * @returns 0 on success, -1 if we were asked to exit
+ */
+int scan_update(char **patharray) {
+    int index=0;
+    struct stat sb;
+
+    util_mutex_lock(l_scan);
+
+    while((patharray[index] != NULL) && (!util_must_exit())) {
+        if(os_stat(patharray[index],&sb)) {
+            DPRINTF(E_DBG,L_SCAN,"Gone: %s\n",patharray[index]);
+            db_del_path(NULL,patharray[index]);
+        } else if(S_ISDIR(sb.st_mode)) {
+            DPRINTF(E_DBG,L_SCAN,"Scanning directory %s\n",patharray[index]);
+            scan_path(patharray[index]);
+        } else {
+            scan_filename(patharray[index],SCAN_TEST_COMPDIR,NULL);
+        }
+        index++;
+    }
+
+    if((!util_must_exit()) && (scan_playlistlist.next))
+        scan_process_playlistlist();
+
+    util_mutex_unlock(l_scan);
+    return util_must_exit() ? -1 : 0;
+}
+
+/**
+ * get the number of milliseconds between two times
+ */
+uint32_t scan_elapsed_ms(struct timeval *pstart, struct timeval *pend) {
+    return (uint32_t)((pend->tv_sec - pstart->tv_sec) * 1000 +
+                      (pend->tv_usec - pstart->tv_usec) / 1000);
+}
+
+/**
+ * set up an empty job queue
+ *
+ * @param pq queue to initialize
+ * @param max how many jobs it can hold before pushes block
+ * @param producers how many threads will be pushing to it
+ */
+void scan_queue_init(SCAN_QUEUE *pq, int max, int producers) {
+    memset(pq,0,sizeof(SCAN_QUEUE));
+    pq->max = max;
+    pq->producers = producers;
+    pthread_mutex_init(&pq->lock,NULL);
+    pthread_cond_init(&pq->not_empty,NULL);
+    pthread_cond_init(&pq->not_full,NULL);
+}
+
+/**
+ * tear down a queue.  It should be empty by now.
+ */
+void scan_queue_destroy(SCAN_QUEUE *pq) {
+    pthread_mutex_destroy(&pq->lock);
+    pthread_cond_destroy(&pq->not_empty);
+    pthread_cond_destroy(&pq->not_full);
+}
+
+/**
+ * add a job to the tail of a queue, waiting for room if it's full
+ *
+ * @param pq queue to add to
+ * @param pjob job to add
+ * @param wait_ms incremented by however long we had to wait
+ */
+void scan_queue_push(SCAN_QUEUE *pq, SCAN_JOB *pjob, uint32_t *wait_ms) {
+    struct timeval start, end;
+
+    pjob->next = NULL;
+
+    pthread_mutex_lock(&pq->lock);
+    if(pq->count >= pq->max) {
+        gettimeofday(&start,NULL);
+        while(pq->count >= pq->max)
+            pthread_cond_wait(&pq->not_full,&pq->lock);
+        gettimeofday(&end,NULL);
+        *wait_ms += scan_elapsed_ms(&start,&end);
+    }
+
+    if(pq->tail)
+        pq->tail->next = pjob;
+    else
+        pq->head = pjob;
+    pq->tail = pjob;
+    pq->count++;
+
+    pthread_cond_signal(&pq->not_empty);
+    pthread_mutex_unlock(&pq->lock);
+}
+
+/**
+ * take up to max jobs off the head of a queue, waiting for some
+ * if it's empty.
+ *
+ * @param pq queue to take from
+ * @param max most jobs to take
+ * @param wait_ms incremented by however long we had to wait
+ * @returns list of jobs (linked through next), or NULL if the queue
+ *          is empty and nobody is going to add anything else
+ */
+SCAN_JOB *scan_queue_pop(SCAN_QUEUE *pq, int max, uint32_t *wait_ms) {
+    struct timeval start, end;
+    SCAN_JOB *phead, *plast;
+    int taken = 1;
+
+    pthread_mutex_lock(&pq->lock);
+    if((!pq->head) && (pq->producers)) {
+        gettimeofday(&start,NULL);
+        while((!pq->head) && (pq->producers))
+            pthread_cond_wait(&pq->not_empty,&pq->lock);
+        gettimeofday(&end,NULL);
+        *wait_ms += scan_elapsed_ms(&start,&end);
+    }
+
+    phead = pq->head;
+    if(phead) {
+        plast = phead;
+        while((taken < max) && (plast->next)) {
+            plast = plast->next;
+            taken++;
+        }
+        pq->head = plast->next;
+        if(!pq->head)
+            pq->tail = NULL;
+        plast->next = NULL;
+        pq->count -= taken;
+        pthread_cond_broadcast(&pq->not_full);
+    }
+
+    pthread_mutex_unlock(&pq->lock);
+    return phead;
+}
+
+/**
+ * note that one of the threads feeding a queue is done.  When the
+ * last one is, whoever is waiting on the queue gets woken up to
+ * drain it and quit.
+ */
+void scan_queue_close(SCAN_QUEUE *pq) {
+    pthread_mutex_lock(&pq->lock);
+    pq->producers--;
+    pthread_cond_broadcast(&pq->not_empty);
+    pthread_mutex_unlock(&pq->lock);
+}
+
+/**
+ * parser stage: read tags for the files the walker found
+ */
+void *scan_parse_thread(void *arg) {
+    SCAN_JOB *pjob;
+    uint32_t wait_ms = 0;
+    uint32_t files = 0;
+
+    while((pjob = scan_queue_pop(&scan_parse_queue,1,&wait_ms))) {
+        if(util_must_exit())
+            pjob->result = FALSE;
+        else
+            pjob->result = scan_music_info(&pjob->mp3file,&pjob->sb,
+                                           pjob->is_compdir);
+        files++;
+        scan_queue_push(&scan_write_queue,pjob,&wait_ms);
+    }
+
+    pthread_mutex_lock(&scan_stage_lock);
+    scan_parse_stage.files += files;
+    scan_parse_stage.wait_ms += wait_ms;
+    gettimeofday(&scan_parse_stage.done,NULL);
+    pthread_mutex_unlock(&scan_stage_lock);
+
+    scan_queue_close(&scan_write_queue);
+    return NULL;
+}
+
+/**
+ * writer stage: add parsed files to the db, a batch at a time
+ */
+void *scan_write_thread(void *arg) {
+    SCAN_JOB *pbatch, *pjob;
+    uint32_t wait_ms = 0;
+    uint32_t files = 0;
+
+    while((pbatch = scan_queue_pop(&scan_write_queue,SCAN_WRITE_BATCH,&wait_ms))) {
+        while(pbatch) {
+            pjob = pbatch;
+            pbatch = pjob->next;
+
+            if(pjob->result) {
+                /* FIXME: error handling */
+                db_add(NULL,&pjob->mp3file);
+                files++;
+            } else if(!util_must_exit()) {
+                DPRINTF(E_WARN,L_SCAN,"Skipping %s - scan failed\n",
+                        pjob->mp3file.path);
+            }
+
+            scan_freetags(&pjob->mp3file);
+            free(pjob);
+        }
+    }
+
+    scan_write_stage.files = files;
+    scan_write_stage.wait_ms = wait_ms;
+    gettimeofday(&scan_write_stage.done,NULL);
+    return NULL;
+}
+
+/**
+ * start up the parser and writer threads for a full scan.  If
+ * scanning/scan_threads is 0, or the threads can't be started,
+ * files get scanned inline, the way they always used to be.
+ *
+ * @returns TRUE if the pipeline is running
+ */
+int scan_pipeline_start(void) {
+    int depth;
+    int started;
+    int err;
+
+    scan_threads = conf_get_int("scanning","scan_threads",SCAN_DEFAULT_THREADS);
+    depth = conf_get_int("scanning","scan_queue",SCAN_DEFAULT_QUEUE);
+    if(depth < 1)
+        depth = 1;
+
+    if(scan_threads < 1)
+        return FALSE;
+
+    scan_parse_tids = (pthread_t*)malloc(scan_threads * sizeof(pthread_t));
+    if(!scan_parse_tids) {
+        DPRINTF(E_LOG,L_SCAN,"Malloc error starting scan pipeline\n");
+        return FALSE;
+    }
+
+    memset(&scan_walk_stage,0,sizeof(SCAN_STAGE));
+    memset(&scan_parse_stage,0,sizeof(SCAN_STAGE));
+    memset(&scan_write_stage,0,sizeof(SCAN_STAGE));
+    gettimeofday(&scan_start,NULL);
+
+    scan_queue_init(&scan_parse_queue,depth,1);
+    scan_queue_init(&scan_write_queue,depth,scan_threads);
+
+    if((err=pthread_create(&scan_write_tid,NULL,scan_write_thread,NULL))) {
+        DPRINTF(E_LOG,L_SCAN,"Could not start scan writer: %s\n",strerror(err));
+        scan_queue_destroy(&scan_parse_queue);
+        scan_queue_destroy(&scan_write_queue);
+        free(scan_parse_tids);
+        scan_parse_tids = NULL;
+        return FALSE;
+    }
+
+    for(started = 0; started < scan_threads; started++) {
+        if((err=pthread_create(&scan_parse_tids[started],NULL,
+                               scan_parse_thread,NULL))) {
+            DPRINTF(E_LOG,L_SCAN,"Could not start scan worker: %s\n",
+                    strerror(err));
+            break;
+        }
+    }
+
+    /* make do with however many we got -- the writer is still
+     * counting on the ones that didn't start */
+    while(scan_threads > started) {
+        scan_queue_close(&scan_write_queue);
+        scan_threads--;
+    }
+
+    if(!scan_threads) {
+        pthread_join(scan_write_tid,NULL);
+        scan_queue_destroy(&scan_parse_queue);
+        scan_queue_destroy(&scan_write_queue);
+        free(scan_parse_tids);
+        scan_parse_tids = NULL;
+        return FALSE;
+    }
+
+    DPRINTF(E_DBG,L_SCAN,"Scan pipeline: %d workers, queue depth %d\n",
+            scan_threads, depth);
+
+    scan_pipeline_running = TRUE;
+    return TRUE;
+}
+
+/**
+ * wait for the pipeline to drain, shut it down, and report how
+ * fast each stage went.  Does nothing if it isn't running.
+ */
+void scan_pipeline_finish(void) {
+    int index;
+    uint32_t walk_ms, parse_ms, write_ms;
+
+    if(!scan_pipeline_running)
+        return;
+
+    gettimeofday(&scan_walk_stage.done,NULL);
+    scan_queue_close(&scan_parse_queue);
+
+    for(index = 0; index < scan_threads; index++)
+        pthread_join(scan_parse_tids[index],NULL);
+    pthread_join(scan_write_tid,NULL);
+
+    scan_queue_destroy(&scan_parse_queue);
+    scan_queue_destroy(&scan_write_queue);
+    free(scan_parse_tids);
+    scan_parse_tids = NULL;
+    scan_pipeline_running = FALSE;
+
+    walk_ms = scan_elapsed_ms(&scan_start,&scan_walk_stage.done);
+    parse_ms = scan_elapsed_ms(&scan_start,&scan_parse_stage.done);
+    write_ms = scan_elapsed_ms(&scan_start,&scan_write_stage.done);
+
+    DPRINTF(E_LOG,L_SCAN,"Scan walk: %d files queued in %d ms (%d/sec), "
+            "%d ms blocked\n",scan_walk_stage.files,walk_ms,
+            walk_ms ? (int)(scan_walk_stage.files * 1000ULL / walk_ms) : 0,
+            scan_walk_stage.wait_ms);
+    DPRINTF(E_LOG,L_SCAN,"Scan parse: %d files in %d ms on %d workers "
+            "(%d/sec), %d ms idle\n",scan_parse_stage.files,parse_ms,
+            scan_threads,
+            parse_ms ? (int)(scan_parse_stage.files * 1000ULL / parse_ms) : 0,
+            scan_parse_stage.wait_ms);
+    DPRINTF(E_LOG,L_SCAN,"Scan write: %d files in %d ms (%d/sec), "
+            "%d ms idle\n",scan_write_stage.files,write_ms,
+            write_ms ? (int)(scan_write_stage.files * 1000ULL / write_ms) : 0,
+            scan_write_stage.wait_ms);
+}
+
 /**
  * check to see if a particular path is a complation path
  *
@@ -637,23 +1046,61 @@ void scan_filename(char *path, int compdir, char *extensions) {
 /*
  * scan_music_file
  *
- * scan a particular file as a music file
+ * scan a particular file as a music file.  During a full scan,
+ * this just hands the file off to the pipeline.
  */
 void scan_music_file(char *path, char *fname,
                      struct stat *psb, int is_compdir) {
     MP3FILE mp3file;
-    char *current=NULL;
-    char *type;
-    TAGHANDLER *ptaghandler;
-    char fdescr[50];
+    SCAN_JOB *pjob;
 
     /* we found an mp3 file */
     DPRINTF(E_INF,L_SCAN,"Found music file: %s\n",fname);
 
+    if(scan_pipeline_running) {
+        pjob = (SCAN_JOB*)calloc(1,sizeof(SCAN_JOB));
+        if(pjob) {
+            scan_music_setup(&pjob->mp3file,path,fname,psb);
+            memcpy(&pjob->sb,psb,sizeof(struct stat));
+            pjob->is_compdir = is_compdir;
+            scan_walk_stage.files++;
+            scan_queue_push(&scan_parse_queue,pjob,&scan_walk_stage.wait_ms);
+            return;
+        }
+        DPRINTF(E_LOG,L_SCAN,"Malloc error queueing %s\n",path);
+    }
+
     memset((void*)&mp3file,0,sizeof(mp3file));
-    mp3file.path=strdup(path);
-    mp3file.fname=strdup(fname);
-    mp3file.file_size = psb->st_size;
+    scan_music_setup(&mp3file,path,fname,psb);
+
+    if(scan_music_info(&mp3file,psb,is_compdir)) {
+        /* FIXME: error handling */
+        db_add(NULL,&mp3file);
+    } else {
+        DPRINTF(E_WARN,L_SCAN,"Skipping %s - scan failed\n",mp3file.path);
+    }
+
+    scan_freetags(&mp3file);
+}
+
+/**
+ * fill in what can be told about a music file from its name,
+ * without opening it
+ *
+ * @param pmp3 zeroed MP3FILE to fill in
+ * @param path full path of the file
+ * @param fname file name part of the path
+ * @param psb stat of the file
+ */
+void scan_music_setup(MP3FILE *pmp3, char *path, char *fname, struct stat *psb) {
+    char *current=NULL;
+    char *type;
+    TAGHANDLER *ptaghandler;
+    char fdescr[50];
+
+    pmp3->path=strdup(path);
+    pmp3->fname=strdup(fname);
+    pmp3->file_size = psb->st_size;
 
     if((fname) && (strlen(fname) > 1) && (fname[strlen(fname)-1] != '.')) {
         type = strrchr(fname, '.') + 1;
@@ -662,59 +1109,67 @@ void scan_music_file(char *path, char *fname,
             ptaghandler=scan_gethandler(type);
             if(ptaghandler) {
                 /* yup, use the official format */
-                mp3file.type=strdup(ptaghandler->type);
+                pmp3->type=strdup(ptaghandler->type);
                 if(ptaghandler->description)
-                    mp3file.description=strdup(ptaghandler->description);
+                    pmp3->description=strdup(ptaghandler->description);
 
                 if(ptaghandler->codectype)
-                    mp3file.codectype=strdup(ptaghandler->codectype);
+                    pmp3->codectype=strdup(ptaghandler->codectype);
 
-                DPRINTF(E_DBG,L_SCAN,"Codec type: %s\n",mp3file.codectype);
+                DPRINTF(E_DBG,L_SCAN,"Codec type: %s\n",pmp3->codectype);
             } else {
                 /* just dummy up songformat, codectype and description */
-                mp3file.type=strdup(type);
-                mp3file.codectype = strdup("unkn");
-                mp3file.song_length = 10 * 60 * 1000; /* 10 min */
+                pmp3->type=strdup(type);
+                pmp3->codectype = strdup("unkn");
+                pmp3->song_length = 10 * 60 * 1000; /* 10 min */
 
                 /* upper-case types cause some problems */
-                current=mp3file.type;
+                current=pmp3->type;
                 while(*current) {
                     *current=tolower(*current);
                     current++;
                 }
 
-                sprintf(fdescr,"%s audio file",mp3file.type);
-                mp3file.description = strdup(fdescr);
+                sprintf(fdescr,"%s audio file",pmp3->type);
+                pmp3->description = strdup(fdescr);
                 /* we'll just dodge the codectype */
             }
         }
     }
+}
 
+/**
+ * read the tags of a music file and finish filling it in.  This is
+ * the slow part of a scan, and doesn't touch the db, so the scan
+ * pipeline runs several of these at once.
+ *
+ * @param pmp3 MP3FILE from scan_music_setup
+ * @param psb stat of the file
+ * @param is_compdir whether the file is in a compilation dir
+ * @returns TRUE if the file should be added to the db
+ */
+int scan_music_info(MP3FILE *pmp3, struct stat *psb, int is_compdir) {
     /* Do the tag lookup here */
-    if(scan_get_info(mp3file.path,&mp3file)) {
-        if(is_compdir)
-            mp3file.compilation = 1;
-        make_composite_tags(&mp3file);
-        /* fill in the time_added.  I'm not sure of the logic in this.
-           My thinking is to use time created, but what is that?  Best
-           guess would be earliest of st_mtime and st_ctime...
-        */
-        mp3file.time_added=(int) psb->st_mtime;
-        if(psb->st_ctime < mp3file.time_added)
-            mp3file.time_added=(int) psb->st_ctime;
-        mp3file.time_modified=(int) psb->st_mtime;
-
-        DPRINTF(E_DBG,L_SCAN," Date Added: %d\n",mp3file.time_added);
-
-        DPRINTF(E_DBG,L_SCAN," Codec: %s\n",mp3file.codectype);
+    if(!scan_get_info(pmp3->path,pmp3))
+        return FALSE;
 
-        /* FIXME: error handling */
-        db_add(NULL,&mp3file);
-    } else {
-        DPRINTF(E_WARN,L_SCAN,"Skipping %s - scan failed\n",mp3file.path);
-    }
+    if(is_compdir)
+        pmp3->compilation = 1;
+    make_composite_tags(pmp3);
+    /* fill in the time_added.  I'm not sure of the logic in this.
+       My thinking is to use time created, but what is that?  Best
+       guess would be earliest of st_mtime and st_ctime...
+    */
+    pmp3->time_added=(int) psb->st_mtime;
+    if(psb->st_ctime < pmp3->time_added)
+        pmp3->time_added=(int) psb->st_ctime;
+    pmp3->time_modified=(int) psb->st_mtime;
 
-    scan_freetags(&mp3file);
+    DPRINTF(E_DBG,L_SCAN," Date Added: %d\n",pmp3->time_added);
+
+    DPRINTF(E_DBG,L_SCAN," Codec: %s\n",pmp3->codectype);
+
+    return TRUE;
 }
 
 /**
@@ -36,6 +36,7 @@ extern void scan_filename(char *path, int compdir, char *extensions);
 
 extern char *scan_winamp_genre[];
 extern int scan_init(char **patharray);
+extern int scan_update(char **patharray);
 extern void make_composite_tags(MP3FILE *song);
 
 #ifndef TRUE
@@ -6,22 +6,132 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "daapd.h"
 #include "conf.h"
 #include "db.h"
 #include "err.h"
+#include "io.h"
 #include "smart-parser.h"
+#include "webserver.h"
+#include "xml-rpc.h"
+
+#define BENCH_ITEMS     100000
+#define BENCH_PLAYLISTS 50
 
 CONFIG config;
 char *scan_winamp_genre[] = { NULL };
 
+/* conf.c wants these for the web config pages */
+XMLSTRUCT *xml_init(WS_CONNINFO *pwsc, int emit_header) { return NULL; }
+void xml_push(XMLSTRUCT *pxml, char *term) { }
+void xml_pop(XMLSTRUCT *pxml) { }
+void xml_output(XMLSTRUCT *pxml, char *section, char *fmt, ...) { }
+void xml_deinit(XMLSTRUCT *pxml) { }
+
+/* the kind of thing people actually make smart playlists out of */
+char *bench_phrases[] = {
+    "genre includes \"%s\"",
+    "artist startswith \"%s\"",
+    "album endswith \"%s\"",
+    "genre = \"%s\" and year > 1990",
+    "genre = \"%s\" or rating >= 80",
+    "(artist includes \"%s\" or album includes \"live\") and bitrate >= 192",
+    "time_added after 30 days before today and genre not includes \"%s\"",
+    "title includes \"%s\" and play_count > 2 and song_length < 300000",
+    "year >= 1970 and year < 1980 and genre includes \"%s\"",
+    "album_artist = \"%s\" or compilation = 1"
+};
+
+char *bench_words[] = { "rock", "jazz", "the", "ive", "pop", "folk" };
+char *bench_genres[] = { "Rock", "Jazz", "Classical", "Pop", "Electronic",
+                         "Folk", "Hip-Hop", "Blues" };
+
 void usage(void) {
-    printf("Usage:\n\n  parser [-t <type (0/1)>] [-d <debug level>] \"phrase\"\n\n");
+    printf("Usage:\n\n  parser [-t <type (0/1)>] [-d <debug level>] \"phrase\"\n");
+    printf("  parser -b [-d <debug level>]\n\n");
+    printf("  -b times %d smart playlists against %d songs\n\n",
+           BENCH_PLAYLISTS,BENCH_ITEMS);
     exit(0);
 }
 
+/**
+ * time a pile of smart playlists against a synthetic library, the
+ * way pl_advise_add does when a scan adds songs.  Roughly: 12 songs
+ * to an album, 8 albums to an artist.
+ */
+int bench(void) {
+    MEDIA_NATIVE *pmn;
+    PARSETREE pt[BENCH_PLAYLISTS];
+    char phrase[256];
+    char buffer[64];
+    struct timeval start, end;
+    double ms;
+    int item, pl;
+    int matches = 0;
+    time_t now = time(NULL);
+
+    pmn = (MEDIA_NATIVE*)calloc(BENCH_ITEMS,sizeof(MEDIA_NATIVE));
+    if(!pmn) {
+        fprintf(stderr,"Malloc error\n");
+        return -1;
+    }
+
+    for(item = 0; item < BENCH_ITEMS; item++) {
+        pmn[item].id = item + 1;
+        sprintf(buffer,"Song %d",item);
+        pmn[item].title = strdup(buffer);
+        sprintf(buffer,"The Artist %d",item / 96);
+        pmn[item].artist = strdup(buffer);
+        pmn[item].album_artist = strdup(buffer);
+        sprintf(buffer,"Album %d%s",item / 12,(item / 12) % 5 ? "" : " (Live)");
+        pmn[item].album = strdup(buffer);
+        pmn[item].genre = strdup(bench_genres[(item / 96) % 8]);
+        pmn[item].year = 1960 + (item / 12) % 50;
+        pmn[item].rating = (item * 7) % 101;
+        pmn[item].bitrate = (item % 3) ? 192 : 128;
+        pmn[item].play_count = item % 5;
+        pmn[item].song_length = 120000 + (item % 240) * 1000;
+        pmn[item].time_added = (uint32_t)(now - (item % 90) * 86400);
+        pmn[item].compilation = ((item / 12) % 17) == 0;
+    }
+
+    for(pl = 0; pl < BENCH_PLAYLISTS; pl++) {
+        snprintf(phrase,sizeof(phrase),
+                 bench_phrases[pl % (sizeof(bench_phrases) / sizeof(char*))],
+                 bench_words[pl % (sizeof(bench_words) / sizeof(char*))]);
+        pt[pl] = sp_init();
+        if(!sp_parse(pt[pl],phrase,SP_TYPE_PLAYLIST)) {
+            fprintf(stderr,"%s: %s\n",phrase,sp_get_error(pt[pl]));
+            return -1;
+        }
+    }
+
+    gettimeofday(&start,NULL);
+    for(item = 0; item < BENCH_ITEMS; item++) {
+        for(pl = 0; pl < BENCH_PLAYLISTS; pl++) {
+            if(sp_matches_native(pt[pl],&pmn[item]))
+                matches++;
+        }
+    }
+    gettimeofday(&end,NULL);
+
+    ms = (end.tv_sec - start.tv_sec) * 1000.0 +
+        (end.tv_usec - start.tv_usec) / 1000.0;
+
+    printf("%d playlists x %d songs: %.1f ms, %.1f ns per match, %d matches\n",
+           BENCH_PLAYLISTS, BENCH_ITEMS, ms,
+           ms * 1000000.0 / ((double)BENCH_ITEMS * BENCH_PLAYLISTS), matches);
+
+    for(pl = 0; pl < BENCH_PLAYLISTS; pl++)
+        sp_dispose(pt[pl]);
+
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     int option;
     int type=0;
@@ -33,9 +143,13 @@ int main(int argc, char *argv[]) {
     int size;
     int err;
     char *perr;
+    int benchmark=0;
 
-    while((option = getopt(argc, argv, "d:t:c:")) != -1) {
+    while((option = getopt(argc, argv, "bd:t:c:")) != -1) {
         switch(option) {
+        case 'b':
+            benchmark = 1;
+            break;
         case 'c':
             configfile = optarg;
             break;
@@ -53,6 +167,15 @@ int main(int argc, char *argv[]) {
 
     //    err_setdebugmask("parse");
 
+    if(benchmark) {
+        if(debuglevel) {
+            err_setlevel(debuglevel);
+            err_setdest(LOGDEST_STDERR);
+        }
+        return bench();
+    }
+
+    io_init();
     if(conf_read(configfile) != CONF_E_SUCCESS) {
         fprintf(stderr,"could not read config file: %s\n",configfile);
         exit(1);
@@ -82,7 +205,11 @@ int main(int argc, char *argv[]) {
     if(!sp_parse(pt,argv[optind],type)) {
         printf("%s\n",sp_get_error(pt));
     } else {
+#ifdef HAVE_SQL
         printf("SQL: %s\n",sp_sql_clause(pt));
+#else
+        printf("Parsed ok\n");
+#endif
     }
 
     sp_dispose(pt);
@@ -1,9 +1,18 @@
+# $Id$
 CC=gcc
-CFLAGS := $(CFLAGS) -g -I/opt/local/include -DHAVE_CONFIG_H -I. -I.. -Wall -DHAVE_SQL -no-cpp-precomp -DMAC -DHOST='"argh"'
-LDFLAGS := $(LDFLAGS) -L/opt/local/lib -lsqlite -lsqlite3 -lm -framework CoreFoundation
+CFLAGS := $(CFLAGS) -g -DHAVE_CONFIG_H -I. -I.. -DERR_LEAN
+LDFLAGS := $(LDFLAGS) -lsqlite3 -lpthread
 TARGET=parser
-OBJECTS=parser-driver.o smart-parser.o err.o db-sql.o db-generic.o db-sql-sqlite3.o db-sql-sqlite2.o conf.o ll.o xml-rpc.o webserver.o uici.o os-unix.o restart.o configfile.o rend-win32.o plugin.o db-sql-updates.o dispatch.o dynamic-art.o scan-aac.o
+OBJECTS=parser-driver.o smart-parser.o db.o db-index.o db-mem.o \
+	db-sql-sqlite3.o db-sql-updates.o playlists.o idset.o redblack.o conf.o \
+	ll.o err.o util.o io.o os-unix.o compat.o bsd-snprintf.o
 
 $(TARGET):	$(OBJECTS)
-	$(CC) -o $(TARGET) $(LDFLAGS) $(OBJECTS)
+	$(CC) -o $(TARGET) $(OBJECTS) $(LDFLAGS)
 
+# os-unix wants the real syslog functions that ERR_LEAN stubs out
+os-unix.o:	os-unix.c
+	$(CC) $(filter-out -DERR_LEAN,$(CFLAGS)) -c -o $@ os-unix.c
+
+clean:
+	rm -f $(OBJECTS) $(TARGET)
@@ -24,13 +24,14 @@
 #include "conf.h"
 #include "daapd.h"
 #include "db.h"
+#include "db-index.h"
 #include "err.h"
 #include "smart-parser.h"
 #include "ff-dbstruct.h"
 #include "ff-plugins.h"
+#include "idset.h"
 #include "os.h"
 #include "playlists.h"
-#include "redblack.h"
 #include "util.h"
 
 #define PL_NO_DUPS 1
@@ -42,24 +43,39 @@ typedef struct sortorder_t {
     struct sororder_t *next;
 } SORTORDER;
 
+/*
+ * a frozen copy of a playlist's items.  Enumerations walk one of
+ * these rather than the playlist itself, so they don't need the db
+ * lock once they have it, and writers can go on changing the
+ * playlist.  A change just drops the playlist's copy; the next
+ * enumeration to come along makes a new one.
+ */
+typedef struct pl_snapshot_t {
+    int refcount;            /**< the playlist holds one while current */
+    IDSET *pids;
+} PL_SNAPSHOT;
+
 typedef struct playlist_t {
     PLAYLIST_NATIVE *ppln;
     PARSETREE pt;            /**< Only valid for smart playlists */
     struct playlist_t *next;
-    struct rbtree *prb;
+    IDSET *pids;             /**< song ids in the playlist */
+    PL_SNAPSHOT *psnap;      /**< current items, or NULL if stale */
 } PLAYLIST;
 
 struct plenumhandle_t {
-    PLAYLIST *ppl;
-    int nextop;  /* unused? */
-    RBLIST *rblist;
+    PL_SNAPSHOT *psnap;      /**< items being walked */
+    PLAYLIST_NATIVE *plists; /**< copies of the visible playlists */
+    int count;               /**< playlists in plists */
+    uint32_t pos;            /**< next item (idset cursor) or playlist */
     void *last_value;
 };
 
 #define MAYBEFREE(a) if((a)) free((a))
 
 /** Globals */
-static PLAYLIST pl_list = { NULL, NULL, NULL, NULL };
+static PLAYLIST pl_list = { NULL, NULL, NULL, NULL, NULL };
+static int pl_fullscan = FALSE;  /**< smart playlists get rebuilt after */
 uint64_t pl_id = 1;     // First playlist to be created will be the library
 char *pl_error_list[] = {
     "Success",
@@ -83,8 +99,12 @@ static void pl_save(PLAYLIST *ppl);
 static void pl_set_error(char **pe, int error, ...);
 static void pl_purge(PLAYLIST *ppl);
 static int pl_add_playlist_item_nolock(char **pe, PLAYLIST *ppl, uint32_t songid);
+static int pl_insert_item(char **pe, PLAYLIST *ppl, uint32_t songid);
+static int pl_update_smart_list(char **pe, PLAYLIST **pplaylists, int count);
 static int pl_contains_item(uint32_t pl_id, uint32_t song_id);
-static int pl_compare(const void *v1, const void *v2, const void *vso);
+static PL_SNAPSHOT *pl_snapshot_get(PLAYLIST *ppl);
+static void pl_snapshot_release(PL_SNAPSHOT *psnap);
+static void pl_snapshot_stale(PLAYLIST *ppl);
 
 /* here's a nice hack... */
 MEDIA_NATIVE *db_fetch_item_nolock(char **pe, int id);
@@ -122,9 +142,11 @@ int pl_load(char *filename) {
     memset(ppln,0,sizeof(PLAYLIST_NATIVE));
     memset(ppl,0,sizeof(PLAYLIST));
 
-    ppl->prb = rbinit(pl_compare,NULL);
+    ppl->pids = idset_new();
     ppl->ppln = ppln;
 
+    if(!ppl->pids) DPRINTF(E_FATAL,L_PL,"malloc error in pl_load\n");
+
     // load up the file...
     while(io_allocline(handle, &line) && line) {
         DPRINTF(E_DBG,L_PL,"Loaded line: %s",line);
@@ -149,7 +171,8 @@ int pl_load(char *filename) {
             } else if(strcasecmp((char*)line,"idx") == 0) {
                 ppl->ppln->idx = util_atoui32(sep);
             }
-        } else {
+        } else if(!(ppl->ppln->type & PL_DYNAMIC)) {
+            /* smart playlists get rebuilt once they're all loaded */
             if((id = util_atoui32((char*)line))) {
                 // must be an id?
                 pl_add_playlist_item_nolock(NULL, ppl, id);
@@ -190,8 +213,7 @@ int pl_load(char *filename) {
         }
 
         if(ppl) {
-            /* walk the tree... */
-            rbdestroy(ppl->prb);
+            idset_free(ppl->pids);
             free(ppl);
         }
     }
@@ -206,8 +228,7 @@ void pl_save(PLAYLIST *ppl) {
     char *ppath;
     char *pcache_dir;
     IOHANDLE handle;
-    RBLIST *rblist;
-    uint32_t *pid;
+    uint32_t cursor = 0;
     uint32_t song_id;
 
     if(ppln->id == 1) // don't bother saving the library playlist
@@ -238,14 +259,8 @@ void pl_save(PLAYLIST *ppl) {
 
                 io_printf(handle,"\n# Item list\n\n");
 
-                rblist = rbopenlist(ppl->prb);
-                if(rblist) {
-                    while(NULL != (pid = (uint32_t*)rbreadlist(rblist))) {
-                        song_id = *pid;
-                        io_printf(handle,"%u\n",song_id);
-                    }
-                    rbcloselist(rblist);
-                }
+                while((song_id = idset_next(ppl->pids, &cursor)))
+                    io_printf(handle,"%u\n",song_id);
             } else {
                 DPRINTF(E_LOG,L_PL,"Can't write playlist: %s\n",ppath);
             }
@@ -278,106 +293,186 @@ void pl_set_error(char **pe, int error, ...) {
 }
 
 /**
- * Compare to MP3 items, returning (as is typical) < 0 if p1 < p2,
- * 0 if they are identical, or > 1 if p1 > p2, based on the sort
- * criteria specified
+ * populate/refresh a smart playlist by bulk scan on the database
+ *
+ * NOTE: this assumes the playlist lock is held.
  *
- * @param p1 first mp3 file to compare
- * @param p2 second mp3 file to compare
- * @param ps criteria for sorting
- * @returns < 0 if p1 < p2, 0 if p1 == p2, and > 0 if p1 > p2
+ * @param pe error buffer
+ * @param ppl smart playlist to refresh
+ * @returns PL_E_SUCCESS on success, error code otherwise
+ */
+int pl_update_smart(char **pe, PLAYLIST *ppl) {
+    ASSERT((ppl) && (ppl->ppln) && (ppl->ppln->type & PL_DYNAMIC));
+
+    if((!ppl) || (!ppl->ppln) || (!(ppl->ppln->type & PL_DYNAMIC)))
+        return DB_E_SUCCESS; /* ?? */
+
+    return pl_update_smart_list(pe, &ppl, 1);
+}
+
+/**
+ * populate/refresh every smart playlist in one pass over the library.
+ *
+ * NOTE: this assumes the playlist lock is held.
+ *
+ * @param pe error buffer
+ * @returns PL_E_SUCCESS on success, error code otherwise
  */
-int pl_compare(const void *v1, const void *v2, const void *vso) {
-    SORTORDER *ps = (SORTORDER *)vso;
-    int id1 = *((int*)v1);
-    int id2 = *((int*)v2);
-    MEDIA_NATIVE *p1;
-    MEDIA_NATIVE *p2;
+int pl_update_smart_all(char **pe) {
+    PLAYLIST *ppl;
+    PLAYLIST **pplaylists;
+    int count = 0;
     int result;
 
-    if(!ps) { /* unspecified sort order */
-        /* return in id order */
-        if(id1 < id2)
-            return -1;
-        if(id1 > id2)
-            return 1;
-        return 0;
+    for(ppl = pl_list.next; ppl; ppl = ppl->next) {
+        if(ppl->ppln->type & PL_DYNAMIC)
+            count++;
     }
 
-    /* FIXME: look these things up from a LRU cache based on tree depth */
-    p1 = db_fetch_item(NULL, id1);
-    if(!p1) {
-        DPRINTF(E_LOG,L_PL,"DANGER: pl_compare: null item fetch\n");
-        return 0;
+    if(!count)
+        return PL_E_SUCCESS;
+
+    pplaylists = (PLAYLIST **)malloc(count * sizeof(PLAYLIST *));
+    if(!pplaylists) {
+        pl_set_error(pe,PL_E_MALLOC);
+        return PL_E_MALLOC;
     }
 
-    p2 = db_fetch_item(NULL, id2);
-    if(!p2) {
-        DPRINTF(E_LOG,L_PL,"DANGER: pl_compare: null item fetch\n");
-        db_dispose_item(p1);
-        return 0;
+    count = 0;
+    for(ppl = pl_list.next; ppl; ppl = ppl->next) {
+        if(ppl->ppln->type & PL_DYNAMIC)
+            pplaylists[count++] = ppl;
     }
 
-    db_dispose_item(p1);
-    db_dispose_item(p2);
+    result = pl_update_smart_list(pe, pplaylists, count);
+    free(pplaylists);
 
+    DPRINTF(E_INF,L_PL,"Updated %d smart playlists\n",count);
     return result;
 }
 
-
 /**
- * populate/refresh a smart playlist by bulk scan on the database
+ * refresh a set of smart playlists.  Whatever the indexes can answer
+ * goes straight in.  The rest is done by walking the songs the
+ * indexes aren't sure of once, checking each against all of the
+ * playlists that need it, so refreshing a pile of playlists costs
+ * at most one fetch per song rather than one per song per playlist.
  *
  * NOTE: this assumes the playlist lock is held.
  *
- * @param
+ * @param pe error buffer
+ * @param pplaylists array of smart playlists to refresh
+ * @param count number of playlists in pplaylists
+ * @returns PL_E_SUCCESS on success, error code otherwise
  */
-int pl_update_smart(char **pe, PLAYLIST *ppl) {
+int pl_update_smart_list(char **pe, PLAYLIST **pplaylists, int count) {
     MEDIA_NATIVE *pmn;
-    int err;
+    int err = PL_E_SUCCESS;
+    int index;
     uint32_t song_id;
-    uint32_t *pid;
+    uint32_t cursor = 0;
     char *e_db;
     PLAYLIST *plibrary;
-    RBLIST *rblist;
-
-    ASSERT((ppl) && (ppl->ppln) && (ppl->ppln->type & PL_DYNAMIC));
-
-    if((!ppl) || (!ppl->ppln) || (!(ppl->ppln->type & PL_DYNAMIC)))
-        return DB_E_SUCCESS; /* ?? */
+    IDSET **ppcheck;
+    IDSET *pyes, *pmaybe, *pnew;
+    IDSET *pwalk = NULL;
 
-    pl_purge(ppl);
+    for(index = 0; index < count; index++)
+        pl_purge(pplaylists[index]);
 
     plibrary = pl_find(1);
     if(!plibrary)
         return PL_E_SUCCESS;
 
-    rblist = rbopenlist(plibrary->prb);
-    if(!rblist)
-        return PL_E_SUCCESS;
+    ppcheck = (IDSET **)calloc(count, sizeof(IDSET *));
+    if(!ppcheck) {
+        pl_set_error(pe,PL_E_MALLOC);
+        return PL_E_MALLOC;
+    }
+
+    /* the songs each playlist needs checked, NULL for all of them */
+    for(index = 0; index < count; index++) {
+        if(!db_index_plan(pplaylists[index]->pt, &pyes, &pmaybe))
+            continue;
+
+        pnew = idset_and(plibrary->pids, pyes);
+        ppcheck[index] = idset_andnot(pmaybe, pyes);
+        idset_free(pyes);
+        idset_free(pmaybe);
+
+        if((!pnew) || (!ppcheck[index])) {
+            /* just check them all, then */
+            idset_free(pnew);
+            idset_free(ppcheck[index]);
+            ppcheck[index] = NULL;
+            continue;
+        }
+
+        idset_free(pplaylists[index]->pids);
+        pplaylists[index]->pids = pnew;
+        pplaylists[index]->ppln->items = idset_count(pnew);
+        pl_snapshot_stale(pplaylists[index]);
+    }
+
+    /* walk the songs any of them need checked */
+    for(index = 0; index < count; index++) {
+        if(!ppcheck[index])
+            break;
+        pnew = pwalk ? idset_or(pwalk, ppcheck[index]) : idset_copy(ppcheck[index]);
+        idset_free(pwalk);
+        if(!(pwalk = pnew))
+            break;
+    }
+
+    if(index < count) {
+        idset_free(pwalk);
+        pwalk = NULL;
+    }
+
+    while((song_id = idset_next(pwalk ? pwalk : plibrary->pids, &cursor))) {
+        if((pwalk) && (!idset_contains(plibrary->pids, song_id)))
+            continue;
 
-    while(NULL != (pid = (uint32_t*)rbreadlist(rblist))) {
-        song_id = *pid;
         pmn = db_fetch_item_nolock(&e_db, song_id);
         if(!pmn) {
-            rbcloselist(rblist);
             pl_set_error(pe,PL_E_DBERROR,e_db);
             free(e_db);
-            return PL_E_DBERROR;
+            err = PL_E_DBERROR;
+            break;
         }
 
-        if(sp_matches_native(ppl->pt, pmn)) {
-            if(PL_E_SUCCESS != (err = pl_add_playlist_item(pe, ppl->ppln->id, song_id))) {
+        for(index = 0; index < count; index++) {
+            if((ppcheck[index]) && (!idset_contains(ppcheck[index], song_id)))
+                continue;
+
+            if(!sp_matches_native(pplaylists[index]->pt, pmn))
+                continue;
+
+            /* we already know the song is good, so skip the fetch */
+            if(PL_E_SUCCESS != (err = pl_insert_item(pe, pplaylists[index], song_id))) {
                 DPRINTF(E_DBG,L_PL,"can't add item to playlist\n");
-                rbcloselist(rblist);
-                return err;
+                break;
             }
         }
+
+        db_dispose_item(pmn);
+        if(err != PL_E_SUCCESS)
+            break;
     }
 
-    rbcloselist(rblist);
+    for(index = 0; index < count; index++)
+        idset_free(ppcheck[index]);
+    free(ppcheck);
+    idset_free(pwalk);
+
+    if(err != PL_E_SUCCESS)
+        return err;
+
+    for(index = 0; index < count; index++) {
+        DPRINTF(E_DBG,L_PL,"Updated smart playlist %s: items: %d\n",
+                pplaylists[index]->ppln->title,pplaylists[index]->ppln->items);
+    }
 
-    DPRINTF(E_DBG,L_PL,"Updated smart playlist: items: %d\n",ppl->ppln->items);
     return PL_E_SUCCESS;
 }
 
@@ -468,15 +563,14 @@ int pl_add_playlist(char **pe, char *name, int type, char *query, char *path, in
         return PL_E_MALLOC;
     }
 
-    /* FIXME: Add the right comparison info for this playlist */
-    pnew->prb = rbinit(pl_compare,NULL);
-    if(!pnew->prb) {
+    pnew->pids = idset_new();
+    if(!pnew->pids) {
         if(pnew) free(pnew);
         if(ppln) free(ppln);
         if(pt) sp_dispose(pt);
         //util_mutex_unlock(l_pl);
-        pl_set_error(pe,PL_E_RBTREE);
-        return PL_E_RBTREE;
+        pl_set_error(pe,PL_E_MALLOC);
+        return PL_E_MALLOC;
     }
 
     memset(ppln, 0, sizeof(PLAYLIST_NATIVE));
@@ -500,6 +594,7 @@ int pl_add_playlist(char **pe, char *name, int type, char *query, char *path, in
 
     pnew->ppln = ppln;
     pnew->pt = pt;
+    pnew->psnap = NULL;
 
     /* run to the bottom of the pl_list */
     pcurrent = &pl_list;
@@ -516,6 +611,10 @@ int pl_add_playlist(char **pe, char *name, int type, char *query, char *path, in
             free(e_db);
             sp_dispose(pt);
             pcurrent->next = NULL;
+            idset_free(pnew->pids);
+            if(ppln->title) free(ppln->title);
+            if(ppln->query) free(ppln->query);
+            free(ppln);
             free(pnew);
             //util_mutex_unlock(l_pl);
             return PL_E_DBERROR;
@@ -532,33 +631,23 @@ int pl_add_playlist(char **pe, char *name, int type, char *query, char *path, in
 
 /**
  * delete all the entries from a playlist.  This
- * leaves the redblack tree, just purges the data
+ * leaves the id set, just purges the data
  * from it.  This assumes that the playlist lock is held
  *
  * @param ppl playlist to purge entries from
  */
 void pl_purge(PLAYLIST *ppl) {
-    const void *ptr;
-    uint32_t id;
-    uint32_t *pid;
-
-    ASSERT(ppl && ppl->prb);
+    ASSERT(ppl && ppl->pids);
 
-    if((!ppl) || (!ppl->prb))
+    if((!ppl) || (!ppl->pids))
         return;
 
     DPRINTF(E_DBG,L_PL,"Purging playlist %s\n",ppl->ppln->title);
 
-    ptr = rblookup(RB_LUFIRST,NULL,ppl->prb);
-    while(ptr) {
-        id = *(uint32_t*)ptr;
-        pid = (uint32_t*)rbdelete((void*)&id,ppl->prb);
-        if(pid)
-            free(pid);
-        ptr = rblookup(RB_LUFIRST,NULL,ppl->prb);
-    }
+    idset_clear(ppl->pids);
 
     ppl->ppln->items = 0;
+    pl_snapshot_stale(ppl);
 }
 
 /**
@@ -613,8 +702,6 @@ int pl_add_playlist_item(char **pe, uint32_t playlistid, uint32_t songid) {
 int pl_add_playlist_item_nolock(char **pe, PLAYLIST *ppl, uint32_t songid) {
     /* find the playlist */
     MEDIA_NATIVE *pmn;
-    uint32_t *pid;
-    const void *val;
 
     /* make sure it's a valid song id */
     /* FIXME: replace this with a db_exists type function */
@@ -627,26 +714,76 @@ int pl_add_playlist_item_nolock(char **pe, PLAYLIST *ppl, uint32_t songid) {
 
     db_dispose_item(pmn);
 
-    /* okay, it's valid, so let's add it */
-    if(!ppl->prb)
-        DPRINTF(E_FATAL,L_PL,"redblack tree not present in playlist\n");
+    return pl_insert_item(pe, ppl, songid);
+}
 
-    pid = (uint32_t *)malloc(sizeof(uint32_t));
-    if(!pid) {
-        pl_set_error(pe,PL_E_MALLOC);
-        return PL_E_MALLOC;
+/**
+ * add a whole batch of songs to a playlist at once, without
+ * checking that they exist.  This is for loading the library at
+ * startup, when the ids have just come out of the db.
+ *
+ * @param pe error buffer
+ * @param playlistid playlist to add to
+ * @param songids ids to add
+ * @param count number of ids in songids
+ * @returns PL_E_SUCCESS on success, error code otherwise
+ */
+int pl_add_playlist_items(char **pe, uint32_t playlistid, uint32_t *songids, int count) {
+    PLAYLIST *ppl;
+    int added = 0;
+    int index;
+    int result;
+
+    ppl = pl_find(playlistid);
+    if(NULL == ppl) {
+        pl_set_error(pe,PL_E_NOTFOUND,playlistid);
+        return PL_E_NOTFOUND;
+    }
+
+    for(index = 0; index < count; index++) {
+        result = idset_add(ppl->pids, songids[index]);
+        if(result < 0) {
+            pl_set_error(pe,PL_E_MALLOC);
+            return PL_E_MALLOC;
+        }
+        added += result;
     }
 
-    *pid = songid;
+    if(added) {
+        ppl->ppln->items += added;
+        pl_snapshot_stale(ppl);
+    }
+    DPRINTF(E_DBG,L_PL,"New playlist size: %d\n",ppl->ppln->items);
 
-    val = rbsearch((const void*)pid, ppl->prb);
-    if(!val) {
-        DPRINTF(E_FATAL,L_SCAN,"redblack tree insert error\n");
-        pl_set_error(pe,PL_E_RBTREE);
-        return PL_E_RBTREE;
+    return PL_E_SUCCESS;
+}
+
+/**
+ * put a song id into a playlist, without checking that the
+ * song exists.
+ *
+ * @param pe error buffer
+ * @param ppl playlist to add to
+ * @param songid song to add
+ * @returns PL_E_SUCCESS on success, error code otherwise
+ */
+int pl_insert_item(char **pe, PLAYLIST *ppl, uint32_t songid) {
+    int result;
+
+    if(!ppl->pids)
+        DPRINTF(E_FATAL,L_PL,"id set not present in playlist\n");
+
+    result = idset_add(ppl->pids, songid);
+    if(result < 0) {
+        pl_set_error(pe,PL_E_MALLOC);
+        return PL_E_MALLOC;
     }
 
+    if(!result) /* already there */
+        return PL_E_SUCCESS;
+
     ppl->ppln->items++;
+    pl_snapshot_stale(ppl);
     DPRINTF(E_DBG,L_PL,"New playlist size: %d\n",ppl->ppln->items);
 
     return PL_E_SUCCESS;
@@ -764,7 +901,8 @@ int pl_delete_playlist(char **pe, uint32_t playlistid) {
 
     free(ppl->ppln);
     if(ppl->pt) sp_dispose(ppl->pt);
-    if(ppl->prb) rbdestroy(ppl->prb);
+    if(ppl->pids) idset_free(ppl->pids);
+    pl_snapshot_stale(ppl);
 
     ppl_prev->next = ppl->next;
     free(ppl);
@@ -782,7 +920,6 @@ int pl_delete_playlist(char **pe, uint32_t playlistid) {
  * @returns PL_E_SUCCESS on success, error code & pe filled on failure
  */
 int pl_delete_playlist_item(char **pe, uint32_t playlistid, uint32_t songid) {
-    uint32_t *pid;
     PLAYLIST *ppl;
 
     /* find the playlist by id */
@@ -792,13 +929,13 @@ int pl_delete_playlist_item(char **pe, uint32_t playlistid, uint32_t songid) {
         return PL_E_NOTFOUND;
     }
 
-    pid = (uint32_t*)rbdelete((void*)&songid,ppl->prb);
-    if(!pid) {
+    if(!idset_del(ppl->pids, songid)) {
         pl_set_error(pe,PL_E_BADSONGID,songid);
         return PL_E_BADSONGID;
     }
 
     ppl->ppln->items--;
+    pl_snapshot_stale(ppl);
 
     return PL_E_SUCCESS;
 }
@@ -930,8 +1067,74 @@ void pl_dispose_playlist(PLAYLIST_NATIVE *ppln) {
 }
 
 /**
- * walk a playlist.  This assumes that a readlock
- * is held
+ * get a reference to the current snapshot of a playlist's items,
+ * making one if the playlist has changed since the last.  This
+ * assumes that a readlock is held, so the set holds still.
+ *
+ * @param ppl playlist to get the items of
+ * @returns snapshot, to be released with pl_snapshot_release
+ */
+PL_SNAPSHOT *pl_snapshot_get(PLAYLIST *ppl) {
+    PL_SNAPSHOT *psnap;
+
+    util_mutex_lock(l_pl);
+    if(!ppl->psnap) {
+        psnap = (PL_SNAPSHOT*)malloc(sizeof(PL_SNAPSHOT));
+        if(psnap)
+            psnap->pids = idset_copy(ppl->pids);
+        if((!psnap) || (!psnap->pids))
+            DPRINTF(E_FATAL,L_PL,"Malloc error in pl_snapshot_get\n");
+
+        psnap->refcount = 1;
+        ppl->psnap = psnap;
+    }
+
+    psnap = ppl->psnap;
+    psnap->refcount++;
+    util_mutex_unlock(l_pl);
+
+    return psnap;
+}
+
+/**
+ * drop a reference to a snapshot, freeing it with the last one
+ *
+ * @param psnap snapshot from pl_snapshot_get
+ */
+void pl_snapshot_release(PL_SNAPSHOT *psnap) {
+    int refcount;
+
+    util_mutex_lock(l_pl);
+    refcount = --psnap->refcount;
+    util_mutex_unlock(l_pl);
+
+    if(!refcount) {
+        idset_free(psnap->pids);
+        free(psnap);
+    }
+}
+
+/**
+ * a playlist has changed, so its snapshot no longer matches.
+ * Anyone walking it keeps their copy.
+ *
+ * @param ppl playlist that changed
+ */
+void pl_snapshot_stale(PLAYLIST *ppl) {
+    PL_SNAPSHOT *psnap;
+
+    util_mutex_lock(l_pl);
+    psnap = ppl->psnap;
+    ppl->psnap = NULL;
+    util_mutex_unlock(l_pl);
+
+    if(psnap)
+        pl_snapshot_release(psnap);
+}
+
+/**
+ * walk a playlist.  This assumes that a readlock is held, but only
+ * until this returns: the walk is over a snapshot of the items.
  */
 PLENUMHANDLE pl_enum_items_start(char **pe, uint32_t playlist_id) {
     PLENUMHANDLE pleh;
@@ -950,83 +1153,116 @@ PLENUMHANDLE pl_enum_items_start(char **pe, uint32_t playlist_id) {
         return NULL;
     }
 
-    pleh->ppl = ppl;
-    pleh->rblist = rbopenlist(ppl->prb);
-
-    if(!pleh->rblist) {
-        pl_set_error(pe,PL_E_RBTREE);
-        return NULL;
-    }
+    memset(pleh,0,sizeof(struct plenumhandle_t));
+    pleh->psnap = pl_snapshot_get(ppl);
 
     return pleh;
 }
 
+/**
+ * get the number of items in a playlist walk
+ *
+ * @param pleh enumeration handle, from pl_enum_items_start
+ * @returns items in the snapshot being walked
+ */
+int pl_enum_items_count(PLENUMHANDLE pleh) {
+    ASSERT(pleh);
+
+    return pleh ? idset_count(pleh->psnap->pids) : 0;
+}
+
 int pl_enum_items_reset(char **pe, PLENUMHANDLE pleh) {
     ASSERT(pleh);
 
     if(!pleh)
         return PL_E_INVALID;
 
-    rbcloselist(pleh->rblist);
-    pleh->rblist = rbopenlist(pleh->ppl->prb);
-    if(!pleh->rblist) {
-        pl_set_error(pe,PL_E_RBTREE);
-        return PL_E_RBTREE;
-    }
-
+    pleh->pos = 0;
     return PL_E_SUCCESS;
 }
 
 uint32_t pl_enum_items_fetch(char **pe, PLENUMHANDLE pleh) {
-    uint32_t *ptr;
-
     ASSERT(pleh);
     if(!pleh) {
         pl_set_error(pe,PL_E_INVALID);
         return 0;
     }
 
-    ptr = (uint32_t *)rbreadlist(pleh->rblist);
-    pleh->last_value = ptr;
+    return idset_next(pleh->psnap->pids, &pleh->pos);
+}
 
-    if(!ptr)
-        return 0;
+/**
+ * get the ids in a playlist walk as a set, for combining with
+ * other sets of ids.  The set belongs to the walk, and goes away
+ * with pl_enum_items_end.
+ *
+ * @param pleh enumeration handle, from pl_enum_items_start
+ * @returns the ids in the snapshot being walked
+ */
+IDSET *pl_enum_items_ids(PLENUMHANDLE pleh) {
+    ASSERT(pleh);
 
-    return *(uint32_t*)ptr;
+    return pleh ? pleh->psnap->pids : NULL;
 }
 
 void pl_enum_items_end(PLENUMHANDLE pleh) {
     ASSERT(pleh);
 
-    rbcloselist(pleh->rblist);
-    if(pleh)
+    if(pleh) {
+        pl_snapshot_release(pleh->psnap);
         free(pleh);
+    }
 }
 
 
 /**
- * enumerate playlists
+ * enumerate playlists.  The visible playlists are copied, so
+ * like the item walks, this only needs the readlock until it
+ * returns.
  *
  * @param pe error buffer
  * @returns enumeration handle, or null on error
  */
 PLENUMHANDLE pl_enum_start(char **pe) {
     PLENUMHANDLE pleh;
+    PLAYLIST *ppl;
+    PLAYLIST_NATIVE *ppln;
+    int count = 0;
 
     DPRINTF(E_DBG,L_PL,"Enumerating playlists\n");
     /* readlock must be set by calling function */
 
     pleh = (PLENUMHANDLE)malloc(sizeof(struct plenumhandle_t));
+    if(!pleh)
+        return NULL;
     memset(pleh,0,sizeof(struct plenumhandle_t));
 
-    pleh->ppl = &pl_list;
+    for(ppl = pl_list.next; ppl; ppl = ppl->next) {
+        if(!(ppl->ppln->type & PL_HIDDEN))
+            count++;
+    }
+
+    pleh->plists = (PLAYLIST_NATIVE*)malloc((count + 1) * sizeof(PLAYLIST_NATIVE));
     pleh->last_value = (PLAYLIST_STRING*)malloc(sizeof(PLAYLIST_STRING));
 
-    if(!pleh->last_value) {
+    if((!pleh->plists) || (!pleh->last_value)) {
+        MAYBEFREE(pleh->plists);
+        MAYBEFREE(pleh->last_value);
         free(pleh);
         return NULL;
     }
 
+    for(ppl = pl_list.next; ppl; ppl = ppl->next) {
+        if(ppl->ppln->type & PL_HIDDEN)
+            continue;
+
+        ppln = &pleh->plists[pleh->count++];
+        memcpy(ppln,ppl->ppln,sizeof(PLAYLIST_NATIVE));
+        if(ppl->ppln->title) ppln->title = strdup(ppl->ppln->title);
+        if(ppl->ppln->query) ppln->query = strdup(ppl->ppln->query);
+        if(ppl->ppln->path) ppln->path = strdup(ppl->ppln->path);
+    }
+
     memset(pleh->last_value,0,sizeof(PLAYLIST_STRING));
     return pleh;
 }
@@ -1044,7 +1280,7 @@ int pl_enum_reset(char **pe, PLENUMHANDLE pleh) {
     if(!pleh)
         return PL_E_SUCCESS;
 
-    pleh->ppl = &pl_list;
+    pleh->pos = 0;
     return PL_E_SUCCESS;
 }
 
@@ -1057,6 +1293,7 @@ int pl_enum_reset(char **pe, PLENUMHANDLE pleh) {
  */
 int pl_enum_fetch(char **pe, char ***result, PLENUMHANDLE pleh) {
     PLAYLIST_STRING *ppls;
+    PLAYLIST_NATIVE *ppln;
 
     DPRINTF(E_DBG,L_PL,"Fetching next playlist\n");
 
@@ -1076,34 +1313,27 @@ int pl_enum_fetch(char **pe, char ***result, PLENUMHANDLE pleh) {
         MAYBEFREE(ppls->idx);
     }
 
-    /* find the next non-hidden playlist */
-    while(1) {
-        pleh->ppl = pleh->ppl->next;
-        if(!pleh->ppl) {
-            *result = NULL;
-            memset(ppls,0,sizeof(PLAYLIST_STRING));
-            return PL_E_SUCCESS;
-        }
-        if(pleh->ppl->ppln && (pleh->ppl->ppln->type & PL_HIDDEN)) {
-            pleh->ppl = pleh->ppl->next;
-        } else {
-            break;
-        }
+    if(pleh->pos >= pleh->count) {
+        *result = NULL;
+        memset(ppls,0,sizeof(PLAYLIST_STRING));
+        return PL_E_SUCCESS;
     }
 
+    ppln = &pleh->plists[pleh->pos++];
+
     /* yuck */
-    ppls->id = util_asprintf("%d",pleh->ppl->ppln->id);
-    ppls->type = util_asprintf("%d",pleh->ppl->ppln->type);
-    ppls->items = util_asprintf("%d",pleh->ppl->ppln->items);
-    ppls->db_timestamp = util_asprintf("%d",pleh->ppl->ppln->db_timestamp);
-    ppls->idx = util_asprintf("%d",pleh->ppl->ppln->idx);
-
-    if(pleh->ppl->ppln->title)
-        ppls->title = strdup(pleh->ppl->ppln->title);
-    if(pleh->ppl->ppln->query)
-        ppls->query = strdup(pleh->ppl->ppln->query);
-    if(pleh->ppl->ppln->path)
-        ppls->path = strdup(pleh->ppl->ppln->path);
+    ppls->id = util_asprintf("%d",ppln->id);
+    ppls->type = util_asprintf("%d",ppln->type);
+    ppls->items = util_asprintf("%d",ppln->items);
+    ppls->db_timestamp = util_asprintf("%d",ppln->db_timestamp);
+    ppls->idx = util_asprintf("%d",ppln->idx);
+
+    if(ppln->title)
+        ppls->title = strdup(ppln->title);
+    if(ppln->query)
+        ppls->query = strdup(ppln->query);
+    if(ppln->path)
+        ppls->path = strdup(ppln->path);
 
     *result = (char**)ppls;
 
@@ -1117,6 +1347,7 @@ int pl_enum_fetch(char **pe, char ***result, PLENUMHANDLE pleh) {
  */
 void pl_enum_end(PLENUMHANDLE pleh) {
     PLAYLIST_STRING *ppls;
+    int index;
 
     if(!pleh)
         return;
@@ -1136,6 +1367,13 @@ void pl_enum_end(PLENUMHANDLE pleh) {
         free(ppls);
     }
 
+    for(index = 0; index < pleh->count; index++) {
+        MAYBEFREE(pleh->plists[index].title);
+        MAYBEFREE(pleh->plists[index].query);
+        MAYBEFREE(pleh->plists[index].path);
+    }
+    free(pleh->plists);
+
     free(pleh);
 }
 
@@ -1153,7 +1391,7 @@ int pl_contains_item(uint32_t pl_id, uint32_t song_id) {
     if(!(ppl = pl_find(pl_id)))
         return FALSE;
 
-    if(rbfind((void*)&song_id,ppl->prb))
+    if(idset_contains(ppl->pids, song_id))
         return TRUE;
 
     return FALSE;
@@ -1165,10 +1403,13 @@ int pl_contains_item(uint32_t pl_id, uint32_t song_id) {
  * playlists, the in-memory db cache, and whatnot
  *
  * @param pmn new entry added (or updated)
+ * @returns TRUE if any playlist gained or lost the entry
  */
-void pl_advise_add(MEDIA_NATIVE *pmn) {
+int pl_advise_add(MEDIA_NATIVE *pmn) {
     PLAYLIST *ppl;
     int is_edit = FALSE;
+    int changed = FALSE;
+    int items;
 
     /* this can be an add or an update... if it's an add, it won't already
      * be in playlist 1
@@ -1180,17 +1421,50 @@ void pl_advise_add(MEDIA_NATIVE *pmn) {
 
     ppl = pl_list.next;
 
-    /* walk through all the playlists, adding them if necessary */
+    /* walk through all the playlists, adding them if necessary.  During
+     * a full scan, smart playlists get rebuilt in one go at the end */
     while(ppl) {
-        if((ppl->ppln->id) && (!is_edit))
-            pl_add_playlist_item(NULL, 1, pmn->id);
+        items = ppl->ppln->items;
+        if((ppl->ppln->id == 1) && (!is_edit))
+            pl_insert_item(NULL, ppl, pmn->id);
+        else if(pl_fullscan)
+            ;
         else if((!is_edit) && (ppl->ppln->type & PL_DYNAMIC) && (sp_matches_native(ppl->pt, pmn)))
-            pl_add_playlist_item(NULL, ppl->ppln->id, pmn->id);
-        else if((is_edit) && (ppl->ppln->type & PL_DYNAMIC) && (!sp_matches_native(ppl->pt, pmn)))
+            pl_insert_item(NULL, ppl, pmn->id);
+        else if((is_edit) && (ppl->ppln->type & PL_DYNAMIC) && (sp_matches_native(ppl->pt, pmn)))
+            pl_insert_item(NULL, ppl, pmn->id); /* no-op if already there */
+        else if((is_edit) && (ppl->ppln->type & PL_DYNAMIC))
             pl_delete_playlist_item(NULL, ppl->ppln->id, pmn->id);
 
+        if(items != ppl->ppln->items)
+            changed = TRUE;
+
         ppl = ppl->next;
     }
+
+    return changed;
+}
+
+/**
+ * warning from the db that a full scan is starting or has finished.
+ * Smart playlists are left alone while the scan is running, then
+ * all rebuilt at once when it's done.
+ *
+ * @param finished FALSE when the scan starts, TRUE when it ends
+ */
+void pl_advise_fullscan(int finished) {
+    char *pe = NULL;
+
+    if(!finished) {
+        pl_fullscan = TRUE;
+        return;
+    }
+
+    pl_fullscan = FALSE;
+    if(PL_E_SUCCESS != pl_update_smart_all(&pe)) {
+        DPRINTF(E_LOG,L_PL,"Error updating smart playlists: %s\n",pe);
+        free(pe);
+    }
 }
 
 /**
@@ -1222,6 +1496,7 @@ int pl_init(char **pe) {
     char *path;
     char *relative_path = NULL;
     char *cache_dir;
+    char *e_pl = NULL;
     int err;
     struct stat sb;
 
@@ -1274,7 +1549,15 @@ int pl_init(char **pe) {
         free(relative_path);
     }
 
+    closedir(playlist_dir);
     free(path);
+
+    /* the saved item lists may well be stale by now */
+    if(PL_E_SUCCESS != pl_update_smart_all(&e_pl)) {
+        DPRINTF(E_LOG,L_PL,"Error updating smart playlists: %s\n",e_pl);
+        free(e_pl);
+    }
+
     return DB_E_SUCCESS;
 }
 
@@ -23,6 +23,7 @@
 #define _PLAYLISTS_H_
 
 #include "ff-dbstruct.h"
+#include "idset.h"
 
 /** Error codes */
 #define PL_E_SUCCESS     0
@@ -47,18 +48,22 @@ extern int pl_deinit(char **pe);
 
 extern int pl_add_playlist(char **pe, char *name, int type, char *query, char *path, int index, uint32_t *id);
 extern int pl_add_playlist_item(char **pe, uint32_t playlistid, uint32_t songid);
+extern int pl_add_playlist_items(char **pe, uint32_t playlistid, uint32_t *songids, int count);
 extern int pl_edit_playlist(char **pe, uint32_t id, char *name, char *query);
 extern int pl_delete_playlist(char **pe, uint32_t playlistid);
 extern int pl_delete_playlist_item(char **pe, uint32_t playlistid, uint32_t songid);
 extern int pl_get_playlist_count(char **pe, int *count);
+extern int pl_update_smart_all(char **pe);
 
 extern PLAYLIST_NATIVE *pl_fetch_playlist(char **pe, char *path, uint32_t index);
 extern PLAYLIST_NATIVE *pl_fetch_playlist_id(char **pe, uint32_t id);
 extern void pl_dispose_playlist(PLAYLIST_NATIVE *ppln);
 
 extern PLENUMHANDLE pl_enum_items_start(char **pe, uint32_t playlist_id);
+extern int pl_enum_items_count(PLENUMHANDLE pleh);
 extern int pl_enum_items_reset(char **pe, PLENUMHANDLE pleh);
 extern uint32_t pl_enum_items_fetch(char **pe, PLENUMHANDLE pleh);
+extern IDSET *pl_enum_items_ids(PLENUMHANDLE pleh);
 extern void pl_enum_items_end(PLENUMHANDLE pleh);
 
 extern PLENUMHANDLE pl_enum_start(char **pe);
@@ -67,8 +72,9 @@ extern int pl_enum_fetch(char **pe, char ***result, PLENUMHANDLE pleh);
 extern void pl_enum_end(PLENUMHANDLE pleh);
 
 /* Advise functions, specific to the db functions */
-extern void pl_advise_add(MEDIA_NATIVE *pmn);
+extern int pl_advise_add(MEDIA_NATIVE *pmn);
 extern void pl_advise_del(uint32_t id);
+extern void pl_advise_fullscan(int finished);
 
 #endif /* _PLAYLISTS_H_ */
 
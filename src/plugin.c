@@ -27,6 +27,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -61,11 +62,16 @@
 #include "rend.h"
 #include "restart.h"
 #include "smart-parser.h"
+#include "ssc-cache.h"
+#include "ssc-pipe.h"
+#include "ssc-session.h"
 #include "xml-rpc.h"
 #include "webserver.h"
 #include "ff-plugins.h"
 #include "io.h"
 
+#define SSC_WAV_HEADER 44   /**< what transcoders put in front of the samples */
+
 typedef struct tag_pluginentry {
     void *phandle;
     PLUGIN_INFO *pinfo;
@@ -91,6 +97,7 @@ int _plugin_error(char **pe, int error, ...);
 void _plugin_free(int *pi);
 void _plugin_recalc_codecs(void);
 int _plugin_ssc_transcode(WS_CONNINFO *pwsc, MP3FILE *pmp3, int offset, int headers);
+PLUGIN_ENTRY *_plugin_ssc_find(MP3FILE *pmp3, char *key, int len);
 
 /**
  * initialize stuff for plugins
@@ -431,35 +438,185 @@ void plugin_event_dispatch(int event_id, int intval, void *vp, int len) {
 
 
 /**
- * stupid helper to copy transcode stream to the fd
+ * find the transcoder for a song, and make up the transcode cache
+ * key for the song going through it
+ *
+ * @param pmp3 song to transcode
+ * @param key buffer for the cache key
+ * @param len size of key buffer
+ * @returns the transcoder, or NULL if there isn't one
+ */
+PLUGIN_ENTRY *_plugin_ssc_find(MP3FILE *pmp3, char *key, int len) {
+    PLUGIN_ENTRY *ppi;
+    struct stat sb;
+
+    ppi = _plugin_list.next;
+    while(ppi) {
+        if((ppi->pinfo->type & PLUGIN_TRANSCODE) &&
+           (strstr(ppi->pinfo->codeclist,pmp3->codectype))) {
+            /* time_modified is when the db last saw it, not the file's */
+            if(stat(pmp3->path,&sb))
+                sb.st_mtime = 0;
+
+            /* everything transcodes to wav, for now */
+            snprintf(key,len,"%s:%lu:%s:wav",pmp3->path,
+                     (unsigned long)sb.st_mtime,ppi->pinfo->server);
+            return ppi;
+        }
+        ppi = ppi->next;
+    }
+
+    return NULL;
+}
+
+/**
+ * see if a song has been transcoded all the way into the transcode
+ * cache, so it can be streamed from there like a plain file
+ *
+ * @param pmp3 song to look for
+ * @param ppath returns path of the transcoded file (malloc'd)
+ * @returns handle to pass to ssc_cache_release, or NULL if it isn't there
+ */
+void *plugin_ssc_cached(MP3FILE *pmp3, char **ppath) {
+    char key[PATH_MAX + 256];
+
+    if(!_plugin_ssc_find(pmp3,key,sizeof(key)))
+        return NULL;
+
+    return ssc_cache_lookup(key,ppath);
+}
+
+/**
+ * get a transcode to an offset by having the transcoder seek, rather
+ * than reading and throwing away everything up to there.  The offset
+ * is turned into a sample from the channels and sample size in the
+ * wav header, which has to be read first anyway.
+ *
+ * @param pfn transcoder, which must have an ssc_seek
+ * @param vp transcoder handle
+ * @param poffset offset to get to, returns how much is left to skip
+ * @returns TRUE on success, FALSE if the transcoder gave out
+ */
+int __plugin_ssc_seek(PLUGIN_TRANSCODE_FN *pfn, void *vp, int *poffset) {
+    unsigned char header[SSC_WAV_HEADER];
+    int bytes_read;
+    int got = 0;
+    int channels;
+    int bits_per_sample;
+    int block_align;
+    int offset;
+
+    while(got < SSC_WAV_HEADER) {
+        bytes_read = pfn->ssc_read(vp,(char*)&header[got],SSC_WAV_HEADER - got);
+        if(bytes_read <= 0)
+            return FALSE;
+        got += bytes_read;
+    }
+
+    offset = *poffset - SSC_WAV_HEADER;
+    *poffset = offset;
+
+    channels = header[22] | (header[23] << 8);
+    bits_per_sample = header[34] | (header[35] << 8);
+    block_align = channels * bits_per_sample / 8;
+
+    if((memcmp(header,"RIFF",4)) || (memcmp(&header[36],"data",4)) ||
+       (!block_align)) {
+        DPRINTF(E_LOG,L_PLUG,"Can't seek without a wav header\n");
+        return TRUE;
+    }
+
+    DPRINTF(E_DBG,L_PLUG,"Seeking to sample %d\n",offset / block_align);
+    if(pfn->ssc_seek(vp,(uint64_t)(offset / block_align)))
+        *poffset = offset % block_align;
+
+    return TRUE;
+}
+
+/**
+ * stupid helper to copy transcode stream to the fd.  The transcoder
+ * runs ahead on its own thread (see ssc-pipe.c), and this sends what
+ * it's done so far.  When filling the transcode cache, the whole song
+ * gets transcoded into it, even the part before the offset.  If the
+ * client goes away, the fill only keeps going while someone else is
+ * reading along behind it -- otherwise the partial file is thrown
+ * away, rather than tie up this thread for the rest of the song.
+ * When leading a shared transcode, what goes to the client goes to
+ * the session, too.
  */
 int __plugin_ssc_copy(WS_CONNINFO *pwsc, PLUGIN_TRANSCODE_FN *pfn,
-                     void *vp,int offset) {
+                     void *vp,int offset, void *pcache, void *psession,
+                     char *name) {
+    SSC_PIPE *ppipe;
     int bytes_read;
-    int bytes_to_read;
     int total_bytes_read = 0;
-    char buffer[1024];
+    int client_ok = TRUE;
+    char *buffer;
 
-    /* first, skip past the offset */
-    while(offset) {
-        bytes_to_read = sizeof(buffer);
-        if(bytes_to_read > offset)
-            bytes_to_read = offset;
+    /* seek if we can -- but a fill has to have it all */
+    if((offset > SSC_WAV_HEADER) && (pfn->ssc_seek) && (!pcache)) {
+        if(!__plugin_ssc_seek(pfn,vp,&offset))
+            return -1;
+    }
 
-        bytes_read = pfn->ssc_read(vp,buffer,bytes_to_read);
-        if(bytes_read <= 0)
+    ppipe = ssc_pipe_start(pfn,vp,name);
+    if(!ppipe) {
+        if(pcache)
+            ssc_cache_finish(pcache,FALSE);
+        return -1;
+    }
+
+    /* then skip past whatever is left of the offset */
+    while(offset) {
+        bytes_read = ssc_pipe_peek(ppipe,&buffer);
+        if(bytes_read <= 0) {
+            if(pcache)
+                ssc_cache_finish(pcache,bytes_read == 0);
+            if(psession)
+                ssc_session_finish(psession,bytes_read == 0);
+            ssc_pipe_end(ppipe);
             return bytes_read;
+        }
+
+        if(bytes_read > offset)
+            bytes_read = offset;
 
+        if((pcache) && (!ssc_cache_write(pcache,buffer,bytes_read))) {
+            ssc_cache_finish(pcache,FALSE);
+            pcache = NULL;
+        }
+
+        ssc_pipe_consume(ppipe,bytes_read);
         offset -= bytes_read;
     }
 
-    while((bytes_read=pfn->ssc_read(vp,buffer,sizeof(buffer))) > 0) {
-        total_bytes_read += bytes_read;
-        if(ws_writebinary(pwsc,buffer,bytes_read) != bytes_read) {
-            return total_bytes_read;
+    while((bytes_read=ssc_pipe_peek(ppipe,&buffer)) > 0) {
+        if((pcache) && (!ssc_cache_write(pcache,buffer,bytes_read))) {
+            ssc_cache_finish(pcache,FALSE);
+            pcache = NULL;
         }
+
+        if(client_ok) {
+            if(psession)
+                ssc_session_write(psession,buffer,bytes_read);
+            total_bytes_read += bytes_read;
+            if(ws_writebinary(pwsc,buffer,bytes_read) != bytes_read)
+                client_ok = FALSE;
+        }
+
+        ssc_pipe_consume(ppipe,bytes_read);
+
+        if((!client_ok) && ((!pcache) || (!ssc_cache_followed(pcache))))
+            break;
     }
 
+    if((pcache) && (bytes_read <= 0))
+        ssc_cache_finish(pcache,bytes_read == 0);
+    if((psession) && (bytes_read <= 0))
+        ssc_session_finish(psession,bytes_read == 0);
+
+    ssc_pipe_end(ppipe);
+
     /*
     if(bytes_read < 0) {
         return bytes_read;
@@ -469,6 +626,67 @@ int __plugin_ssc_copy(WS_CONNINFO *pwsc, PLUGIN_TRANSCODE_FN *pfn,
     return total_bytes_read;
 }
 
+/**
+ * copy a transcode that someone else is filling into the transcode
+ * cache to the fd, following along behind them
+ */
+int __plugin_ssc_cache_copy(WS_CONNINFO *pwsc, void *pcache, int offset) {
+    int bytes_read;
+    int total_bytes_read = 0;
+    uint64_t pos = offset;
+    char buffer[8192];
+
+    while((bytes_read = ssc_cache_read(pcache,pos,buffer,sizeof(buffer))) > 0) {
+        pos += bytes_read;
+        total_bytes_read += bytes_read;
+        if(ws_writebinary(pwsc,buffer,bytes_read) != bytes_read)
+            break;
+    }
+
+    return total_bytes_read;
+}
+
+/**
+ * copy a transcode that another client is leading to the fd, reading
+ * along behind them
+ *
+ * @param poffset where to start, returns where it got to
+ * @param ptotal returns bytes sent
+ * @returns TRUE if done, FALSE if the rest has to be transcoded here
+ */
+int __plugin_ssc_session_copy(WS_CONNINFO *pwsc, void *psession,
+                              int *poffset, int *ptotal) {
+    int bytes_read;
+    char buffer[8192];
+
+    while((bytes_read = ssc_session_read(psession,*poffset,buffer,
+                                         sizeof(buffer))) > 0) {
+        *poffset += bytes_read;
+        *ptotal += bytes_read;
+        if(ws_writebinary(pwsc,buffer,bytes_read) != bytes_read)
+            return TRUE;
+    }
+
+    return (bytes_read != SSC_SESSION_BEHIND);
+}
+
+/**
+ * emit the headers for a transcoded stream, which has no length
+ */
+void __plugin_ssc_headers(WS_CONNINFO *pwsc, int offset) {
+    ws_addresponseheader(pwsc,"Content-Type","audio/wav");
+    ws_addresponseheader(pwsc,"Connection","Close");
+    if(!offset) {
+        ws_writefd(pwsc,"HTTP/1.1 200 OK\r\n");
+    } else {
+        ws_addresponseheader(pwsc,"Content-Range",
+                             "bytes %ld-*/*",
+                             (long)offset);
+        ws_writefd(pwsc,"HTTP/1.1 206 Partial Content\r\n");
+    }
+    ws_emitheaders(pwsc);
+}
+
 /**
  * do the transcode, emitting the headers, content type,
  * and shoving the file down the wire
@@ -480,22 +698,60 @@ int __plugin_ssc_copy(WS_CONNINFO *pwsc, PLUGIN_TRANSCODE_FN *pfn,
  * @returns bytes transferred, or -1 on error
  */
 int plugin_ssc_transcode(WS_CONNINFO *pwsc, MP3FILE *pmp3, int offset, int headers) {
-    PLUGIN_ENTRY *ppi, *ptc=NULL;
+    PLUGIN_ENTRY *ptc;
     PLUGIN_TRANSCODE_FN *pfn = NULL;
     void *vp_ssc;
+    void *pcache = NULL;
+    void *psession = NULL;
+    int fill = FALSE;
+    int lead = FALSE;
+    int shared = FALSE;
+    int sent = 0;
     int post_error = 1;
     int result = -1;
+    char key[PATH_MAX + 256];
 
     /* first, find the plugin that will do the conversion */
-    ppi = _plugin_list.next;
-    while((ppi) && (!pfn)) {
-        if(ppi->pinfo->type & PLUGIN_TRANSCODE) {
-            if(strstr(ppi->pinfo->codeclist,pmp3->codectype)) {
-                ptc = ppi;
-                pfn = ppi->pinfo->transcode_fns;
+    ptc = _plugin_ssc_find(pmp3,key,sizeof(key));
+    if(ptc) {
+        pfn = ptc->pinfo->transcode_fns;
+
+        /* a transcoder that can seek gets to an offset faster than
+         * a fill from the top would, so only follow one */
+        if((offset > SSC_WAV_HEADER) && (pfn->ssc_seek))
+            pcache = ssc_cache_open(key,NULL);
+        else
+            pcache = ssc_cache_open(key,&fill);
+    }
+
+    if((pcache) && (!fill)) {
+        /* someone else is already at it */
+        DPRINTF(E_DBG,L_PLUG,"Following transcode of %s\n",pmp3->path);
+        if(headers)
+            __plugin_ssc_headers(pwsc,offset);
+        result = __plugin_ssc_cache_copy(pwsc,pcache,offset);
+        ssc_cache_release(pcache);
+        return result;
+    }
+
+    /* no cache being filled, so share with anyone playing it now */
+    if((pfn) && (!pcache)) {
+        while((psession = ssc_session_open(key,offset,&lead)) && (!lead)) {
+            DPRINTF(E_DBG,L_PLUG,"Sharing transcode of %s\n",pmp3->path);
+            if((headers) && (!shared))
+                __plugin_ssc_headers(pwsc,offset);
+            shared = TRUE;
+
+            if(__plugin_ssc_session_copy(pwsc,psession,&offset,&sent)) {
+                ssc_session_release(psession);
+                return sent;
             }
+
+            /* left behind, so pick up from here */
+            DPRINTF(E_DBG,L_PLUG,"Transcoding rest of %s from %d\n",
+                    pmp3->path,offset);
+            ssc_session_release(psession);
         }
-        ppi = ppi->next;
     }
 
     if(pfn) {
@@ -506,22 +762,14 @@ int plugin_ssc_transcode(WS_CONNINFO *pwsc, MP3FILE *pmp3, int offset, int heade
         if(vp_ssc) {
             if(pfn->ssc_open(vp_ssc,pmp3)) {
                 /* start reading and throwing */
-                if(headers) {
-                    ws_addresponseheader(pwsc,"Content-Type","audio/wav");
-                    ws_addresponseheader(pwsc,"Connection","Close");
-                    if(!offset) {
-                        ws_writefd(pwsc,"HTTP/1.1 200 OK\r\n");
-                    } else {
-                        ws_addresponseheader(pwsc,"Content-Range",
-                                             "bytes %ld-*/*",
-                                             (long)offset);
-                        ws_writefd(pwsc,"HTTP/1.1 206 Partial Content\r\n");
-                    }
-                    ws_emitheaders(pwsc);
-                }
+                if((headers) && (!shared))
+                    __plugin_ssc_headers(pwsc,offset);
 
                 /* start reading/writing */
-                result = __plugin_ssc_copy(pwsc,pfn,vp_ssc,offset);
+                result = __plugin_ssc_copy(pwsc,pfn,vp_ssc,offset,pcache,
+                                           psession,pmp3->path);
+                if(result >= 0)
+                    result += sent;
                 post_error = 0;
                 pfn->ssc_close(vp_ssc);
             } else {
@@ -535,7 +783,13 @@ int plugin_ssc_transcode(WS_CONNINFO *pwsc, MP3FILE *pmp3, int offset, int heade
         }
     }
 
-    if(post_error) {
+    /* unfinished fills get thrown away */
+    if(pcache)
+        ssc_cache_release(pcache);
+    if(psession)
+        ssc_session_release(psession);
+
+    if((post_error) && (!shared)) {
         pwsc->error = EPERM; /* ?? */
         ws_returnerror(pwsc,500,"Internal error");
     }
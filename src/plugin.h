@@ -43,6 +43,7 @@ extern char *plugin_get_description(void *);
 
 extern int plugin_ssc_should_transcode(WS_CONNINFO *pwsc, char *codec);
 extern int plugin_ssc_transcode(WS_CONNINFO *pwsc, MP3FILE *pmp3, int offset, int headers);
+extern void *plugin_ssc_cached(MP3FILE *pmp3, char **ppath);
 
 /* these should really get rows */
 
@@ -229,6 +229,8 @@ int out_daap_session=0;
                                          ((pinfo->empty_strings) ? 8 : 0))
 #define EMIT(a) (pinfo->empty_strings ? 1 : ((a) && strlen((a))) ? 1 : 0)
 
+#define DAAP_SERIALIZE_CHUNK 65536 /**< starting size of a serialized enum */
+
 /* Forwards */
 int daap_get_size(PRIVINFO *pinfo, char **valarray);
 int daap_build_dmap(PRIVINFO *pinfo, char **valarray, unsigned char *presult, int len);
@@ -465,70 +467,72 @@ int daap_get_next_session(void) {
 }
 
 /**
- * find the size of the response by walking through the query and
- * sizing it
+ * walk through the query once, building the dmap for every row
+ * straight into one buffer.  The buffer just doubles as it fills,
+ * so it's a handful of reallocs rather than a malloc per row, and the
+ * query only runs once rather than once to size and once to send.
  *
+ * @param pe error buffer
+ * @param pinfo query info
+ * @param reserve bytes to leave free at the front, for the response header
+ * @param count returns the number of records
+ * @param pdmap returns the buffer (caller frees)
+ * @param total_size returns the size of the records (not including reserve)
  * @returns DB_E_SUCCESS on success, error code otherwise
  */
-int daap_enum_size(char **pe, PRIVINFO *pinfo, int *count, int *total_size) {
+int daap_enum_serialize(char **pe, PRIVINFO *pinfo, int reserve, int *count,
+                        unsigned char **pdmap, int *total_size) {
     int err;
     int record_size;
+    int used, alloc;
+    unsigned char *buffer, *new_buffer;
     char **row;
 
-    pi_log(E_DBG,"Enumerating size\n");
+    pi_log(E_DBG,"Serializing enum\n");
 
-    *count=0;
+    *count = 0;
     *total_size = 0;
+    *pdmap = NULL;
 
-    while((!(err=pi_db_enum_fetch_row(pe,&row,&pinfo->dq))) && (row)) {
-        if((record_size = daap_get_size(pinfo,row))) {
-            *total_size += record_size;
-            *count = *count + 1;
-        }
-    }
+    used = reserve;
+    alloc = DAAP_SERIALIZE_CHUNK;
+    while(alloc < reserve)
+        alloc *= 2;
 
-    if(err) {
-        pi_db_enum_end(NULL,&pinfo->dq);
-        return err;
+    buffer = (unsigned char *)malloc(alloc);
+    if(!buffer) {
+        pi_log(E_FATAL,"Malloc error\n");
     }
 
-    err=pi_db_enum_restart(pe, &pinfo->dq);
-
-    pi_log(E_DBG,"Got size: %d\n",*total_size);
-    return err;
-}
+    while((!(err=pi_db_enum_fetch_row(pe,&row,&pinfo->dq))) && (row)) {
+        if(!(record_size = daap_get_size(pinfo,row)))
+            continue;
+
+        if(used + record_size > alloc) {
+            while(used + record_size > alloc)
+                alloc *= 2;
+            new_buffer = (unsigned char *)realloc(buffer, alloc);
+            if(!new_buffer) {
+                pi_log(E_FATAL,"Malloc error\n");
+            }
+            buffer = new_buffer;
+        }
 
-/**
- * fetch the next record from the enum
- */
-int daap_enum_fetch(char **pe, PRIVINFO *pinfo, int *size, unsigned char **pdmap) {
-    int err;
-    int result_size=0;
-    unsigned char *presult;
-    char **row;
+        daap_build_dmap(pinfo,row,&buffer[used],record_size);
+        used += record_size;
+        *count = *count + 1;
+    }
 
-    err=pi_db_enum_fetch_row(pe, &row, &pinfo->dq);
     if(err) {
         pi_db_enum_end(NULL,&pinfo->dq);
+        free(buffer);
         return err;
     }
 
-    if(row) {
-        result_size = daap_get_size(pinfo,row);
-        if(result_size) {
-            presult = (unsigned char*)malloc(result_size);
-            if(!presult) {
-                pi_log(E_FATAL,"Malloc error\n");
-            }
-
-            daap_build_dmap(pinfo,row,presult,result_size);
-            *pdmap=presult;
-            *size = result_size;
-        }
-    } else {
-        *size = 0;
-    }
+    *pdmap = buffer;
+    *total_size = used - reserve;
 
+    pi_log(E_DBG,"Got size: %d\n",*total_size);
     return 0;
 }
 
@@ -31,7 +31,7 @@ extern int dmap_add_container(unsigned char *where, char *tag, int size);
 extern int daap_get_next_session(void);
 
 
-extern int daap_enum_size(char **pe, PRIVINFO *pinfo, int *count, int *total_size);
-extern int daap_enum_fetch(char **pe, PRIVINFO *pinfo, int *size, unsigned char **pdmap);
+extern int daap_enum_serialize(char **pe, PRIVINFO *pinfo, int reserve, int *count,
+                               unsigned char **pdmap, int *total_size);
 
 #endif /* _OUT_DAAP_PROTO_H_ */
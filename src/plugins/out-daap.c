@@ -83,6 +83,8 @@ static void out_daap_error(WS_CONNINFO *pwsc, PRIVINFO *ppi, char *container, ch
 static int out_daap_output_start(WS_CONNINFO *pwsc, PRIVINFO *ppi, int content_length);
 static int out_daap_output_write(WS_CONNINFO *pwsc, PRIVINFO *ppi, unsigned char *block, int len);
 static int out_daap_output_end(WS_CONNINFO *pwsc, PRIVINFO *ppi);
+static int out_daap_cache_output(WS_CONNINFO *pwsc, PRIVINFO *ppi);
+static void out_daap_cache_store(PRIVINFO *ppi, int revision, unsigned char *block, int len);
 
 static DAAP_ITEMS *out_daap_xml_lookup_tag(char *tag);
 static char *out_daap_xml_encode(char *original, int len);
@@ -220,6 +222,12 @@ void out_daap_cleanup(PRIVINFO *ppi) {
     if(ppi->output_info)
         free(ppi->output_info);
 
+    if(ppi->cache_key)
+        free(ppi->cache_key);
+
+    if(ppi->uri)
+        free(ppi->uri);
+
     free(ppi);
 }
 
@@ -284,11 +292,6 @@ void out_daap_handler(WS_CONNINFO *pwsc) {
     long l,h;
     char *ptr;
 
-    pi_log(E_DBG,"Getting uri...\n");
-
-    string = pi_ws_uri(pwsc);
-    string++;
-
     pi_log(E_DBG,"Mallocing privinfo...\n");
     ppi = (PRIVINFO *)malloc(sizeof(PRIVINFO));
     if(ppi) {
@@ -300,6 +303,17 @@ void out_daap_handler(WS_CONNINFO *pwsc) {
         return;
     }
 
+    /* tokenize a copy, as an update can be run again on the same
+     * request (see pi_db_wait_update) */
+    pi_log(E_DBG,"Getting uri...\n");
+    ppi->uri = strdup(pi_ws_uri(pwsc));
+    if(!ppi->uri) {
+        pi_ws_returnerror(pwsc,500,"Malloc error in plugin_handler");
+        out_daap_cleanup(ppi);
+        return;
+    }
+    string = ppi->uri + 1;
+
     memset((void*)&ppi->dq,0,sizeof(DB_QUERY));
 
     ppi->empty_strings = pi_conf_get_int("daap","empty_strings",0);
@@ -344,6 +358,7 @@ void out_daap_handler(WS_CONNINFO *pwsc) {
     if(pi_ws_getvar(pwsc,"query")) {
         ppi->dq.filter_type = FILTER_TYPE_APPLE;
         ppi->dq.filter = pi_ws_getvar(pwsc,"query");
+        ppi->dq.count_at_end = TRUE; /* mtco is only needed after the enum */
     }
 
     pi_log(E_DBG,"Tokenizing url\n");
@@ -672,6 +687,96 @@ int out_daap_output_end(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     return 0;
 }
 
+/**
+ * see if there is already a finished response for this request,
+ * and if so, send it.  Otherwise, remember the cache key so the
+ * response can be stored once it's built.
+ *
+ * Anything that can change the response has to be in the key,
+ * including the headers that decide whether songs get transcoded.
+ * Xml output is never cached.
+ *
+ * @param pwsc current conninfo struct
+ * @param ppi current dbquery struct, with meta set
+ * @returns TRUE if the response was sent from the cache
+ */
+int out_daap_cache_output(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
+    char *query, *index_req, *user_agent, *codecs, *accept;
+    void *handle;
+    unsigned char *data;
+    int len, gzipped;
+    int key_len;
+    int part;
+
+    if(pi_ws_getvar(pwsc,"output"))
+        return FALSE;
+
+    query = pi_ws_getvar(pwsc,"query");
+    index_req = pi_ws_getvar(pwsc,"index");
+    user_agent = pi_ws_getrequestheader(pwsc,"user-agent");
+    codecs = pi_ws_getrequestheader(pwsc,"accept-codecs");
+
+    /* the uri has already been chopped up by the handler */
+    key_len = 64;
+    for(part=0; part < ppi->uri_count; part++)
+        key_len += (int)strlen(ppi->uri_sections[part]) + 1;
+    key_len += query ? (int)strlen(query) : 0;
+    key_len += index_req ? (int)strlen(index_req) : 0;
+    key_len += user_agent ? (int)strlen(user_agent) : 0;
+    key_len += codecs ? (int)strlen(codecs) : 0;
+
+    ppi->cache_key = (char*)malloc(key_len);
+    if(!ppi->cache_key)
+        return FALSE;
+
+    ppi->cache_key[0] = '\0';
+    for(part=0; part < ppi->uri_count; part++) {
+        strcat(ppi->cache_key,"/");
+        strcat(ppi->cache_key,ppi->uri_sections[part]);
+    }
+    len = (int)strlen(ppi->cache_key);
+    snprintf(&ppi->cache_key[len],key_len - len,"|%llx|%s|%s|%s|%s",
+             ppi->meta, query ? query : "", index_req ? index_req : "",
+             user_agent ? user_agent : "", codecs ? codecs : "");
+
+    accept = pi_ws_getrequestheader(pwsc,"accept-encoding");
+    handle = pi_dmap_cache_lookup(ppi->cache_key,
+                                  (accept) && (strcasestr(accept,"gzip")),
+                                  &data,&len,&gzipped);
+    if(!handle)
+        return FALSE;
+
+    pi_log(E_DBG,"Sending cached response for %s\n",ppi->cache_key);
+
+    if(gzipped) {
+        pi_ws_addresponseheader(pwsc,"Content-Encoding","gzip");
+        pi_ws_addresponseheader(pwsc,"Vary","Accept-Encoding");
+    }
+    pi_ws_addresponseheader(pwsc,"Content-Length","%d",len);
+    pi_ws_writefd(pwsc,"HTTP/1.1 200 OK\r\n");
+    pi_ws_emitheaders(pwsc);
+    pi_ws_writebinary(pwsc,(char*)data,len);
+    pi_dmap_cache_release(handle);
+
+    out_daap_output_end(pwsc,ppi);
+    return TRUE;
+}
+
+/**
+ * hand a finished response to the cache, or free it if the
+ * cache doesn't want it.
+ *
+ * @param ppi current dbquery struct
+ * @param revision db revision from before the enum started
+ * @param block finished response
+ * @param len length of response
+ */
+void out_daap_cache_store(PRIVINFO *ppi, int revision, unsigned char *block, int len) {
+    if((!ppi->cache_key) ||
+       (!pi_dmap_cache_store(ppi->cache_key,revision,block,len)))
+        free(block);
+}
+
 
 DAAP_ITEMS *out_daap_xml_lookup_tag(char *tag) {
     DAAP_ITEMS *pitem;
@@ -962,13 +1067,13 @@ void out_daap_editplaylist(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
  * enumerate and return playlistitems
  */
 void out_daap_playlistitems(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
-    unsigned char items_response[61];
-    unsigned char *current=items_response;
+    unsigned char *current;
     int song_count;
     int list_length;
     unsigned char *block;
     char *pe = NULL;
     int mtco;
+    int revision;
 
     if(pi_ws_getvar(pwsc,"meta")) {
         ppi->meta = daap_encode_meta(pi_ws_getvar(pwsc,"meta"));
@@ -983,6 +1088,10 @@ void out_daap_playlistitems(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     ppi->dq.query_type = QUERY_TYPE_ITEMS;
     ppi->dq.playlist_id = atoi(ppi->uri_sections[3]);
 
+    if(out_daap_cache_output(pwsc,ppi))
+        return;
+
+    revision = pi_db_revision();
     if(pi_db_enum_start(&pe,&ppi->dq)) {
         pi_log(E_LOG,"Could not start enum: %s\n",pe);
         out_daap_error(pwsc,ppi,"apso",pe);
@@ -990,19 +1099,22 @@ void out_daap_playlistitems(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
         return;
     }
 
-    if(daap_enum_size(&pe,ppi,&song_count,&list_length)) {
+    if(daap_enum_serialize(&pe,ppi,61,&song_count,&block,&list_length)) {
         pi_log(E_LOG,"Could not enum size: %s\n",pe);
         out_daap_error(pwsc,ppi,"apso",pe);
         if(pe) free(pe);
         return;
     }
 
+    pi_db_enum_end(NULL,&ppi->dq);
+
     pi_log(E_DBG,"Item enum:  got %d songs, dmap size: %d\n",song_count,list_length);
 
     mtco = song_count;
     if(ppi->dq.offset || ppi->dq.limit)
         mtco = ppi->dq.totalcount;
 
+    current = block;
     current += dmap_add_container(current,"apso",list_length + 53);
     current += dmap_add_int(current,"mstt",200);         /* 12 */
     current += dmap_add_char(current,"muty",0);          /*  9 */
@@ -1011,27 +1123,15 @@ void out_daap_playlistitems(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     current += dmap_add_container(current,"mlcl",list_length);
 
     out_daap_output_start(pwsc,ppi,61+list_length);
-    out_daap_output_write(pwsc,ppi,items_response,61);
-
-    /* FIXME: Error checking */
-    while((daap_enum_fetch(NULL,ppi,&list_length,&block)==0) &&
-          (list_length)) {
-        pi_log(E_SPAM,"Got block of size %d\n",list_length);
-        out_daap_output_write(pwsc,ppi,block,list_length);
-        free(block);
-    }
-
-    pi_log(E_DBG,"Done enumerating.\n");
-
-    pi_db_enum_end(NULL,&ppi->dq);
+    out_daap_output_write(pwsc,ppi,block,61+list_length);
+    out_daap_cache_store(ppi,revision,block,61+list_length);
 
     out_daap_output_end(pwsc,ppi);
     return;
 }
 
 void out_daap_browse(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
-    unsigned char browse_response[52];
-    unsigned char *current=browse_response;
+    unsigned char *current;
     int item_count;
     int list_length;
     unsigned char *block;
@@ -1039,6 +1139,7 @@ void out_daap_browse(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     int which_field=5;
     char *pe = NULL;
     int mtco;
+    int revision;
 
     if(strcasecmp(ppi->uri_sections[2],"browse") == 0) {
         which_field = 3;
@@ -1068,6 +1169,10 @@ void out_daap_browse(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
         return;
     }
 
+    if(out_daap_cache_output(pwsc,ppi))
+        return;
+
+    revision = pi_db_revision();
     if(pi_db_enum_start(&pe,&ppi->dq)) {
         pi_log(E_LOG,"Could not start enum: %s\n",pe);
         out_daap_error(pwsc,ppi,"abro",pe);
@@ -1077,8 +1182,14 @@ void out_daap_browse(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
 
     pi_log(E_DBG,"Getting enum size.\n");
 
-    /* FIXME: Error handling */
-    daap_enum_size(NULL,ppi,&item_count,&list_length);
+    if(daap_enum_serialize(&pe,ppi,52,&item_count,&block,&list_length)) {
+        pi_log(E_LOG,"Could not enum size: %s\n",pe);
+        out_daap_error(pwsc,ppi,"abro",pe);
+        if(pe) free(pe);
+        return;
+    }
+
+    pi_db_enum_end(NULL, &ppi->dq);
 
     pi_log(E_DBG,"Item enum: got %d items, dmap size: %d\n",
             item_count,list_length);
@@ -1087,6 +1198,7 @@ void out_daap_browse(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     if((ppi->dq.offset) || (ppi->dq.limit))
         mtco = ppi->dq.totalcount;
 
+    current = block;
     current += dmap_add_container(current,"abro",list_length + 44);
     current += dmap_add_int(current,"mstt",200);                    /* 12 */
     current += dmap_add_int(current,"mtco",mtco);                   /* 12 */
@@ -1094,32 +1206,21 @@ void out_daap_browse(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     current += dmap_add_container(current,response_type,list_length); /* 8+ */
 
     out_daap_output_start(pwsc,ppi,52+list_length);
-    out_daap_output_write(pwsc,ppi,browse_response,52);
-
-    while((daap_enum_fetch(NULL,ppi,&list_length,&block)==0) &&
-          (list_length))
-    {
-        pi_log(E_SPAM,"Got block of size %d\n",list_length);
-        out_daap_output_write(pwsc,ppi,block,list_length);
-        free(block);
-    }
-
-    pi_log(E_DBG,"Done enumerating\n");
-
-    pi_db_enum_end(NULL, &ppi->dq);
+    out_daap_output_write(pwsc,ppi,block,52+list_length);
+    out_daap_cache_store(ppi,revision,block,52+list_length);
 
     out_daap_output_end(pwsc,ppi);
     return;
 }
 
 void out_daap_playlists(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
-    unsigned char playlist_response[61];
-    unsigned char *current=playlist_response;
+    unsigned char *current;
     int pl_count;
     int list_length;
     unsigned char *block;
     char *pe = NULL;
     int mtco;
+    int revision;
 
     /* currently, this is ignored for playlist queries */
     if(pi_ws_getvar(pwsc,"meta")) {
@@ -1134,6 +1235,10 @@ void out_daap_playlists(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
 
     ppi->dq.query_type = QUERY_TYPE_PLAYLISTS;
 
+    if(out_daap_cache_output(pwsc,ppi))
+        return;
+
+    revision = pi_db_revision();
     if(pi_db_enum_start(&pe,&ppi->dq)) {
         pi_log(E_LOG,"Could not start enum: %s\n",pe);
         out_daap_error(pwsc,ppi,"aply",pe);
@@ -1141,19 +1246,22 @@ void out_daap_playlists(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
         return;
     }
 
-    if(daap_enum_size(NULL,ppi,&pl_count,&list_length)) {
+    if(daap_enum_serialize(&pe,ppi,61,&pl_count,&block,&list_length)) {
         pi_log(E_LOG,"error in enumerating size: %s\n",pe);
         out_daap_error(pwsc,ppi,"aply",pe);
         if(pe) free(pe);
         return;
     }
 
+    pi_db_enum_end(NULL,&ppi->dq);
+
     pi_log(E_DBG,"Item enum:  got %d playlists, dmap size: %d\n",pl_count,list_length);
 
     mtco = pl_count;
     if((ppi->dq.offset) || (ppi->dq.limit))
         mtco = ppi->dq.totalcount;
 
+    current = block;
     current += dmap_add_container(current,"aply",list_length + 53);
     current += dmap_add_int(current,"mstt",200);         /* 12 */
     current += dmap_add_char(current,"muty",0);          /*  9 */
@@ -1162,33 +1270,21 @@ void out_daap_playlists(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     current += dmap_add_container(current,"mlcl",list_length);
 
     out_daap_output_start(pwsc,ppi,61+list_length);
-    out_daap_output_write(pwsc,ppi,playlist_response,61);
-
-    /* FIXME: error checking */
-    while((daap_enum_fetch(NULL,ppi,&list_length,&block)==0) &&
-          (list_length))
-    {
-        pi_log(E_SPAM,"Got block of size %d\n",list_length);
-        out_daap_output_write(pwsc,ppi,block,list_length);
-        free(block);
-    }
-
-    pi_log(E_DBG,"Done enumerating.\n");
-
-    pi_db_enum_end(NULL,&ppi->dq);
+    out_daap_output_write(pwsc,ppi,block,61+list_length);
+    out_daap_cache_store(ppi,revision,block,61+list_length);
 
     out_daap_output_end(pwsc,ppi);
     return;
 }
 
 void out_daap_items(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
-    unsigned char items_response[61];
-    unsigned char *current=items_response;
+    unsigned char *current;
     int song_count;
     int list_length;
     unsigned char *block;
     char *pe = NULL;
     int mtco;
+    int revision;
 
     if(pi_ws_getvar(pwsc,"meta")) {
         ppi->meta = daap_encode_meta(pi_ws_getvar(pwsc,"meta"));
@@ -1199,6 +1295,10 @@ void out_daap_items(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     ppi->dq.query_type = QUERY_TYPE_ITEMS;
     ppi->dq.playlist_id = 1;
 
+    if(out_daap_cache_output(pwsc,ppi))
+        return;
+
+    revision = pi_db_revision();
     if(pi_db_enum_start(&pe,&ppi->dq)) {
         pi_log(E_LOG,"Could not start enum: %s\n",pe);
         out_daap_error(pwsc,ppi,"adbs",pe);
@@ -1206,14 +1306,15 @@ void out_daap_items(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
         return;
     }
 
-    /* FIXME: Error handling */
-    if(daap_enum_size(&pe,ppi,&song_count,&list_length)) {
+    if(daap_enum_serialize(&pe,ppi,61,&song_count,&block,&list_length)) {
         pi_log(E_LOG,"Error getting dmap size: %s\n",pe);
         out_daap_error(pwsc,ppi,"adbs",pe);
         if(pe) free(pe);
         return;
     }
 
+    pi_db_enum_end(NULL,&ppi->dq);
+
     pi_log(E_DBG,"Item enum:  got %d songs, dmap size: %d\n",song_count,
               list_length);
 
@@ -1221,6 +1322,7 @@ void out_daap_items(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     if((ppi->dq.offset) || (ppi->dq.limit))
         mtco = ppi->dq.totalcount;
 
+    current = block;
     current += dmap_add_container(current,"adbs",list_length + 53);
     current += dmap_add_int(current,"mstt",200);         /* 12 */
     current += dmap_add_char(current,"muty",0);          /*  9 */
@@ -1229,17 +1331,9 @@ void out_daap_items(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     current += dmap_add_container(current,"mlcl",list_length);
 
     out_daap_output_start(pwsc,ppi,61+list_length);
-    out_daap_output_write(pwsc,ppi,items_response,61);
+    out_daap_output_write(pwsc,ppi,block,61+list_length);
+    out_daap_cache_store(ppi,revision,block,61+list_length);
 
-    /* FIXME: check errors */
-    while((daap_enum_fetch(NULL,ppi,&list_length,&block)==0) &&
-          (list_length)) {
-        pi_log(E_SPAM,"Got block of size %d\n",list_length);
-        out_daap_output_write(pwsc,ppi,block,list_length);
-        free(block);
-    }
-    pi_log(E_DBG,"Done enumerating.\n");
-    pi_db_enum_end(NULL,&ppi->dq);
     out_daap_output_end(pwsc,ppi);
     return;
 }
@@ -1252,7 +1346,9 @@ void out_daap_update(WS_CONNINFO *pwsc, PRIVINFO *ppi) {
     pi_config_set_status(pwsc,ppi->session_id,"Waiting for DB update");
 
     if(!pi_db_wait_update(pwsc)) {
-        pi_log(E_DBG,"Update session stopped\n");
+        /* either the client went away, or this will be run again
+         * once there is an update */
+        pi_log(E_DBG,"No update to send yet\n");
         return;
     }
 
@@ -88,8 +88,10 @@ typedef struct tag_daap_privinfo {
     int empty_strings;
     struct tag_output_info *output_info;
     int session_id;
+    char *uri;          /**< copy of the uri that uri_sections point into */
     char *uri_sections[10];
     WS_CONNINFO *pwsc;
+    char *cache_key;
 } PRIVINFO;
 
 #endif /* _OUT_DAAP_H_ */
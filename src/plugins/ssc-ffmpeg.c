@@ -82,6 +82,11 @@ typedef struct tag_ssc_handle {
 
     char wav_header[44];
     int wav_offset;
+    int block_align;
+
+    int seek_pending;           /* seeked, haven't seen where it landed */
+    uint64_t seek_sample;       /* where we wanted to land */
+    int skip_bytes;             /* decoded output to throw away to get there */
 } SSCHANDLE;
 
 #define SSC_FFMPEG_E_SUCCESS      0
@@ -109,6 +114,7 @@ int ssc_ffmpeg_open(void *pv, MP3FILE *pmp3);
 int ssc_ffmpeg_close(void *pv);
 int ssc_ffmpeg_read(void *pv, char *buffer, int len);
 char *ssc_ffmpeg_error(void *pv);
+int ssc_ffmpeg_seek(void *pv, uint64_t sample);
 
 /* Globals */
 PLUGIN_TRANSCODE_FN _ptfn = {
@@ -117,7 +123,8 @@ PLUGIN_TRANSCODE_FN _ptfn = {
     ssc_ffmpeg_open,
     ssc_ffmpeg_close,
     ssc_ffmpeg_read,
-    ssc_ffmpeg_error
+    ssc_ffmpeg_error,
+    ssc_ffmpeg_seek
 };
 
 PLUGIN_INFO _pi = {
@@ -335,8 +342,58 @@ int ssc_ffmpeg_close(void *vp) {
 }
 
 
+/**
+ * seek to a sample, for a client that skipped ahead.  The demuxer
+ * seeks to the packet at or before the sample, and the difference
+ * gets trimmed off the decoded output once we know where that packet
+ * is.  Raw flac doesn't go through a demuxer, so it can't seek.
+ *
+ * @param vp handle
+ * @param sample sample to seek to
+ * @returns TRUE if the next read starts at the sample, FALSE if
+ *          nothing changed
+ */
+int ssc_ffmpeg_seek(void *vp, uint64_t sample) {
+    SSCHANDLE *handle = (SSCHANDLE *)vp;
+    AVStream *pstream;
+    int64_t ts;
+
+    if((!handle) || (handle->raw) || (!handle->pFmtCtx) ||
+       (!handle->pCodecCtx->sample_rate) || (!handle->block_align))
+        return FALSE;
+
+    pstream = handle->pFmtCtx->streams[handle->audio_stream];
+    ts = av_rescale(sample, pstream->time_base.den,
+                    (int64_t)pstream->time_base.num *
+                    handle->pCodecCtx->sample_rate);
+
+    if(av_seek_frame(handle->pFmtCtx,handle->audio_stream,ts,
+                     AVSEEK_FLAG_BACKWARD) < 0) {
+        pi_log(E_DBG,"Can't seek to sample %llu\n",
+               (unsigned long long)sample);
+        return FALSE;
+    }
+
+    avcodec_flush_buffers(handle->pCodecCtx);
+
+    if(handle->packet.data)
+        av_free_packet(&handle->packet);
+    handle->packet.data = NULL;
+    handle->packet_size = 0;
+    handle->first_frame = 0;
+    handle->buf_remainder_len = 0;
+
+    handle->seek_pending = TRUE;
+    handle->seek_sample = sample;
+    handle->skip_bytes = 0;
+
+    return TRUE;
+}
+
 int _ssc_ffmpeg_read_frame(void *vp, char *buffer, int len) {
     SSCHANDLE *handle = (SSCHANDLE *)vp;
+    AVStream *pstream;
+    int64_t landed;
     int data_size;
     int len1;
     int out_size;
@@ -412,6 +469,17 @@ int _ssc_ffmpeg_read_frame(void *vp, char *buffer, int len) {
         
         handle->packet_size = handle->packet.size;
         handle->packet_data = handle->packet.data;
+
+        if((handle->seek_pending) && (handle->packet.pts != AV_NOPTS_VALUE)) {
+            pstream = handle->pFmtCtx->streams[handle->audio_stream];
+            landed = av_rescale(handle->packet.pts * pstream->time_base.num,
+                                handle->pCodecCtx->sample_rate,
+                                pstream->time_base.den);
+            if(landed < (int64_t)handle->seek_sample)
+                handle->skip_bytes = (int)(handle->seek_sample - landed) *
+                    handle->block_align;
+        }
+        handle->seek_pending = FALSE;
     }
 }
 
@@ -444,6 +512,7 @@ int ssc_ffmpeg_read(void *vp, char *buffer, int len) {
     int bytes_returned = 0;
     int bytes_to_copy;
     int size;
+    char *src;
 
     int channels;
     int sample_rate;
@@ -495,6 +564,7 @@ int ssc_ffmpeg_read(void *vp, char *buffer, int len) {
 
             byte_rate = sample_rate * channels * bits_per_sample / 8;
             block_align = channels * bits_per_sample / 8;
+            handle->block_align = block_align;
 
             pi_log(E_DBG,"Channels.......: %d\n",channels);
             pi_log(E_DBG,"Sample rate....: %d\n",sample_rate);
@@ -557,15 +627,27 @@ int ssc_ffmpeg_read(void *vp, char *buffer, int len) {
             return 0;
         }
 
+        /* trim up to where a seek was supposed to land */
+        src = handle->buffer;
+        if(handle->skip_bytes) {
+            if(size <= handle->skip_bytes) {
+                handle->skip_bytes -= size;
+                continue;
+            }
+            src += handle->skip_bytes;
+            size -= handle->skip_bytes;
+            handle->skip_bytes = 0;
+        }
+
         bytes_to_copy = len - bytes_returned;
         if(size < bytes_to_copy) 
             bytes_to_copy = size;
 
-        memcpy(buffer + bytes_returned, handle->buffer, bytes_to_copy);
+        memcpy(buffer + bytes_returned, src, bytes_to_copy);
         bytes_returned += bytes_to_copy;
 
         if(size > bytes_to_copy) {
-            handle->buf_remainder = handle->buffer + bytes_to_copy;
+            handle->buf_remainder = src + bytes_to_copy;
             handle->buf_remainder_len = size - bytes_to_copy;
         }
 
@@ -10,9 +10,21 @@
 #include <stdint.h>
 #endif
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "ff-dbstruct.h"
 #include "ff-plugins.h"
@@ -22,6 +34,55 @@
 # define FALSE 0
 #endif
 
+/*
+ * Running ssc_prog with popen for every song meant forking the whole
+ * server, then /bin/sh, then the script, all before the first byte
+ * could go out.  Instead, a few small worker processes are forked
+ * off the first time they're needed, and each keeps a socket back to
+ * the server.  To play a song, the server sends a worker a RUN frame
+ * with the script's arguments, and the worker starts the script and
+ * sends back the read end of its stdout with the STARTED reply, so
+ * the pcm comes straight from the script.  A STOP frame has the
+ * worker put an end to the script, if it's still going, and send its
+ * exit status back with DONE.
+ *
+ * There are only general/ssc_script_workers workers, so only that
+ * many songs get transcoded at once.  The rest wait their turn, and
+ * how long they waited gets logged.
+ */
+
+#define SSC_SCRIPT_RUN      1   /**< server to worker, args follow */
+#define SSC_SCRIPT_STOP     2   /**< server to worker */
+#define SSC_SCRIPT_STARTED  3   /**< worker to server, with the pcm fd */
+#define SSC_SCRIPT_FAILED   4   /**< worker to server, value is errno */
+#define SSC_SCRIPT_DONE     5   /**< worker to server, value is exit status */
+
+#define SSC_SCRIPT_DEFAULT_WORKERS 4
+#define SSC_SCRIPT_MAX_ARGS 16
+#define SSC_SCRIPT_REQUEST (PATH_MAX + 128)
+#define SSC_SCRIPT_GRACE_MS 2000    /**< after SIGTERM, before SIGKILL */
+#define SSC_SCRIPT_TIMEOUT 5        /**< seconds to wait on a worker */
+
+typedef struct tag_ssc_script_frame {
+    uint32_t type;
+    int32_t value;
+    uint32_t len;               /**< bytes following the frame */
+} SSC_SCRIPT_FRAME;
+
+typedef struct tag_ssc_script_worker {
+    pid_t pid;
+    int sock;                   /**< -1 if not started yet */
+    pid_t script;               /**< script it's running, if any */
+    int busy;
+} SSC_SCRIPT_WORKER;
+
+typedef struct tag_ssc_handle {
+    SSC_SCRIPT_WORKER *pworker;
+    int fd;                     /**< script's stdout */
+    int running;                /**< worker has a script going */
+    char *error;
+} SSCHANDLE;
+
 /* Forwards */
 void *ssc_script_init(void);
 void ssc_script_deinit(void *vp);
@@ -30,6 +91,17 @@ int ssc_script_close(void *vp);
 int ssc_script_read(void *vp, char *buffer, int len);
 char *ssc_script_error(void *vp);
 
+static SSC_SCRIPT_WORKER *ssc_script_get_worker(void);
+static void ssc_script_release_worker(SSC_SCRIPT_WORKER *pworker);
+static int ssc_script_spawn(SSC_SCRIPT_WORKER *pworker);
+static void ssc_script_reap(SSC_SCRIPT_WORKER *pworker);
+static void ssc_script_worker(int sock);
+static int ssc_script_stop(pid_t pid);
+static void ssc_script_closefrom(int keep);
+static int ssc_script_send(int sock, uint32_t type, int32_t value, int fd, char *data, uint32_t len);
+static int ssc_script_recv(int sock, SSC_SCRIPT_FRAME *pframe, int *pfd);
+static int ssc_script_readall(int sock, char *buffer, int len);
+
 PLUGIN_INFO *plugin_info(void);
 
 #define infn ((PLUGIN_INPUT_FN *)(_pi.pi))
@@ -41,7 +113,8 @@ PLUGIN_TRANSCODE_FN _ptfn = {
     ssc_script_open,
     ssc_script_close,
     ssc_script_read,
-    ssc_script_error
+    ssc_script_error,
+    NULL                   /* can't seek */
 };
 
 PLUGIN_INFO _pi = {
@@ -55,17 +128,25 @@ PLUGIN_INFO _pi = {
     NULL                   /* codeclist */
 };
 
-typedef struct tag_ssc_handle {
-    FILE *fin;
-} SSCHANDLE;
-
 static char *_ssc_script_program = NULL;
+static char *_ssc_script_argv[SSC_SCRIPT_MAX_ARGS + 1];
+
+static pthread_mutex_t _ssc_script_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _ssc_script_cond = PTHREAD_COND_INITIALIZER;
+static SSC_SCRIPT_WORKER *_ssc_script_workers = NULL;
+static int _ssc_script_worker_count = 0;
+static unsigned long _ssc_script_runs = 0;
+static unsigned long _ssc_script_waits = 0;
+static unsigned long _ssc_script_wait_ms = 0;
 
 /**
  * return the plugininfo struct to firefly
  */
 PLUGIN_INFO *plugin_info(void) {
     char *codeclist;
+    char *program;
+    int argc = 0;
+    int index;
 
     _ssc_script_program = pi_conf_alloc_string("general","ssc_prog",NULL);
     if(!_ssc_script_program) {
@@ -80,6 +161,36 @@ PLUGIN_INFO *plugin_info(void) {
         return NULL;
     }
 
+    /* there's no shell, so split up any args here */
+    program = strdup(_ssc_script_program);
+    if(program) {
+        for(program = strtok(program," \t"); program && (argc < SSC_SCRIPT_MAX_ARGS);
+            program = strtok(NULL," \t")) {
+            _ssc_script_argv[argc++] = program;
+        }
+    }
+    _ssc_script_argv[argc] = NULL;
+
+    if(!argc) {
+        pi_log(E_LOG,"Bad ssc_prog for script transcoder.\n");
+        return NULL;
+    }
+
+    _ssc_script_worker_count = pi_conf_get_int("general","ssc_script_workers",
+                                               SSC_SCRIPT_DEFAULT_WORKERS);
+    if(_ssc_script_worker_count < 1)
+        _ssc_script_worker_count = 1;
+
+    _ssc_script_workers = (SSC_SCRIPT_WORKER*)calloc(_ssc_script_worker_count,
+                                                     sizeof(SSC_SCRIPT_WORKER));
+    if(!_ssc_script_workers) {
+        pi_log(E_LOG,"Malloc error starting script transcoder.\n");
+        return NULL;
+    }
+
+    for(index = 0; index < _ssc_script_worker_count; index++)
+        _ssc_script_workers[index].sock = -1;
+
     _pi.codeclist = codeclist;
     return &_pi;
 }
@@ -94,15 +205,21 @@ void *ssc_script_init(void) {
     handle = (SSCHANDLE*)malloc(sizeof(SSCHANDLE));
     if(handle) {
         memset(handle,0,sizeof(SSCHANDLE));
+        handle->fd = -1;
     }
 
     return (void*)handle;
 }
 
 /**
- * FIXME: make register errors in the sschandle
+ * get the last error on a handle
  */
 char *ssc_script_error(void *vp) {
+    SSCHANDLE *handle = (SSCHANDLE*)vp;
+
+    if(handle->error)
+        return handle->error;
+
     return "Unknown";
 }
 
@@ -115,12 +232,10 @@ char *ssc_script_error(void *vp) {
 void ssc_script_deinit(void *vp) {
     SSCHANDLE *handle = (SSCHANDLE*)vp;
 
-    if(handle->fin) {
-        pclose(handle->fin);
-    }
-
-    if(handle)
+    if(handle) {
+        ssc_script_close(vp);
         free(handle);
+    }
 }
 
 /**
@@ -133,72 +248,89 @@ void ssc_script_deinit(void *vp) {
  */
 int ssc_script_open(void *vp, MP3FILE *pmp3) {
     SSCHANDLE *handle = (SSCHANDLE*)vp;
-    char *cmd;
-    char *newpath;
-    char *metachars = "\"\\!(){}#*?$&<>`"; /* More?? */
-    char metacount = 0;
-    char *src,*dst;
-    char *file;
+    SSC_SCRIPT_FRAME frame;
+    char request[SSC_SCRIPT_REQUEST];
     char *codec;
     int duration;
+    int len;
+    int fd;
+    int tries;
 
-    file = pmp3->path;
     codec = pmp3->codectype;
     duration = pmp3->song_length;
 
-
-    src=file;
-    while(*src) {
-        if(strchr(metachars,*src))
-            metacount+=5;
-        src++;
+    /* path, offset, length, codec -- just as ssc_prog gets them */
+    len = snprintf(request,sizeof(request),"%s%c0%c%lu.%03lu%c%s",
+                   pmp3->path,0,0,(unsigned long) duration / 1000,
+                   (unsigned long)duration % 1000,0,
+                   (codec && *codec) ? codec : "*");
+    if((len < 0) || (len >= (int)sizeof(request))) {
+        handle->error = "Path too long";
+        return FALSE;
     }
+    len++;
+
+    handle->pworker = ssc_script_get_worker();
 
-    if(metachars) {
-        newpath = (char*)malloc(strlen(file) + metacount + 1);
-        if(!newpath) {
-            pi_log(E_FATAL,"ssc_script_open: malloc\n");
+    for(tries = 0; tries < 2; tries++) {
+        if((handle->pworker->sock == -1) && (!ssc_script_spawn(handle->pworker))) {
+            handle->error = "Can't start a transcoder process";
+            return FALSE;
         }
-        src=file;
-        dst=newpath;
-
-        while(*src) {
-            if(strchr(metachars,*src)) {
-                *dst++='"';
-                *dst++='\'';
-                *dst++=*src++;
-                *dst++='\'';
-                *dst++='"';
-            } else {
-                *dst++=*src++;
+
+        pi_log(E_INF,"Executing %s \"%s\" (worker %d)\n",_ssc_script_program,
+               pmp3->path,handle->pworker->pid);
+
+        if((ssc_script_send(handle->pworker->sock,SSC_SCRIPT_RUN,0,-1,
+                            request,len)) &&
+           (ssc_script_recv(handle->pworker->sock,&frame,&fd))) {
+            if(frame.type == SSC_SCRIPT_STARTED) {
+                handle->pworker->script = frame.value;
+                handle->fd = fd;
+                handle->running = TRUE;
+                return TRUE;
             }
+
+            pi_log(E_LOG,"Can't run %s: %s\n",_ssc_script_program,
+                   strerror(frame.value));
+            handle->error = "Can't run ssc_prog";
+            return FALSE;
         }
-        *dst='\0';
-    } else {
-        newpath = strdup(file); /* becuase it will be freed... */
-    }
-
-    /* FIXME: is 64 enough? is there a better way to determine this? */
-    cmd=(char *)malloc(strlen(_ssc_script_program) +
-                       strlen(file) +
-                       64);
-    sprintf(cmd, "%s \"%s\" 0 %lu.%03lu \"%s\"",
-            _ssc_script_program, newpath, (unsigned long) duration / 1000,
-            (unsigned long)duration % 1000, (codec && *codec) ? codec : "*");
-    pi_log(E_INF,"Executing %s\n",cmd);
-    handle->fin = popen(cmd, "r");
-    free(newpath);
-    free(cmd);  /* should really have in-place expanded the path */
 
-    return TRUE;
+        /* worker went away -- start another */
+        ssc_script_reap(handle->pworker);
+    }
+
+    handle->error = "Lost transcoder process";
+    return FALSE;
 }
 
 int ssc_script_close(void *vp) {
     SSCHANDLE *handle = (SSCHANDLE*)vp;
+    SSC_SCRIPT_FRAME frame;
+
+    if(handle->fd != -1) {
+        close(handle->fd);
+        handle->fd = -1;
+    }
+
+    if(handle->running) {
+        handle->running = FALSE;
+        if((ssc_script_send(handle->pworker->sock,SSC_SCRIPT_STOP,0,-1,NULL,0)) &&
+           (ssc_script_recv(handle->pworker->sock,&frame,NULL)) &&
+           (frame.type == SSC_SCRIPT_DONE)) {
+            handle->pworker->script = 0;
+            if((WIFEXITED(frame.value)) && (WEXITSTATUS(frame.value)))
+                pi_log(E_LOG,"%s exited with %d\n",_ssc_script_program,
+                       WEXITSTATUS(frame.value));
+        } else {
+            ssc_script_reap(handle->pworker);
+        }
+    }
 
-    if(handle->fin) {
-        pclose(handle->fin);
-        handle->fin=NULL;
+    if(handle->pworker) {
+        ssc_script_release_worker(handle->pworker);
+        handle->pworker = NULL;
     }
 
     return TRUE;
@@ -206,7 +338,436 @@ int ssc_script_close(void *vp) {
 
 int ssc_script_read(void *vp, char *buffer, int len) {
     SSCHANDLE *handle = (SSCHANDLE*)vp;
+    int bytes_read;
+
+    do {
+        bytes_read = read(handle->fd,buffer,len);
+    } while((bytes_read < 0) && (errno == EINTR));
+
+    return bytes_read;
+}
+
+/**
+ * wait for a free worker
+ *
+ * @returns the worker, which is ours until ssc_script_release_worker
+ */
+SSC_SCRIPT_WORKER *ssc_script_get_worker(void) {
+    SSC_SCRIPT_WORKER *pworker = NULL;
+    struct timeval start, now;
+    unsigned long waited = 0;
+    int queued = FALSE;
+    int index;
+
+    gettimeofday(&start,NULL);
+
+    pthread_mutex_lock(&_ssc_script_lock);
+    while(1) {
+        for(index = 0; index < _ssc_script_worker_count; index++) {
+            if(!_ssc_script_workers[index].busy) {
+                pworker = &_ssc_script_workers[index];
+                break;
+            }
+        }
+
+        if(pworker)
+            break;
+
+        queued = TRUE;
+        pthread_cond_wait(&_ssc_script_cond,&_ssc_script_lock);
+        gettimeofday(&now,NULL);
+        waited = (now.tv_sec - start.tv_sec) * 1000 +
+            (now.tv_usec - start.tv_usec) / 1000;
+    }
+
+    pworker->busy = TRUE;
+    _ssc_script_runs++;
+    if(queued) {
+        _ssc_script_waits++;
+        _ssc_script_wait_ms += waited;
+    }
+    pthread_mutex_unlock(&_ssc_script_lock);
+
+    if(queued) {
+        pi_log(E_INF,"Waited %lu ms for one of %d transcoders\n",waited,
+               _ssc_script_worker_count);
+    }
+    pi_log(E_DBG,"%lu transcodes, %lu waited, %lu ms waiting in all\n",
+           _ssc_script_runs, _ssc_script_waits, _ssc_script_wait_ms);
+
+    return pworker;
+}
+
+/**
+ * give a worker back for the next transcode
+ */
+void ssc_script_release_worker(SSC_SCRIPT_WORKER *pworker) {
+    pthread_mutex_lock(&_ssc_script_lock);
+    pworker->busy = FALSE;
+    pthread_cond_signal(&_ssc_script_cond);
+    pthread_mutex_unlock(&_ssc_script_lock);
+}
+
+/**
+ * fork off a worker process
+ *
+ * @param pworker worker slot to start
+ * @returns TRUE on success, FALSE otherwise
+ */
+int ssc_script_spawn(SSC_SCRIPT_WORKER *pworker) {
+    struct timeval timeout;
+    int sv[2];
+    pid_t pid;
+
+    if(socketpair(AF_UNIX,SOCK_STREAM,0,sv) < 0) {
+        pi_log(E_LOG,"Can't make transcoder socket: %s\n",strerror(errno));
+        return FALSE;
+    }
+
+    pid = fork();
+    if(pid < 0) {
+        pi_log(E_LOG,"Can't start transcoder: %s\n",strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return FALSE;
+    }
+
+    if(!pid) {
+        close(sv[0]);
+        ssc_script_worker(sv[1]);
+        _exit(0);
+    }
 
-    return fread(buffer,1,len,handle->fin);
+    close(sv[1]);
+
+    /* a wedged worker shouldn't wedge the server, too */
+    timeout.tv_sec = SSC_SCRIPT_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(sv[0],SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+
+    pworker->pid = pid;
+    pworker->sock = sv[0];
+    pworker->script = 0;
+    return TRUE;
+}
+
+/**
+ * get rid of a worker that stopped answering, so a new one gets
+ * started next time
+ */
+void ssc_script_reap(SSC_SCRIPT_WORKER *pworker) {
+    if(pworker->sock != -1) {
+        pi_log(E_LOG,"Lost transcoder process %d\n",pworker->pid);
+        close(pworker->sock);
+        if(pworker->script)
+            kill(-pworker->script,SIGKILL);
+        kill(pworker->pid,SIGKILL);
+        waitpid(pworker->pid,NULL,0);
+    }
+
+    pworker->sock = -1;
+    pworker->pid = 0;
+    pworker->script = 0;
+}
+
+/**
+ * put an end to a script (and whatever it started), giving it a
+ * little while to go quietly before killing it
+ *
+ * @param pid script to stop
+ * @returns its wait status
+ */
+int ssc_script_stop(pid_t pid) {
+    int status = 0;
+    int waited;
+    pid_t result;
+
+    kill(-pid,SIGTERM);
+    for(waited = 0; waited < SSC_SCRIPT_GRACE_MS; waited += 20) {
+        result = waitpid(pid,&status,WNOHANG);
+        if((result == pid) || ((result < 0) && (errno != EINTR)))
+            return status;
+        usleep(20000);
+    }
+
+    kill(-pid,SIGKILL);
+    while((waitpid(pid,&status,0) < 0) && (errno == EINTR))
+        ;
+
+    return status;
+}
+
+/**
+ * close every fd past stderr but one, without trying every possible
+ * fd number -- the limit can be in the millions
+ *
+ * @param keep fd to leave open
+ */
+void ssc_script_closefrom(int keep) {
+    DIR *pdir;
+    struct dirent *pde;
+    int fd;
+
+#ifdef SYS_close_range
+    if((keep > 3) && (!syscall(SYS_close_range,3,keep - 1,0)) &&
+       (!syscall(SYS_close_range,keep + 1,~0U,0)))
+        return;
+    if((keep == 3) && (!syscall(SYS_close_range,4,~0U,0)))
+        return;
+#endif
+
+    if((pdir = opendir("/proc/self/fd"))) {
+        while((pde = readdir(pdir))) {
+            fd = atoi(pde->d_name);
+            if((fd > 2) && (fd != keep) && (fd != dirfd(pdir)))
+                close(fd);
+        }
+        closedir(pdir);
+        return;
+    }
+
+    for(fd = sysconf(_SC_OPEN_MAX) - 1; fd > 2; fd--) {
+        if(fd != keep)
+            close(fd);
+    }
+}
+
+/**
+ * the worker process.  This is a fork of a threaded server, so it
+ * sticks to plain system calls: no logging, and no malloc past
+ * reading /proc/self/fd at startup.
+ *
+ * @param sock socket back to the server
+ */
+void ssc_script_worker(int sock) {
+    static char request[SSC_SCRIPT_REQUEST];
+    char *argv[SSC_SCRIPT_MAX_ARGS + 5];
+    SSC_SCRIPT_FRAME frame;
+    sigset_t set;
+    pid_t pid = 0;
+    int status;
+    int fds[2];
+    int argc;
+    int fd;
+    char *arg;
+
+    /* don't hold the server's files, clients, or other workers open */
+    ssc_script_closefrom(sock);
+
+    /* the server has these blocked or ignored, the script shouldn't */
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK,&set,NULL);
+    signal(SIGPIPE,SIG_DFL);
+
+    while(ssc_script_recv(sock,&frame,NULL)) {
+        if(frame.len > sizeof(request))
+            break;
+        if((frame.len) && (!ssc_script_readall(sock,request,frame.len)))
+            break;
+
+        if(frame.type == SSC_SCRIPT_STOP) {
+            status = 0;
+            if(pid) {
+                status = ssc_script_stop(pid);
+                pid = 0;
+            }
+            if(!ssc_script_send(sock,SSC_SCRIPT_DONE,status,-1,NULL,0))
+                break;
+            continue;
+        }
+
+        if((frame.type != SSC_SCRIPT_RUN) || (pid) || (!frame.len))
+            break;
+
+        request[frame.len - 1] = '\0';
+        for(argc = 0; _ssc_script_argv[argc]; argc++)
+            argv[argc] = _ssc_script_argv[argc];
+        for(arg = request; (arg < request + frame.len) && (argc < SSC_SCRIPT_MAX_ARGS + 4);
+            arg += strlen(arg) + 1) {
+            argv[argc++] = arg;
+        }
+        argv[argc] = NULL;
+
+        if(pipe(fds) < 0) {
+            if(!ssc_script_send(sock,SSC_SCRIPT_FAILED,errno,-1,NULL,0))
+                break;
+            continue;
+        }
+
+        pid = fork();
+        if(pid < 0) {
+            pid = 0;
+            close(fds[0]);
+            close(fds[1]);
+            if(!ssc_script_send(sock,SSC_SCRIPT_FAILED,errno,-1,NULL,0))
+                break;
+            continue;
+        }
+
+        if(!pid) {
+            /* own group, so STOP gets the decoders it starts, too */
+            setpgid(0,0);
+            dup2(fds[1],1);
+            close(fds[0]);
+            close(fds[1]);
+            close(sock);
+            execvp(argv[0],argv);
+            _exit(127);
+        }
+
+        close(fds[1]);
+        fd = fds[0];
+        if(!ssc_script_send(sock,SSC_SCRIPT_STARTED,pid,fd,NULL,0))
+            break;
+        close(fd);
+    }
+
+    /* server is gone */
+    if(pid)
+        ssc_script_stop(pid);
 }
 
+/**
+ * send a frame, and maybe an fd and some data along with it
+ *
+ * @returns TRUE on success, FALSE if the other end is gone
+ */
+int ssc_script_send(int sock, uint32_t type, int32_t value, int fd, char *data, uint32_t len) {
+    SSC_SCRIPT_FRAME frame;
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct cmsghdr *pcmsg;
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(int))];
+    } control;
+    int sent;
+    int written;
+    int total;
+
+    frame.type = type;
+    frame.value = value;
+    frame.len = len;
+
+    memset(&msg,0,sizeof(msg));
+    iov[0].iov_base = (void*)&frame;
+    iov[0].iov_len = sizeof(frame);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+
+    if(fd != -1) {
+        msg.msg_control = control.control;
+        msg.msg_controllen = sizeof(control.control);
+        pcmsg = CMSG_FIRSTHDR(&msg);
+        pcmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        pcmsg->cmsg_level = SOL_SOCKET;
+        pcmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(pcmsg),&fd,sizeof(int));
+    }
+
+    do {
+        sent = sendmsg(sock,&msg,0);
+    } while((sent < 0) && (errno == EINTR));
+
+    if(sent < 0)
+        return FALSE;
+
+    /* anything that didn't make it goes out without the fd */
+    total = sizeof(frame) + len;
+    while(sent < total) {
+        if(sent < (int)sizeof(frame))
+            written = write(sock,(char*)&frame + sent,sizeof(frame) - sent);
+        else
+            written = write(sock,data + (sent - sizeof(frame)),total - sent);
+
+        if((written < 0) && (errno == EINTR))
+            continue;
+        if(written <= 0)
+            return FALSE;
+        sent += written;
+    }
+
+    return TRUE;
+}
+
+/**
+ * get the next frame, and the fd that came with it, if any.  The
+ * data after the frame (frame.len bytes) is left for the caller.
+ *
+ * @param sock socket to read
+ * @param pframe frame to fill
+ * @param pfd returns the fd, or -1 (NULL to not take one)
+ * @returns TRUE on success, FALSE if the other end is gone
+ */
+int ssc_script_recv(int sock, SSC_SCRIPT_FRAME *pframe, int *pfd) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *pcmsg;
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(int))];
+    } control;
+    int received;
+    int fd = -1;
+
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = (void*)pframe;
+    iov.iov_len = sizeof(SSC_SCRIPT_FRAME);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.control;
+    msg.msg_controllen = sizeof(control.control);
+
+    do {
+        received = recvmsg(sock,&msg,0);
+    } while((received < 0) && (errno == EINTR));
+
+    if(received <= 0)
+        return FALSE;
+
+    pcmsg = CMSG_FIRSTHDR(&msg);
+    if((pcmsg) && (pcmsg->cmsg_level == SOL_SOCKET) &&
+       (pcmsg->cmsg_type == SCM_RIGHTS))
+        memcpy(&fd,CMSG_DATA(pcmsg),sizeof(int));
+
+    if(pfd)
+        *pfd = fd;
+    else if(fd != -1)
+        close(fd);
+
+    if(received < (int)sizeof(SSC_SCRIPT_FRAME)) {
+        if(!ssc_script_readall(sock,(char*)pframe + received,
+                               sizeof(SSC_SCRIPT_FRAME) - received)) {
+            if((pfd) && (fd != -1)) {
+                close(fd);
+                *pfd = -1;
+            }
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * read exactly len bytes
+ *
+ * @returns TRUE on success, FALSE if the other end is gone
+ */
+int ssc_script_readall(int sock, char *buffer, int len) {
+    int bytes_read;
+
+    while(len) {
+        bytes_read = read(sock,buffer,len);
+        if((bytes_read < 0) && (errno == EINTR))
+            continue;
+        if(bytes_read <= 0)
+            return FALSE;
+        buffer += bytes_read;
+        len -= bytes_read;
+    }
+
+    return TRUE;
+}
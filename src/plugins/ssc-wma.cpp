@@ -80,7 +80,8 @@ PLUGIN_TRANSCODE_FN _ptfn = {
     ssc_wma_open,
     ssc_wma_close,
     ssc_wma_read,
-    ssc_wma_error
+    ssc_wma_error,
+    NULL                   /* can't seek */
 };
 
 PLUGIN_INFO _pi = {
@@ -111,6 +111,10 @@ static void RB_ENTRY(_delete_fix)(struct RB_ENTRY(node) **, struct RB_ENTRY(node
 static void RB_ENTRY(_walk)(const struct RB_ENTRY(node) *, void (*)(const RB_ENTRY(data_t) *, const VISIT, const int, void *), void *, int);
 #endif
 
+#ifndef no_build
+static struct RB_ENTRY(node) *RB_ENTRY(_build)(const RB_ENTRY(data_t) **, int, int, int, struct RB_ENTRY(node) *);
+#endif
+
 #ifndef no_readlist
 static RBLIST *RB_ENTRY(_openlist)(const struct RB_ENTRY(node) *);
 static const RB_ENTRY(data_t) * RB_ENTRY(_readlist)(RBLIST *);
@@ -278,6 +282,47 @@ RB_ENTRY(closelist)(RBLIST *rblistp)
 }
 #endif /* no_readlist */
 
+#ifndef no_build
+/*
+ * Fill an empty tree from an array of keys that are already sorted
+ * (and unique) by the tree's comparison routine, without doing any
+ * comparisons or rotations. Returns 0 on success, -1 if the tree
+ * isn't empty or we run out of memory (in which case the tree is
+ * left empty).
+ */
+RB_STATIC int
+RB_ENTRY(build)(const RB_ENTRY(data_t) **keys, int count, struct RB_ENTRY(tree) *rbinfo)
+{
+        int depth=0;
+
+        if (rbinfo==NULL || rbinfo->rb_root!=RBNULL || count < 0)
+                return(-1);
+
+        if (count==0)
+                return(0);
+
+        /* The tree comes out as full as it can be, so every level is
+        ** complete but the bottom one. Colouring the bottom level red
+        ** (when it isn't complete) keeps the black height the same
+        ** along every path.
+        */
+        while ((2 << depth) - 1 < count)
+                depth++;
+
+        if ((2 << depth) - 1 == count)
+                depth=-1;
+
+        rbinfo->rb_root=RB_ENTRY(_build)(keys, count, 0, depth, RBNULL);
+        if (rbinfo->rb_root==NULL)
+        {
+                rbinfo->rb_root=RBNULL;
+                return(-1);
+        }
+
+        return(0);
+}
+#endif /* no_build */
+
 #ifndef no_lookup
 RB_STATIC const RB_ENTRY(data_t) *
 RB_ENTRY(lookup)(int mode, const RB_ENTRY(data_t) *key, struct RB_ENTRY(tree) *rbinfo)
@@ -871,6 +916,45 @@ RB_ENTRY(_walk)(const struct RB_ENTRY(node) *x, void (*action)(const RB_ENTRY(da
 }
 #endif /* no_walk */
 
+#ifndef no_build
+/*
+** Build a subtree from count sorted keys, splitting at the middle.
+** Nodes at red_level are coloured red, the rest black.
+*/
+static struct RB_ENTRY(node) *
+RB_ENTRY(_build)(const RB_ENTRY(data_t) **keys, int count, int level, int red_level, struct RB_ENTRY(node) *up)
+{
+        struct RB_ENTRY(node) *x;
+        int mid;
+
+        if (count==0)
+                return(RBNULL);
+
+        if ((x=RB_ENTRY(_alloc)())==NULL)
+                return(NULL);
+
+        mid=count/2;
+
+        x->up=up;
+        x->colour=(level==red_level) ? RED : BLACK;
+        RB_SET(x, key, keys[mid]);
+
+        x->left=RB_ENTRY(_build)(keys, mid, level+1, red_level, x);
+        if (x->left!=NULL)
+                x->right=RB_ENTRY(_build)(keys+mid+1, count-mid-1, level+1, red_level, x);
+
+        if (x->left==NULL || x->right==NULL)
+        {
+                if (x->left!=NULL && x->left!=RBNULL)
+                        RB_ENTRY(_destroy)(x->left);
+                RB_ENTRY(_free)(x);
+                return(NULL);
+        }
+
+        return(x);
+}
+#endif /* no_build */
+
 #ifndef no_readlist
 static RBLIST *
 RB_ENTRY(_openlist)(const struct RB_ENTRY(node) *rootp)
@@ -122,6 +122,10 @@ RB_STATIC void RB_ENTRY(walk)(const struct RB_ENTRY(tree) *,
                 void *); 
 #endif
 
+#ifndef no_build
+RB_STATIC int RB_ENTRY(build)(const RB_ENTRY(data_t) **, int, struct RB_ENTRY(tree) *);
+#endif
+
 #ifndef no_readlist
 RB_STATIC RBLIST *RB_ENTRY(openlist)(const struct RB_ENTRY(tree) *); 
 RB_STATIC const RB_ENTRY(data_t) *RB_ENTRY(readlist)(RBLIST *); 
@@ -14,6 +14,7 @@
 # include "config.h"
 #endif
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +23,7 @@
 #include "daapd.h"
 #include "err.h"
 #include "ff-dbstruct.h"
+#include "idset.h"
 
 #ifdef HAVE_SQL
 extern int db_sql_escape(char *buffer, int *size, char *fmt, ...);
@@ -65,6 +67,39 @@ typedef struct tag_sp_node {
 #define SP_OPTYPE_INT64   4
 #define SP_OPTYPE_DATE    5
 
+/**
+ * Smart playlists get checked against every song that gets added
+ * during a scan, so rather than walking the parse tree each time,
+ * the tree gets flattened into a little program once it's parsed.
+ *
+ * Each compare sets a result flag.  And/or nodes become conditional
+ * jumps over the right hand side, so evaluation short circuits the
+ * same way the && and || did.  Field offsets are looked up once, and
+ * string needles are lowercased and measured once.
+ */
+#define SP_OP_JFALSE      0 /**< jump if result is false (and) */
+#define SP_OP_JTRUE       1 /**< jump if result is true (or) */
+#define SP_OP_INCLUDES    2
+#define SP_OP_STARTSWITH  3
+#define SP_OP_ENDSWITH    4
+#define SP_OP_STREQUAL    5
+#define SP_OP_INT32       6 /**< numeric compare on a 32 bit field */
+#define SP_OP_INT64       7 /**< numeric compare on a 64 bit field */
+
+typedef struct tag_sp_insn {
+    int opcode;
+    int cmp;           /**< T_LESS, T_EQUAL, etc for numeric ops */
+    int not_flag;
+    int field_id;      /**< column in a MEDIA_STRING */
+    int offset;        /**< offset in a MEDIA_NATIVE, -1 if not there */
+    int len;           /**< needle length for string ops */
+    int target;        /**< pc to jump to for SP_OP_JFALSE/JTRUE */
+    union {
+        char *cvalue;  /**< lowercased needle */
+        int64_t ivalue;
+    } value;
+} SP_INSN;
+
 #define SP_HINT_NONE      0
 #define SP_HINT_STRING    1
 #define SP_HINT_INT       2
@@ -355,6 +390,8 @@ typedef struct tag_parsetree {
     SP_TOKEN token;
     int token_pos;
     SP_NODE *tree;
+    SP_INSN *program;
+    int program_len;
     char *error;
     char level;
 } PARSESTRUCT, *PARSETREE;
@@ -408,7 +445,16 @@ static time_t sp_parse_date(PARSETREE tree);
 static time_t sp_parse_date_interval(PARSETREE tree);
 static void sp_free_node(SP_NODE *node);
 static void sp_set_error(PARSETREE tree,int error);
-static int sp_node_matches(SP_NODE *node, MEDIA_STRING *pms, MEDIA_NATIVE *pmn);
+static int sp_node_count(SP_NODE *node);
+static int sp_compile_node(SP_NODE *node, SP_INSN *program, int pc);
+static void sp_free_program(PARSETREE tree);
+static int sp_prefix_matches(char *str, char *needle, int len);
+static int sp_program_matches(PARSETREE tree, MEDIA_STRING *pms, MEDIA_NATIVE *pmn);
+static int sp_insn_matches(SP_INSN *pinsn, char *val_string, int64_t val);
+static int sp_plan_test(void *arg, char *val_string, int64_t val);
+static int sp_plan_node(PARSETREE tree, SP_NODE *node, int *ppc, IDSET *pall,
+                        IDSET *(*lookup)(int, int(*)(void *, char *, int64_t), void *),
+                        int *pindexed, IDSET **ppyes, IDSET **ppmaybe);
 
 /**
  * simple logging funcitons
@@ -736,12 +782,18 @@ int sp_parse(PARSETREE tree, char *term, int type) {
 
     if(tree->tree)
         sp_free_node(tree->tree);
+    sp_free_program(tree);
 
     sp_scan(tree,SP_HINT_NONE);
     tree->tree = sp_parse_phrase(tree);
 
     if(tree->tree) {
         DPRINTF(E_SPAM,L_PARSE,"Parsed successfully (type %d)\n",type);
+        tree->program_len = sp_node_count(tree->tree);
+        tree->program = (SP_INSN*)calloc(tree->program_len,sizeof(SP_INSN));
+        if(!tree->program)
+            DPRINTF(E_FATAL,L_PARSE,"Malloc Error\n");
+        sp_compile_node(tree->tree,tree->program,0);
     } else {
         DPRINTF(E_SPAM,L_PARSE,"Parsing error (type %d)\n",type);
     }
@@ -1350,6 +1402,10 @@ int sp_dispose(PARSETREE tree) {
     if(tree->error)
         free(tree->error);
 
+    if(tree->tree)
+        sp_free_node(tree->tree);
+    sp_free_program(tree);
+
     free(tree);
     return 1;
 }
@@ -1537,6 +1593,143 @@ void sp_set_error(PARSETREE tree, int error) {
     return;
 }
 
+/**
+ * count the instructions it will take to compile a node tree.
+ * Every node is one instruction: compares are compares, and
+ * and/or nodes are the jump between their two halves.
+ *
+ * @param node node tree to count
+ * @returns number of instructions
+ */
+int sp_node_count(SP_NODE *node) {
+    if(node->op_type == SP_OPTYPE_ANDOR)
+        return 1 + sp_node_count(node->left.node) +
+            sp_node_count(node->right.node);
+
+    return 1;
+}
+
+/**
+ * compile a node tree into a flat program
+ *
+ * @param node node tree to compile
+ * @param program program to compile into (sized by sp_node_count)
+ * @param pc where in the program to put it
+ * @returns pc of the next free instruction
+ */
+int sp_compile_node(SP_NODE *node, SP_INSN *program, int pc) {
+    SP_INSN *pinsn;
+    int field;
+    int jump_pc;
+    char *src, *dst;
+
+    if(node->op_type == SP_OPTYPE_ANDOR) {
+        pc = sp_compile_node(node->left.node, program, pc);
+        jump_pc = pc++;
+        program[jump_pc].opcode = (node->op == T_AND) ? SP_OP_JFALSE : SP_OP_JTRUE;
+        pc = sp_compile_node(node->right.node, program, pc);
+        program[jump_pc].target = pc;
+        return pc;
+    }
+
+    pinsn = &program[pc];
+    pinsn->cmp = node->op;
+    pinsn->not_flag = node->not_flag;
+
+    /* the parser's field ids follow the db columns, not MEDIA_NATIVE
+     * or MEDIA_STRING, so look the field up again by name */
+    pinsn->field_id = -1;
+    pinsn->offset = -1;
+    for(field = 0; field < SG_LAST; field++) {
+        if(strcasecmp(ff_field_data[field].name, node->left.field) == 0) {
+            pinsn->field_id = field;
+            pinsn->offset = ff_field_data[field].offset;
+            break;
+        }
+    }
+
+    if(node->op_type == SP_OPTYPE_STRING) {
+        switch(node->op) {
+        case T_INCLUDES:
+            pinsn->opcode = SP_OP_INCLUDES;
+            break;
+        case T_STARTSWITH:
+            pinsn->opcode = SP_OP_STARTSWITH;
+            break;
+        case T_ENDSWITH:
+            pinsn->opcode = SP_OP_ENDSWITH;
+            break;
+        case T_EQUAL:
+            pinsn->opcode = SP_OP_STREQUAL;
+            break;
+        default:
+            DPRINTF(E_FATAL,L_PARSE,"Bad string op\n");
+            break;
+        }
+
+        pinsn->len = (int)strlen(node->right.cvalue);
+        pinsn->value.cvalue = (char*)malloc(pinsn->len + 1);
+        if(!pinsn->value.cvalue)
+            DPRINTF(E_FATAL,L_PARSE,"Malloc Error\n");
+
+        src = node->right.cvalue;
+        dst = pinsn->value.cvalue;
+        while(*src)
+            *dst++ = tolower((unsigned char)*src++);
+        *dst = '\0';
+    } else {
+        if((field < SG_LAST) && (ff_field_data[field].type == FT_INT64))
+            pinsn->opcode = SP_OP_INT64;
+        else
+            pinsn->opcode = SP_OP_INT32;
+
+        if(node->op_type == SP_OPTYPE_DATE)
+            pinsn->value.ivalue = (int64_t)node->right.tvalue;
+        else
+            pinsn->value.ivalue = (int64_t)(uint32_t)node->right.ivalue;
+    }
+
+    return pc + 1;
+}
+
+/**
+ * free a compiled program
+ *
+ * @param tree tree to free the program from
+ */
+void sp_free_program(PARSETREE tree) {
+    int pc;
+
+    if(!tree->program)
+        return;
+
+    for(pc = 0; pc < tree->program_len; pc++) {
+        if((tree->program[pc].opcode >= SP_OP_INCLUDES) &&
+           (tree->program[pc].opcode <= SP_OP_STREQUAL))
+            free(tree->program[pc].value.cvalue);
+    }
+
+    free(tree->program);
+    tree->program = NULL;
+    tree->program_len = 0;
+}
+
+/**
+ * compare the start of a string against a lowercased needle
+ *
+ * @param str string to check
+ * @param needle lowercased needle
+ * @param len length of needle
+ * @returns TRUE if str starts with needle, ignoring case
+ */
+int sp_prefix_matches(char *str, char *needle, int len) {
+    while(len--) {
+        if(tolower((unsigned char)*str++) != *needle++)
+            return FALSE;
+    }
+    return TRUE;
+}
+
 /**
  * see if the given parse tree matches the passed mediaobject
  *
@@ -1545,7 +1738,7 @@ void sp_set_error(PARSETREE tree, int error) {
  * @returns TRUE if successful match, FALSE otherwise
  */
 int sp_matches_native(PARSETREE tree, MEDIA_NATIVE *pmn) {
-    return sp_node_matches(tree->tree, NULL, pmn);
+    return sp_program_matches(tree, NULL, pmn);
 }
 
 /**
@@ -1556,185 +1749,262 @@ int sp_matches_native(PARSETREE tree, MEDIA_NATIVE *pmn) {
  * @returns TRUE if successful match, FALSE otherwise
  */
 int sp_matches_string(PARSETREE tree, MEDIA_STRING *pms) {
-    return sp_node_matches(tree->tree, pms, NULL);
+    return sp_program_matches(tree, pms, NULL);
 }
 
 /**
- * see if the given node tree matches the passed mediaobject
+ * run a compiled tree against the passed media object
  *
- * @param node node to check
- * @param pmo media object to compare to parse tree
+ * @param tree parsetree to run
+ * @param pms string media object, or NULL
+ * @param pmn native media object, or NULL
  * @returns TRUE if successful match, FALSE otherwise
  */
-int sp_node_matches(SP_NODE *node, MEDIA_STRING *pms, MEDIA_NATIVE *pmn) {
+int sp_program_matches(PARSETREE tree, MEDIA_STRING *pms, MEDIA_NATIVE *pmn) {
+    SP_INSN *pinsn;
+    SP_INSN *pend;
     char *val_string;
-    uint32_t val_uint32;
-    uint64_t val_uint64;
-    time_t val_date;
+    int64_t val;
     int result = FALSE;
-    int offset;
-    int is_native = (pmn != NULL);
-    char **tmp;
 
     ASSERT((pmn)||(pms));
 
-    if((!pmn) && (!pms))
+    if(((!pmn) && (!pms)) || (!tree->program))
         return FALSE;
 
-    if(node->op_type == SP_OPTYPE_ANDOR) {
-        if(node->op == T_AND) {
-            return (sp_node_matches(node->right.node,pms,pmn) &&
-                    sp_node_matches(node->left.node,pms,pmn));
-        } else {
-            return (sp_node_matches(node->right.node,pms,pmn) ||
-                    sp_node_matches(node->left.node,pms,pmn));
-        }
-    }
-
-    // Actually check the node
-    offset = ff_field_data[node->field_id].offset;
+    pinsn = tree->program;
+    pend = pinsn + tree->program_len;
 
-    if(node->op_type == SP_OPTYPE_STRING) {
-        if(!is_native) {
-            tmp = (char **)pms;
-            val_string = tmp[node->field_id];
-            val_string = tmp[node->field_id] ? tmp[node->field_id] : "";
-        } else {
-            val_string = *(char**)(((void*)pmn)+offset);
-            if(!val_string) val_string = "";
-        }
-
-        switch(node->op) {
-        case T_INCLUDES:
-            if(strcasestr(val_string,node->right.cvalue))
-                result = TRUE;
-            break;
-        case T_STARTSWITH:
-            if(strlen(node->right.cvalue) <= strlen(val_string) &&
-               (strncasecmp(val_string,node->right.cvalue,strlen(node->right.cvalue)) == 0))
-                result = TRUE;
-            break;
-        case T_ENDSWITH:
-            offset = strlen(val_string) - strlen(node->right.cvalue);
-            if(offset >= 0) {
-                if(strncasecmp(val_string+offset,node->right.cvalue,strlen(node->right.cvalue)) == 0)
-                    result = TRUE;
+    while(pinsn < pend) {
+        switch(pinsn->opcode) {
+        case SP_OP_JFALSE:
+            if(!result) {
+                pinsn = &tree->program[pinsn->target];
+                continue;
             }
-            break;
-        case T_EQUAL:
-            if(strcasecmp(val_string, node->right.cvalue) == 0)
-                result = TRUE;
+            pinsn++;
+            continue;
+        case SP_OP_JTRUE:
+            if(result) {
+                pinsn = &tree->program[pinsn->target];
+                continue;
+            }
+            pinsn++;
+            continue;
+        case SP_OP_INT32:
+        case SP_OP_INT64:
+            if(pmn) {
+                if(pinsn->offset == -1)
+                    val = 0;
+                else if(pinsn->opcode == SP_OP_INT64)
+                    val = (int64_t)*((uint64_t*)((char*)pmn + pinsn->offset));
+                else
+                    val = (int64_t)*((uint32_t*)((char*)pmn + pinsn->offset));
+            } else {
+                val_string = (pinsn->field_id == -1) ? NULL :
+                    ((char**)pms)[pinsn->field_id];
+                val = val_string ? (int64_t)strtoull(val_string,NULL,10) : 0;
+            }
+
+            result = sp_insn_matches(pinsn, NULL, val);
             break;
         default:
-            DPRINTF(E_FATAL,L_PARSE,"Bad string op\n");
+            if(pmn) {
+                val_string = (pinsn->offset == -1) ? NULL :
+                    *(char**)((char*)pmn + pinsn->offset);
+            } else {
+                val_string = (pinsn->field_id == -1) ? NULL :
+                    ((char**)pms)[pinsn->field_id];
+            }
+            result = sp_insn_matches(pinsn, val_string, 0);
             break;
         }
-    } else if(node->op_type == SP_OPTYPE_INT) {
-        if(!is_native) {
-            tmp = (char **)pms;
-            if(tmp[node->field_id])
-                val_uint32 = strtoul(tmp[node->field_id],NULL,10);
-            else
-                val_uint32 = 0;
-        } else {
-            val_uint32 = *((uint32_t*)(((void*)pmn)+offset));
-        }
-        switch(node->op) {
+
+        if(pinsn->not_flag)
+            result = !result;
+        pinsn++;
+    }
+
+    return result;
+}
+
+/**
+ * run a single compare, without the not.  Numeric compares use val,
+ * string compares use val_string.
+ *
+ * @param pinsn compare to run
+ * @param val_string string value of the field (NULL is empty)
+ * @param val numeric value of the field
+ * @returns TRUE if it matches, FALSE otherwise
+ */
+int sp_insn_matches(SP_INSN *pinsn, char *val_string, int64_t val) {
+    int val_len;
+
+    switch(pinsn->opcode) {
+    case SP_OP_INT32:
+    case SP_OP_INT64:
+        switch(pinsn->cmp) {
         case T_LESSEQUAL:
-            if(val_uint32 <= node->right.ivalue)
-                result = TRUE;
-            break;
+            return (val <= pinsn->value.ivalue);
         case T_LESS:
-            if(val_uint32 < node->right.ivalue)
-                result = TRUE;
-            break;
+            return (val < pinsn->value.ivalue);
         case T_GREATEREQUAL:
-            if(val_uint32 >= node->right.ivalue)
-                result = TRUE;
-            break;
+            return (val >= pinsn->value.ivalue);
         case T_GREATER:
-            if(val_uint32 > node->right.ivalue)
-                result = TRUE;
-            break;
-        case T_EQUAL:
-            if(val_uint32 == node->right.ivalue)
-                result = TRUE;
-            break;
+            return (val > pinsn->value.ivalue);
         default:
-            DPRINTF(E_FATAL,L_PARSE,"Bad int op\n");
-            break;
+            return (val == pinsn->value.ivalue);
         }
-    } else if(node->op_type == SP_OPTYPE_INT64) {
-        if(!is_native) {
-            tmp = (char**)pms;
-            if(tmp)
-                val_uint64 = strtoull(tmp[node->field_id],NULL,10);
-            else
-                val_uint64 = 0;
-        } else {
-            val_uint64 = *((uint64_t*)(((void*)pmn)+offset));
+    }
+
+    if(!val_string)
+        val_string = "";
+
+    switch(pinsn->opcode) {
+    case SP_OP_INCLUDES:
+        if(!pinsn->len)
+            return TRUE;
+        while(*val_string) {
+            if((tolower((unsigned char)*val_string) == pinsn->value.cvalue[0]) &&
+               (sp_prefix_matches(val_string,pinsn->value.cvalue,pinsn->len)))
+                return TRUE;
+            val_string++;
         }
-        switch(node->op) {
-        case T_LESSEQUAL:
-            if(val_uint64 <= node->right.ivalue64)
-                result = TRUE;
-            break;
-        case T_LESS:
-            if(val_uint64 < node->right.ivalue64)
-                result = TRUE;
-            break;
-        case T_GREATEREQUAL:
-            if(val_uint64 >= node->right.ivalue64)
-                result = TRUE;
-            break;
-        case T_GREATER:
-            if(val_uint64 > node->right.ivalue64)
-                result = TRUE;
-            break;
-        case T_EQUAL:
-            if(val_uint64 == node->right.ivalue64)
-                result = TRUE;
-            break;
-        default:
-            DPRINTF(E_FATAL,L_PARSE,"Bad int64 op\n");
-            break;
+        return FALSE;
+    case SP_OP_STARTSWITH:
+        return sp_prefix_matches(val_string,pinsn->value.cvalue,pinsn->len);
+    case SP_OP_ENDSWITH:
+        val_len = (int)strlen(val_string);
+        return (val_len >= pinsn->len) &&
+            sp_prefix_matches(val_string + val_len - pinsn->len,
+                              pinsn->value.cvalue,pinsn->len);
+    default: /* SP_OP_STREQUAL -- compare the terminator too */
+        return sp_prefix_matches(val_string,pinsn->value.cvalue,
+                                 pinsn->len + 1);
+    }
+}
+
+/**
+ * work out what can be known about which items match a tree from
+ * indexes, without looking at the items.  The lookup function
+ * gets a field and a test, runs the test on each value of the field
+ * it has indexed, and returns the items with a value that passed,
+ * or NULL if it has no index on that field.
+ *
+ * Compares that can be looked up are exact, and the rest could match
+ * anything.  And and or carry that up the tree, so what comes out
+ * is the items that certainly match (yes), and the items that might
+ * (maybe, which includes yes).  Only maybe - yes has to be checked
+ * item by item.
+ *
+ * @param tree compiled tree to plan
+ * @param pall every item
+ * @param lookup index lookup
+ * @param ppyes returns items that match
+ * @param ppmaybe returns items that might match
+ * @returns TRUE if any of it came from an index, FALSE otherwise
+ */
+int sp_plan(PARSETREE tree, IDSET *pall,
+            IDSET *(*lookup)(int, int(*)(void *, char *, int64_t), void *),
+            IDSET **ppyes, IDSET **ppmaybe) {
+    int pc = 0;
+    int indexed = FALSE;
+
+    *ppyes = *ppmaybe = NULL;
+
+    if((!tree->program) || (!tree->tree))
+        return FALSE;
+
+    if(!sp_plan_node(tree, tree->tree, &pc, pall, lookup, &indexed, ppyes, ppmaybe))
+        return FALSE;
+
+    if(!indexed) {
+        idset_free(*ppyes);
+        idset_free(*ppmaybe);
+        *ppyes = *ppmaybe = NULL;
+    }
+
+    return indexed;
+}
+
+/**
+ * test an indexed value against a compare, for sp_plan
+ *
+ * @param arg the SP_INSN being planned
+ */
+int sp_plan_test(void *arg, char *val_string, int64_t val) {
+    return sp_insn_matches((SP_INSN *)arg, val_string, val);
+}
+
+/**
+ * plan a node, walking the program alongside it.  Program order is
+ * the order sp_compile_node laid it out in: left, jump, right.
+ *
+ * @param ppc pc of the node's first instruction, updated past it
+ * @returns TRUE on success, FALSE on malloc error
+ */
+int sp_plan_node(PARSETREE tree, SP_NODE *node, int *ppc, IDSET *pall,
+                 IDSET *(*lookup)(int, int(*)(void *, char *, int64_t), void *),
+                 int *pindexed, IDSET **ppyes, IDSET **ppmaybe) {
+    SP_INSN *pinsn;
+    IDSET *pyes1, *pmaybe1, *pyes2, *pmaybe2;
+    IDSET *pset = NULL;
+    IDSET *ptemp;
+    int result;
+
+    *ppyes = *ppmaybe = NULL;
+
+    if(node->op_type == SP_OPTYPE_ANDOR) {
+        if(!sp_plan_node(tree, node->left.node, ppc, pall, lookup,
+                         pindexed, &pyes1, &pmaybe1))
+            return FALSE;
+
+        (*ppc)++; /* the jump */
+        if(!sp_plan_node(tree, node->right.node, ppc, pall, lookup,
+                         pindexed, &pyes2, &pmaybe2)) {
+            idset_free(pyes1);
+            idset_free(pmaybe1);
+            return FALSE;
         }
-    } else if(node->op_type == SP_OPTYPE_DATE) {
-        if(!is_native) {
-            tmp = (char**)pms;
-            if(tmp)
-                val_date = (time_t)strtoul(tmp[node->field_id],NULL,10);
-            else
-                val_date = 0;
+
+        if(node->op == T_AND) {
+            *ppyes = idset_and(pyes1, pyes2);
+            *ppmaybe = idset_and(pmaybe1, pmaybe2);
         } else {
-            val_date = *((uint32_t*)(((void*)pmn) + offset));
+            *ppyes = idset_or(pyes1, pyes2);
+            *ppmaybe = idset_or(pmaybe1, pmaybe2);
         }
-        switch(node->op) {
-        case T_LESSEQUAL:
-            if(val_date <= node->right.tvalue)
-                result = TRUE;
-            break;
-        case T_LESS:
-            if(val_date < node->right.tvalue)
-                result = TRUE;
-            break;
-        case T_GREATEREQUAL:
-            if(val_date >= node->right.tvalue)
-                result = TRUE;
-            break;
-        case T_GREATER:
-            if(val_date > node->right.tvalue)
-                result = TRUE;
-            break;
-        case T_EQUAL:
-            if(val_date == node->right.tvalue)
-                result = TRUE;
-            break;
-        default:
-            DPRINTF(E_FATAL,L_PARSE,"Bad date op\n");
-            break;
+
+        idset_free(pyes1);
+        idset_free(pmaybe1);
+        idset_free(pyes2);
+        idset_free(pmaybe2);
+    } else {
+        pinsn = &tree->program[(*ppc)++];
+        if(pinsn->field_id != -1)
+            pset = lookup(pinsn->field_id, sp_plan_test, (void*)pinsn);
+
+        if(pset) {
+            *pindexed = TRUE;
+            if(pinsn->not_flag) {
+                ptemp = idset_andnot(pall, pset);
+                idset_free(pset);
+                pset = ptemp;
+            }
+            *ppyes = pset;
+            *ppmaybe = pset ? idset_copy(pset) : NULL;
+        } else {
+            *ppyes = idset_new();
+            *ppmaybe = idset_copy(pall);
         }
     }
 
+    result = ((*ppyes) && (*ppmaybe));
+    if(!result) {
+        idset_free(*ppyes);
+        idset_free(*ppmaybe);
+        *ppyes = *ppmaybe = NULL;
+    }
+
     return result;
 }
@@ -6,6 +6,7 @@
 #define _SMART_PARSER_H_
 
 #include "ff-dbstruct.h"
+#include "idset.h"
 
 typedef void* PARSETREE;
 
@@ -17,6 +18,12 @@ extern char *sp_sql_clause(PARSETREE tree);
 int sp_matches_native(PARSETREE tree, MEDIA_NATIVE *pmn);
 int sp_matches_string(PARSETREE tree, MEDIA_STRING *pms);
 
+/** index lookup for sp_plan: run test on each value of field_id, and
+ * return the items with a value that passed, or NULL if not indexed */
+typedef IDSET *(*SP_LOOKUP_FN)(int field_id, int(*test)(void *, char *, int64_t), void *arg);
+extern int sp_plan(PARSETREE tree, IDSET *pall, SP_LOOKUP_FN lookup,
+                   IDSET **ppyes, IDSET **ppmaybe);
+
 #define SP_TYPE_PLAYLIST 0
 #define SP_TYPE_QUERY    1
 
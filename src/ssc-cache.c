@@ -0,0 +1,652 @@
+/*
+ * $Id$
+ * on-disk cache of transcoded songs
+ *
+ * Copyright (C) 2006 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Transcoding a song is expensive, and a client that seeks in one
+ * closes the stream and asks for it again from an offset, which used
+ * to mean transcoding (and throwing away) everything up to there.
+ * So the transcoder output gets written to a file in cache_dir/ssc
+ * as it goes out the first time.  Anyone else who wants the same
+ * song while that's going on reads along behind the transcoder
+ * instead of starting their own, and once the file is finished, it
+ * gets served like any other file: with a length, ranges, and
+ * sendfile.
+ *
+ * Files are named for a hash of whatever the caller uses as the key
+ * (path, mtime, transcoder and format), so they still work after a
+ * restart.  A file being filled is named .tmp until it's done, and
+ * leftover .tmp files get thrown away at startup.  When the cache
+ * gets bigger than general/ssc_cache_size, the least recently used
+ * finished files that nobody is reading get deleted.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "daapd.h"
+#include "conf.h"
+#include "err.h"
+#include "ssc-cache.h"
+#include "util.h"
+
+#ifndef TRUE
+#  define TRUE 1
+#  define FALSE 0
+#endif
+
+#define SSC_CACHE_DEFAULT_SIZE 512 /**< in megabytes */
+
+#define SSC_CACHE_FILLING  0
+#define SSC_CACHE_COMPLETE 1
+#define SSC_CACHE_FAILED   2
+
+typedef struct tag_ssc_cache_entry {
+    uint64_t hash;                /**< of the key -- also the file name */
+    uint64_t bytes;               /**< on disk so far */
+    int state;                    /**< SSC_CACHE_FILLING, etc */
+    int refcount;                 /**< the cache itself holds one */
+    struct tag_ssc_cache_entry *prev;
+    struct tag_ssc_cache_entry *next;
+} SSC_CACHE_ENTRY;
+
+typedef struct tag_ssc_cache_handle {
+    SSC_CACHE_ENTRY *pentry;
+    int fd;                       /**< the filler's, or a reader's, or -1 */
+    int filler;                   /**< TRUE if this handle fills the file */
+} SSC_CACHE_HANDLE;
+
+/* Globals */
+static pthread_mutex_t ssc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ssc_cache_cond = PTHREAD_COND_INITIALIZER; /**< something grew */
+static SSC_CACHE_ENTRY ssc_cache_lru;   /**< sentinel: next is newest */
+static char *ssc_cache_dir = NULL;
+static SSC_CACHE_STATS ssc_cache_info;
+
+/* Forwards */
+static uint64_t ssc_cache_hash(char *key);
+static char *ssc_cache_path(uint64_t hash, int state);
+static SSC_CACHE_ENTRY *ssc_cache_find(uint64_t hash);
+static void ssc_cache_push(SSC_CACHE_ENTRY *pentry);
+static void ssc_cache_unlink(SSC_CACHE_ENTRY *pentry);
+static void ssc_cache_unref(SSC_CACHE_ENTRY *pentry);
+static void ssc_cache_evict(void);
+static void ssc_cache_load(void);
+static SSC_CACHE_HANDLE *ssc_cache_handle(SSC_CACHE_ENTRY *pentry, int fd, int filler);
+
+/**
+ * set up the cache from the config, and pick up the files left from
+ * last time.  The cache is disabled if general/ssc_cache_size is 0.
+ */
+void ssc_cache_init(void) {
+    char *cache_dir;
+
+    ssc_cache_lru.next = ssc_cache_lru.prev = &ssc_cache_lru;
+    memset(&ssc_cache_info,0,sizeof(ssc_cache_info));
+
+    cache_dir = conf_alloc_string("general","cache_dir",NULL);
+    if(!cache_dir) {
+        DPRINTF(E_LOG,L_PLUG,"No cache_dir, not caching transcodes\n");
+        return;
+    }
+
+    ssc_cache_dir = util_asprintf("%s/ssc",cache_dir);
+    free(cache_dir);
+    if(!ssc_cache_dir)
+        DPRINTF(E_FATAL,L_PLUG,"Malloc error in ssc_cache_init\n");
+
+    ssc_cache_info.max_bytes = 1024 * 1024 * (uint64_t)
+        conf_get_int("general","ssc_cache_size",SSC_CACHE_DEFAULT_SIZE);
+
+    if(ssc_cache_info.max_bytes) {
+        pthread_mutex_lock(&ssc_cache_lock);
+        ssc_cache_load();
+        ssc_cache_evict();
+        pthread_mutex_unlock(&ssc_cache_lock);
+    }
+
+    DPRINTF(E_DBG,L_PLUG,"Transcode cache: %u songs, %llu of %llu bytes\n",
+            ssc_cache_info.entries,
+            (unsigned long long)ssc_cache_info.bytes,
+            (unsigned long long)ssc_cache_info.max_bytes);
+}
+
+/**
+ * forget about everything.  The files stay around for next time, and
+ * entries still being read get freed when they are released.
+ */
+void ssc_cache_deinit(void) {
+    SSC_CACHE_ENTRY *pentry;
+
+    pthread_mutex_lock(&ssc_cache_lock);
+    while((pentry = ssc_cache_lru.next) != &ssc_cache_lru) {
+        ssc_cache_unlink(pentry);
+        ssc_cache_unref(pentry);
+    }
+    ssc_cache_info.max_bytes = 0;
+    pthread_mutex_unlock(&ssc_cache_lock);
+
+    if(ssc_cache_dir)
+        free(ssc_cache_dir);
+    ssc_cache_dir = NULL;
+}
+
+/**
+ * hash a key into a file name (64 bit fnv-1a)
+ */
+uint64_t ssc_cache_hash(char *key) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * get the path for an entry's file
+ *
+ * @param hash entry's hash
+ * @param state SSC_CACHE_FILLING for the file that's being filled
+ * @returns malloc'd path, or NULL on malloc error
+ */
+char *ssc_cache_path(uint64_t hash, int state) {
+    return util_asprintf("%s/%016llx.%s",ssc_cache_dir,
+                         (unsigned long long)hash,
+                         (state == SSC_CACHE_FILLING) ? "tmp" : "ssc");
+}
+
+/**
+ * find an entry.  Must be called with the cache lock held.
+ */
+SSC_CACHE_ENTRY *ssc_cache_find(uint64_t hash) {
+    SSC_CACHE_ENTRY *pentry;
+
+    for(pentry = ssc_cache_lru.next; pentry != &ssc_cache_lru;
+        pentry = pentry->next) {
+        if(pentry->hash == hash)
+            return pentry;
+    }
+
+    return NULL;
+}
+
+/**
+ * put an entry at the front of the lru list, taking it out of where
+ * it was if it's already there.  Must be called with the cache lock
+ * held.
+ */
+void ssc_cache_push(SSC_CACHE_ENTRY *pentry) {
+    if(pentry->next) {
+        pentry->prev->next = pentry->next;
+        pentry->next->prev = pentry->prev;
+    }
+
+    pentry->next = ssc_cache_lru.next;
+    pentry->prev = &ssc_cache_lru;
+    ssc_cache_lru.next->prev = pentry;
+    ssc_cache_lru.next = pentry;
+}
+
+/**
+ * take an entry out of the lru list and the accounting.  Must be
+ * called with the cache lock held.
+ */
+void ssc_cache_unlink(SSC_CACHE_ENTRY *pentry) {
+    pentry->prev->next = pentry->next;
+    pentry->next->prev = pentry->prev;
+    pentry->prev = pentry->next = NULL;
+
+    ssc_cache_info.bytes -= pentry->bytes;
+    ssc_cache_info.entries--;
+}
+
+/**
+ * drop a reference to an entry, freeing it when it's the last.
+ * Must be called with the cache lock held.
+ */
+void ssc_cache_unref(SSC_CACHE_ENTRY *pentry) {
+    if(--pentry->refcount)
+        return;
+
+    free(pentry);
+}
+
+/**
+ * delete the least recently used finished files until the cache is
+ * back under its size.  Files that are being read or filled have to
+ * wait.  Must be called with the cache lock held.
+ */
+void ssc_cache_evict(void) {
+    SSC_CACHE_ENTRY *pentry, *pprev;
+    char *path;
+
+    pentry = ssc_cache_lru.prev;
+    while((ssc_cache_info.bytes > ssc_cache_info.max_bytes) &&
+          (pentry != &ssc_cache_lru)) {
+        pprev = pentry->prev;
+        if((pentry->refcount == 1) && (pentry->state == SSC_CACHE_COMPLETE)) {
+            path = ssc_cache_path(pentry->hash, pentry->state);
+            if(path) {
+                DPRINTF(E_DBG,L_PLUG,"Evicting %s\n",path);
+                unlink(path);
+                free(path);
+            }
+            ssc_cache_unlink(pentry);
+            ssc_cache_unref(pentry);
+            ssc_cache_info.evictions++;
+        }
+        pentry = pprev;
+    }
+}
+
+/**
+ * pick up the finished files in the cache dir, and clean out the
+ * ones that were being filled when we last stopped.  Must be called
+ * with the cache lock held.
+ */
+void ssc_cache_load(void) {
+    DIR *pdir;
+    struct dirent *pde;
+    struct stat sb;
+    SSC_CACHE_ENTRY *pentry;
+    unsigned long long hash;
+    char *path;
+    char ext[4];
+
+    if(!(pdir = opendir(ssc_cache_dir))) {
+        DPRINTF(E_LOG,L_PLUG,"Can't open %s: %s\n",ssc_cache_dir,
+                strerror(errno));
+        return;
+    }
+
+    while((pde = readdir(pdir))) {
+        if((strlen(pde->d_name) != 20) ||
+           (sscanf(pde->d_name,"%16llx.%3s",&hash,ext) != 2))
+            continue;
+
+        path = util_asprintf("%s/%s",ssc_cache_dir,pde->d_name);
+        if(!path)
+            break;
+
+        if(!strcmp(ext,"tmp")) {
+            DPRINTF(E_DBG,L_PLUG,"Removing partial transcode %s\n",path);
+            unlink(path);
+        } else if((!strcmp(ext,"ssc")) && (!stat(path,&sb)) &&
+                  (pentry = (SSC_CACHE_ENTRY*)calloc(1,sizeof(SSC_CACHE_ENTRY)))) {
+            pentry->hash = (uint64_t)hash;
+            pentry->bytes = (uint64_t)sb.st_size;
+            pentry->state = SSC_CACHE_COMPLETE;
+            pentry->refcount = 1;
+            ssc_cache_push(pentry);
+            ssc_cache_info.bytes += pentry->bytes;
+            ssc_cache_info.entries++;
+        }
+        free(path);
+    }
+
+    closedir(pdir);
+}
+
+/**
+ * make a handle on an entry, taking a reference for it.  Must be
+ * called with the cache lock held.
+ *
+ * @returns handle, or NULL on malloc error
+ */
+SSC_CACHE_HANDLE *ssc_cache_handle(SSC_CACHE_ENTRY *pentry, int fd, int filler) {
+    SSC_CACHE_HANDLE *phandle;
+
+    phandle = (SSC_CACHE_HANDLE*)malloc(sizeof(SSC_CACHE_HANDLE));
+    if(!phandle) {
+        DPRINTF(E_LOG,L_PLUG,"Malloc error in ssc_cache_handle\n");
+        return NULL;
+    }
+
+    phandle->pentry = pentry;
+    phandle->fd = fd;
+    phandle->filler = filler;
+    pentry->refcount++;
+
+    return phandle;
+}
+
+/**
+ * look for a finished file.  On a hit, the file stays around until
+ * the returned handle is passed to ssc_cache_release.
+ *
+ * @param key what was transcoded, and how
+ * @param ppath returns the path of the file (malloc'd)
+ * @returns handle to release, or NULL on a miss
+ */
+void *ssc_cache_lookup(char *key, char **ppath) {
+    SSC_CACHE_ENTRY *pentry;
+    SSC_CACHE_HANDLE *phandle = NULL;
+    uint64_t hash;
+
+    if(!ssc_cache_info.max_bytes)
+        return NULL;
+
+    hash = ssc_cache_hash(key);
+
+    pthread_mutex_lock(&ssc_cache_lock);
+    pentry = ssc_cache_find(hash);
+    if((pentry) && (pentry->state == SSC_CACHE_COMPLETE)) {
+        *ppath = ssc_cache_path(hash, pentry->state);
+        if((*ppath) && (phandle = ssc_cache_handle(pentry,-1,FALSE))) {
+            ssc_cache_push(pentry);
+            ssc_cache_info.hits++;
+        } else if(*ppath) {
+            free(*ppath);
+        }
+    }
+    pthread_mutex_unlock(&ssc_cache_lock);
+
+    return (void*)phandle;
+}
+
+/**
+ * get an entry to stream a transcode through.  If nobody has started
+ * on it yet, the caller gets to fill it, and must write the whole
+ * transcode with ssc_cache_write, then call ssc_cache_finish.
+ * Otherwise, the caller reads it with ssc_cache_read, which waits on
+ * the filler as needed.
+ *
+ * @param key what is being transcoded, and how
+ * @param pfill returns TRUE if the caller has to fill the entry, or
+ *        NULL to only take an entry that's already there
+ * @returns handle to release, or NULL if the cache is off (or broken)
+ */
+void *ssc_cache_open(char *key, int *pfill) {
+    SSC_CACHE_ENTRY *pentry;
+    SSC_CACHE_HANDLE *phandle = NULL;
+    uint64_t hash;
+    char *path;
+    int fd;
+
+    if(pfill)
+        *pfill = FALSE;
+    if(!ssc_cache_info.max_bytes)
+        return NULL;
+
+    hash = ssc_cache_hash(key);
+
+    pthread_mutex_lock(&ssc_cache_lock);
+    pentry = ssc_cache_find(hash);
+    if(pentry) {
+        if((phandle = ssc_cache_handle(pentry,-1,FALSE))) {
+            ssc_cache_push(pentry);
+            ssc_cache_info.follows++;
+        }
+        pthread_mutex_unlock(&ssc_cache_lock);
+        return (void*)phandle;
+    }
+
+    if(!pfill) {
+        pthread_mutex_unlock(&ssc_cache_lock);
+        return NULL;
+    }
+
+    path = ssc_cache_path(hash, SSC_CACHE_FILLING);
+    pentry = (SSC_CACHE_ENTRY*)calloc(1,sizeof(SSC_CACHE_ENTRY));
+    if((!path) || (!pentry)) {
+        DPRINTF(E_LOG,L_PLUG,"Malloc error in ssc_cache_open\n");
+        pthread_mutex_unlock(&ssc_cache_lock);
+        if(path) free(path);
+        if(pentry) free(pentry);
+        return NULL;
+    }
+
+    fd = open(path,O_WRONLY | O_CREAT | O_TRUNC,0600);
+    if(fd == -1) {
+        DPRINTF(E_LOG,L_PLUG,"Can't create %s: %s\n",path,strerror(errno));
+        pthread_mutex_unlock(&ssc_cache_lock);
+        free(path);
+        free(pentry);
+        return NULL;
+    }
+
+    pentry->hash = hash;
+    pentry->state = SSC_CACHE_FILLING;
+    pentry->refcount = 1;
+
+    if(!(phandle = ssc_cache_handle(pentry,fd,TRUE))) {
+        pthread_mutex_unlock(&ssc_cache_lock);
+        close(fd);
+        unlink(path);
+        free(path);
+        free(pentry);
+        return NULL;
+    }
+
+    ssc_cache_push(pentry);
+    ssc_cache_info.entries++;
+    ssc_cache_info.misses++;
+    pthread_mutex_unlock(&ssc_cache_lock);
+
+    free(path);
+    *pfill = TRUE;
+    return (void*)phandle;
+}
+
+/**
+ * add the next block of transcoder output to an entry being filled
+ *
+ * @param handle handle from ssc_cache_open that has to fill
+ * @param buffer block to add
+ * @param len length of block
+ * @returns TRUE on success, FALSE on write error (the caller should
+ *          ssc_cache_finish the entry as incomplete)
+ */
+int ssc_cache_write(void *handle, char *buffer, int len) {
+    SSC_CACHE_HANDLE *phandle = (SSC_CACHE_HANDLE*)handle;
+    int bytes_written;
+    int total = 0;
+
+    while(total < len) {
+        bytes_written = write(phandle->fd, buffer + total, len - total);
+        if(bytes_written < 0) {
+            if(errno == EINTR)
+                continue;
+            DPRINTF(E_LOG,L_PLUG,"Error writing transcode cache: %s\n",
+                    strerror(errno));
+            return FALSE;
+        }
+        total += bytes_written;
+    }
+
+    pthread_mutex_lock(&ssc_cache_lock);
+    phandle->pentry->bytes += len;
+    ssc_cache_info.bytes += len;
+    pthread_cond_broadcast(&ssc_cache_cond);
+    pthread_mutex_unlock(&ssc_cache_lock);
+
+    return TRUE;
+}
+
+/**
+ * done filling an entry.  A complete entry becomes a finished file
+ * that can be looked up, an incomplete one gets thrown away (and
+ * anyone reading along gets an error).
+ *
+ * @param handle handle from ssc_cache_open that has to fill
+ * @param complete TRUE if the transcoder got to the end
+ */
+void ssc_cache_finish(void *handle, int complete) {
+    SSC_CACHE_HANDLE *phandle = (SSC_CACHE_HANDLE*)handle;
+    SSC_CACHE_ENTRY *pentry = phandle->pentry;
+    char *tmp_path, *path;
+
+    if(close(phandle->fd))
+        complete = FALSE;
+    phandle->fd = -1;
+
+    pthread_mutex_lock(&ssc_cache_lock);
+
+    tmp_path = ssc_cache_path(pentry->hash, SSC_CACHE_FILLING);
+    path = ssc_cache_path(pentry->hash, SSC_CACHE_COMPLETE);
+
+    if((complete) && (tmp_path) && (path) && (!rename(tmp_path,path))) {
+        pentry->state = SSC_CACHE_COMPLETE;
+    } else {
+        if(tmp_path)
+            unlink(tmp_path);
+        pentry->state = SSC_CACHE_FAILED;
+        if(pentry->next) {
+            ssc_cache_unlink(pentry);
+            ssc_cache_unref(pentry);
+        }
+    }
+
+    pthread_cond_broadcast(&ssc_cache_cond);
+    ssc_cache_evict();
+    pthread_mutex_unlock(&ssc_cache_lock);
+
+    if(tmp_path) free(tmp_path);
+    if(path) free(path);
+}
+
+/**
+ * see whether anyone is reading along behind a fill
+ *
+ * @param handle handle from ssc_cache_open that has to fill
+ * @returns TRUE if another client is reading the entry
+ */
+int ssc_cache_followed(void *handle) {
+    SSC_CACHE_HANDLE *phandle = (SSC_CACHE_HANDLE*)handle;
+    int followed;
+
+    /* one for the cache, one for the filler */
+    pthread_mutex_lock(&ssc_cache_lock);
+    followed = (phandle->pentry->refcount > 2);
+    pthread_mutex_unlock(&ssc_cache_lock);
+
+    return followed;
+}
+
+/**
+ * read from an entry, waiting for the filler to get there if it
+ * hasn't yet
+ *
+ * @param handle handle from ssc_cache_open
+ * @param offset where to read from
+ * @param buffer buffer to read into
+ * @param len size of buffer
+ * @returns bytes read, 0 at the end, or -1 if the transcode failed
+ */
+int ssc_cache_read(void *handle, uint64_t offset, char *buffer, int len) {
+    SSC_CACHE_HANDLE *phandle = (SSC_CACHE_HANDLE*)handle;
+    SSC_CACHE_ENTRY *pentry = phandle->pentry;
+    char *path;
+    int bytes_read;
+
+    pthread_mutex_lock(&ssc_cache_lock);
+    while((pentry->state == SSC_CACHE_FILLING) && (offset >= pentry->bytes))
+        pthread_cond_wait(&ssc_cache_cond,&ssc_cache_lock);
+
+    if(pentry->state == SSC_CACHE_FAILED) {
+        pthread_mutex_unlock(&ssc_cache_lock);
+        return -1;
+    }
+
+    if(offset >= pentry->bytes) {
+        pthread_mutex_unlock(&ssc_cache_lock);
+        return 0;
+    }
+
+    if(pentry->bytes - offset < (uint64_t)len)
+        len = (int)(pentry->bytes - offset);
+
+    /* open while the lock keeps the file from being renamed */
+    if(phandle->fd == -1) {
+        path = ssc_cache_path(pentry->hash, pentry->state);
+        if(path) {
+            phandle->fd = open(path,O_RDONLY);
+            if(phandle->fd == -1)
+                DPRINTF(E_LOG,L_PLUG,"Can't open %s: %s\n",path,
+                        strerror(errno));
+            free(path);
+        }
+    }
+    pthread_mutex_unlock(&ssc_cache_lock);
+
+    if(phandle->fd == -1)
+        return -1;
+
+    if(lseek(phandle->fd,(off_t)offset,SEEK_SET) == (off_t)-1)
+        return -1;
+
+    while(((bytes_read = read(phandle->fd,buffer,len)) < 0) && (errno == EINTR))
+        ;
+
+    return bytes_read;
+}
+
+/**
+ * done with an entry from ssc_cache_lookup or ssc_cache_open.
+ *
+ * @param handle handle to release
+ */
+void ssc_cache_release(void *handle) {
+    SSC_CACHE_HANDLE *phandle = (SSC_CACHE_HANDLE*)handle;
+
+    if((phandle->filler) && (phandle->fd != -1))
+        ssc_cache_finish(handle,FALSE);
+
+    if(phandle->fd != -1)
+        close(phandle->fd);
+
+    pthread_mutex_lock(&ssc_cache_lock);
+    ssc_cache_unref(phandle->pentry);
+    ssc_cache_evict();
+    pthread_mutex_unlock(&ssc_cache_lock);
+
+    free(phandle);
+}
+
+/**
+ * get a snapshot of the cache counters
+ *
+ * @param pstats struct to fill
+ */
+void ssc_cache_stats(SSC_CACHE_STATS *pstats) {
+    pthread_mutex_lock(&ssc_cache_lock);
+    memcpy(pstats,&ssc_cache_info,sizeof(SSC_CACHE_STATS));
+    pthread_mutex_unlock(&ssc_cache_lock);
+}
@@ -0,0 +1,46 @@
+/*
+ * $Id$
+ * on-disk cache of transcoded songs
+ *
+ * Copyright (C) 2006 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SSC_CACHE_H_
+#define _SSC_CACHE_H_
+
+typedef struct tag_ssc_cache_stats {
+    uint64_t max_bytes;     /**< disk cap (0 = cache disabled) */
+    uint64_t bytes;         /**< disk in use, including files being filled */
+    uint32_t entries;       /**< songs cached or being cached */
+    uint32_t hits;          /**< served from a finished file */
+    uint32_t follows;       /**< served from a file still being filled */
+    uint32_t misses;
+    uint32_t evictions;     /**< dropped to stay under max_bytes */
+} SSC_CACHE_STATS;
+
+extern void ssc_cache_init(void);
+extern void ssc_cache_deinit(void);
+extern void *ssc_cache_lookup(char *key, char **ppath);
+extern void *ssc_cache_open(char *key, int *pfill);
+extern int ssc_cache_write(void *handle, char *buffer, int len);
+extern void ssc_cache_finish(void *handle, int complete);
+extern int ssc_cache_followed(void *handle);
+extern int ssc_cache_read(void *handle, uint64_t offset, char *buffer, int len);
+extern void ssc_cache_release(void *handle);
+extern void ssc_cache_stats(SSC_CACHE_STATS *pstats);
+
+#endif /* _SSC_CACHE_H_ */
@@ -0,0 +1,405 @@
+/*
+ * $Id$
+ * decode thread and ring buffer for transcoded streams
+ *
+ * Copyright (C) 2006 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A transcoded stream used to decode a little, write it to the
+ * client, decode a little more, and so on, so a slow client held up
+ * the decoder and a slow decode held up the client.  Now a thread
+ * per stream runs the transcoder into a ring buffer, and the
+ * connection sends out of the ring in big writes.
+ *
+ * There is exactly one writer (the decode thread) and one reader
+ * (the connection), so the ring itself needs no lock: each side owns
+ * its own counter, and only reads the other's.  The lock and cond
+ * are just for sleeping.  The decoder stops once general/ssc_buffer_high
+ * KB are waiting and starts again when it's down to ssc_buffer_low.
+ * When the connection finds the ring empty (an underrun), it waits
+ * for ssc_buffer_low KB before sending again.
+ *
+ * With general/ssc_buffer set to 0, there is no thread, and the
+ * connection runs the transcoder itself whenever the ring is empty.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include "daapd.h"
+#include "conf.h"
+#include "err.h"
+#include "ssc-pipe.h"
+
+#ifndef TRUE
+#  define TRUE 1
+#  define FALSE 0
+#endif
+
+#define SSC_PIPE_DEFAULT_SIZE 1024  /**< in kilobytes */
+#define SSC_PIPE_DEFAULT_HIGH 768
+#define SSC_PIPE_DEFAULT_LOW  256
+#define SSC_PIPE_CHUNK   32768      /**< most to decode at once */
+#define SSC_PIPE_WRITE   65536      /**< most to send at once */
+#define SSC_PIPE_UNBUFFERED SSC_PIPE_WRITE
+
+struct tag_ssc_pipe {
+    PLUGIN_TRANSCODE_FN *pfn;
+    void *vp;
+
+    char *ring;
+    uint32_t size;              /**< a power of two */
+    uint32_t mask;
+    uint32_t high;              /**< decoder stops here... */
+    uint32_t low;               /**< ...and starts again here */
+
+    volatile uint32_t head;     /**< bytes decoded, only the decoder writes it */
+    volatile uint32_t tail;     /**< bytes sent, only the connection writes it */
+    volatile int done;          /**< 1 at the end, -1 on a transcode error */
+    volatile int stop;          /**< connection is done with it */
+
+    int threaded;
+    pthread_t tid;
+    pthread_mutex_t lock;       /**< just for sleeping */
+    pthread_cond_t cond;
+    volatile int decoder_waiting;
+    volatile int reader_waiting;
+
+    int started;                /**< has sent anything yet */
+    SSC_PIPE_STREAM info;
+
+    SSC_PIPE *next;
+};
+
+/* Globals */
+static pthread_mutex_t ssc_pipe_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static SSC_PIPE *ssc_pipe_list = NULL;  /**< streams running now */
+static SSC_PIPE_STATS ssc_pipe_info;
+static uint32_t ssc_pipe_size = 0;      /**< ring size, 0 for no thread */
+static uint32_t ssc_pipe_high;
+static uint32_t ssc_pipe_low;
+
+/* Forwards */
+static void *ssc_pipe_decoder(void *arg);
+static void ssc_pipe_wake(SSC_PIPE *ppipe);
+
+/**
+ * pick up the buffer sizes from the config
+ */
+void ssc_pipe_init(void) {
+    uint32_t size;
+
+    memset(&ssc_pipe_info,0,sizeof(ssc_pipe_info));
+
+    size = 1024 * conf_get_int("general","ssc_buffer",SSC_PIPE_DEFAULT_SIZE);
+    ssc_pipe_high = 1024 * conf_get_int("general","ssc_buffer_high",
+                                        SSC_PIPE_DEFAULT_HIGH);
+    ssc_pipe_low = 1024 * conf_get_int("general","ssc_buffer_low",
+                                       SSC_PIPE_DEFAULT_LOW);
+
+    /* round up, so the counters can just wrap */
+    ssc_pipe_size = 0;
+    if(size) {
+        if(size < SSC_PIPE_CHUNK)
+            size = SSC_PIPE_CHUNK;
+        ssc_pipe_size = SSC_PIPE_CHUNK;
+        while(ssc_pipe_size < size)
+            ssc_pipe_size <<= 1;
+    }
+
+    if((!ssc_pipe_high) || (ssc_pipe_high > ssc_pipe_size))
+        ssc_pipe_high = ssc_pipe_size;
+    /* the decoder sleeps until the reader gets below low, so low has
+     * to be under high, or a full ring never sleeps at all */
+    if(ssc_pipe_low >= ssc_pipe_high)
+        ssc_pipe_low = ssc_pipe_high / 2;
+
+    DPRINTF(E_DBG,L_PLUG,"Transcode buffer: %u bytes, high %u, low %u\n",
+            ssc_pipe_size, ssc_pipe_high, ssc_pipe_low);
+}
+
+/**
+ * start a transcoder running into a ring buffer.  The transcoder
+ * must already be open, and belongs to the pipe until ssc_pipe_end.
+ *
+ * @param pfn transcoder
+ * @param vp open transcoder handle
+ * @param name what's being transcoded, for the status page
+ * @returns pipe, or NULL on malloc error
+ */
+SSC_PIPE *ssc_pipe_start(PLUGIN_TRANSCODE_FN *pfn, void *vp, char *name) {
+    SSC_PIPE *ppipe;
+    int err;
+
+    ppipe = (SSC_PIPE*)calloc(1,sizeof(SSC_PIPE));
+    if(!ppipe) {
+        DPRINTF(E_LOG,L_PLUG,"Malloc error in ssc_pipe_start\n");
+        return NULL;
+    }
+
+    ppipe->pfn = pfn;
+    ppipe->vp = vp;
+    ppipe->size = ssc_pipe_size ? ssc_pipe_size : SSC_PIPE_UNBUFFERED;
+    ppipe->mask = ppipe->size - 1;
+    ppipe->high = ssc_pipe_size ? ssc_pipe_high : ppipe->size;
+    ppipe->low = ssc_pipe_size ? ssc_pipe_low : 0;
+    strncpy(ppipe->info.name,name,sizeof(ppipe->info.name) - 1);
+
+    ppipe->ring = (char*)malloc(ppipe->size);
+    if(!ppipe->ring) {
+        DPRINTF(E_LOG,L_PLUG,"Malloc error in ssc_pipe_start\n");
+        free(ppipe);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ppipe->lock,NULL);
+    pthread_cond_init(&ppipe->cond,NULL);
+
+    if(ssc_pipe_size) {
+        if((err = pthread_create(&ppipe->tid,NULL,ssc_pipe_decoder,ppipe))) {
+            DPRINTF(E_LOG,L_PLUG,"Can't start decode thread, transcoding "
+                    "unbuffered: %s\n",strerror(err));
+        } else {
+            ppipe->threaded = TRUE;
+        }
+    }
+
+    pthread_mutex_lock(&ssc_pipe_list_lock);
+    ppipe->next = ssc_pipe_list;
+    ssc_pipe_list = ppipe;
+    ssc_pipe_info.streams++;
+    ssc_pipe_info.total++;
+    pthread_mutex_unlock(&ssc_pipe_list_lock);
+
+    return ppipe;
+}
+
+/**
+ * kick whoever might be sleeping on the other side of the pipe
+ */
+void ssc_pipe_wake(SSC_PIPE *ppipe) {
+    pthread_mutex_lock(&ppipe->lock);
+    pthread_cond_broadcast(&ppipe->cond);
+    pthread_mutex_unlock(&ppipe->lock);
+}
+
+/**
+ * the decode thread: run the transcoder into the ring until it's
+ * done or the connection is
+ */
+void *ssc_pipe_decoder(void *arg) {
+    SSC_PIPE *ppipe = (SSC_PIPE*)arg;
+    uint32_t head;
+    uint32_t space;
+    int bytes_read;
+
+    while(!ppipe->stop) {
+        head = ppipe->head;
+
+        if(head - ppipe->tail >= ppipe->high) {
+            pthread_mutex_lock(&ppipe->lock);
+            ppipe->decoder_waiting = TRUE;
+            __sync_synchronize();
+            ppipe->info.stalls++;
+            while((!ppipe->stop) && (ppipe->head - ppipe->tail > ppipe->low))
+                pthread_cond_wait(&ppipe->cond,&ppipe->lock);
+            ppipe->decoder_waiting = FALSE;
+            pthread_mutex_unlock(&ppipe->lock);
+            continue;
+        }
+
+        /* only up to the end of the ring -- the rest on the next pass */
+        space = ppipe->high - (head - ppipe->tail);
+        if(space > ppipe->size - (head & ppipe->mask))
+            space = ppipe->size - (head & ppipe->mask);
+        if(space > SSC_PIPE_CHUNK)
+            space = SSC_PIPE_CHUNK;
+
+        bytes_read = ppipe->pfn->ssc_read(ppipe->vp,
+                                          &ppipe->ring[head & ppipe->mask],
+                                          (int)space);
+        if(bytes_read <= 0) {
+            ppipe->done = bytes_read ? -1 : 1;
+            __sync_synchronize();
+            ssc_pipe_wake(ppipe);
+            break;
+        }
+
+        /* data has to be there before the reader can see it is */
+        __sync_synchronize();
+        ppipe->head = head + bytes_read;
+        __sync_synchronize();
+
+        if((ppipe->reader_waiting) &&
+           (ppipe->head - ppipe->tail >= ppipe->low))
+            ssc_pipe_wake(ppipe);
+    }
+
+    return NULL;
+}
+
+/**
+ * get at the next decoded bytes, waiting for them if need be
+ *
+ * @param ppipe pipe to read
+ * @param pdata returns where the bytes are
+ * @returns how many bytes there are, 0 at the end, -1 on a transcode error
+ */
+int ssc_pipe_peek(SSC_PIPE *ppipe, char **pdata) {
+    uint32_t tail = ppipe->tail;
+    uint32_t avail;
+    int bytes_read;
+
+    if(!ppipe->threaded) {
+        if((ppipe->head == tail) && (!ppipe->done)) {
+            ppipe->head = ppipe->tail = tail = 0;
+            bytes_read = ppipe->pfn->ssc_read(ppipe->vp,ppipe->ring,
+                                              (int)ppipe->size);
+            if(bytes_read <= 0)
+                ppipe->done = bytes_read ? -1 : 1;
+            else
+                ppipe->head = bytes_read;
+        }
+    } else if(ppipe->head == tail) {
+        pthread_mutex_lock(&ppipe->lock);
+        ppipe->reader_waiting = TRUE;
+        __sync_synchronize();
+        if((ppipe->head == tail) && (!ppipe->done) && (ppipe->started))
+            ppipe->info.underruns++;
+        while((!ppipe->done) && ((ppipe->head == tail) ||
+                                 (ppipe->head - tail < ppipe->low)))
+            pthread_cond_wait(&ppipe->cond,&ppipe->lock);
+        ppipe->reader_waiting = FALSE;
+        pthread_mutex_unlock(&ppipe->lock);
+    }
+
+    __sync_synchronize();
+    avail = ppipe->head - tail;
+    if(!avail)
+        return (ppipe->done < 0) ? -1 : 0;
+
+    if(avail > ppipe->size - (tail & ppipe->mask))
+        avail = ppipe->size - (tail & ppipe->mask);
+    if(avail > SSC_PIPE_WRITE)
+        avail = SSC_PIPE_WRITE;
+
+    ppipe->started = TRUE;
+    *pdata = &ppipe->ring[tail & ppipe->mask];
+    return (int)avail;
+}
+
+/**
+ * done with bytes from ssc_pipe_peek, so the decoder can reuse the
+ * space
+ *
+ * @param ppipe pipe being read
+ * @param len how many of the peeked bytes were used
+ */
+void ssc_pipe_consume(SSC_PIPE *ppipe, int len) {
+    /* done with the data before the decoder can see it's free */
+    __sync_synchronize();
+    ppipe->tail += len;
+    ppipe->info.bytes += len;
+    __sync_synchronize();
+
+    if((ppipe->decoder_waiting) &&
+       (ppipe->head - ppipe->tail <= ppipe->low))
+        ssc_pipe_wake(ppipe);
+}
+
+/**
+ * stop the decoder and tear down the pipe.  The transcoder is the
+ * caller's again after this.
+ *
+ * @param ppipe pipe to end
+ */
+void ssc_pipe_end(SSC_PIPE *ppipe) {
+    SSC_PIPE **pprev;
+
+    if(ppipe->threaded) {
+        ppipe->stop = TRUE;
+        __sync_synchronize();
+        ssc_pipe_wake(ppipe);
+        pthread_join(ppipe->tid,NULL);
+    }
+
+    DPRINTF(E_INF,L_PLUG,"Transcoded %s: %llu bytes, %u underruns, "
+            "%u stalls\n",ppipe->info.name,
+            (unsigned long long)ppipe->info.bytes,
+            ppipe->info.underruns, ppipe->info.stalls);
+
+    pthread_mutex_lock(&ssc_pipe_list_lock);
+    for(pprev = &ssc_pipe_list; *pprev; pprev = &(*pprev)->next) {
+        if(*pprev == ppipe) {
+            *pprev = ppipe->next;
+            break;
+        }
+    }
+    ssc_pipe_info.streams--;
+    ssc_pipe_info.underruns += ppipe->info.underruns;
+    ssc_pipe_info.stalls += ppipe->info.stalls;
+    pthread_mutex_unlock(&ssc_pipe_list_lock);
+
+    pthread_mutex_destroy(&ppipe->lock);
+    pthread_cond_destroy(&ppipe->cond);
+    free(ppipe->ring);
+    free(ppipe);
+}
+
+/**
+ * get a snapshot of the counters.  Underruns and stalls are for the
+ * streams that have finished.
+ *
+ * @param pstats struct to fill
+ */
+void ssc_pipe_stats(SSC_PIPE_STATS *pstats) {
+    pthread_mutex_lock(&ssc_pipe_list_lock);
+    memcpy(pstats,&ssc_pipe_info,sizeof(SSC_PIPE_STATS));
+    pthread_mutex_unlock(&ssc_pipe_list_lock);
+}
+
+/**
+ * get a snapshot of the streams running now
+ *
+ * @param pstreams array to fill
+ * @param max size of the array
+ * @returns how many were filled in
+ */
+int ssc_pipe_streams(SSC_PIPE_STREAM *pstreams, int max) {
+    SSC_PIPE *ppipe;
+    int count = 0;
+
+    pthread_mutex_lock(&ssc_pipe_list_lock);
+    for(ppipe = ssc_pipe_list; (ppipe) && (count < max); ppipe = ppipe->next) {
+        memcpy(&pstreams[count],&ppipe->info,sizeof(SSC_PIPE_STREAM));
+        pstreams[count].buffered = ppipe->head - ppipe->tail;
+        count++;
+    }
+    pthread_mutex_unlock(&ssc_pipe_list_lock);
+
+    return count;
+}
@@ -0,0 +1,52 @@
+/*
+ * $Id$
+ * decode thread and ring buffer for transcoded streams
+ *
+ * Copyright (C) 2006 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SSC_PIPE_H_
+#define _SSC_PIPE_H_
+
+#include "ff-plugins.h"
+
+typedef struct tag_ssc_pipe SSC_PIPE;
+
+typedef struct tag_ssc_pipe_stats {
+    uint32_t streams;       /**< running now */
+    uint32_t total;         /**< run since startup */
+    uint32_t underruns;     /**< connection had nothing to send */
+    uint32_t stalls;        /**< decoder had nowhere to put it */
+} SSC_PIPE_STATS;
+
+typedef struct tag_ssc_pipe_stream {
+    char name[256];
+    uint64_t bytes;         /**< handed to the connection so far */
+    uint32_t buffered;      /**< decoded, waiting to be sent */
+    uint32_t underruns;
+    uint32_t stalls;
+} SSC_PIPE_STREAM;
+
+extern void ssc_pipe_init(void);
+extern SSC_PIPE *ssc_pipe_start(PLUGIN_TRANSCODE_FN *pfn, void *vp, char *name);
+extern int ssc_pipe_peek(SSC_PIPE *ppipe, char **pdata);
+extern void ssc_pipe_consume(SSC_PIPE *ppipe, int len);
+extern void ssc_pipe_end(SSC_PIPE *ppipe);
+extern void ssc_pipe_stats(SSC_PIPE_STATS *pstats);
+extern int ssc_pipe_streams(SSC_PIPE_STREAM *pstreams, int max);
+
+#endif /* _SSC_PIPE_H_ */
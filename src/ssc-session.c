@@ -0,0 +1,421 @@
+/*
+ * $Id$
+ * transcodes shared between clients playing the same song
+ *
+ * Copyright (C) 2006 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * When several zones play the same song at once, each of them would
+ * get its own transcoder, all doing the same work.  Instead, the
+ * first one to ask for a song leads a session, and keeps a window of
+ * the last bytes it sent.  Anyone else who asks for the same song
+ * (and format) while that's going on, from an offset still in (or
+ * just past) that window, reads along out of it at their own pace.
+ *
+ * A session nobody has joined keeps only a small window, enough for
+ * clients that ask at nearly the same moment.  It grows to
+ * general/ssc_session_buffer KB when someone joins, and all the
+ * windows together stay under general/ssc_session_limit KB.  Past
+ * that, new sessions don't get started and windows don't grow, so
+ * clients get transcodes of their own.
+ *
+ * The leader never waits for readers, so memory stays bounded: a
+ * reader that falls far enough behind that the bytes it needs are
+ * gone gets told to go transcode for itself (SSC_SESSION_BEHIND), and
+ * so does everyone still reading when the leader's own client goes
+ * away.
+ *
+ * This is for when the transcode cache isn't being filled.  When it
+ * is, readers follow the cache file instead (see ssc-cache.c).
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include "daapd.h"
+#include "conf.h"
+#include "err.h"
+#include "ssc-session.h"
+
+#ifndef TRUE
+#  define TRUE 1
+#  define FALSE 0
+#endif
+
+#define SSC_SESSION_DEFAULT_SIZE  8192  /**< in kilobytes */
+#define SSC_SESSION_DEFAULT_LIMIT 32768 /**< in kilobytes */
+#define SSC_SESSION_START_SIZE    (256 * 1024)
+
+#define SSC_SESSION_RUNNING  0
+#define SSC_SESSION_COMPLETE 1
+#define SSC_SESSION_FAILED   2
+#define SSC_SESSION_LEFT     3  /**< leader went away before the end */
+
+typedef struct tag_ssc_session {
+    char *key;
+    char *window;               /**< the last size bytes the leader sent */
+    uint32_t size;
+    uint64_t start;             /**< offset the leader started at */
+    uint64_t end;               /**< offset the leader has sent up to */
+    int state;                  /**< SSC_SESSION_RUNNING, etc */
+    int refcount;               /**< leader and readers */
+    pthread_cond_t cond;        /**< something got sent */
+    struct tag_ssc_session *next;
+} SSC_SESSION;
+
+typedef struct tag_ssc_session_handle {
+    SSC_SESSION *psession;
+    int leader;
+} SSC_SESSION_HANDLE;
+
+/* Globals */
+static pthread_mutex_t ssc_session_lock = PTHREAD_MUTEX_INITIALIZER;
+static SSC_SESSION *ssc_session_list = NULL;    /**< running sessions */
+static SSC_SESSION_STATS ssc_session_info;
+
+/* Forwards */
+static void ssc_session_unlink(SSC_SESSION *psession);
+static uint64_t ssc_session_oldest(SSC_SESSION *psession);
+static void ssc_session_grow(SSC_SESSION *psession);
+
+/**
+ * pick up the window sizes from the config.  Sharing is disabled if
+ * general/ssc_session_buffer is 0.
+ */
+void ssc_session_init(void) {
+    memset(&ssc_session_info,0,sizeof(ssc_session_info));
+    ssc_session_info.max_bytes = 1024 *
+        conf_get_int("general","ssc_session_buffer",SSC_SESSION_DEFAULT_SIZE);
+    ssc_session_info.limit_bytes = 1024 *
+        conf_get_int("general","ssc_session_limit",SSC_SESSION_DEFAULT_LIMIT);
+}
+
+/**
+ * take the running session off the list, so nobody else joins it
+ */
+void ssc_session_unlink(SSC_SESSION *psession) {
+    SSC_SESSION **pprev;
+
+    for(pprev = &ssc_session_list; *pprev; pprev = &(*pprev)->next) {
+        if(*pprev == psession) {
+            *pprev = psession->next;
+            ssc_session_info.sessions--;
+            break;
+        }
+    }
+}
+
+/**
+ * oldest offset that's still in the window
+ */
+uint64_t ssc_session_oldest(SSC_SESSION *psession) {
+    if(psession->end - psession->start > psession->size)
+        return psession->end - psession->size;
+
+    return psession->start;
+}
+
+/**
+ * grow a session's window to the full size, if that fits under the
+ * limit.  If it doesn't, the window just stays as it is.
+ */
+void ssc_session_grow(SSC_SESSION *psession) {
+    uint32_t new_size = ssc_session_info.max_bytes;
+    uint64_t offset;
+    uint32_t chunk;
+    char *new_window;
+
+    if((new_size <= psession->size) ||
+       (ssc_session_info.bytes + (new_size - psession->size) >
+        ssc_session_info.limit_bytes))
+        return;
+
+    if(!(new_window = (char*)malloc(new_size)))
+        return;
+
+    /* same offsets, new places */
+    for(offset = ssc_session_oldest(psession); offset < psession->end;
+        offset += chunk) {
+        chunk = psession->size - (uint32_t)(offset % psession->size);
+        if(chunk > new_size - (uint32_t)(offset % new_size))
+            chunk = new_size - (uint32_t)(offset % new_size);
+        if(chunk > psession->end - offset)
+            chunk = (uint32_t)(psession->end - offset);
+        memcpy(&new_window[offset % new_size],
+               &psession->window[offset % psession->size],chunk);
+    }
+
+    free(psession->window);
+    psession->window = new_window;
+    ssc_session_info.bytes += new_size - psession->size;
+    psession->size = new_size;
+}
+
+/**
+ * join the session for a song, or start one.  A song someone else is
+ * already transcoding, but too far from the offset to share, gets no
+ * session at all, and neither does anything past the memory limit.
+ *
+ * @param key what is being transcoded, and how
+ * @param offset where the caller wants to start
+ * @param plead returns TRUE if the caller leads the session (and has
+ *        to ssc_session_write what it sends)
+ * @returns handle to release, or NULL if the caller is on their own
+ */
+void *ssc_session_open(char *key, uint64_t offset, int *plead) {
+    SSC_SESSION *psession;
+    SSC_SESSION_HANDLE *phandle;
+    uint32_t size;
+
+    *plead = FALSE;
+    if(!ssc_session_info.max_bytes)
+        return NULL;
+
+    phandle = (SSC_SESSION_HANDLE*)calloc(1,sizeof(SSC_SESSION_HANDLE));
+    if(!phandle) {
+        DPRINTF(E_LOG,L_PLUG,"Malloc error in ssc_session_open\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ssc_session_lock);
+    for(psession = ssc_session_list; psession; psession = psession->next) {
+        if(!strcmp(psession->key,key))
+            break;
+    }
+
+    if(psession) {
+        if((offset < ssc_session_oldest(psession)) || (offset > psession->end)) {
+            pthread_mutex_unlock(&ssc_session_lock);
+            free(phandle);
+            return NULL;
+        }
+
+        ssc_session_grow(psession);
+        psession->refcount++;
+        ssc_session_info.readers++;
+        pthread_mutex_unlock(&ssc_session_lock);
+
+        phandle->psession = psession;
+        return (void*)phandle;
+    }
+
+    size = SSC_SESSION_START_SIZE;
+    if(size > ssc_session_info.max_bytes)
+        size = ssc_session_info.max_bytes;
+
+    if(ssc_session_info.bytes + size > ssc_session_info.limit_bytes) {
+        pthread_mutex_unlock(&ssc_session_lock);
+        free(phandle);
+        return NULL;
+    }
+
+    psession = (SSC_SESSION*)calloc(1,sizeof(SSC_SESSION));
+    if(psession) {
+        psession->key = strdup(key);
+        psession->window = (char*)malloc(size);
+    }
+
+    if((!psession) || (!psession->key) || (!psession->window)) {
+        DPRINTF(E_LOG,L_PLUG,"Malloc error in ssc_session_open\n");
+        pthread_mutex_unlock(&ssc_session_lock);
+        if(psession) {
+            if(psession->key) free(psession->key);
+            if(psession->window) free(psession->window);
+            free(psession);
+        }
+        free(phandle);
+        return NULL;
+    }
+
+    psession->size = size;
+    psession->start = psession->end = offset;
+    psession->state = SSC_SESSION_RUNNING;
+    psession->refcount = 1;
+    pthread_cond_init(&psession->cond,NULL);
+    psession->next = ssc_session_list;
+    ssc_session_list = psession;
+    ssc_session_info.bytes += size;
+    ssc_session_info.sessions++;
+    ssc_session_info.started++;
+    pthread_mutex_unlock(&ssc_session_lock);
+
+    phandle->psession = psession;
+    phandle->leader = TRUE;
+    *plead = TRUE;
+    return (void*)phandle;
+}
+
+/**
+ * add the next block the leader sent to the window, pushing out the
+ * oldest
+ *
+ * @param handle handle from ssc_session_open that leads
+ * @param buffer block that was sent
+ * @param len length of block
+ */
+void ssc_session_write(void *handle, char *buffer, int len) {
+    SSC_SESSION *psession = ((SSC_SESSION_HANDLE*)handle)->psession;
+    uint32_t size;
+    uint32_t pos;
+    uint32_t chunk;
+
+    pthread_mutex_lock(&ssc_session_lock);
+    size = psession->size;
+
+    /* only the tail of a block bigger than the window matters */
+    if((uint32_t)len > size) {
+        psession->end += len - size;
+        buffer += len - size;
+        len = size;
+    }
+
+    while(len) {
+        pos = (uint32_t)(psession->end % size);
+        chunk = size - pos;
+        if(chunk > (uint32_t)len)
+            chunk = len;
+        memcpy(&psession->window[pos],buffer,chunk);
+        psession->end += chunk;
+        buffer += chunk;
+        len -= chunk;
+    }
+
+    pthread_cond_broadcast(&psession->cond);
+    pthread_mutex_unlock(&ssc_session_lock);
+}
+
+/**
+ * the leader got to the end of the transcode.  Readers get the rest
+ * of the window, then the end (or an error).
+ *
+ * @param handle handle from ssc_session_open that leads
+ * @param complete TRUE if the transcoder got to the end
+ */
+void ssc_session_finish(void *handle, int complete) {
+    SSC_SESSION *psession = ((SSC_SESSION_HANDLE*)handle)->psession;
+
+    pthread_mutex_lock(&ssc_session_lock);
+    if(psession->state == SSC_SESSION_RUNNING) {
+        psession->state = complete ? SSC_SESSION_COMPLETE : SSC_SESSION_FAILED;
+        ssc_session_unlink(psession);
+        pthread_cond_broadcast(&psession->cond);
+    }
+    pthread_mutex_unlock(&ssc_session_lock);
+}
+
+/**
+ * read from a session, waiting for the leader to get there if it
+ * hasn't yet
+ *
+ * @param handle handle from ssc_session_open
+ * @param offset where to read from
+ * @param buffer buffer to read into
+ * @param len size of buffer
+ * @returns bytes read, 0 at the end, -1 if the transcode failed, or
+ *          SSC_SESSION_BEHIND if the caller has to transcode the rest
+ *          itself
+ */
+int ssc_session_read(void *handle, uint64_t offset, char *buffer, int len) {
+    SSC_SESSION *psession = ((SSC_SESSION_HANDLE*)handle)->psession;
+    uint32_t pos;
+
+    pthread_mutex_lock(&ssc_session_lock);
+    while((psession->state == SSC_SESSION_RUNNING) && (offset >= psession->end))
+        pthread_cond_wait(&psession->cond,&ssc_session_lock);
+
+    if(offset < ssc_session_oldest(psession)) {
+        ssc_session_info.detached++;
+        pthread_mutex_unlock(&ssc_session_lock);
+        return SSC_SESSION_BEHIND;
+    }
+
+    if(offset >= psession->end) {
+        if(psession->state == SSC_SESSION_LEFT)
+            ssc_session_info.detached++;
+        pthread_mutex_unlock(&ssc_session_lock);
+        switch(psession->state) {
+        case SSC_SESSION_COMPLETE:
+            return 0;
+        case SSC_SESSION_LEFT:
+            return SSC_SESSION_BEHIND;
+        default:
+            return -1;
+        }
+    }
+
+    if(psession->end - offset < (uint64_t)len)
+        len = (int)(psession->end - offset);
+
+    pos = (uint32_t)(offset % psession->size);
+    if(psession->size - pos < (uint32_t)len)
+        len = psession->size - pos;
+
+    memcpy(buffer,&psession->window[pos],len);
+    pthread_mutex_unlock(&ssc_session_lock);
+
+    return len;
+}
+
+/**
+ * done with a session.  A leader that didn't finish leaves its
+ * readers to fend for themselves.
+ *
+ * @param handle handle to release
+ */
+void ssc_session_release(void *handle) {
+    SSC_SESSION_HANDLE *phandle = (SSC_SESSION_HANDLE*)handle;
+    SSC_SESSION *psession = phandle->psession;
+
+    pthread_mutex_lock(&ssc_session_lock);
+    if((phandle->leader) && (psession->state == SSC_SESSION_RUNNING)) {
+        psession->state = SSC_SESSION_LEFT;
+        ssc_session_unlink(psession);
+        pthread_cond_broadcast(&psession->cond);
+    }
+
+    if(!--psession->refcount) {
+        ssc_session_info.bytes -= psession->size;
+        pthread_cond_destroy(&psession->cond);
+        free(psession->key);
+        free(psession->window);
+        free(psession);
+    }
+    pthread_mutex_unlock(&ssc_session_lock);
+
+    free(phandle);
+}
+
+/**
+ * get a snapshot of the session counters
+ *
+ * @param pstats struct to fill
+ */
+void ssc_session_stats(SSC_SESSION_STATS *pstats) {
+    pthread_mutex_lock(&ssc_session_lock);
+    memcpy(pstats,&ssc_session_info,sizeof(SSC_SESSION_STATS));
+    pthread_mutex_unlock(&ssc_session_lock);
+}
@@ -0,0 +1,45 @@
+/*
+ * $Id$
+ * transcodes shared between clients playing the same song
+ *
+ * Copyright (C) 2006 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SSC_SESSION_H_
+#define _SSC_SESSION_H_
+
+#define SSC_SESSION_BEHIND -2   /**< from ssc_session_read: transcode it yourself */
+
+typedef struct tag_ssc_session_stats {
+    uint32_t max_bytes;     /**< most kept per session (0 = sharing disabled) */
+    uint32_t limit_bytes;   /**< most kept by all sessions together */
+    uint32_t bytes;         /**< kept now */
+    uint32_t sessions;      /**< running now */
+    uint32_t started;       /**< since startup */
+    uint32_t readers;       /**< clients that shared someone else's */
+    uint32_t detached;      /**< readers that fell behind, or were left */
+} SSC_SESSION_STATS;
+
+extern void ssc_session_init(void);
+extern void *ssc_session_open(char *key, uint64_t offset, int *plead);
+extern void ssc_session_write(void *handle, char *buffer, int len);
+extern void ssc_session_finish(void *handle, int complete);
+extern int ssc_session_read(void *handle, uint64_t offset, char *buffer, int len);
+extern void ssc_session_release(void *handle);
+extern void ssc_session_stats(SSC_SESSION_STATS *pstats);
+
+#endif /* _SSC_SESSION_H_ */
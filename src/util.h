@@ -24,6 +24,7 @@ typedef enum {
     l_memdebug,
     l_upnp,
     l_pl,
+    l_scan,
     l_last
 } ff_lock_t;
 
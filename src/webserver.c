@@ -46,6 +46,13 @@
 # include <arpa/inet.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+
 #include "daapd.h"
 #include "webserver.h"
 #include "io.h"
@@ -62,6 +69,16 @@
 #define MAX_HOSTNAME 256
 #define MAX_LINEBUFFER 2048
 #define BLKSIZE PIPE_BUF
+#define WS_SENDFILE_CHUNK (1024 * 1024) /**< max bytes per sendfile call */
+
+#define WS_DEFAULT_WORKERS 16   /**< request workers if not configured */
+#define WS_DEFAULT_MAX_WORKERS 64 /**< most workers, counting extra ones */
+#define WS_IDLE_TIMEOUT    1800 /**< seconds a keep-alive conn can idle */
+#define WS_REQUEST_TIMEOUT 10   /**< seconds to finish sending a request */
+#define WS_REAP_INTERVAL   60   /**< seconds between idle conn sweeps */
+#define WS_MAX_EVENTS      64   /**< events to pull per epoll_wait */
+#define WS_WORKER_LINGER   60   /**< seconds an extra worker idles before exiting */
+#define WS_HOLD_SETTLE     5    /**< seconds from a change until held requests rerun */
 
 #ifdef DEBUG
 #  ifndef ASSERT
@@ -96,7 +113,11 @@ typedef struct tag_ws_handler {
 
 typedef struct tag_ws_connlist {
     WS_CONNINFO *pwsc;
+    int parked;             /**< idle, waiting on the reactor */
+    int release;            /**< held, and released before it was parked */
+    time_t last_active;     /**< when the connection was parked */
     struct tag_ws_connlist *next;
+    struct tag_ws_connlist *ready_next; /**< ready queue */
 } WS_CONNLIST;
 
 typedef struct tag_ws_private {
@@ -112,6 +133,21 @@ typedef struct tag_ws_private {
     pthread_t server_tid;
     pthread_cond_t exit_cond;
     pthread_mutex_t exit_mutex;
+
+    /* reactor state -- unused with thread-per-connection */
+    int epoll_fd;
+    int wake_fd[2];
+    int workers;
+    int max_workers;        /**< no extra workers past this many */
+    pthread_t *worker_tid;
+    pthread_mutex_t ready_mutex;
+    pthread_cond_t ready_cond;
+    WS_CONNLIST *ready_head;
+    WS_CONNLIST *ready_tail;
+    int queued;             /**< connections on the ready queue */
+    int waiting;            /**< workers waiting for one */
+    int overflow;           /**< extra workers started past the pool */
+    time_t release_at;      /**< when to rerun held requests, or 0 */
 } WS_PRIVATE;
 
 
@@ -120,6 +156,8 @@ typedef struct tag_ws_private {
  */
 void *ws_mainthread(void*);
 void *ws_dispatcher(void*);
+void *ws_worker(void*);
+void *ws_overflow_worker(void*);
 int ws_lock_unsafe(void);
 int ws_unlock_unsafe(void);
 void ws_defaulthandler(WS_PRIVATE *pwsp, WS_CONNINFO *pwsc);
@@ -143,8 +181,25 @@ int ws_registerhandler(WSHANDLE ws, char *stem,
 int ws_decodepassword(char *header, char **username, char **password);
 int ws_testrequestheader(WS_CONNINFO *pwsc, char *header, char *value);
 char *ws_getrequestheader(WS_CONNINFO *pwsc, char *header);
-static void ws_add_dispatch_thread(WS_PRIVATE *pwsp, WS_CONNINFO *pwsc);
+static WS_CONNLIST *ws_add_dispatch_thread(WS_PRIVATE *pwsp, WS_CONNINFO *pwsc);
 static void ws_remove_dispatch_thread(WS_PRIVATE *pwsp, WS_CONNINFO *pwsc);
+static WS_CONNINFO *ws_accept(WS_PRIVATE *pwsp);
+static int ws_dispatch_request(WS_CONNINFO *pwsc);
+static int ws_dispatch_handler(WS_CONNINFO *pwsc);
+static void ws_close_connection(WS_CONNINFO *pwsc);
+#ifdef HAVE_SYS_EPOLL_H
+static int ws_reactor_init(WS_PRIVATE *pwsp);
+static void ws_reactor_deinit(WS_PRIVATE *pwsp);
+static int ws_park(WS_PRIVATE *pwsp, WS_CONNLIST *pcl, int op);
+static void ws_reap_idle(WS_PRIVATE *pwsp, int all);
+static void ws_ready(WS_PRIVATE *pwsp, WS_CONNLIST *pcl);
+static void ws_release(WS_PRIVATE *pwsp);
+static void ws_work(WS_PRIVATE *pwsp, int overflow);
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+static int ws_sendfile(WS_CONNINFO *pwsc, IOHANDLE hfile,
+                       uint64_t *bytes_copied);
+#endif
 static int ws_encoding_hack(WS_CONNINFO *pwsc);
 
 static void ws_default_errhandler(int level, char *msg);
@@ -286,7 +341,7 @@ WSHANDLE ws_init(WSCONFIG *config) {
         return NULL;
     }
 
-    memcpy(&pwsp->wsconfig,config,sizeof(WS_PRIVATE));
+    memcpy(&pwsp->wsconfig,config,sizeof(WSCONFIG));
     pwsp->connlist.next=NULL;
     pwsp->running=0;
     pwsp->threadno=0;
@@ -294,6 +349,14 @@ WSHANDLE ws_init(WSCONFIG *config) {
     pwsp->dispatch_threads=0;
     pwsp->handlers.next=NULL;
 
+    pwsp->epoll_fd = -1;
+    pwsp->wake_fd[0] = pwsp->wake_fd[1] = -1;
+    pwsp->workers = 0;
+    pwsp->worker_tid = NULL;
+    pwsp->ready_head = pwsp->ready_tail = NULL;
+    pwsp->queued = pwsp->waiting = pwsp->overflow = 0;
+    pwsp->release_at = 0;
+
     if((err=pthread_cond_init(&pwsp->exit_cond, NULL))) {
         ws_dprintf(L_WS_LOG,"Error in pthread_cond_init: %s\n",strerror(err));
         return NULL;
@@ -304,6 +367,16 @@ WSHANDLE ws_init(WSCONFIG *config) {
         return NULL;
     }
 
+    if((err=pthread_cond_init(&pwsp->ready_cond, NULL))) {
+        ws_dprintf(L_WS_LOG,"Error in pthread_cond_init: %s\n",strerror(err));
+        return NULL;
+    }
+
+    if((err=pthread_mutex_init(&pwsp->ready_mutex,NULL))) {
+        ws_dprintf(L_WS_LOG,"Error in pthread_mutex_init: %s\n",strerror(err));
+        return NULL;
+    }
+
     WS_EXIT();
     return (WSHANDLE)pwsp;
 }
@@ -364,9 +437,22 @@ int ws_start(WSHANDLE ws) {
         }
     }
 
+#ifdef HAVE_SYS_EPOLL_H
+    if((err = ws_reactor_init(pwsp)) != E_WS_SUCCESS) {
+        io_close(pwsp->hserver);
+        io_dispose(pwsp->hserver);
+        WS_EXIT();
+        return err;
+    }
+#endif
+
     ws_dprintf(L_WS_INF,"Starting server thread\n");
     if((err=pthread_create(&pwsp->server_tid,NULL,ws_mainthread,(void*)pwsp))) {
         ws_dprintf(L_WS_LOG,"Could not spawn thread: %s\n",strerror(err));
+#ifdef HAVE_SYS_EPOLL_H
+        pwsp->stop=1;
+        ws_reactor_deinit(pwsp);
+#endif
         io_close(pwsp->hserver);
         io_dispose(pwsp->hserver);
         WS_EXIT();
@@ -381,6 +467,141 @@ int ws_start(WSHANDLE ws) {
 }
 
 
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Stop the worker pool and release the reactor resources.  The
+ * caller must have set pwsp->stop, otherwise the workers will
+ * just go back to waiting for more work.
+ *
+ * @param pwsp webserver to tear the reactor down for
+ */
+void ws_reactor_deinit(WS_PRIVATE *pwsp) {
+    int index;
+
+    pthread_mutex_lock(&pwsp->ready_mutex);
+    pthread_cond_broadcast(&pwsp->ready_cond);
+    pthread_mutex_unlock(&pwsp->ready_mutex);
+
+    for(index=0; index < pwsp->workers; index++) {
+        pthread_join(pwsp->worker_tid[index],NULL);
+    }
+
+    /* the extra workers are detached, so just wait for them to go */
+    pthread_mutex_lock(&pwsp->ready_mutex);
+    while(pwsp->overflow)
+        pthread_cond_wait(&pwsp->ready_cond,&pwsp->ready_mutex);
+    pthread_mutex_unlock(&pwsp->ready_mutex);
+
+    pwsp->workers = 0;
+    if(pwsp->worker_tid)
+        free(pwsp->worker_tid);
+    pwsp->worker_tid = NULL;
+
+    if(pwsp->epoll_fd != -1)
+        close(pwsp->epoll_fd);
+    if(pwsp->wake_fd[0] != -1)
+        close(pwsp->wake_fd[0]);
+    if(pwsp->wake_fd[1] != -1)
+        close(pwsp->wake_fd[1]);
+
+    pwsp->epoll_fd = -1;
+    pwsp->wake_fd[0] = pwsp->wake_fd[1] = -1;
+}
+
+/**
+ * Set up the epoll set and spin up the request workers.  Rather than
+ * holding a thread per connection, idle keep-alive connections are
+ * parked on the epoll set, and only connections with a request
+ * waiting get handed off to a worker.
+ *
+ * @param pwsp webserver to set up the reactor for
+ * @returns E_WS_SUCCESS on success, or appropriate E_WS_ error code
+ */
+int ws_reactor_init(WS_PRIVATE *pwsp) {
+    struct epoll_event ev;
+    SOCKET_T sock;
+    int index;
+    int err;
+
+    WS_ENTER();
+
+    if(!io_getsocket(pwsp->hserver,&sock)) {
+        ws_dprintf(L_WS_LOG,"Can't get listen socket: %s\n",
+                   io_errstr(pwsp->hserver));
+        WS_EXIT();
+        return E_WS_LISTEN;
+    }
+
+    if(((pwsp->epoll_fd = epoll_create(WS_MAX_EVENTS)) == -1) ||
+       (pipe(pwsp->wake_fd) == -1)) {
+        ws_dprintf(L_WS_LOG,"Can't create reactor: %s\n",strerror(errno));
+        ws_reactor_deinit(pwsp);
+        WS_EXIT();
+        return E_WS_NATIVE;
+    }
+
+    memset(&ev,0,sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;   /* listen socket */
+    if(epoll_ctl(pwsp->epoll_fd,EPOLL_CTL_ADD,sock,&ev) == -1) {
+        ws_dprintf(L_WS_LOG,"epoll_ctl: %s\n",strerror(errno));
+        ws_reactor_deinit(pwsp);
+        WS_EXIT();
+        return E_WS_NATIVE;
+    }
+
+    ev.data.ptr = (void*)pwsp; /* wakeup pipe */
+    if(epoll_ctl(pwsp->epoll_fd,EPOLL_CTL_ADD,pwsp->wake_fd[0],&ev) == -1) {
+        ws_dprintf(L_WS_LOG,"epoll_ctl: %s\n",strerror(errno));
+        ws_reactor_deinit(pwsp);
+        WS_EXIT();
+        return E_WS_NATIVE;
+    }
+
+    pwsp->workers = pwsp->wsconfig.worker_threads;
+    if(pwsp->workers <= 0)
+        pwsp->workers = WS_DEFAULT_WORKERS;
+
+    pwsp->max_workers = pwsp->wsconfig.max_worker_threads;
+    if(pwsp->max_workers <= 0)
+        pwsp->max_workers = WS_DEFAULT_MAX_WORKERS;
+    if(pwsp->max_workers < pwsp->workers)
+        pwsp->max_workers = pwsp->workers;
+
+    pwsp->worker_tid = (pthread_t*)malloc(sizeof(pthread_t) * pwsp->workers);
+    if(!pwsp->worker_tid) {
+        ws_dprintf(L_WS_LOG,"Malloc error: %s\n",strerror(errno));
+        pwsp->workers = 0;
+        ws_reactor_deinit(pwsp);
+        WS_EXIT();
+        return E_WS_MEMORY;
+    }
+
+    for(index=0; index < pwsp->workers; index++) {
+        if((err=pthread_create(&pwsp->worker_tid[index],NULL,
+                               ws_worker,(void*)pwsp))) {
+            ws_dprintf(L_WS_LOG,"Could not spawn worker: %s\n",strerror(err));
+            break;
+        }
+    }
+
+    if(!index) {
+        pwsp->workers = 0;
+        ws_reactor_deinit(pwsp);
+        WS_EXIT();
+        return E_WS_PTHREADS;
+    }
+
+    pwsp->workers = index;
+    ws_dprintf(L_WS_INF,"Started %d request workers, up to %d when busy\n",
+               pwsp->workers,pwsp->max_workers);
+
+    WS_EXIT();
+    return E_WS_SUCCESS;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+
 /*
  * ws_remove_dispatch_thread
  *
@@ -423,15 +644,15 @@ void ws_remove_dispatch_thread(WS_PRIVATE *pwsp, WS_CONNINFO *pwsc) {
  * ws_add_dispatch_thread
  *
  * Add a thread to the dispatch thread list
+ *
+ * returns the new connection list entry
  */
-void ws_add_dispatch_thread(WS_PRIVATE *pwsp, WS_CONNINFO *pwsc) {
+WS_CONNLIST *ws_add_dispatch_thread(WS_PRIVATE *pwsp, WS_CONNINFO *pwsc) {
     WS_CONNLIST *pNew;
 
     WS_ENTER();
 
     pNew=(WS_CONNLIST*)malloc(sizeof(WS_CONNLIST));
-    pNew->next=NULL;
-    pNew->pwsc=pwsc;
 
     if(!pNew) {
         ws_dprintf(L_WS_FATAL,"Malloc: %s\n",strerror(errno));
@@ -439,6 +660,9 @@ void ws_add_dispatch_thread(WS_PRIVATE *pwsp, WS_CONNINFO *pwsc) {
                   * honor L_WS_FATAL */
     }
 
+    memset(pNew,0,sizeof(WS_CONNLIST));
+    pNew->pwsc=pwsc;
+
     ws_lock_connlist(pwsp);
 
     /* list is locked... */
@@ -448,6 +672,7 @@ void ws_add_dispatch_thread(WS_PRIVATE *pwsp, WS_CONNINFO *pwsc) {
 
     ws_unlock_connlist(pwsp);
     WS_EXIT();
+    return pNew;
 }
 
 /**
@@ -463,20 +688,46 @@ int ws_stop(WSHANDLE ws) {
     WS_HANDLER *current;
     WS_CONNLIST *pcl;
     void *result;
+#ifdef HAVE_SYS_EPOLL_H
+    SOCKET_T sock;
+#endif
 
     WS_ENTER();
 
-    /* free the ws_handlers */
-    while(pwsp->handlers.next) {
-        current=pwsp->handlers.next;
-        pwsp->handlers.next=current->next;
-        free(&current->stem);
-        free(current);
-    }
-
     pwsp->stop=1;
     pwsp->running=0;
 
+#ifdef HAVE_SYS_EPOLL_H
+    /* kick the reactor out of epoll_wait.  It drops the idle
+     * connections on the way out */
+    if(write(pwsp->wake_fd[1],"x",1) != 1)
+        ws_dprintf(L_WS_LOG,"ws_stop: can't wake reactor\n");
+
+    pthread_join(pwsp->server_tid,&result);
+
+    ws_dprintf(L_WS_DBG,"ws_stop: closing the server fd\n");
+    io_close(pwsp->hserver);
+    io_dispose(pwsp->hserver);
+
+    /* Shut down the sockets of the requests the workers are still
+     * running, so they error out.  The workers own those connections,
+     * so they are left for the workers to close.
+     */
+    ws_lock_connlist(pwsp);
+    for(pcl = pwsp->connlist.next; pcl; pcl = pcl->next) {
+        if(io_getsocket(pcl->pwsc->hclient,&sock))
+            shutdown(sock,SHUT_RDWR);
+    }
+    ws_unlock_connlist(pwsp);
+
+    /* the workers close whatever is still queued, and once they are
+     * joined, nothing else can be using the connection list */
+    ws_reactor_deinit(pwsp);
+
+    if(pwsp->dispatch_threads)
+        ws_dprintf(L_WS_LOG,"ws_stop: %d connections left open\n",
+                   pwsp->dispatch_threads);
+#else
     ws_dprintf(L_WS_DBG,"ws_stop: closing the server fd\n");
     io_close(pwsp->hserver);
     io_dispose(pwsp->hserver);
@@ -508,6 +759,15 @@ int ws_stop(WSHANDLE ws) {
     }
 
     ws_unlock_connlist(pwsp);
+#endif
+
+    /* free the ws_handlers */
+    while(pwsp->handlers.next) {
+        current=pwsp->handlers.next;
+        pwsp->handlers.next=current->next;
+        free(current->stem);
+        free(current);
+    }
 
     free(pwsp);
 
@@ -515,6 +775,470 @@ int ws_stop(WSHANDLE ws) {
     return TRUE;
 }
 
+/**
+ * Accept a new connection from the listen socket, and build up
+ * a connection handle for it.  The new connection is not yet
+ * registered on the connection list.
+ *
+ * @param pwsp webserver to accept a connection on
+ * @returns new connection, or NULL if the accept failed
+ */
+WS_CONNINFO *ws_accept(WS_PRIVATE *pwsp) {
+    IOHANDLE hnew;
+    WS_CONNINFO *pwsc;
+    /* FIXME: endpoint from io_socket */
+    char hostname[MAX_HOSTNAME+1];
+    struct in_addr hostaddr;
+
+    WS_ENTER();
+
+    pwsc=(WS_CONNINFO*)malloc(sizeof(WS_CONNINFO));
+    if(!pwsc) {
+        /* can't very well service any more threads! */
+        ws_dprintf(L_WS_FATAL,"Error: %s\n",strerror(errno));
+        pwsp->running=0;
+        WS_EXIT();
+        exit(1); /* should be unnecessary */
+        return NULL;
+    }
+
+    memset(pwsc,0,sizeof(WS_CONNINFO));
+
+    hnew = io_new();
+    if(!hnew)
+        ws_dprintf(L_WS_FATAL,"Malloc error in io_new()");
+
+    if(!io_listen_accept(pwsp->hserver,hnew,&hostaddr)) {
+        ws_dprintf(L_WS_LOG,"Dispatcher: accept failed: %s\n",
+            io_errstr(pwsp->hserver));
+        io_dispose(hnew);
+        free(pwsc);
+        WS_EXIT();
+        return NULL;
+    }
+
+    /* read ahead, so parsing the request and headers doesn't
+     * cost a syscall per byte */
+    io_buffer(hnew);
+
+    /* FIXME: Get remote endpoint */
+    strncpy(hostname,inet_ntoa(hostaddr),MAX_HOSTNAME);
+
+    pwsc->hostname=strdup(hostname);
+    pwsc->hclient = hnew;
+    pwsc->pwsp = pwsp;
+
+    WS_EXIT();
+    return pwsc;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Park an idle connection on the reactor, waiting for the next
+ * request to come in.  This is done with EPOLLONESHOT, so only one
+ * worker ever owns a connection at a time.  A held connection is
+ * parked the same way, but waits for ws_release instead.
+ *
+ * @param pwsp webserver the connection belongs to
+ * @param pcl connection list entry of the connection to park
+ * @param op EPOLL_CTL_ADD for a new connection, EPOLL_CTL_MOD to re-arm
+ * @returns TRUE on success, FALSE if the connection should be closed
+ */
+int ws_park(WS_PRIVATE *pwsp, WS_CONNLIST *pcl, int op) {
+    struct epoll_event ev;
+    SOCKET_T sock;
+    int retval = TRUE;
+    int err;
+
+    if(!io_getsocket(pcl->pwsc->hclient,&sock))
+        return FALSE;
+
+    memset(&ev,0,sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = (void*)pcl;
+
+    /* this has to be done under the connlist lock, otherwise the
+     * reaper could close the connection out from under the epoll_ctl */
+    ws_lock_connlist(pwsp);
+    if(pwsp->stop) {
+        retval = FALSE;
+    } else if((pcl->pwsc->held) && (pcl->release)) {
+        /* released while the handler was still running */
+        pcl->release = 0;
+        ws_ready(pwsp,pcl);
+    } else {
+        pcl->parked = 1;
+        pcl->last_active = time(NULL);
+        err = epoll_ctl(pwsp->epoll_fd,op,sock,&ev);
+        if((err == -1) && (errno == ENOENT) && (op == EPOLL_CTL_MOD)) {
+            /* it came off the set when it was released from a hold */
+            err = epoll_ctl(pwsp->epoll_fd,EPOLL_CTL_ADD,sock,&ev);
+        }
+        if(err == -1) {
+            ws_dprintf(L_WS_LOG,"Thread %d: epoll_ctl: %s\n",
+                       pcl->pwsc->threadno,strerror(errno));
+            pcl->parked = 0;
+            retval = FALSE;
+        }
+    }
+    ws_unlock_connlist(pwsp);
+
+    return retval;
+}
+
+/**
+ * Close parked connections that have been idle for longer than
+ * WS_IDLE_TIMEOUT.  This is what used to be the read timeout on the
+ * request line in the dispatch thread.  Held connections are waiting
+ * on something else, so they are left alone.  This must only be
+ * called from the reactor thread.
+ *
+ * @param pwsp webserver to reap connections for
+ * @param all close all parked connections, not just the stale ones
+ */
+void ws_reap_idle(WS_PRIVATE *pwsp, int all) {
+    WS_CONNLIST *pcl;
+    WS_CONNINFO *pwsc;
+    time_t now;
+
+    WS_ENTER();
+
+    now = time(NULL);
+    do {
+        pwsc = NULL;
+
+        ws_lock_connlist(pwsp);
+        for(pcl = pwsp->connlist.next; pcl; pcl = pcl->next) {
+            if((pcl->parked) &&
+               ((all) || ((!pcl->pwsc->held) &&
+                          (now - pcl->last_active > WS_IDLE_TIMEOUT)))) {
+                pcl->parked = 0;
+                pwsc = pcl->pwsc;
+                break;
+            }
+        }
+        ws_unlock_connlist(pwsp);
+
+        if(pwsc) {
+            ws_dprintf(L_WS_DBG,"Thread %d: closing idle connection\n",
+                       pwsc->threadno);
+            ws_should_close(pwsc,TRUE);
+            ws_close_connection(pwsc);
+        }
+    } while(pwsc);
+
+    WS_EXIT();
+}
+
+/**
+ * Hand a connection with a pending request to the worker pool.  If
+ * every worker is already busy, most likely streaming a song, then
+ * rather than have the request wait behind them, another worker is
+ * started for it, up to max_workers in all.  Past that, it waits on
+ * the queue.  The extra ones go away again once things quiet down.
+ *
+ * @param pwsp webserver the connection belongs to
+ * @param pcl connection list entry for the ready connection
+ */
+void ws_ready(WS_PRIVATE *pwsp, WS_CONNLIST *pcl) {
+    pthread_t tid;
+    int err;
+
+    pthread_mutex_lock(&pwsp->ready_mutex);
+
+    pcl->ready_next = NULL;
+    if(pwsp->ready_tail)
+        pwsp->ready_tail->ready_next = pcl;
+    else
+        pwsp->ready_head = pcl;
+    pwsp->ready_tail = pcl;
+    pwsp->queued++;
+
+    if((pwsp->queued > pwsp->waiting) &&
+       (pwsp->workers + pwsp->overflow < pwsp->max_workers)) {
+        if((err=pthread_create(&tid,NULL,ws_overflow_worker,(void*)pwsp))) {
+            ws_dprintf(L_WS_LOG,"Could not spawn worker: %s\n",strerror(err));
+        } else {
+            pthread_detach(tid);
+            pwsp->overflow++;
+            ws_dprintf(L_WS_DBG,"All workers busy, now running %d\n",
+                       pwsp->workers + pwsp->overflow);
+        }
+    }
+
+    pthread_cond_signal(&pwsp->ready_cond);
+    pthread_mutex_unlock(&pwsp->ready_mutex);
+}
+
+/**
+ * Run the requests that were held with ws_hold.  Ones that are
+ * parked come off the reactor and go to the workers, and ones that
+ * are still in their handler get run again as soon as it returns.
+ * This must only be called from the reactor thread.
+ *
+ * @param pwsp webserver to release the held requests for
+ */
+void ws_release(WS_PRIVATE *pwsp) {
+    struct epoll_event ev;
+    WS_CONNLIST *pcl;
+    SOCKET_T sock;
+
+    WS_ENTER();
+
+    memset(&ev,0,sizeof(ev));
+
+    ws_lock_connlist(pwsp);
+    for(pcl = pwsp->connlist.next; pcl; pcl = pcl->next) {
+        if(!pcl->pwsc->held)
+            continue;
+
+        if(!pcl->parked) {
+            pcl->release = 1;
+            continue;
+        }
+
+        /* take it off the set, so nothing can come in for it
+         * while a worker has it */
+        pcl->parked = 0;
+        if(io_getsocket(pcl->pwsc->hclient,&sock))
+            epoll_ctl(pwsp->epoll_fd,EPOLL_CTL_DEL,sock,&ev);
+
+        ws_dprintf(L_WS_DBG,"Thread %d: releasing held request\n",
+                   pcl->pwsc->threadno);
+        ws_ready(pwsp,pcl);
+    }
+    ws_unlock_connlist(pwsp);
+
+    WS_EXIT();
+}
+
+/**
+ * Request worker loop.  This pulls connections with a pending request
+ * off the ready queue, services exactly one request, and then either
+ * parks the connection back on the reactor or closes it.  Handlers run
+ * here exactly as they did in the old per-connection dispatch threads.
+ *
+ * @param pwsp webserver to work for
+ * @param overflow TRUE if this is an extra worker, which exits after
+ *        WS_WORKER_LINGER seconds with nothing to do
+ */
+void ws_work(WS_PRIVATE *pwsp, int overflow) {
+    WS_CONNLIST *pcl;
+    WS_CONNINFO *pwsc;
+    struct timespec linger;
+    int keep;
+
+    WS_ENTER();
+
+    while(1) {
+        linger.tv_sec = time(NULL) + WS_WORKER_LINGER;
+        linger.tv_nsec = 0;
+
+        pthread_mutex_lock(&pwsp->ready_mutex);
+        pwsp->waiting++;
+        while((!pwsp->ready_head) && (!pwsp->stop)) {
+            if(!overflow) {
+                pthread_cond_wait(&pwsp->ready_cond,&pwsp->ready_mutex);
+            } else if(pthread_cond_timedwait(&pwsp->ready_cond,
+                                             &pwsp->ready_mutex,
+                                             &linger) == ETIMEDOUT) {
+                break;
+            }
+        }
+        pwsp->waiting--;
+
+        pcl = pwsp->ready_head;
+        if(pcl) {
+            pwsp->ready_head = pcl->ready_next;
+            if(!pwsp->ready_head)
+                pwsp->ready_tail = NULL;
+            pwsp->queued--;
+        } else if(overflow) {
+            pwsp->overflow--;
+            pthread_cond_broadcast(&pwsp->ready_cond);
+        }
+        pthread_mutex_unlock(&pwsp->ready_mutex);
+
+        if(!pcl) /* stopping, or not needed any more */
+            break;
+
+        pwsc = pcl->pwsc;
+
+        if(pwsp->stop) {
+            /* shutting down, so don't start anything new */
+            ws_should_close(pwsc,TRUE);
+            ws_close_connection(pwsc);
+            continue;
+        }
+
+        if(pwsc->held) {
+            ws_lock_connlist(pwsp);
+            pwsc->held = 0;
+            pcl->release = 0;
+            ws_unlock_connlist(pwsp);
+            keep = ws_dispatch_handler(pwsc);
+        } else {
+            keep = ws_dispatch_request(pwsc);
+        }
+
+        /* pipelined requests are already sitting in the read-ahead
+         * buffer, where epoll can't see them, so serve them here */
+        while((keep) && (!pwsp->stop) && (!pwsc->held) &&
+              (io_buffered(pwsc->hclient)))
+            keep = ws_dispatch_request(pwsc);
+
+        if((keep) && (ws_park(pwsp,pcl,EPOLL_CTL_MOD)))
+            continue;
+
+        ws_should_close(pwsc,TRUE);
+        ws_close_connection(pwsc);
+    }
+
+    WS_EXIT();
+}
+
+/**
+ * Request worker, one of the pool started with the server
+ *
+ * @param arg pointer to the web server private session
+ */
+void *ws_worker(void *arg) {
+    ws_work((WS_PRIVATE*)arg,FALSE);
+    return NULL;
+}
+
+/**
+ * Request worker started when the pool was all busy
+ *
+ * @param arg pointer to the web server private session
+ */
+void *ws_overflow_worker(void *arg) {
+    ws_work((WS_PRIVATE*)arg,TRUE);
+    return NULL;
+}
+
+/**
+ * Main thread for webserver - this is the reactor.  It accepts
+ * connections and parks them on the epoll set.  When a parked
+ * connection becomes readable, it is handed off to the worker pool
+ * to be serviced.  Connections that sit idle for too long are
+ * closed from here, and held requests are released from here.
+ *
+ * @param arg this is actually a pointer to the web server private session
+ */
+void *ws_mainthread(void *arg) {
+    WS_PRIVATE *pwsp = (WS_PRIVATE*)arg;
+    WS_CONNINFO *pwsc;
+    WS_CONNLIST *pcl;
+    struct epoll_event events[WS_MAX_EVENTS];
+    time_t last_reap;
+    time_t now;
+    char junk[32];
+    int timeout;
+    int release;
+    int held;
+    int count;
+    int index;
+
+    WS_ENTER();
+
+    last_reap = time(NULL);
+
+    while(!pwsp->stop) {
+        timeout = WS_REAP_INTERVAL * 1000;
+        ws_lock_connlist(pwsp);
+        if(pwsp->release_at) {
+            now = time(NULL);
+            if(pwsp->release_at <= now)
+                timeout = 0;
+            else if(pwsp->release_at - now < WS_REAP_INTERVAL)
+                timeout = (int)(pwsp->release_at - now) * 1000;
+        }
+        ws_unlock_connlist(pwsp);
+
+        count = epoll_wait(pwsp->epoll_fd,events,WS_MAX_EVENTS,timeout);
+        if(count == -1) {
+            if(errno == EINTR)
+                continue;
+
+            ws_dprintf(L_WS_FATAL,"Dispatcher: epoll_wait: %s\n",
+                       strerror(errno));
+            pwsp->running=0;
+            WS_EXIT();
+            return NULL;
+        }
+
+        for(index = 0; index < count; index++) {
+            if(events[index].data.ptr == (void*)pwsp) {
+                /* woken up by ws_stop or ws_release_held */
+                if(read(pwsp->wake_fd[0],junk,sizeof(junk)) == -1)
+                    ws_dprintf(L_WS_DBG,"Dispatcher: wake error\n");
+            } else if(events[index].data.ptr == NULL) {
+                if(!(pwsc = ws_accept(pwsp))) {
+                    io_close(pwsp->hserver);
+                    io_dispose(pwsp->hserver);
+                    pwsp->running=0;
+
+                    ws_dprintf(L_WS_FATAL,"Dispatcher: Aborting\n");
+                    WS_EXIT();
+                    return NULL;
+                }
+
+                ws_lock_unsafe();
+                pwsc->threadno=pwsp->threadno;
+                pwsp->threadno++;
+                ws_unlock_unsafe();
+
+                pcl = ws_add_dispatch_thread(pwsp,pwsc);
+                if(!ws_park(pwsp,pcl,EPOLL_CTL_ADD)) {
+                    ws_should_close(pwsc,TRUE);
+                    ws_close_connection(pwsc);
+                }
+            } else {
+                pcl = (WS_CONNLIST*)events[index].data.ptr;
+
+                ws_lock_connlist(pwsp);
+                pcl->parked = 0;
+                held = pcl->pwsc->held;
+                ws_unlock_connlist(pwsp);
+
+                if(!held) {
+                    ws_ready(pwsp,pcl);
+                } else {
+                    /* nothing more should come in on a held request,
+                     * so this is the client hanging up */
+                    ws_dprintf(L_WS_DBG,"Thread %d: held connection closed\n",
+                               pcl->pwsc->threadno);
+                    ws_should_close(pcl->pwsc,TRUE);
+                    ws_close_connection(pcl->pwsc);
+                }
+            }
+        }
+
+        ws_lock_connlist(pwsp);
+        release = (pwsp->release_at) && (pwsp->release_at <= time(NULL));
+        if(release)
+            pwsp->release_at = 0;
+        ws_unlock_connlist(pwsp);
+
+        if(release)
+            ws_release(pwsp);
+
+        if(time(NULL) - last_reap >= WS_REAP_INTERVAL) {
+            ws_reap_idle(pwsp,FALSE);
+            last_reap = time(NULL);
+        }
+    }
+
+    /* drop the idle connections, the workers finish off the rest */
+    ws_reap_idle(pwsp,TRUE);
+
+    WS_EXIT();
+    return NULL;
+}
+
+#else /* ndef HAVE_SYS_EPOLL_H */
+
 /**
  * Main thread for webserver - this accepts connections
  * and spawns a handler thread for each incoming connection.
@@ -529,53 +1253,23 @@ int ws_stop(WSHANDLE ws) {
  */
 void *ws_mainthread(void *arg) {
     int err;
-    IOHANDLE hnew;
     WS_PRIVATE *pwsp = (WS_PRIVATE*)arg;
     WS_CONNINFO *pwsc;
     pthread_t tid;
-    /* FIXME: endpoint from io_socket */
-    char hostname[MAX_HOSTNAME+1];
-    struct in_addr hostaddr;
 
     WS_ENTER();
 
     while(1) {
-        pwsc=(WS_CONNINFO*)malloc(sizeof(WS_CONNINFO));
-        if(!pwsc) {
-            /* can't very well service any more threads! */
-            ws_dprintf(L_WS_FATAL,"Error: %s\n",strerror(errno));
-            pwsp->running=0;
-            WS_EXIT();
-            exit(1); /* should be unnecessary */
-            return NULL;
-        }
-
-        memset(pwsc,0,sizeof(WS_CONNINFO));
-
-        hnew = io_new();
-        if(!hnew)
-            ws_dprintf(L_WS_FATAL,"Malloc error in io_new()");
-
-        if(!io_listen_accept(pwsp->hserver,hnew,&hostaddr)) {
-            ws_dprintf(L_WS_LOG,"Dispatcher: accept failed: %s\n",
-                io_errstr(pwsp->hserver));
+        if(!(pwsc = ws_accept(pwsp))) {
             io_close(pwsp->hserver);
             io_dispose(pwsp->hserver);
             pwsp->running=0;
-            free(pwsc);
 
             ws_dprintf(L_WS_FATAL,"Dispatcher: Aborting\n");
             WS_EXIT();
             return NULL;
         }
 
-        /* FIXME: Get remote endpoint */
-        strncpy(hostname,inet_ntoa(hostaddr),MAX_HOSTNAME);
-
-        pwsc->hostname=strdup(hostname);
-        pwsc->hclient = hnew;
-        pwsc->pwsp = pwsp;
-
         /* Spawn off a dispatcher to decide what to do with
          * the request
          */
@@ -590,7 +1284,7 @@ void *ws_mainthread(void *arg) {
         if((err=pthread_create(&tid,NULL,ws_dispatcher,(void*)pwsc))) {
             ws_set_err(pwsc,E_WS_PTHREADS);
             ws_dprintf(L_WS_FATAL,"Could not spawn thread: %s\n",strerror(err));
-            ws_close(pwsc);
+            ws_close_connection(pwsc);
         } else {
             ws_add_dispatch_thread(pwsp,pwsc);
             pthread_detach(tid);
@@ -601,25 +1295,23 @@ void *ws_mainthread(void *arg) {
     WS_EXIT();
 }
 
+#endif /* HAVE_SYS_EPOLL_H */
+
 
 /**
- * Close the connection.  This might be called when things
- * are already in bad shape, so we'll ignore errors and let
- * them be detected back in either the dispatch
- * thread or the main server thread
+ * Release the per-request state of a connection.  This might be
+ * called when things are already in bad shape, so we'll ignore
+ * errors and let them be detected back in the dispatcher.
  *
- * Mainly, we just want to make sure that any
- * allocated memory has been freed
+ * This no longer tears down the connection itself: if the
+ * connection has been marked to close (or has errored), it is
+ * closed by the server once the handler returns.
  *
- * @param pwsc connection to close
- * @returns TRUE on success
+ * @param pwsc connection to clean up
  */
 void ws_close(WS_CONNINFO *pwsc) {
-    WS_PRIVATE *pwsp = (WS_PRIVATE *)(pwsc->pwsp);
-
     WS_ENTER();
 
-    ws_dprintf(L_WS_DBG,"Thread %d: Terminating\n",pwsc->threadno);
     ws_dprintf(L_WS_DBG,"Thread %d: Freeing request headers\n",pwsc->threadno);
     ws_freearglist(&pwsc->request_headers);
     ws_dprintf(L_WS_DBG,"Thread %d: Freeing response headers\n",pwsc->threadno);
@@ -631,32 +1323,100 @@ void ws_close(WS_CONNINFO *pwsc) {
         pwsc->uri=NULL;
     }
 
-    if((pwsc->close)||(pwsc->error)) {
-        ws_dprintf(L_WS_DBG,"Thread %d: Closing fd\n",pwsc->threadno);
-        io_close(pwsc->hclient);
-        io_dispose(pwsc->hclient);
-        /* this thread is done */
+    WS_EXIT();
+}
 
-        ws_remove_dispatch_thread(pwsp, pwsc);
+/**
+ * Tear down a connection.  This removes the connection from the
+ * connection list, closes the client socket, and frees the connection
+ * along with any local storage.  It comes off the list first, so
+ * ws_stop never sees a client socket that is already gone.
+ *
+ * @param pwsc connection to close
+ */
+void ws_close_connection(WS_CONNINFO *pwsc) {
+    WS_PRIVATE *pwsp = (WS_PRIVATE *)(pwsc->pwsp);
 
-        /* Get rid of the local storage */
-        if(pwsc->local_storage) {
-            if(pwsc->storage_callback) {
-                pwsc->storage_callback(pwsc->local_storage);
-                pwsc->local_storage=NULL;
-                pwsc->storage_callback=NULL;
-            }
-        }
+    WS_ENTER();
 
-        free(pwsc->hostname);
-        memset(pwsc,0x00,sizeof(WS_CONNINFO));
-        free(pwsc);
-        WS_EXIT();
-        pthread_exit(NULL);
+    ws_dprintf(L_WS_DBG,"Thread %d: Terminating\n",pwsc->threadno);
+    ws_close(pwsc);
+
+    ws_remove_dispatch_thread(pwsp, pwsc);
+
+    ws_dprintf(L_WS_DBG,"Thread %d: Closing fd\n",pwsc->threadno);
+    io_close(pwsc->hclient);
+    io_dispose(pwsc->hclient);
+
+    /* Get rid of the local storage */
+    if(pwsc->local_storage) {
+        if(pwsc->storage_callback) {
+            pwsc->storage_callback(pwsc->local_storage);
+            pwsc->local_storage=NULL;
+            pwsc->storage_callback=NULL;
+        }
     }
+
+    free(pwsc->hostname);
+    memset(pwsc,0x00,sizeof(WS_CONNINFO));
+    free(pwsc);
     WS_EXIT();
 }
 
+/**
+ * Put the current request on hold, rather than answering it.  Once
+ * the handler returns, the connection waits on the reactor without
+ * tying up a worker until ws_release_held is called, and then the
+ * handler is run again on the same request, so it had best leave the
+ * request as it found it.  If the client hangs up in the meantime,
+ * the connection is just closed.
+ *
+ * @param pwsc connection whose request to hold
+ * @returns TRUE if held, FALSE if the handler has to wait itself
+ */
+int ws_hold(WS_CONNINFO *pwsc) {
+#ifdef HAVE_SYS_EPOLL_H
+    WS_PRIVATE *pwsp = (WS_PRIVATE *)(pwsc->pwsp);
+
+    ws_lock_connlist(pwsp);
+    pwsc->held = 1;
+    ws_unlock_connlist(pwsp);
+
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/**
+ * Run the requests held with ws_hold again.  This doesn't happen
+ * right away, but WS_HOLD_SETTLE seconds after the first call that
+ * isn't already pending, so a burst of changes only wakes them once.
+ * A steady stream of changes, like a scan, still wakes them every
+ * WS_HOLD_SETTLE seconds.
+ *
+ * @param ws webserver to release the held requests for
+ */
+void ws_release_held(WSHANDLE ws) {
+#ifdef HAVE_SYS_EPOLL_H
+    WS_PRIVATE *pwsp = (WS_PRIVATE*)ws;
+    int wake;
+
+    if((!pwsp) || (!pwsp->running))
+        return;
+
+    ws_lock_connlist(pwsp);
+    wake = !pwsp->release_at;
+    if(wake)
+        pwsp->release_at = time(NULL) + WS_HOLD_SETTLE;
+    ws_unlock_connlist(pwsp);
+
+    /* after the first kick, the reactor watches the clock itself */
+    if((wake) && (write(pwsp->wake_fd[1],"x",1) != 1))
+        ws_dprintf(L_WS_LOG,"Can't wake reactor\n");
+#endif
+}
+
 /*
  * ws_freearglist
  *
@@ -708,6 +1468,7 @@ int ws_getpostvars(WS_CONNINFO *pwsc) {
     char *content_length;
     unsigned char *buffer;
     uint32_t length;
+    uint32_t total, chunk;
     uint32_t ms;
 
     WS_ENTER();
@@ -735,8 +1496,13 @@ int ws_getpostvars(WS_CONNINFO *pwsc) {
 
     // make the read time out 30 minutes like we said in the
     // /server-info response
-    ms = 1800 * 1000;
-    if(!io_read_timeout(pwsc->hclient, buffer, &length, &ms)) {
+    ms = WS_REQUEST_TIMEOUT * 1000;
+    for(total=0; total < length; total += chunk) {
+        chunk = length - total;
+        if((io_read_timeout(pwsc->hclient, &buffer[total], &chunk, &ms)) &&
+           (chunk))
+            continue;
+
         if(0 == ms) {
             ws_dprintf(L_WS_INF,"Thread %d: Timeout reading post vars\n",
                 pwsc->threadno);
@@ -752,6 +1518,7 @@ int ws_getpostvars(WS_CONNINFO *pwsc) {
         free(buffer);
         return FALSE;
     }
+    buffer[length] = '\0';
 
     ws_dprintf(L_WS_DBG,"Thread %d: Read post vars: %s\n",pwsc->threadno,buffer);
 
@@ -779,16 +1546,18 @@ int ws_getpostvars(WS_CONNINFO *pwsc) {
 int ws_getheaders(WS_CONNINFO *pwsc) {
     char *first, *last;
     int done;
-    char buffer[MAX_LINEBUFFER];
-    uint32_t len;
+    char *buffer;
+    uint32_t len, ms;
 
     WS_ENTER();
 
-    /* Break down the headers into some kind of header list */
+    /* Break down the headers into some kind of header list.  Lines
+     * are parsed in place in the connection read-ahead buffer */
+    ms = WS_REQUEST_TIMEOUT * 1000;
     done=0;
     while(!done) {
-        len = sizeof(buffer);
-        if(!io_readline(pwsc->hclient,(unsigned char *)buffer,&len)) {
+        if(!io_readline_slice(pwsc->hclient,(unsigned char **)&buffer,
+                              &len,&ms)) {
             ws_set_err(pwsc,E_WS_READ);
             pwsc->error=errno;
             ws_dprintf(L_WS_INF,"Thread %d: read error: %s\n",pwsc->threadno,
@@ -797,17 +1566,23 @@ int ws_getheaders(WS_CONNINFO *pwsc) {
             return FALSE;
         }
 
-        ws_dprintf(L_WS_DBG,"Thread %d: Read: %s",pwsc->threadno,buffer);
+        ws_dprintf(L_WS_DBG,"Thread %d: Read: %s\n",pwsc->threadno,buffer);
+
+        if(!len) { /* EOF before the end of headers */
+            ws_set_err(pwsc,E_WS_READ);
+            WS_EXIT();
+            return FALSE;
+        }
+
+        /* trim the trailing \r */
+        if(buffer[len-1] == '\r')
+            buffer[--len] = '\0';
 
         first=buffer;
         if(buffer[0] == '\r')
             first=&buffer[1];
 
-        /* trim the trailing \n */
-        if(first[strlen(first)-1] == '\n')
-            first[strlen(first)-1] = '\0';
-
-        if(strlen(first) == 0) {
+        if(*first == '\0') {
             ws_dprintf(L_WS_DBG,"Thread %d: Headers parsed!\n",pwsc->threadno);
             done=1;
         } else {
@@ -822,7 +1597,7 @@ int ws_getheaders(WS_CONNINFO *pwsc) {
                 while(*last==' ')
                     last++;
 
-                while(last[strlen(last)-1] == '\r')
+                while((*last) && (last[strlen(last)-1] == '\r'))
                     last[strlen(last)-1] = '\0';
 
                 ws_dprintf(L_WS_DBG,"Thread %d: Adding header *%s=%s*\n",
@@ -940,233 +1715,285 @@ int ws_getgetvars(WS_CONNINFO *pwsc, char *string) {
 }
 
 
+#ifndef HAVE_SYS_EPOLL_H
 /**
- * Main dispatch thread.  This gets the request, reads the
- * headers, decodes the GET'd or POST'd variables,
- * then decides what function should service the request
+ * Main dispatch thread.  This services requests on a
+ * connection until the connection is closed, or errors out.
  *
  * @param arg a pointer to the WS_CONNINFO struct we are servicing
  */
 void *ws_dispatcher(void *arg) {
     WS_CONNINFO *pwsc=(WS_CONNINFO*)arg;
-    WS_PRIVATE *pwsp=pwsc->pwsp;
-    char buffer[MAX_LINEBUFFER];
-    char *first,*last;
-    int connection_done=0;
-    int can_dispatch;
-    char *auth, *username, *password;
-    int hdrs,handler;
-    time_t now;
-    struct tm now_tm;
-    void (*req_handler)(WS_CONNINFO*);
-    int(*auth_handler)(WS_CONNINFO*, char *, char *);
-    uint32_t ms, len;
 
-    WS_ENTER()
+    WS_ENTER();
 
     /* quick fence to ensure that we have been registered on the thread list */
     ws_lock_unsafe();
     ws_unlock_unsafe();
 
-    while(!connection_done) {
-        // Now, get the request from the other end
-        // and decide where to dispatch it
-        ms = 1800 * 1000;
-        len = sizeof(buffer);
-        if(!io_readline_timeout(pwsc->hclient,(unsigned char *)buffer,&len,&ms) || (!len)) {
-            ws_set_err(pwsc,E_WS_TIMEOUT);
-            pwsc->error=errno;
-            pwsc->close=1;
-            ws_dprintf(L_WS_WARN,"Thread %d:  could not read: %s\n",
-                pwsc->threadno,io_errstr(pwsc->hclient));
-            ws_close(pwsc);
-            WS_EXIT();
-            return NULL;
-        }
+    while(ws_dispatch_request(pwsc))
+        ;
 
-        ws_dprintf(L_WS_DBG,"Thread %d: \n",pwsc->threadno);
-        ws_dprintf(L_WS_DBG - 1, "Request: %s", buffer);
+    ws_close_connection(pwsc);
 
-        first=last=buffer;
-        strsep(&last," ");
-        if(!last) {
-            pwsc->close=1;
-            ws_returnerror(pwsc,400,"Bad request");
-            ws_close(pwsc);
-            ws_dprintf(L_WS_SPAM,"Error: bad request.  Exiting ws_dispatcher\n");
-            WS_EXIT();
-            return NULL;
-        }
+    WS_EXIT();
+    return NULL;
+}
+#endif /* HAVE_SYS_EPOLL_H */
 
-        if(!strcasecmp(first,"get")) {
-            pwsc->request_type = RT_GET;
-        } else if(!strcasecmp(first,"post")) {
-            pwsc->request_type = RT_POST;
-        } else {
-            /* TODO: pass these to the underlying client, as they
-             * might be interested in them (UPnP, maybe) */
-            ws_set_err(pwsc,E_WS_REQTYPE);
-            ws_returnerror(pwsc,501,"Not implemented");
-            ws_close(pwsc);
-            ws_dprintf(L_WS_SPAM,"Error: not get or post.  Exiting ws_dispatcher\n");
-            WS_EXIT();
-            return NULL;
-        }
+/**
+ * Service a single request on a connection.  This gets the request,
+ * reads the headers, decodes the GET'd or POST'd variables,
+ * then decides what function should service the request
+ *
+ * @param pwsc the connection to service a request on
+ * @returns TRUE if the connection should be kept open for more requests
+ */
+int ws_dispatch_request(WS_CONNINFO *pwsc) {
+    char *buffer;
+    char *first,*last;
+    int http10;
+    uint32_t ms, len;
 
-        first=last;
-        strsep(&last," ");
-        pwsc->uri=strdup(first);
+    WS_ENTER();
 
-        /* Get headers */
-        if((!ws_getheaders(pwsc)) || (!last)) { /* didn't provide a HTTP/1.x */
-            /* error already set */
-            ws_dprintf(L_WS_LOG,"Thread %d: Couldn't parse headers - aborting\n",pwsc->threadno);
-            ws_should_close(pwsc,TRUE);
-            ws_close(pwsc);
-            WS_EXIT();
-            return NULL;
-        }
+    // Now, get the request from the other end
+    // and decide where to dispatch it
+#ifdef HAVE_SYS_EPOLL_H
+    /* the reactor only hands over connections with something to
+     * read, so this is just how long the client has to finish */
+    ms = WS_REQUEST_TIMEOUT * 1000;
+#else
+    ms = WS_IDLE_TIMEOUT * 1000;
+#endif
+    if(!io_readline_slice(pwsc->hclient,(unsigned char **)&buffer,&len,&ms) ||
+       (!len)) {
+        ws_set_err(pwsc,E_WS_TIMEOUT);
+        pwsc->error=errno;
+        pwsc->close=1;
+        ws_dprintf(L_WS_WARN,"Thread %d:  could not read: %s\n",
+            pwsc->threadno,io_errstr(pwsc->hclient));
+        ws_close(pwsc);
+        WS_EXIT();
+        return FALSE;
+    }
 
+    ws_dprintf(L_WS_DBG,"Thread %d: \n",pwsc->threadno);
+    ws_dprintf(L_WS_DBG - 1, "Request: %s\n", buffer);
 
-        /* Now that we have the headers, we can
-         * decide whether or not this is a persistant
-         * connection */
-        if(strncasecmp(last,"HTTP/1.0",8)==0) { /* defaults to non-persistant */
-            pwsc->close=!ws_testarg(&pwsc->request_headers,"connection","keep-alive");
-        } else { /* default to persistant for HTTP/1.1 and above */
-            pwsc->close=ws_testarg(&pwsc->request_headers,"connection","close");
-        }
+    first=last=buffer;
+    strsep(&last," ");
+    if(!last) {
+        pwsc->close=1;
+        ws_returnerror(pwsc,400,"Bad request");
+        ws_close(pwsc);
+        ws_dprintf(L_WS_SPAM,"Error: bad request.  Exiting ws_dispatcher\n");
+        WS_EXIT();
+        return FALSE;
+    }
 
-        ws_dprintf(L_WS_DBG,"Thread %d: Connection type %s: Connection: %s\n",
-                pwsc->threadno, last, pwsc->close ? "non-persist" : "persist");
+    if(!strcasecmp(first,"get")) {
+        pwsc->request_type = RT_GET;
+    } else if(!strcasecmp(first,"post")) {
+        pwsc->request_type = RT_POST;
+    } else {
+        /* TODO: pass these to the underlying client, as they
+         * might be interested in them (UPnP, maybe) */
+        ws_set_err(pwsc,E_WS_REQTYPE);
+        ws_returnerror(pwsc,501,"Not implemented");
+        ws_close(pwsc);
+        ws_dprintf(L_WS_SPAM,"Error: not get or post.  Exiting ws_dispatcher\n");
+        WS_EXIT();
+        return FALSE;
+    }
 
-        if(!pwsc->uri) {
-            ws_set_err(pwsc,E_WS_MEMORY);
-            ws_dprintf(L_WS_LOG,"Thread %d: Error allocation URI\n",
-                    pwsc->threadno);
-            ws_returnerror(pwsc,500,"Internal server error");
-            ws_close(pwsc);
-            WS_EXIT();
-            return NULL;
-        }
+    first=last;
+    strsep(&last," ");
+    pwsc->uri=strdup(first);
 
-        /* trim the URI */
-        first=pwsc->uri;
-        strsep(&first,"?");
+    /* the request line lives in the read-ahead buffer, so it's
+     * gone once the headers are read. */
+    http10 = (last) && (strncasecmp(last,"HTTP/1.0",8)==0);
 
-        if(first) { /* got some GET args */
-            ws_dprintf(L_WS_DBG,"Thread %d: parsing GET args\n",pwsc->threadno);
-            ws_getgetvars(pwsc,first);
-        }
+    /* Get headers */
+    if((!ws_getheaders(pwsc)) || (!last)) { /* didn't provide a HTTP/1.x */
+        /* error already set */
+        ws_dprintf(L_WS_LOG,"Thread %d: Couldn't parse headers - aborting\n",pwsc->threadno);
+        ws_should_close(pwsc,TRUE);
+        ws_close(pwsc);
+        WS_EXIT();
+        return FALSE;
+    }
 
-        /* fix the URI by un urldecoding it */
 
-        ws_dprintf(L_WS_DBG,"Thread %d: Original URI: %s\n",
-                pwsc->threadno,pwsc->uri);
+    /* Now that we have the headers, we can
+     * decide whether or not this is a persistant
+     * connection */
+    if(http10) { /* defaults to non-persistant */
+        pwsc->close=!ws_testarg(&pwsc->request_headers,"connection","keep-alive");
+    } else { /* default to persistant for HTTP/1.1 and above */
+        pwsc->close=ws_testarg(&pwsc->request_headers,"connection","close");
+    }
 
-        first=ws_urldecode(pwsc->uri,ws_encoding_hack(pwsc));
-        free(pwsc->uri);
-        pwsc->uri=first;
+    ws_dprintf(L_WS_DBG,"Thread %d: Connection type %s: Connection: %s\n",
+            pwsc->threadno, http10 ? "HTTP/1.0" : "HTTP/1.1",
+            pwsc->close ? "non-persist" : "persist");
 
-        /* Strip out the proxy stuff - iTunes 4.5 */
-        first=strstr(pwsc->uri,"://");
+    if(!pwsc->uri) {
+        ws_set_err(pwsc,E_WS_MEMORY);
+        ws_dprintf(L_WS_LOG,"Thread %d: Error allocation URI\n",
+                pwsc->threadno);
+        ws_returnerror(pwsc,500,"Internal server error");
+        ws_close(pwsc);
+        WS_EXIT();
+        return FALSE;
+    }
+
+    /* trim the URI */
+    first=pwsc->uri;
+    strsep(&first,"?");
+
+    if(first) { /* got some GET args */
+        ws_dprintf(L_WS_DBG,"Thread %d: parsing GET args\n",pwsc->threadno);
+        ws_getgetvars(pwsc,first);
+    }
+
+    /* fix the URI by un urldecoding it */
+
+    ws_dprintf(L_WS_DBG,"Thread %d: Original URI: %s\n",
+            pwsc->threadno,pwsc->uri);
+
+    first=ws_urldecode(pwsc->uri,ws_encoding_hack(pwsc));
+    free(pwsc->uri);
+    pwsc->uri=first;
+
+    /* Strip out the proxy stuff - iTunes 4.5 */
+    first=strstr(pwsc->uri,"://");
+    if(first) {
+        first += 3;
+        first=strchr(first,'/');
         if(first) {
-            first += 3;
-            first=strchr(first,'/');
-            if(first) {
-                first=strdup(first);
-                free(pwsc->uri);
-                pwsc->uri=first;
-            }
+            first=strdup(first);
+            free(pwsc->uri);
+            pwsc->uri=first;
         }
+    }
 
 
-        ws_dprintf(L_WS_DBG,"Thread %d: Translated URI: %s\n",pwsc->threadno,
-                pwsc->uri);
+    ws_dprintf(L_WS_DBG,"Thread %d: Translated URI: %s\n",pwsc->threadno,
+            pwsc->uri);
 
-        /* now, parse POST args */
-        if(pwsc->request_type == RT_POST)
-            ws_getpostvars(pwsc);
+    /* now, parse POST args */
+    if(pwsc->request_type == RT_POST)
+        ws_getpostvars(pwsc);
 
-        hdrs=1;
+    WS_EXIT();
+    return ws_dispatch_handler(pwsc);
+}
 
-        handler=ws_findhandler(pwsp,pwsc,&req_handler,&auth_handler,&hdrs);
+/**
+ * Find the handler for a parsed request, and run it.  This is also
+ * how a request held with ws_hold gets run again.
+ *
+ * @param pwsc the connection with the request to run
+ * @returns TRUE if the connection should be kept open for more requests
+ */
+int ws_dispatch_handler(WS_CONNINFO *pwsc) {
+    WS_PRIVATE *pwsp=pwsc->pwsp;
+    int can_dispatch;
+    char *auth, *username, *password;
+    int hdrs,handler;
+    time_t now;
+    struct tm now_tm;
+    void (*req_handler)(WS_CONNINFO*);
+    int(*auth_handler)(WS_CONNINFO*, char *, char *);
 
-        time(&now);
-        ws_dprintf(L_WS_DBG,"Thread %d: Time is %d seconds after epoch\n",
-                pwsc->threadno,now);
-        gmtime_r(&now,&now_tm);
-        ws_dprintf(L_WS_DBG,"Thread %d: Setting time header\n",pwsc->threadno);
-        ws_addarg(&pwsc->response_headers,"Date",
-                  "%s, %d %s %d %02d:%02d:%02d GMT",
-                  ws_dow[now_tm.tm_wday],now_tm.tm_mday,
-                  ws_moy[now_tm.tm_mon],now_tm.tm_year + 1900,
-                  now_tm.tm_hour,now_tm.tm_min,now_tm.tm_sec);
+    WS_ENTER();
 
-        if(hdrs) {
-            ws_addarg(&pwsc->response_headers,"Connection",
-                      pwsc->close ? "close" : "keep-alive");
+    hdrs=1;
 
-            ws_addarg(&pwsc->response_headers,"Server",
-                      PACKAGE "/" VERSION);
+    handler=ws_findhandler(pwsp,pwsc,&req_handler,&auth_handler,&hdrs);
 
-            ws_addarg(&pwsc->response_headers,"Content-Type","text/html");
-            ws_addarg(&pwsc->response_headers,"Content-Language","en_us");
-        }
+    time(&now);
+    ws_dprintf(L_WS_DBG,"Thread %d: Time is %d seconds after epoch\n",
+            pwsc->threadno,now);
+    gmtime_r(&now,&now_tm);
+    ws_dprintf(L_WS_DBG,"Thread %d: Setting time header\n",pwsc->threadno);
+    ws_addarg(&pwsc->response_headers,"Date",
+              "%s, %d %s %d %02d:%02d:%02d GMT",
+              ws_dow[now_tm.tm_wday],now_tm.tm_mday,
+              ws_moy[now_tm.tm_mon],now_tm.tm_year + 1900,
+              now_tm.tm_hour,now_tm.tm_min,now_tm.tm_sec);
 
-        /* Find the appropriate handler and dispatch it */
-        if(handler == -1) {
-            ws_dprintf(L_WS_DBG,"Thread %d: Using default handler.\n",
-                    pwsc->threadno);
-            ws_defaulthandler(pwsp,pwsc);
-        } else {
-            ws_dprintf(L_WS_DBG,"Thread %d: Using non-default handler\n",
-                    pwsc->threadno);
+    if(hdrs) {
+        ws_addarg(&pwsc->response_headers,"Connection",
+                  pwsc->close ? "close" : "keep-alive");
 
-            can_dispatch=0;
-            /* If an auth handler is registered, but it accepts a
-             * username and password of NULL, then don't bother
-             * authing.
-             */
-            if((auth_handler) && (auth_handler(pwsc,NULL,NULL)==0)) {
-                /* do the auth thing */
-                auth=ws_getarg(&pwsc->request_headers,"Authorization");
-                if((auth) && (ws_decodepassword(auth,&username, &password))) {
-                    if(auth_handler(pwsc,username,password))
-                        can_dispatch=1;
-                    ws_addarg(&pwsc->request_vars,"HTTP_USER","%s",username);
-                    ws_addarg(&pwsc->request_vars,"HTTP_PASSWD","%s",password);
-                    free(username); /* this frees password too */
-                }
+        ws_addarg(&pwsc->response_headers,"Server",
+                  PACKAGE "/" VERSION);
 
-                if(!can_dispatch) { /* auth failed, or need auth */
-                    //ws_addarg(&pwsc->response_headers,"Connection","close");
-                    ws_addarg(&pwsc->response_headers,"WWW-Authenticate",
-                              "Basic realm=\"webserver\"");
-                    ws_returnerror(pwsc,401,"Unauthorized");
-                    ws_set_err(pwsc,E_WS_SUCCESS); /* don't close! */
-                }
-            } else {
-                can_dispatch=1;
+        ws_addarg(&pwsc->response_headers,"Content-Type","text/html");
+        ws_addarg(&pwsc->response_headers,"Content-Language","en_us");
+    }
+
+    /* Find the appropriate handler and dispatch it */
+    if(handler == -1) {
+        ws_dprintf(L_WS_DBG,"Thread %d: Using default handler.\n",
+                pwsc->threadno);
+        ws_defaulthandler(pwsp,pwsc);
+    } else {
+        ws_dprintf(L_WS_DBG,"Thread %d: Using non-default handler\n",
+                pwsc->threadno);
+
+        can_dispatch=0;
+        /* If an auth handler is registered, but it accepts a
+         * username and password of NULL, then don't bother
+         * authing.
+         */
+        if((auth_handler) && (auth_handler(pwsc,NULL,NULL)==0)) {
+            /* do the auth thing */
+            auth=ws_getarg(&pwsc->request_headers,"Authorization");
+            if((auth) && (ws_decodepassword(auth,&username, &password))) {
+                if(auth_handler(pwsc,username,password))
+                    can_dispatch=1;
+                ws_addarg(&pwsc->request_vars,"HTTP_USER","%s",username);
+                ws_addarg(&pwsc->request_vars,"HTTP_PASSWD","%s",password);
+                free(username); /* this frees password too */
             }
 
-            if(can_dispatch) {
-                if(req_handler)
-                    req_handler(pwsc);
-                else
-                    ws_defaulthandler(pwsp,pwsc);
+            if(!can_dispatch) { /* auth failed, or need auth */
+                //ws_addarg(&pwsc->response_headers,"Connection","close");
+                ws_addarg(&pwsc->response_headers,"WWW-Authenticate",
+                          "Basic realm=\"webserver\"");
+                ws_returnerror(pwsc,401,"Unauthorized");
+                ws_set_err(pwsc,E_WS_SUCCESS); /* don't close! */
             }
+        } else {
+            can_dispatch=1;
         }
 
-        if((pwsc->close) || (pwsc->error) || (pwsp->stop)) {
-            ws_should_close(pwsc,TRUE);
-            connection_done=1;
+        if(can_dispatch) {
+            if(req_handler)
+                req_handler(pwsc);
+            else
+                ws_defaulthandler(pwsp,pwsc);
         }
-        ws_close(pwsc);
     }
 
+    if((pwsc->held) && (!pwsc->error) && (!pwsp->stop)) {
+        /* keep the request around to run again */
+        WS_EXIT();
+        return TRUE;
+    }
+    pwsc->held = 0;
+
+    if((pwsc->close) || (pwsc->error) || (pwsp->stop)) {
+        ws_should_close(pwsc,TRUE);
+    }
+    ws_close(pwsc);
+
     WS_EXIT();
-    return NULL;
+    return !pwsc->close;
 }
 
 
@@ -2016,8 +2843,67 @@ void *ws_enum_var(WS_CONNINFO *pwsc, char **key, char **value, void *last) {
     return plist;
 }
 
+#ifdef HAVE_SYS_SENDFILE_H
 /**
- * copy a file (given a fd) to the output socket
+ * copy a file to the output socket with sendfile, so the data never
+ * has to come up into userspace.  This only works when the file is a
+ * plain file and the client is a plain socket, and starts from the
+ * current position of the file (so it honors a seek to a range offset).
+ *
+ * If sendfile isn't supported for this file, the file position is
+ * left at the first unsent byte, and the caller can pick up from
+ * there with a normal read/write copy.
+ *
+ * @param pwsc connection to stream output to
+ * @param hfile file to stream
+ * @param bytes_copied incremented by the number of bytes sent
+ * @returns TRUE if the whole file was sent, FALSE to fall back
+ *          to copying, or -1 on write error
+ */
+int ws_sendfile(WS_CONNINFO *pwsc, IOHANDLE hfile, uint64_t *bytes_copied) {
+    FILE_T fd;
+    SOCKET_T sock;
+    uint64_t pos;
+    off_t offset;
+    ssize_t result;
+
+    if((io_buffered(hfile)) ||
+       (!io_getfd(hfile,&fd)) ||
+       (!io_getsocket(pwsc->hclient,&sock)) ||
+       (!io_getpos(hfile,&pos)))
+        return FALSE;
+
+    offset = (off_t)pos;
+    while(1) {
+        result = sendfile(sock,fd,&offset,WS_SENDFILE_CHUNK);
+        if(result > 0) {
+            *bytes_copied += result;
+            continue;
+        }
+
+        if(result == 0) /* EOF */
+            return TRUE;
+
+        if(errno == EINTR)
+            continue;
+
+        if((errno == EINVAL) || (errno == ENOSYS)) {
+            /* not supported on this file -- let caller copy the rest */
+            ws_dprintf(L_WS_DBG,"Thread %d: sendfile unavailable: %s\n",
+                       pwsc->threadno,strerror(errno));
+            io_setpos(hfile,(uint64_t)offset,SEEK_SET);
+            return FALSE;
+        }
+
+        ws_dprintf(L_WS_LOG,"Write error: %s\n",strerror(errno));
+        return -1;
+    }
+}
+#endif
+
+/**
+ * copy a file (given a fd) to the output socket.  Where possible, this
+ * is done with sendfile, otherwise it's a read/write loop.
  *
  * FIXME: Move this to something like io_readwrite
  *
@@ -2037,12 +2923,22 @@ int ws_copyfile(WS_CONNINFO *pwsc, IOHANDLE hfile, uint64_t *bytes_copied) {
     if(!pwsc)
         return -1; /* error handling! */
 
+#ifdef HAVE_SYS_SENDFILE_H
+    retval = ws_sendfile(pwsc,hfile,&total_bytes);
+    if(retval) {
+        if(bytes_copied)
+            *bytes_copied = total_bytes;
+        return (retval == TRUE);
+    }
+#endif
+
     bytes_read = BLKSIZE;
     while(io_read(hfile,buf,&bytes_read) && bytes_read) {
         bytes_written = bytes_read;
         if(!io_write(pwsc->hclient,buf,&bytes_written)) {
             ws_dprintf(L_WS_LOG,"Write error: %s\n",io_errstr(pwsc->hclient));
-            *bytes_copied = total_bytes;
+            if(bytes_copied)
+                *bytes_copied = total_bytes;
             return FALSE;
         }
 
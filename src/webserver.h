@@ -65,6 +65,8 @@ typedef struct tag_wsconfig {
     char *ssl_pw;
     unsigned short port;
     unsigned short ssl_port;
+    int worker_threads;
+    int max_worker_threads;
 } WSCONFIG;
 
 typedef struct tag_arglist {
@@ -85,6 +87,7 @@ typedef struct tag_ws_conninfo {
     char *uri;
     char *hostname;
     int close;
+    int held;               /**< waiting on ws_release_held */
     int secure;
     void *secure_storage;
     void *local_storage;
@@ -137,6 +140,8 @@ extern char *ws_uri(WS_CONNINFO *pwsc);
 extern void *ws_enum_var(WS_CONNINFO *pwsc, char **key, char **value, void *last);
 extern int ws_copyfile(WS_CONNINFO *pwsc, IOHANDLE hfile, uint64_t *bytes_copied);
 extern void ws_should_close(WS_CONNINFO *pwsc, int should_close);
+extern int ws_hold(WS_CONNINFO *pwsc);
+extern void ws_release_held(WSHANDLE ws);
 extern int ws_threadno(WS_CONNINFO *pwsc);
 extern char *ws_hostname(WS_CONNINFO *pwsc);
 
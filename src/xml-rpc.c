@@ -38,7 +38,13 @@
 #include "configfile.h"
 #include "conf.h"
 #include "db.h"
+#include "db-sql-sqlite3.h"
+#include "dmap-cache.h"
+#include "ssc-cache.h"
+#include "ssc-pipe.h"
+#include "ssc-session.h"
 #include "err.h"
+#include "monitor.h"
 #include "mp3-scanner.h"
 #include "os.h"
 #include "plugin.h"
@@ -518,6 +524,19 @@ void xml_get_stats(WS_CONNINFO *pwsc) {
     SCAN_STATUS *pss;
     WSTHREADENUM wste;
     int count;
+    uint32_t fetches;
+    DB_CACHE_STATS cache_stats;
+    DMAP_CACHE_STATS dmap_stats;
+    SSC_CACHE_STATS ssc_stats;
+    SSC_PIPE_STATS pipe_stats;
+    SSC_SESSION_STATS session_stats;
+    SSC_PIPE_STREAM pipe_streams[16];
+    int stream_count;
+    int stream;
+    MONITOR_STATS monitor_info;
+#ifdef HAVE_LIBSQLITE3
+    DB_SQLITE3_STATS handle_info;
+#endif
     XMLSTRUCT *pxml;
     void *phandle;
 
@@ -625,13 +644,118 @@ void xml_get_stats(WS_CONNINFO *pwsc) {
     xml_output(pxml,"value","%d",config.stats.songs_served);
     xml_pop(pxml); /* stat */
 
+    db_cache_stats(&cache_stats);
+    fetches = cache_stats.hits + cache_stats.misses;
+
     xml_push(pxml,"stat");
     xml_output(pxml,"name","DB Info");
     xml_output(pxml,"value","%d enums, %d hits on %d fetches, %02f%%",config.stats.db_enum_fetches,
-               config.stats.db_id_hits, config.stats.db_id_fetches,
-               (float)config.stats.db_id_hits/(float)config.stats.db_id_fetches * 100.0);
+               cache_stats.hits, fetches,
+               fetches ? (float)cache_stats.hits/(float)fetches * 100.0 : 0.0);
+    xml_pop(pxml); /* stat */
+
+    xml_push(pxml,"stat");
+    xml_output(pxml,"name","Item Cache");
+    xml_output(pxml,"value","%u of %u items, %u hits, %u misses, %u evictions",
+               cache_stats.items, cache_stats.capacity, cache_stats.hits,
+               cache_stats.misses, cache_stats.evictions);
+    xml_pop(pxml); /* stat */
+
+    dmap_cache_stats(&dmap_stats);
+    fetches = dmap_stats.hits + dmap_stats.misses;
+
+    xml_push(pxml,"stat");
+    xml_output(pxml,"name","DMAP Cache");
+    xml_output(pxml,"value","%u responses, %u of %u KB, %u hits (%u gzipped) on %u requests, %02f%%, %u evictions",
+               dmap_stats.entries, dmap_stats.bytes / 1024,
+               dmap_stats.max_bytes / 1024, dmap_stats.hits,
+               dmap_stats.gzip_hits, fetches,
+               fetches ? (float)dmap_stats.hits/(float)fetches * 100.0 : 0.0,
+               dmap_stats.evictions);
+    xml_pop(pxml); /* stat */
+
+    ssc_cache_stats(&ssc_stats);
+
+    xml_push(pxml,"stat");
+    xml_output(pxml,"name","Transcode Cache");
+    if(ssc_stats.max_bytes) {
+        xml_output(pxml,"value","%u songs, %llu of %llu MB, %u hits, %u followed, %u misses, %u evictions",
+                   ssc_stats.entries,
+                   (unsigned long long)ssc_stats.bytes / (1024 * 1024),
+                   (unsigned long long)ssc_stats.max_bytes / (1024 * 1024),
+                   ssc_stats.hits, ssc_stats.follows, ssc_stats.misses,
+                   ssc_stats.evictions);
+    } else {
+        xml_output(pxml,"value","Not in use");
+    }
+    xml_pop(pxml); /* stat */
+
+    ssc_session_stats(&session_stats);
+
+    xml_push(pxml,"stat");
+    xml_output(pxml,"name","Shared Transcodes");
+    if(session_stats.max_bytes) {
+        xml_output(pxml,"value","%u running (%u since startup), %u of %u KB, %u shared, %u left behind",
+                   session_stats.sessions, session_stats.started,
+                   session_stats.bytes / 1024, session_stats.limit_bytes / 1024,
+                   session_stats.readers, session_stats.detached);
+    } else {
+        xml_output(pxml,"value","Not in use");
+    }
+    xml_pop(pxml); /* stat */
+
+    ssc_pipe_stats(&pipe_stats);
+
+    xml_push(pxml,"stat");
+    xml_output(pxml,"name","Transcode Pipeline");
+    xml_output(pxml,"value","%u streams (%u since startup), %u underruns, %u stalls",
+               pipe_stats.streams, pipe_stats.total, pipe_stats.underruns,
+               pipe_stats.stalls);
     xml_pop(pxml); /* stat */
 
+    stream_count = ssc_pipe_streams(pipe_streams,
+                                    sizeof(pipe_streams) / sizeof(SSC_PIPE_STREAM));
+    for(stream = 0; stream < stream_count; stream++) {
+        xml_push(pxml,"stat");
+        xml_output(pxml,"name","Transcoding %s",pipe_streams[stream].name);
+        xml_output(pxml,"value","%llu KB sent, %u KB buffered, %u underruns, %u stalls",
+                   (unsigned long long)pipe_streams[stream].bytes / 1024,
+                   pipe_streams[stream].buffered / 1024,
+                   pipe_streams[stream].underruns,
+                   pipe_streams[stream].stalls);
+        xml_pop(pxml); /* stat */
+    }
+
+    xml_push(pxml,"stat");
+    xml_output(pxml,"name","File Monitor");
+    if(monitor_running()) {
+        monitor_stats(&monitor_info);
+        xml_output(pxml,"value","%u directories, %u events, %u paths rescanned, %u overflows",
+                   monitor_info.watches, monitor_info.events,
+                   monitor_info.updates, monitor_info.overflows);
+    } else {
+        xml_output(pxml,"value","Not running");
+    }
+    xml_pop(pxml); /* stat */
+
+#ifdef HAVE_LIBSQLITE3
+    xml_push(pxml,"stat");
+    xml_output(pxml,"name","DB Handles");
+    db_sqlite3_stats(&handle_info);
+    if(handle_info.handles) {
+        xml_output(pxml,"value","%u readers, %u leases, %u waits (%llu ms), "
+                   "%u writes, %u waits (%llu ms)",
+                   handle_info.handles, handle_info.read_leases,
+                   handle_info.read_waits,
+                   (unsigned long long)handle_info.read_wait_us / 1000,
+                   handle_info.write_locks, handle_info.write_waits,
+                   (unsigned long long)handle_info.write_wait_us / 1000);
+    } else {
+        xml_output(pxml,"value","Not in use");
+    }
+    xml_pop(pxml); /* stat */
+#endif
+
     xml_pop(pxml); /* statistics */
 
 